@@ -160,3 +160,97 @@ void BRBloomFilterFree(BRBloomFilter *filter)
     if (filter->filter) free(filter->filter);
     free(filter);
 }
+
+// returns the index of the word pair and sets bit to the bit within those words for the given hash function
+inline static size_t _BRRollingBloomFilterPos(const BRRollingBloomFilter *filter, const uint8_t *data, size_t dataLen,
+                                              uint32_t hashNum, uint32_t *bit)
+{
+    uint32_t h = BRMurmur3_32(data, dataLen, hashNum*0xfba4c795 + filter->tweak);
+
+    *bit = h & 0x3f;
+    return ((h >> 6) % (filter->length/2))*2;
+}
+
+// returns a newly allocated rolling bloom filter that must be freed by calling BRRollingBloomFilterFree()
+BRRollingBloomFilter *BRRollingBloomFilterNew(double falsePositiveRate, size_t elemCount, uint32_t tweak)
+{
+    BRRollingBloomFilter *filter = calloc(1, sizeof(*filter));
+    double logRate;
+    size_t bits;
+
+    assert(filter != NULL);
+    assert(falsePositiveRate > 0.0 && falsePositiveRate < 1.0);
+    assert(elemCount > 0);
+    logRate = log(falsePositiveRate);
+    filter->hashFuncs = round(logRate/log(0.5));
+    if (filter->hashFuncs < 1) filter->hashFuncs = 1;
+    if (filter->hashFuncs > BLOOM_MAX_HASH_FUNCS) filter->hashFuncs = BLOOM_MAX_HASH_FUNCS;
+    filter->genElemCount = (elemCount + 1)/2;
+    // sized for three full generations, the most the filter ever holds
+    bits = ceil(-1.0*filter->hashFuncs*filter->genElemCount*3/log(1.0 - exp(logRate/filter->hashFuncs)));
+    filter->length = ((bits + 63)/64)*2;
+    filter->data = calloc(filter->length, sizeof(*(filter->data)));
+    assert(filter->data != NULL);
+    filter->tweak = tweak;
+    filter->generation = 1;
+    return filter;
+}
+
+// true if data is matched by filter
+int BRRollingBloomFilterContainsData(const BRRollingBloomFilter *filter, const uint8_t *data, size_t dataLen)
+{
+    uint32_t i, bit;
+    size_t pos;
+
+    assert(filter != NULL);
+    assert(data != NULL || dataLen == 0);
+
+    for (i = 0; data && i < filter->hashFuncs; i++) {
+        pos = _BRRollingBloomFilterPos(filter, data, dataLen, i, &bit);
+        if (! (((filter->data[pos] | filter->data[pos + 1]) >> bit) & 1)) return 0;
+    }
+
+    return (data) ? 1 : 0;
+}
+
+// add data to filter, possibly forgetting the oldest generation of data
+void BRRollingBloomFilterInsertData(BRRollingBloomFilter *filter, const uint8_t *data, size_t dataLen)
+{
+    uint64_t mask1, mask2, mask;
+    uint32_t i, bit;
+    size_t pos;
+
+    assert(filter != NULL);
+    assert(data != NULL || dataLen == 0);
+    if (! data) return;
+
+    if (filter->elemCount == filter->genElemCount) { // start a new generation, reusing the oldest one's number
+        filter->elemCount = 0;
+        filter->generation = filter->generation % 3 + 1;
+        mask1 = -(uint64_t)(filter->generation & 1);
+        mask2 = -(uint64_t)(filter->generation >> 1);
+
+        for (pos = 0; pos < filter->length; pos += 2) { // clear bits whose generation number matches the new one
+            mask = (filter->data[pos] ^ mask1) | (filter->data[pos + 1] ^ mask2);
+            filter->data[pos] &= mask;
+            filter->data[pos + 1] &= mask;
+        }
+    }
+
+    for (i = 0; i < filter->hashFuncs; i++) {
+        pos = _BRRollingBloomFilterPos(filter, data, dataLen, i, &bit);
+        filter->data[pos] = (filter->data[pos] & ~((uint64_t)1 << bit)) | ((uint64_t)(filter->generation & 1) << bit);
+        filter->data[pos + 1] = (filter->data[pos + 1] & ~((uint64_t)1 << bit)) |
+                                ((uint64_t)(filter->generation >> 1) << bit);
+    }
+
+    filter->elemCount++;
+}
+
+// frees memory allocated for filter
+void BRRollingBloomFilterFree(BRRollingBloomFilter *filter)
+{
+    assert(filter != NULL);
+    if (filter->data) free(filter->data);
+    free(filter);
+}
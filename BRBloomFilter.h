@@ -75,6 +75,31 @@ void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t
 // frees memory allocated for filter
 void BRBloomFilterFree(BRBloomFilter *filter);
 
+// a rolling bloom filter has a fixed size and forgets the oldest elements as new ones are added, it always remembers at
+// least the most recent elemCount elements, insertions are split into three generations of elemCount/2 each, and
+// starting a new generation clears the bits set only by the oldest one
+typedef struct {
+    uint64_t *data; // pairs of words holding a two bit generation number (0 for none) for each filter bit
+    size_t length; // number of words in data
+    uint32_t hashFuncs;
+    uint32_t tweak;
+    size_t genElemCount; // insertions per generation
+    size_t elemCount; // insertions in the current generation
+    uint32_t generation; // current generation number, 1 to 3
+} BRRollingBloomFilter;
+
+// returns a newly allocated rolling bloom filter that must be freed by calling BRRollingBloomFilterFree()
+BRRollingBloomFilter *BRRollingBloomFilterNew(double falsePositiveRate, size_t elemCount, uint32_t tweak);
+
+// true if data is matched by filter
+int BRRollingBloomFilterContainsData(const BRRollingBloomFilter *filter, const uint8_t *data, size_t dataLen);
+
+// add data to filter, possibly forgetting the oldest generation of data
+void BRRollingBloomFilterInsertData(BRRollingBloomFilter *filter, const uint8_t *data, size_t dataLen);
+
+// frees memory allocated for filter
+void BRRollingBloomFilterFree(BRRollingBloomFilter *filter);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,343 @@
+//
+//  BRHeaderStore.c
+//
+//  Copyright (c) 2019 breadwallet LLC.
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRHeaderStore.h"
+#include "BRCrypto.h"
+#include "BRInt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEADER_STORE_MAGIC   0x53485242 // "BRHS"
+#define HEADER_STORE_VERSION 1
+#define FILE_HEADER_SIZE     32 // magic, version, record size, 4 reserved bytes, synced count, 8 reserved bytes
+#define RECORD_SIZE          116 // 80 byte block header, height, chain work
+#define SYNC_COUNT_OFFSET    16
+
+struct BRHeaderStoreStruct {
+    int fd;
+    const uint8_t *map; // read-only mapping of the records present when the store was opened
+    size_t mapLen, count, syncCount; // syncCount is the number of records known to be on permanent storage
+    UInt256 lastHash, lastWork; // block hash and chain work of the last record
+    uint32_t lastHeight;
+};
+
+// returns the work needed to find a block with the given compact difficulty target, approximated as 2^256/target
+static UInt256 _BRHeaderWork(uint32_t target)
+{
+    const uint32_t size = target >> 24, mantissa = target & 0x007fffff;
+    uint32_t n[8] = { 0 };
+    uint64_t rem = 0;
+    UInt256 work = UINT256_ZERO;
+    
+    if (mantissa == 0 || size <= 3 || size > 34) return work; // target out of range for any valid block
+    n[(256 - (size - 3)*8)/32] = 1u << ((256 - (size - 3)*8) % 32); // 2^256/2^((size - 3)*8)
+
+    for (int i = 7; i >= 0; i--) { // long division by mantissa, one 32bit limb at a time
+        rem = (rem << 32) | n[i];
+        UInt32SetLE(&work.u8[i*4], (uint32_t)(rem/mantissa));
+        rem %= mantissa;
+    }
+    
+    return work;
+}
+
+// returns a + b, treating both as little-endian 256bit integers
+static UInt256 _BRHeaderWorkAdd(UInt256 a, UInt256 b)
+{
+    uint64_t sum = 0;
+    
+    for (int i = 0; i < 8; i++) {
+        sum += (uint64_t)UInt32GetLE(&a.u8[i*4]) + UInt32GetLE(&b.u8[i*4]);
+        UInt32SetLE(&a.u8[i*4], (uint32_t)sum);
+        sum >>= 32;
+    }
+    
+    return a;
+}
+
+// returns a pointer to the record at index, either in the file mapping or read into buf
+static const uint8_t *_BRHeaderStoreRecord(BRHeaderStore *store, size_t index, uint8_t buf[RECORD_SIZE])
+{
+    off_t off = FILE_HEADER_SIZE + (off_t)index*RECORD_SIZE;
+    
+    assert(index < store->count);
+    if (off + RECORD_SIZE <= (off_t)store->mapLen) return &store->map[off];
+    return (pread(store->fd, buf, RECORD_SIZE, off) == RECORD_SIZE) ? buf : NULL;
+}
+
+// sets the last record fields from the record at index count - 1
+static int _BRHeaderStoreSetLast(BRHeaderStore *store)
+{
+    uint8_t buf[RECORD_SIZE];
+    const uint8_t *rec = (store->count > 0) ? _BRHeaderStoreRecord(store, store->count - 1, buf) : NULL;
+    
+    if (store->count > 0 && ! rec) return 0;
+    store->lastHash = store->lastWork = UINT256_ZERO;
+    store->lastHeight = 0;
+    
+    if (rec) {
+        BRSHA256_2(&store->lastHash, rec, 80);
+        store->lastHeight = UInt32GetLE(&rec[80]);
+        store->lastWork = UInt256Get(&rec[84]);
+    }
+    
+    return 1;
+}
+
+// writes the synced count to the file header, after making sure the records it covers are on permanent storage
+static int _BRHeaderStoreWriteSyncCount(BRHeaderStore *store, size_t count)
+{
+    uint8_t buf[sizeof(uint64_t)];
+    
+    UInt64SetLE(buf, count);
+    if (fsync(store->fd) != 0 || pwrite(store->fd, buf, sizeof(buf), SYNC_COUNT_OFFSET) != sizeof(buf)) return 0;
+    if (fsync(store->fd) != 0) return 0;
+    store->syncCount = count;
+    return 1;
+}
+
+// true if rec is a valid header that follows the previous record, with prevHash, prevHeight and prevWork
+static int _BRHeaderStoreRecordIsValid(const uint8_t *rec, int hasPrev, UInt256 prevHash, uint32_t prevHeight,
+                                       UInt256 prevWork)
+{
+    BRMerkleBlock *block = BRMerkleBlockParse(rec, 80);
+    UInt256 work = _BRHeaderWorkAdd(prevWork, _BRHeaderWork(block->target));
+    int r = BRMerkleBlockIsValid(block, (uint32_t)time(NULL));
+    
+    if (hasPrev && (! UInt256Eq(block->prevBlock, prevHash) || UInt32GetLE(&rec[80]) != prevHeight + 1)) r = 0;
+    if (! UInt256Eq(UInt256Get(&rec[84]), work)) r = 0;
+    BRMerkleBlockFree(block);
+    return r;
+}
+
+// opens the header store file at path, creating it if needed, returns NULL and sets errno on failure
+// the store must be closed by calling BRHeaderStoreClose(), it is not thread safe
+BRHeaderStore *BRHeaderStoreOpen(const char *path)
+{
+    BRHeaderStore *store = calloc(1, sizeof(*store));
+    uint8_t hdr[FILE_HEADER_SIZE] = { 0 };
+    const uint8_t *rec;
+    struct stat st;
+    size_t count = 0;
+    int r = 1, err = 0;
+    
+    assert(store != NULL);
+    assert(path != NULL);
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0 || fstat(store->fd, &st) != 0) r = 0;
+    
+    if (r && st.st_size < FILE_HEADER_SIZE) { // new file
+        UInt32SetLE(&hdr[0], HEADER_STORE_MAGIC);
+        UInt32SetLE(&hdr[4], HEADER_STORE_VERSION);
+        UInt32SetLE(&hdr[8], RECORD_SIZE);
+        if (pwrite(store->fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(store->fd) != 0) r = 0;
+        st.st_size = FILE_HEADER_SIZE;
+    }
+    else if (r && (pread(store->fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                   UInt32GetLE(&hdr[0]) != HEADER_STORE_MAGIC || UInt32GetLE(&hdr[4]) != HEADER_STORE_VERSION ||
+                   UInt32GetLE(&hdr[8]) != RECORD_SIZE)) {
+        err = EINVAL; // not a header store, or an unsupported version
+        r = 0;
+    }
+    
+    if (r) {
+        count = (size_t)(st.st_size - FILE_HEADER_SIZE)/RECORD_SIZE;
+        store->syncCount = (UInt64GetLE(&hdr[SYNC_COUNT_OFFSET]) < count) ?
+                           (size_t)UInt64GetLE(&hdr[SYNC_COUNT_OFFSET]) : count;
+        store->mapLen = FILE_HEADER_SIZE + count*RECORD_SIZE;
+        store->map = mmap(NULL, store->mapLen, PROT_READ, MAP_SHARED, store->fd, 0);
+        if (store->map == MAP_FAILED) store->map = NULL, store->mapLen = 0, r = 0;
+    }
+    
+    if (r) { // synced records are trusted, records written after the last sync are kept only if they're valid
+        store->count = store->syncCount;
+        r = _BRHeaderStoreSetLast(store);
+        
+        while (r && store->count < count) {
+            rec = &store->map[FILE_HEADER_SIZE + store->count*RECORD_SIZE];
+            if (! _BRHeaderStoreRecordIsValid(rec, (store->count > 0), store->lastHash, store->lastHeight,
+                                              store->lastWork)) break;
+            store->count++;
+            BRSHA256_2(&store->lastHash, rec, 80);
+            store->lastHeight = UInt32GetLE(&rec[80]);
+            store->lastWork = UInt256Get(&rec[84]);
+        }
+        
+        // truncate any partial or invalid records, so appends continue from the last good one
+        if (r && FILE_HEADER_SIZE + (off_t)store->count*RECORD_SIZE < st.st_size &&
+            ftruncate(store->fd, FILE_HEADER_SIZE + (off_t)store->count*RECORD_SIZE) != 0) r = 0;
+    }
+
+    if (! r) {
+        if (! err) err = errno;
+        if (store->map) munmap((void *)store->map, store->mapLen);
+        if (store->fd >= 0) close(store->fd);
+        free(store);
+        store = NULL;
+        errno = err;
+    }
+    
+    return store;
+}
+
+// number of headers in the store
+size_t BRHeaderStoreCount(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return store->count;
+}
+
+// returns the header at index as a merkle block with no transactions, and blockHash and height set
+BRMerkleBlock BRHeaderStoreHeader(BRHeaderStore *store, size_t index)
+{
+    BRMerkleBlock block = BR_MERKLE_BLOCK_NONE;
+    uint8_t buf[RECORD_SIZE];
+    const uint8_t *rec;
+    
+    assert(store != NULL);
+    assert(index < store->count);
+    rec = _BRHeaderStoreRecord(store, index, buf);
+    
+    if (rec) {
+        block.version = UInt32GetLE(&rec[0]);
+        block.prevBlock = UInt256Get(&rec[4]);
+        block.merkleRoot = UInt256Get(&rec[36]);
+        block.timestamp = UInt32GetLE(&rec[68]);
+        block.target = UInt32GetLE(&rec[72]);
+        block.nonce = UInt32GetLE(&rec[76]);
+        block.height = UInt32GetLE(&rec[80]);
+        block.blockHash = BRHeaderStoreBlockHash(store, index);
+    }
+    
+    return block;
+}
+
+// block hash of the header at index
+UInt256 BRHeaderStoreBlockHash(BRHeaderStore *store, size_t index)
+{
+    uint8_t buf[RECORD_SIZE];
+    const uint8_t *rec;
+    
+    assert(store != NULL);
+    assert(index < store->count);
+    if (index + 1 == store->count) return store->lastHash;
+    rec = _BRHeaderStoreRecord(store, index + 1, buf); // hashes aren't stored, the next header's prevBlock has it
+    return (rec) ? UInt256Get(&rec[4]) : UINT256_ZERO;
+}
+
+// height of the header at index
+uint32_t BRHeaderStoreHeight(BRHeaderStore *store, size_t index)
+{
+    uint8_t buf[RECORD_SIZE];
+    const uint8_t *rec;
+    
+    assert(store != NULL);
+    assert(index < store->count);
+    rec = _BRHeaderStoreRecord(store, index, buf);
+    return (rec) ? UInt32GetLE(&rec[80]) : BLOCK_UNKNOWN_HEIGHT;
+}
+
+// total chain work of the headers up to and including index, as a little-endian 256bit integer
+UInt256 BRHeaderStoreChainWork(BRHeaderStore *store, size_t index)
+{
+    uint8_t buf[RECORD_SIZE];
+    const uint8_t *rec;
+    
+    assert(store != NULL);
+    assert(index < store->count);
+    rec = _BRHeaderStoreRecord(store, index, buf);
+    return (rec) ? UInt256Get(&rec[84]) : UINT256_ZERO;
+}
+
+// appends the header of block, which must follow the last header in the store, returns true on success
+int BRHeaderStoreAppend(BRHeaderStore *store, const BRMerkleBlock *block)
+{
+    BRMerkleBlock header;
+    uint8_t rec[RECORD_SIZE];
+    UInt256 work;
+    
+    assert(store != NULL);
+    assert(block != NULL);
+    assert(block->height != BLOCK_UNKNOWN_HEIGHT);
+    
+    if (store->count > 0 && (! UInt256Eq(block->prevBlock, store->lastHash) ||
+                             block->height != store->lastHeight + 1)) {
+        errno = EINVAL;
+        return 0;
+    }
+    
+    header = *block;
+    header.totalTx = 0; // serialize only the 80 byte header
+    BRMerkleBlockSerialize(&header, rec, 80);
+    UInt32SetLE(&rec[80], block->height);
+    work = _BRHeaderWorkAdd(store->lastWork, _BRHeaderWork(block->target));
+    UInt256Set(&rec[84], work);
+    
+    if (pwrite(store->fd, rec, sizeof(rec), FILE_HEADER_SIZE + (off_t)store->count*RECORD_SIZE) != sizeof(rec)) {
+        return 0;
+    }
+    
+    store->count++;
+    store->lastHash = block->blockHash;
+    store->lastHeight = block->height;
+    store->lastWork = work;
+    if (store->count >= store->syncCount + HEADER_STORE_SYNC_INTERVAL) BRHeaderStoreSync(store);
+    return 1;
+}
+
+// removes the headers from index on, returns true on success
+int BRHeaderStoreTruncate(BRHeaderStore *store, size_t index)
+{
+    assert(store != NULL);
+    if (index >= store->count) return 1;
+    
+    // lower the synced count first so a crash can never leave it covering records that are being replaced
+    if (index < store->syncCount && ! _BRHeaderStoreWriteSyncCount(store, index)) return 0;
+    if (ftruncate(store->fd, FILE_HEADER_SIZE + (off_t)index*RECORD_SIZE) != 0) return 0;
+    store->count = index;
+    return _BRHeaderStoreSetLast(store);
+}
+
+// flushes appended headers to permanent storage, returns true on success
+int BRHeaderStoreSync(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return (store->syncCount == store->count || _BRHeaderStoreWriteSyncCount(store, store->count));
+}
+
+// syncs and closes the store
+void BRHeaderStoreClose(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    BRHeaderStoreSync(store);
+    if (store->map) munmap((void *)store->map, store->mapLen);
+    close(store->fd);
+    free(store);
+}
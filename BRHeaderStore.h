@@ -0,0 +1,82 @@
+//
+//  BRHeaderStore.h
+//
+//  Copyright (c) 2019 breadwallet LLC.
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRHeaderStore_h
+#define BRHeaderStore_h
+
+#include "BRMerkleBlock.h"
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// an append-only file of consecutive block headers, each stored with its height and the chain work it adds up to,
+// counted from the block before the first header - a reorg is handled by truncating the file back to the fork point
+//
+// appended headers are made durable by BRHeaderStoreSync(), which fsyncs them before recording the new header count in
+// the file header. when a store is reopened after a crash, headers written since the last sync are kept only if they
+// are valid and connect to the chain, and anything after the first bad or partial record is truncated
+
+#define HEADER_STORE_SYNC_INTERVAL BLOCK_DIFFICULTY_INTERVAL // appended headers are synced at least this often
+
+typedef struct BRHeaderStoreStruct BRHeaderStore;
+
+// opens the header store file at path, creating it if needed, returns NULL and sets errno on failure
+// the store must be closed by calling BRHeaderStoreClose(), it is not thread safe
+BRHeaderStore *BRHeaderStoreOpen(const char *path);
+
+// number of headers in the store
+size_t BRHeaderStoreCount(BRHeaderStore *store);
+
+// returns the header at index as a merkle block with no transactions, and blockHash and height set
+BRMerkleBlock BRHeaderStoreHeader(BRHeaderStore *store, size_t index);
+
+// block hash of the header at index
+UInt256 BRHeaderStoreBlockHash(BRHeaderStore *store, size_t index);
+
+// height of the header at index
+uint32_t BRHeaderStoreHeight(BRHeaderStore *store, size_t index);
+
+// total chain work of the headers up to and including index, as a little-endian 256bit integer
+UInt256 BRHeaderStoreChainWork(BRHeaderStore *store, size_t index);
+
+// appends the header of block, which must follow the last header in the store, returns true on success
+int BRHeaderStoreAppend(BRHeaderStore *store, const BRMerkleBlock *block);
+
+// removes the headers from index on, returns true on success
+int BRHeaderStoreTruncate(BRHeaderStore *store, size_t index);
+
+// flushes appended headers to permanent storage, returns true on success
+int BRHeaderStoreSync(BRHeaderStore *store);
+
+// syncs and closes the store
+void BRHeaderStoreClose(BRHeaderStore *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRHeaderStore_h
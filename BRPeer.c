@@ -25,7 +25,7 @@
 #include "BRPeer.h"
 #include "BRMerkleBlock.h"
 #include "BRAddress.h"
-#include "BRSet.h"
+#include "BRBloomFilter.h"
 #include "BRArray.h"
 #include "BRCrypto.h"
 #include "BRInt.h"
@@ -40,8 +40,14 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>	
 #include <arpa/inet.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define HEADER_LENGTH      24
 #define MAX_MSG_LENGTH     0x02000000
@@ -53,8 +59,22 @@
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
 #define WITNESS_FLAG       0x40000000
+#define KNOWN_TX_COUNT     20000 // remember at least this many of the most recent tx hashes known to the remote peer
+#define KNOWN_TX_FP_RATE   0.000001
+#define BLOCK_WINDOW_MIN   10  // merkleblocks to request at once from the slowest peers
+#define BLOCK_WINDOW_MAX   500 // merkleblocks to request at once from the fastest peers
+#define BLOCK_WINDOW_INIT  100 // merkleblocks to request at once before a peer's throughput has been measured
 
 #define PTHREAD_STACK_SIZE  (512 * 1024)
+#define RECV_BUFFER_SIZE    0x10000 // socket reads are done in chunks of up to this size
+#define SEND_QUEUE_LIMIT    0x800000 // a peer that lets more than this back up in its send queue is disconnected
+#define SEND_MAX_IOV        64
+
+#define LOOP_MAX_THREADS   16
+#define LOOP_MAX_EVENTS    64
+#define LOOP_MAX_READS     16
+#define LOOP_TICK          0.1 // timer wheel resolution in seconds
+#define LOOP_WHEEL_SLOTS   256 // a full turn of the wheel is 25.6s, later deadlines are checked once per turn
 
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
@@ -83,6 +103,9 @@
 // - if at any point tx messages consume enough wallet addresses to drop below the bip32 chain gap limit, more addresses
 //   are generated and local peer sends filterload with an updated bloom filter
 // - after filterload is sent, getdata is sent to re-request recent blocks that may contain new tx matching the filter
+//
+// in headers-first mode, getheaders is repeated all the way to the tip of the chain instead of switching to getblocks,
+// and the local peer sends getdata for merkleblocks itself, so block ranges can be fetched from several peers at once
 
 typedef enum {
     inv_undefined = 0,
@@ -94,23 +117,34 @@ typedef enum {
     inv_filtered_witness_block = inv_filtered_block | WITNESS_FLAG
 } inv_type;
 
+typedef struct _BRPeerLoop BRPeerLoop;
+
+typedef struct {
+    uint8_t header[HEADER_LENGTH];
+    uint8_t *payload;
+    size_t len, off; // payload length, and how much of header and payload has already been sent
+} BRPeerSendItem;
+
 typedef struct {
     BRPeer peer; // superstruct on top of BRPeer
     uint32_t magicNumber;
     char host[INET6_ADDRSTRLEN];
     BRPeerStatus status;
-    int waitingForNetwork;
+    int waitingForNetwork, headersFirst;
     volatile int needsFilterUpdate;
     uint64_t nonce, feePerKb;
     char *useragent;
     uint32_t version, lastblock, earliestKeyTime, currentBlockHeight;
     double startTime, pingTime;
     volatile double disconnectTime, mempoolTime;
+    double blockRequestTime, blockArrivalTime, blockLatency, blockInterval; // merkleblock throughput measurements
+    size_t blocksInFlight;
+    uint64_t blockCount, blockBytes;
     int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
     UInt256 lastBlockHash;
     BRMerkleBlock *currentBlock;
-    UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
-    BRSet *knownTxHashSet;
+    UInt256 *currentBlockTxHashes, *knownBlockHashes;
+    BRRollingBloomFilter *knownTxFilter;
     volatile int socket;
     void *info;
     void (*connected)(void *info);
@@ -130,6 +164,15 @@ typedef struct {
     void (**volatile pongCallback)(void *info, int success);
     void *volatile mempoolInfo;
     void (*volatile mempoolCallback)(void *info, int success);
+    BRPeerLoop *loop; // event loop multiplexing the connection, or NULL when the peer has its own thread
+    int loopSocket, loopConnecting, loopWantWrite, loopError, loopDone, timerSlot;
+    double loopMsgTimeout, timerDeadline;
+    uint8_t *recvBuf; // bytes read from the socket, messages are dispatched straight out of this buffer
+    size_t recvOff, recvLen, recvSize, recvReads, recvTotal;
+    BRPeerSendItem *sendQueue; // messages the socket couldn't take yet, in order
+    size_t sendQueued; // bytes waiting in sendQueue
+    pthread_mutex_t sendLock; // serializes writes to the socket and guards sendQueue
+    int wakeFd[2]; // pipe that wakes the peer thread's poll when sendQueue stops being empty
     pthread_t thread;
     pthread_mutex_t lock;
 } BRPeerContext;
@@ -143,24 +186,27 @@ inline static int _BRPeerIsIPv4(const BRPeer *peer)
     return (peer->address.u64[0] == 0 && peer->address.u16[4] == 0 && peer->address.u16[5] == 0xffff);
 }
 
-static void _BRPeerAddKnownTxHashes(const BRPeer *peer, const UInt256 txHashes[], size_t txCount)
+inline static int _BRPeerKnowsTxHash(const BRPeer *peer, UInt256 txHash)
+{
+    return BRRollingBloomFilterContainsData(((BRPeerContext *)peer)->knownTxFilter, txHash.u8, sizeof(txHash));
+}
+
+// adds txHashes to the remote peer's known tx filter, and if newHashes isn't NULL, copies the hashes that weren't
+// already known to it, returns the number of hashes that weren't already known
+static size_t _BRPeerAddKnownTxHashes(const BRPeer *peer, const UInt256 txHashes[], size_t txCount,
+                                      UInt256 *newHashes)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    UInt256 *knownTxHashes = ctx->knownTxHashes;
     size_t i, j;
     
-    for (i = 0; i < txCount; i++) {
-        if (! BRSetContains(ctx->knownTxHashSet, &txHashes[i])) {
-            array_add(knownTxHashes, txHashes[i]);
-            
-            if (ctx->knownTxHashes != knownTxHashes) { // check if knownTxHashes was moved to a new memory location
-                ctx->knownTxHashes = knownTxHashes;
-                BRSetClear(ctx->knownTxHashSet);
-                for (j = array_count(knownTxHashes); j > 0; j--) BRSetAdd(ctx->knownTxHashSet, &knownTxHashes[j - 1]);
-            }
-            else BRSetAdd(ctx->knownTxHashSet, &knownTxHashes[array_count(knownTxHashes) - 1]);
-        }
+    for (i = 0, j = 0; i < txCount; i++) {
+        if (_BRPeerKnowsTxHash(peer, txHashes[i])) continue;
+        BRRollingBloomFilterInsertData(ctx->knownTxFilter, txHashes[i].u8, sizeof(*txHashes));
+        if (newHashes) newHashes[j] = txHashes[i];
+        j++;
     }
+    
+    return j;
 }
 
 static void _BRPeerDidConnect(BRPeer *peer)
@@ -379,13 +425,13 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             for (i = 0, j = 0; i < txCount; i++) {
                 hash = UInt256Get(transactions[i]);
                 
-                if (BRSetContains(ctx->knownTxHashSet, &hash)) {
+                if (_BRPeerKnowsTxHash(peer, hash)) {
                     if (ctx->hasTx) ctx->hasTx(ctx->info, hash);
                 }
                 else txHashes[j++] = hash;
             }
             
-            _BRPeerAddKnownTxHashes(peer, txHashes, j);
+            _BRPeerAddKnownTxHashes(peer, txHashes, j, NULL);
             if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
     
             // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
@@ -470,18 +516,21 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
         peer_log(peer, "got %zu header(s)", count);
     
         // To improve chain download performance, if this message contains 2000 headers then request the next 2000
-        // headers immediately, and switch to requesting blocks when we receive a header newer than earliestKeyTime
+        // headers immediately, and switch to requesting blocks when we receive a header newer than earliestKeyTime,
+        // unless in headers-first mode, where fewer than 2000 headers means the tip of the chain was reached
         uint32_t timestamp = (count > 0) ? UInt32GetLE(&msg[off + 81*(count - 1) + 68]) : 0;
+        int keyTimeReached = (! ctx->headersFirst && timestamp > 0 &&
+                              timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime);
     
-        if (count >= 2000 || (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
+        if (count >= 2000 || keyTimeReached || ctx->headersFirst) {
             size_t last = 0;
             time_t now = time(NULL);
             UInt256 locators[2];
             
-            BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
-            BRSHA256_2(&locators[1], &msg[off], 80);
+            if (count > 0) BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
+            if (count > 0) BRSHA256_2(&locators[1], &msg[off], 80);
 
-            if (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
+            if (keyTimeReached) {
                 // request blocks for the remainder of the chain
                 timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
 
@@ -492,7 +541,7 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
                 BRSHA256_2(&locators[0], &msg[off + 81*(last - 1)], 80);
                 BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
             }
-            else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+            else if (count >= 2000) BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
 
             for (size_t i = 0; r && i < count; i++) {
                 BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81*i], 81);
@@ -594,6 +643,34 @@ static int _BRPeerAcceptGetdataMessage(BRPeer *peer, const uint8_t *msg, size_t
     return r;
 }
 
+// updates merkleblock throughput measurements, blocks that arrive after the peer was idle measure the latency from
+// getdata to first block, and the rest measure the interval between blocks with the request pipeline full
+static void _BRPeerBlocksReceived(BRPeer *peer, size_t blockCount, size_t len)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct timeval tv;
+    double now;
+    
+    gettimeofday(&tv, NULL);
+    now = tv.tv_sec + (double)tv.tv_usec/1000000;
+    pthread_mutex_lock(&ctx->lock);
+    
+    if (len > 0 && ctx->blocksInFlight > 0 && ctx->blockArrivalTime < ctx->blockRequestTime) {
+        // 50% low pass filter on latency, the same as ping time
+        ctx->blockLatency = (ctx->blockLatency > 0) ? ctx->blockLatency*0.5 + (now - ctx->blockRequestTime)*0.5 :
+                            now - ctx->blockRequestTime;
+    }
+    else if (len > 0 && ctx->blocksInFlight > 0) {
+        // 10% low pass filter on the interval, since it's sampled once per block
+        ctx->blockInterval = (ctx->blockInterval > 0) ? ctx->blockInterval*0.9 + (now - ctx->blockArrivalTime)*0.1 :
+                             now - ctx->blockArrivalTime;
+    }
+    
+    if (len > 0) ctx->blockArrivalTime = now, ctx->blockCount += blockCount, ctx->blockBytes += len;
+    ctx->blocksInFlight -= (blockCount < ctx->blocksInFlight) ? blockCount : ctx->blocksInFlight;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
 static int _BRPeerAcceptNotfoundMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -633,6 +710,8 @@ static int _BRPeerAcceptNotfoundMessage(BRPeer *peer, const uint8_t *msg, size_t
             off += 36;
         }
         
+        _BRPeerBlocksReceived(peer, array_count(blockHashes), 0); // notfound blocks are no longer in flight
+        
         if (ctx->notfound) {
             ctx->notfound(ctx->info, txHashes, array_count(txHashes), blockHashes, array_count(blockHashes));
         }
@@ -735,10 +814,11 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
                 *hashes = (sizeof(UInt256)*count <= 0x1000) ? _hashes : malloc(count*sizeof(*hashes));
         
         assert(hashes != NULL);
+        _BRPeerBlocksReceived(peer, 1, msgLen);
         count = BRMerkleBlockTxHashes(block, hashes, count);
 
         for (size_t i = count; i > 0; i--) { // reverse order for more efficient removal as tx arrive
-            if (BRSetContains(ctx->knownTxHashSet, &hashes[i - 1])) continue;
+            if (_BRPeerKnowsTxHash(peer, hashes[i - 1])) continue;
             array_add(ctx->currentBlockTxHashes, hashes[i - 1]);
         }
 
@@ -861,6 +941,28 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     return r;
 }
 
+static socklen_t _BRPeerSockAddr(BRPeer *peer, int domain, struct sockaddr_storage *addr)
+{
+    socklen_t addrLen;
+
+    memset(addr, 0, sizeof(*addr));
+
+    if (domain == PF_INET6) {
+        ((struct sockaddr_in6 *)addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)addr)->sin6_addr = *(struct in6_addr *)&peer->address;
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(peer->port);
+        addrLen = sizeof(struct sockaddr_in6);
+    }
+    else {
+        ((struct sockaddr_in *)addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
+        ((struct sockaddr_in *)addr)->sin_port = htons(peer->port);
+        addrLen = sizeof(struct sockaddr_in);
+    }
+
+    return addrLen;
+}
+
 static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -891,20 +993,7 @@ static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *erro
     }
 
     if (r) {
-        memset(&addr, 0, sizeof(addr));
-        
-        if (domain == PF_INET6) {
-            ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
-            ((struct sockaddr_in6 *)&addr)->sin6_addr = *(struct in6_addr *)&peer->address;
-            ((struct sockaddr_in6 *)&addr)->sin6_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in6);
-        }
-        else {
-            ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
-            ((struct sockaddr_in *)&addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
-            ((struct sockaddr_in *)&addr)->sin_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in);
-        }
+        addrLen = _BRPeerSockAddr(peer, domain, &addr);
         
         if (connect(ctx->socket, (struct sockaddr *)&addr, addrLen) < 0) err = errno;
         
@@ -978,6 +1067,237 @@ static double _peerGetMempoolTime (BRPeerContext *ctx) {
     return value;
 }
 
+// verifies a message header, returns an errno.h code if it's malformed
+static int _BRPeerCheckHeader(BRPeer *peer, const uint8_t *header)
+{
+    const char *type = (const char *)(&header[4]);
+    uint32_t msgLen = UInt32GetLE(&header[16]);
+    int error = 0;
+
+    if (header[15] != 0) { // verify header type field is NULL terminated
+        peer_log(peer, "malformed message header: type not NULL terminated");
+        error = EPROTO;
+    }
+    else if (msgLen > MAX_MSG_LENGTH) { // check message length
+        peer_log(peer, "error reading %s, message length %"PRIu32" is too long", type, msgLen);
+        error = EPROTO;
+    }
+
+    return error;
+}
+
+// verifies the payload checksum and dispatches the message, returns an errno.h code on failure
+static int _BRPeerProcessMessage(BRPeer *peer, const uint8_t *header, const uint8_t *payload)
+{
+    const char *type = (const char *)(&header[4]);
+    uint32_t msgLen = UInt32GetLE(&header[16]);
+    uint32_t checksum = UInt32GetLE(&header[20]);
+    UInt256 hash;
+    int error = 0;
+
+    BRSHA256_2(&hash, payload, msgLen);
+
+    if (UInt32GetLE(&hash) != checksum) { // verify checksum
+        peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32", SHA256_2:%s",
+                 type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
+        error = EPROTO;
+    }
+    else if (! _BRPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
+
+    return error;
+}
+
+// reads as much as fits in the receive buffer with a single syscall, returns the result of read()
+static ssize_t _BRPeerRecv(BRPeerContext *ctx, int socket)
+{
+    ssize_t n;
+
+    if (! ctx->recvBuf) {
+        ctx->recvBuf = malloc(RECV_BUFFER_SIZE);
+        assert(ctx->recvBuf != NULL);
+        ctx->recvSize = RECV_BUFFER_SIZE;
+        ctx->recvOff = ctx->recvLen = 0;
+    }
+
+    if (ctx->recvOff > 0 && ctx->recvOff + ctx->recvLen > ctx->recvSize*3/4) { // slide unparsed bytes to the front
+        memmove(ctx->recvBuf, &ctx->recvBuf[ctx->recvOff], ctx->recvLen);
+        ctx->recvOff = 0;
+    }
+
+    n = read(socket, &ctx->recvBuf[ctx->recvOff + ctx->recvLen], ctx->recvSize - ctx->recvOff - ctx->recvLen);
+    ctx->recvReads++;
+    if (n > 0) ctx->recvLen += n, ctx->recvTotal += n;
+    return n;
+}
+
+// dispatches each complete message in the receive buffer without copying it, returns an errno.h code on failure
+static int _BRPeerRecvMessages(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    uint8_t *header;
+    size_t len;
+    int error = 0;
+
+    while (! error && _peerCheckAndGetSocket(ctx, NULL)) {
+        header = &ctx->recvBuf[ctx->recvOff];
+
+        while (sizeof(uint32_t) <= ctx->recvLen && UInt32GetLE(header) != ctx->magicNumber) {
+            header++, ctx->recvOff++, ctx->recvLen--; // skip one byte at a time until we find the magic number
+        }
+
+        if (ctx->recvLen < HEADER_LENGTH || (error = _BRPeerCheckHeader(peer, header)) != 0) break;
+        len = HEADER_LENGTH + UInt32GetLE(&header[16]);
+
+        if (ctx->recvLen < len) { // make room for the rest of the message
+            if (ctx->recvOff + len > ctx->recvSize) {
+                memmove(ctx->recvBuf, header, ctx->recvLen);
+                ctx->recvOff = 0;
+            }
+
+            if (len > ctx->recvSize) {
+                ctx->recvBuf = realloc(ctx->recvBuf, (ctx->recvSize = len));
+                assert(ctx->recvBuf != NULL);
+            }
+
+            break;
+        }
+
+        ctx->recvOff += len;
+        ctx->recvLen -= len;
+        error = _BRPeerProcessMessage(peer, header, &header[HEADER_LENGTH]);
+    }
+
+    if (ctx->recvLen == 0) ctx->recvOff = 0;
+
+    if (ctx->recvLen == 0 && ctx->recvSize > RECV_BUFFER_SIZE) { // give back the space used by a large message
+        ctx->recvBuf = realloc(ctx->recvBuf, (ctx->recvSize = RECV_BUFFER_SIZE));
+        assert(ctx->recvBuf != NULL);
+    }
+
+    return error;
+}
+
+// writes as much of the send queue as the socket will take with a single syscall, ctx->sendLock must be held
+// returns an errno.h code on failure
+static int _BRPeerFlush(BRPeerContext *ctx, int socket)
+{
+    BRPeerSendItem *item;
+    struct iovec iov[SEND_MAX_IOV];
+    struct msghdr msg;
+    size_t i, count = 0, len;
+    ssize_t n;
+
+    for (i = 0; i < array_count(ctx->sendQueue) && count + 2 <= SEND_MAX_IOV; i++) {
+        item = &ctx->sendQueue[i];
+
+        if (item->off < HEADER_LENGTH) {
+            iov[count].iov_base = &item->header[item->off];
+            iov[count++].iov_len = HEADER_LENGTH - item->off;
+        }
+
+        if (item->len > 0) {
+            len = (item->off > HEADER_LENGTH) ? item->off - HEADER_LENGTH : 0;
+            iov[count].iov_base = &item->payload[len];
+            iov[count++].iov_len = item->len - len;
+        }
+    }
+
+    if (count == 0) return 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    n = sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) return (errno == EWOULDBLOCK || errno == EINTR) ? 0 : errno;
+    ctx->sendQueued -= n;
+
+    for (i = 0; i < array_count(ctx->sendQueue) && n > 0; i++) {
+        item = &ctx->sendQueue[i];
+        len = HEADER_LENGTH + item->len - item->off;
+
+        if ((size_t)n < len) {
+            item->off += n;
+            break;
+        }
+
+        n -= len;
+        if (item->payload) free(item->payload);
+    }
+
+    array_rm_range(ctx->sendQueue, 0, i);
+    return 0;
+}
+
+static void _BRPeerClearSendQueue(BRPeerContext *ctx)
+{
+    for (size_t i = 0; i < array_count(ctx->sendQueue); i++) {
+        if (ctx->sendQueue[i].payload) free(ctx->sendQueue[i].payload);
+    }
+
+    array_clear(ctx->sendQueue);
+    ctx->sendQueued = 0;
+}
+
+static void _BRPeerDidDisconnect(BRPeer *peer, int error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int socket;
+
+    pthread_mutex_lock(&ctx->sendLock);
+    pthread_mutex_lock(&ctx->lock);
+    socket = ctx->socket;
+    ctx->socket = -1;
+    ctx->status = BRPeerStatusDisconnected;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (socket >= 0) close(socket);
+    _BRPeerClearSendQueue(ctx);
+    pthread_mutex_unlock(&ctx->sendLock);
+    peer_log(peer, "disconnected, received %zu bytes with %zu reads", ctx->recvTotal, ctx->recvReads);
+    if (ctx->recvBuf) free(ctx->recvBuf);
+    ctx->recvBuf = NULL;
+    ctx->recvSize = ctx->recvOff = ctx->recvLen = 0;
+    
+    while (array_count(ctx->pongCallback) > 0) {
+        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
+        void *pongInfo = ctx->pongInfo[0];
+        
+        array_rm(ctx->pongCallback, 0);
+        array_rm(ctx->pongInfo, 0);
+        if (pongCallback) pongCallback(pongInfo, 0);
+    }
+
+    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
+    ctx->mempoolCallback = NULL;
+    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
+}
+
+// opens the pipe used to wake the peer thread when messages are queued, returns true on success
+static int _BRPeerOpenWakePipe(BRPeerContext *ctx)
+{
+    int fds[2], i;
+
+    if (pipe(fds) < 0) return 0;
+
+    for (i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, NULL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_lock(&ctx->sendLock);
+    ctx->wakeFd[0] = fds[0];
+    ctx->wakeFd[1] = fds[1];
+    pthread_mutex_unlock(&ctx->sendLock);
+    return 1;
+}
+
+static void _BRPeerCloseWakePipe(BRPeerContext *ctx)
+{
+    pthread_mutex_lock(&ctx->sendLock);
+    if (ctx->wakeFd[0] >= 0) close(ctx->wakeFd[0]);
+    if (ctx->wakeFd[1] >= 0) close(ctx->wakeFd[1]);
+    ctx->wakeFd[0] = ctx->wakeFd[1] = -1;
+    pthread_mutex_unlock(&ctx->sendLock);
+}
 
 static void *_peerThreadRoutine(void *arg)
 {
@@ -986,133 +1306,449 @@ static void *_peerThreadRoutine(void *arg)
     int socket, error = 0;
 
     pthread_cleanup_push(ctx->threadCleanup, ctx->info);
+    if (! _BRPeerOpenWakePipe(ctx)) error = errno;
     
-    if (_BRPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
+    if (! error && _BRPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
         struct timeval tv;
-        double time = 0, msgTimeout;
-        uint8_t header[HEADER_LENGTH], *payload = malloc(0x1000);
-        size_t len = 0, payloadLen = 0x1000;
+        double time = 0, msgTimeout = DBL_MAX;
         ssize_t n = 0;
+        char buf[64];
 
-        assert(payload != NULL);
         gettimeofday(&tv, NULL);
         ctx->startTime = tv.tv_sec + (double)tv.tv_usec/1000000;
         BRPeerSendVersionMessage(peer);
 
         while (_peerCheckAndGetSocket(ctx, &socket) && ! error) {
-            len = 0;
+            struct pollfd fd[2] = { { socket, POLLIN, 0 }, { ctx->wakeFd[0], POLLIN, 0 } };
+
+            pthread_mutex_lock(&ctx->sendLock);
+            if (array_count(ctx->sendQueue) > 0) fd[0].events |= POLLOUT;
+            pthread_mutex_unlock(&ctx->sendLock);
+            if (poll(fd, 2, 1000) < 0 && errno != EINTR) error = errno;
+            if (fd[1].revents & POLLIN) while (read(ctx->wakeFd[0], buf, sizeof(buf)) > 0);
+            n = -1;
+
+            if (! error && (fd[0].revents & POLLOUT)) {
+                pthread_mutex_lock(&ctx->sendLock);
+                error = _BRPeerFlush(ctx, socket);
+                pthread_mutex_unlock(&ctx->sendLock);
+            }
 
-            while (socket >= 0 && ! error && len < HEADER_LENGTH) {
-                n = read(socket, &header[len], sizeof(header) - len);
-                if (n > 0) len += n;
+            if (! error && (fd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+                n = _BRPeerRecv(ctx, socket);
                 if (n == 0) error = ECONNRESET;
                 if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                gettimeofday(&tv, NULL);
-                time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                if (! error && time >= _peerGetDisconnectTime(ctx)) error = ETIMEDOUT;
-
-                if (! error && time >= _peerGetMempoolTime(ctx)) {
-                    peer_log(peer, "done waiting for mempool response");
-                    BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
-                    ctx->mempoolCallback = NULL;
-
-                    pthread_mutex_lock(&ctx->lock);
-                    ctx->mempoolTime = DBL_MAX;
-                    pthread_mutex_unlock(&ctx->lock);
-                }
+            }
 
-                while (sizeof(uint32_t) <= len && UInt32GetLE(header) != ctx->magicNumber) {
-                    memmove(header, &header[1], --len); // consume one byte at a time until we find the magic number
-                }
+            if (error) peer_log(peer, "%s", strerror(error));
+            if (n > 0) error = _BRPeerRecvMessages(peer);
+            gettimeofday(&tv, NULL);
+            time = tv.tv_sec + (double)tv.tv_usec/1000000;
+            // a partially received message must keep making progress
+            if (n > 0) msgTimeout = (ctx->recvLen >= HEADER_LENGTH) ? time + MESSAGE_TIMEOUT : DBL_MAX;
 
-                socket = _peerGetSocket(ctx);
-            }
-            
-            if (error) {
+            if (! error && (time >= _peerGetDisconnectTime(ctx) || time >= msgTimeout)) {
+                error = ETIMEDOUT;
                 peer_log(peer, "%s", strerror(error));
             }
-            else if (header[15] != 0) { // verify header type field is NULL terminated
-                peer_log(peer, "malformed message header: type not NULL terminated");
-                error = EPROTO;
-            }
-            else if (len == HEADER_LENGTH) {
-                const char *type = (const char *)(&header[4]);
-                uint32_t msgLen = UInt32GetLE(&header[16]);
-                uint32_t checksum = UInt32GetLE(&header[20]);
-                UInt256 hash;
-                
-                if (msgLen > MAX_MSG_LENGTH) { // check message length
-                    peer_log(peer, "error reading %s, message length %"PRIu32" is too long", type, msgLen);
-                    error = EPROTO;
-                }
-                else {
-                    if (msgLen > payloadLen) payload = realloc(payload, (payloadLen = msgLen));
-                    assert(payload != NULL);
-                    len = 0;
-                    socket = _peerGetSocket(ctx);
-                    msgTimeout = time + MESSAGE_TIMEOUT;
-                    
-                    while (socket >= 0 && ! error && len < msgLen) {
-                        n = read(socket, &payload[len], msgLen - len);
-                        if (n > 0) len += n;
-                        if (n == 0) error = ECONNRESET;
-                        if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                        gettimeofday(&tv, NULL);
-                        time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                        if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT;
-                        if (! error && time >= msgTimeout) error = ETIMEDOUT;
-                        socket = _peerGetSocket(ctx);
-                    }
-                    
-                    if (error) {
-                        peer_log(peer, "%s", strerror(error));
-                    }
-                    else if (len == msgLen) {
-                        BRSHA256_2(&hash, payload, msgLen);
-                        
-                        if (UInt32GetLE(&hash) != checksum) { // verify checksum
-                            peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
-                                     ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
-                            error = EPROTO;
-                        }
-                        else if (! _BRPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
-                    }
-                }
+
+            if (! error && time >= _peerGetMempoolTime(ctx)) {
+                peer_log(peer, "done waiting for mempool response");
+                BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+                ctx->mempoolCallback = NULL;
+
+                pthread_mutex_lock(&ctx->lock);
+                ctx->mempoolTime = DBL_MAX;
+                pthread_mutex_unlock(&ctx->lock);
             }
         }
-        
-        free(payload);
     }
 
+    _BRPeerCloseWakePipe(ctx);
+    _BRPeerDidDisconnect(peer, error);
+    pthread_cleanup_pop(1);
+    return NULL; // detached threads don't need to return a value
+}
+
+#ifdef __linux__
+
+struct _BRPeerLoop {
+    int fd; // epoll instance
+    uint64_t tick; // last timer wheel tick processed
+    BRPeerContext **wheel[LOOP_WHEEL_SLOTS], **due;
+    pthread_t thread;
+    pthread_mutex_t lock;
+};
+
+static BRPeerLoop _peerLoops[LOOP_MAX_THREADS];
+static size_t _peerLoopsStarted = 0, _peerLoopCount = 0, _peerLoopNext = 0;
+static pthread_mutex_t _peerLoopLock = PTHREAD_MUTEX_INITIALIZER;
+
+// returns the event loop the next connection should use, or NULL if peers get their own thread
+static BRPeerLoop *_BRPeerLoopAssign(void)
+{
+    BRPeerLoop *loop = NULL;
+
+    pthread_mutex_lock(&_peerLoopLock);
+    if (_peerLoopCount > 0) loop = &_peerLoops[_peerLoopNext++ % _peerLoopCount];
+    pthread_mutex_unlock(&_peerLoopLock);
+    return loop;
+}
+
+// loop->lock must be held
+static void _BRPeerLoopUnschedule(BRPeerLoop *loop, BRPeerContext *ctx)
+{
+    size_t i;
+
+    if (ctx->timerSlot >= 0) {
+        for (i = array_count(loop->wheel[ctx->timerSlot]); i > 0; i--) {
+            if (loop->wheel[ctx->timerSlot][i - 1] == ctx) break;
+        }
+
+        if (i > 0) array_rm(loop->wheel[ctx->timerSlot], i - 1);
+        ctx->timerSlot = -1;
+    }
+}
+
+// makes sure the peer's timers are checked no later than deadline, a deadline of 0 means on the next tick
+static void _BRPeerLoopSchedule(BRPeerContext *ctx, double deadline)
+{
+    BRPeerLoop *loop = ctx->loop;
+    uint64_t tick = (deadline > 0) ? (uint64_t)(deadline/LOOP_TICK) : 0;
+
+    pthread_mutex_lock(&loop->lock);
+
+    // a peer sits in at most one slot, for its earliest deadline, and deadlines moved later are found lazily
+    if (! ctx->loopDone && deadline < DBL_MAX && (ctx->timerSlot < 0 || deadline < ctx->timerDeadline)) {
+        _BRPeerLoopUnschedule(loop, ctx);
+        if (tick <= loop->tick) tick = loop->tick + 1;
+        ctx->timerSlot = tick % LOOP_WHEEL_SLOTS;
+        ctx->timerDeadline = deadline;
+        array_add(loop->wheel[ctx->timerSlot], ctx);
+    }
+
+    pthread_mutex_unlock(&loop->lock);
+}
+
+// starts a non-blocking connect and registers the socket with the event loop, ctx->lock must be held
+static void _BRPeerLoopOpen(BRPeerContext *ctx, int domain)
+{
+    BRPeer *peer = &ctx->peer;
+    struct sockaddr_storage addr;
+    struct epoll_event event = { EPOLLIN | EPOLLOUT | EPOLLRDHUP, { .ptr = ctx } };
+    socklen_t addrLen = _BRPeerSockAddr(peer, domain, &addr);
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), on = 1, err = 0;
+
+    if (fd < 0) err = errno;
+
+    if (! err) {
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        if (connect(fd, (struct sockaddr *)&addr, addrLen) < 0 && errno != EINPROGRESS) err = errno;
+
+        if (err && domain == PF_INET6 && _BRPeerIsIPv4(peer)) {
+            close(fd);
+            _BRPeerLoopOpen(ctx, PF_INET); // fallback to IPv4
+            return;
+        }
+    }
+
+    ctx->socket = ctx->loopSocket = (err) ? -1 : fd;
+    ctx->loopConnecting = ctx->loopWantWrite = 1;
+    ctx->loopError = err;
+    ctx->loopDone = 0;
+    ctx->loopMsgTimeout = DBL_MAX;
+
+    if (! err && epoll_ctl(ctx->loop->fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        ctx->loopError = err = errno;
+        ctx->socket = ctx->loopSocket = -1;
+        close(fd);
+    }
+
+    if (err) peer_log(peer, "connect error: %s", strerror(err));
+    _BRPeerLoopSchedule(ctx, (err) ? 0 : ctx->disconnectTime); // errors are reported from the event loop thread
+}
+
+// watch for the socket becoming writable only while connecting or with messages queued, ctx->sendLock must be held
+static void _BRPeerLoopWatch(BRPeerContext *ctx)
+{
+    int wantWrite = (ctx->loopConnecting || array_count(ctx->sendQueue) > 0);
+    struct epoll_event event = { EPOLLIN | EPOLLRDHUP | ((wantWrite) ? EPOLLOUT : 0), { .ptr = ctx } };
+
+    if (ctx->loopSocket >= 0 && wantWrite != ctx->loopWantWrite) {
+        ctx->loopWantWrite = wantWrite;
+        epoll_ctl(ctx->loop->fd, EPOLL_CTL_MOD, ctx->loopSocket, &event);
+    }
+}
+
+// disconnect requested by the caller, the event loop closes the socket and calls the disconnected callback
+static void _BRPeerLoopDisconnect(BRPeerContext *ctx)
+{
+    BRPeer *peer = &ctx->peer;
+    int socket;
+
     pthread_mutex_lock(&ctx->lock);
     socket = ctx->socket;
     ctx->socket = -1;
     ctx->status = BRPeerStatusDisconnected;
+    // shutdown under the lock so it can't race the event loop closing the socket
+    if (socket >= 0 && shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "%s", strerror(errno));
+    // schedule before unlocking, the event loop can't finish and free the peer until it takes ctx->lock to close
+    if (socket >= 0) _BRPeerLoopSchedule(ctx, 0);
     pthread_mutex_unlock(&ctx->lock);
+}
 
-    if (socket >= 0) close(socket);
-    peer_log(peer, "disconnected");
-    
-    while (array_count(ctx->pongCallback) > 0) {
-        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
-        void *pongInfo = ctx->pongInfo[0];
-        
-        array_rm(ctx->pongCallback, 0);
-        array_rm(ctx->pongInfo, 0);
-        if (pongCallback) pongCallback(pongInfo, 0);
+static void _BRPeerLoopFinish(BRPeerContext *ctx, int error)
+{
+    BRPeerLoop *loop = ctx->loop;
+    void (*threadCleanup)(void *) = ctx->threadCleanup;
+    void *info = ctx->info;
+
+    pthread_mutex_lock(&loop->lock);
+    _BRPeerLoopUnschedule(loop, ctx);
+    ctx->loopDone = 1;
+    pthread_mutex_unlock(&loop->lock);
+
+    if (ctx->loopSocket >= 0) {
+        pthread_mutex_lock(&ctx->sendLock);
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, ctx->loopSocket, NULL);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->socket = -1;
+        pthread_mutex_unlock(&ctx->lock);
+        close(ctx->loopSocket);
+        ctx->loopSocket = -1;
+        pthread_mutex_unlock(&ctx->sendLock);
     }
 
-    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
-    ctx->mempoolCallback = NULL;
-    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
-    pthread_cleanup_pop(1);
-    return NULL; // detached threads don't need to return a value
+    _BRPeerDidDisconnect(&ctx->peer, error); // peer may be freed by the disconnected callback
+    threadCleanup(info);
+}
+
+// reads what's available on the socket, dispatching each complete message, returns an errno.h code on failure
+static int _BRPeerLoopRead(BRPeerContext *ctx)
+{
+    BRPeer *peer = &ctx->peer;
+    struct timeval tv;
+    double msgTimeout = ctx->loopMsgTimeout;
+    ssize_t n = 1;
+    int i, error = 0;
+
+    // level triggered, so stop after a few chunks to give other peers on the loop a turn
+    for (i = 0; i < LOOP_MAX_READS && n > 0 && ! error && _peerCheckAndGetSocket(ctx, NULL); i++) {
+        n = _BRPeerRecv(ctx, ctx->loopSocket);
+        if (n == 0) error = ECONNRESET;
+        if (n < 0 && errno != EWOULDBLOCK && errno != EINTR) error = errno;
+        if (error) peer_log(peer, "%s", strerror(error));
+        if (n > 0) error = _BRPeerRecvMessages(peer);
+    }
+
+    if (ctx->recvLen >= HEADER_LENGTH) { // the timer wheel picks up an extended timeout lazily
+        gettimeofday(&tv, NULL);
+        ctx->loopMsgTimeout = tv.tv_sec + (double)tv.tv_usec/1000000 + MESSAGE_TIMEOUT;
+        if (msgTimeout == DBL_MAX) _BRPeerLoopSchedule(ctx, ctx->loopMsgTimeout);
+    }
+    else ctx->loopMsgTimeout = DBL_MAX;
+
+    return error;
+}
+
+static void _BRPeerLoopEvent(BRPeerContext *ctx, uint32_t events)
+{
+    BRPeer *peer = &ctx->peer;
+    struct timeval tv;
+    socklen_t optLen = sizeof(int);
+    int error = 0;
+
+    if (! _peerCheckAndGetSocket(ctx, NULL)) { // disconnect requested
+    }
+    else if (ctx->loopConnecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        if (getsockopt(ctx->loopSocket, SOL_SOCKET, SO_ERROR, &error, &optLen) < 0) error = errno;
+
+        if (error) {
+            peer_log(peer, "connect error: %s", strerror(error));
+        }
+        else {
+            peer_log(peer, "socket connected");
+            pthread_mutex_lock(&ctx->sendLock);
+            ctx->loopConnecting = 0;
+            _BRPeerLoopWatch(ctx);
+            pthread_mutex_unlock(&ctx->sendLock);
+            gettimeofday(&tv, NULL);
+            ctx->startTime = tv.tv_sec + (double)tv.tv_usec/1000000;
+            BRPeerSendVersionMessage(peer);
+        }
+    }
+    else if (! ctx->loopConnecting) {
+        if (events & EPOLLOUT) {
+            pthread_mutex_lock(&ctx->sendLock);
+            error = _BRPeerFlush(ctx, ctx->loopSocket);
+            _BRPeerLoopWatch(ctx);
+            pthread_mutex_unlock(&ctx->sendLock);
+            if (error) peer_log(peer, "%s", strerror(error));
+        }
+
+        if (! error && (events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))) error = _BRPeerLoopRead(ctx);
+    }
+
+    if (error || ! _peerCheckAndGetSocket(ctx, NULL)) _BRPeerLoopFinish(ctx, error);
+}
+
+// checks the disconnect, mempool and message timeouts of a peer whose timer wheel slot came due
+static void _BRPeerLoopTimer(BRPeerContext *ctx, double time)
+{
+    BRPeer *peer = &ctx->peer;
+    double deadline = ctx->loopMsgTimeout, mempoolTime;
+    int error = ctx->loopError;
+
+    if (! error && _peerCheckAndGetSocket(ctx, NULL)) {
+        if (time >= _peerGetDisconnectTime(ctx) || time >= ctx->loopMsgTimeout) error = ETIMEDOUT;
+        if (error) peer_log(peer, "%s", strerror(error));
+
+        if (! error && time >= _peerGetMempoolTime(ctx)) {
+            peer_log(peer, "done waiting for mempool response");
+            BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+            ctx->mempoolCallback = NULL;
+
+            pthread_mutex_lock(&ctx->lock);
+            ctx->mempoolTime = DBL_MAX;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+
+        if (! error && _peerCheckAndGetSocket(ctx, NULL)) {
+            mempoolTime = _peerGetMempoolTime(ctx);
+            if (_peerGetDisconnectTime(ctx) < deadline) deadline = _peerGetDisconnectTime(ctx);
+            if (mempoolTime < deadline) deadline = mempoolTime;
+            _BRPeerLoopSchedule(ctx, deadline);
+            return;
+        }
+    }
+
+    _BRPeerLoopFinish(ctx, error);
+}
+
+static void _BRPeerLoopTimers(BRPeerLoop *loop, double time)
+{
+    uint64_t tick = (uint64_t)(time/LOOP_TICK), t;
+    size_t i, j;
+
+    pthread_mutex_lock(&loop->lock);
+
+    for (t = loop->tick + 1; t <= tick && t <= loop->tick + LOOP_WHEEL_SLOTS; t++) {
+        i = t % LOOP_WHEEL_SLOTS;
+        for (j = 0; j < array_count(loop->wheel[i]); j++) loop->wheel[i][j]->timerSlot = -1;
+        array_add_array(loop->due, loop->wheel[i], array_count(loop->wheel[i]));
+        array_clear(loop->wheel[i]);
+    }
+
+    if (tick > loop->tick) loop->tick = tick; // peers rescheduled below land after this tick
+    pthread_mutex_unlock(&loop->lock);
+    for (i = 0; i < array_count(loop->due); i++) _BRPeerLoopTimer(loop->due[i], time);
+    array_clear(loop->due);
+}
+
+static void *_peerLoopRoutine(void *arg)
+{
+    BRPeerLoop *loop = arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    struct timeval tv;
+    int i, count;
+
+    for (;;) { // event loops run for the life of the process
+        count = epoll_wait(loop->fd, events, LOOP_MAX_EVENTS, LOOP_TICK*1000);
+        for (i = 0; i < count; i++) _BRPeerLoopEvent(events[i].data.ptr, events[i].events);
+        gettimeofday(&tv, NULL);
+        _BRPeerLoopTimers(loop, tv.tv_sec + (double)tv.tv_usec/1000000);
+    }
+
+    return NULL;
 }
 
+static int _BRPeerLoopStart(BRPeerLoop *loop)
+{
+    struct timeval tv;
+    pthread_attr_t attr;
+    size_t i;
+    int r = 1;
+
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->fd < 0) return 0;
+    gettimeofday(&tv, NULL);
+    loop->tick = (uint64_t)((tv.tv_sec + (double)tv.tv_usec/1000000)/LOOP_TICK);
+    for (i = 0; i < LOOP_WHEEL_SLOTS; i++) array_new(loop->wheel[i], 2);
+    array_new(loop->due, 10);
+    pthread_mutex_init(&loop->lock, NULL);
+
+    if (pthread_attr_init(&attr) != 0) r = 0;
+
+    if (r && (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+              pthread_attr_setstacksize(&attr, PTHREAD_STACK_SIZE) != 0 ||
+              pthread_create(&loop->thread, &attr, _peerLoopRoutine, loop) != 0)) r = 0;
+
+    if (r) pthread_attr_destroy(&attr);
+
+    if (! r) {
+        for (i = 0; i < LOOP_WHEEL_SLOTS; i++) array_free(loop->wheel[i]);
+        array_free(loop->due);
+        pthread_mutex_destroy(&loop->lock);
+        close(loop->fd);
+    }
+
+    return r;
+}
+
+#else // event loops are built on epoll, on other platforms each peer always gets its own thread
+
+static BRPeerLoop *_BRPeerLoopAssign(void)
+{
+    return NULL;
+}
+
+static void _BRPeerLoopSchedule(BRPeerContext *ctx, double deadline)
+{
+}
+
+static void _BRPeerLoopOpen(BRPeerContext *ctx, int domain)
+{
+}
+
+static void _BRPeerLoopDisconnect(BRPeerContext *ctx)
+{
+}
+
+static void _BRPeerLoopWatch(BRPeerContext *ctx)
+{
+}
+
+#endif
+
+
 static void _dummyThreadCleanup(void *info)
 {
 }
 
+// multiplexes the connections of peers connected after this call on threadCount shared epoll event loop threads
+// instead of a thread per peer, callbacks are then called from the event loop threads and threadCleanup is called when
+// the connection has ended, threadCount 0 goes back to a thread per peer (event loop threads are never stopped)
+// returns the number of event loop threads new connections will use, always 0 where epoll isn't available
+size_t BRPeerSetEventLoopThreads(size_t threadCount)
+{
+#ifdef __linux__
+    size_t count;
+
+    pthread_mutex_lock(&_peerLoopLock);
+    if (threadCount > LOOP_MAX_THREADS) threadCount = LOOP_MAX_THREADS;
+
+    while (_peerLoopsStarted < threadCount && _BRPeerLoopStart(&_peerLoops[_peerLoopsStarted])) {
+        _peerLoopsStarted++;
+    }
+
+    count = _peerLoopCount = (threadCount < _peerLoopsStarted) ? threadCount : _peerLoopsStarted;
+    pthread_mutex_unlock(&_peerLoopLock);
+    return count;
+#else
+    return 0;
+#endif
+}
+
 // returns a newly allocated BRPeer struct that must be freed by calling BRPeerFree()
 BRPeer *BRPeerNew(uint32_t magicNumber)
 {
@@ -1123,14 +1759,17 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
     array_new(ctx->useragent, 40);
     array_new(ctx->knownBlockHashes, 10);
     array_new(ctx->currentBlockTxHashes, 10);
-    array_new(ctx->knownTxHashes, 10);
-    ctx->knownTxHashSet = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    ctx->knownTxFilter = BRRollingBloomFilterNew(KNOWN_TX_FP_RATE, KNOWN_TX_COUNT, BRRand(0));
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
+    array_new(ctx->sendQueue, 10);
     ctx->pingTime = DBL_MAX;
     ctx->mempoolTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
     ctx->socket = -1;
+    ctx->loopSocket = -1;
+    ctx->wakeFd[0] = ctx->wakeFd[1] = -1;
+    ctx->timerSlot = -1;
     ctx->threadCleanup = _dummyThreadCleanup;
 
     {
@@ -1138,6 +1777,7 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
         pthread_mutexattr_init(&attr);
         pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
         pthread_mutex_init(&ctx->lock, &attr);
+        pthread_mutex_init(&ctx->sendLock, &attr);
         pthread_mutexattr_destroy(&attr);
     }
 
@@ -1194,6 +1834,13 @@ void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime)
     ((BRPeerContext *)peer)->earliestKeyTime = earliestKeyTime;
 }
 
+// set this to true to request headers all the way to the tip of the chain instead of switching to getblocks at
+// earliestKeyTime, merkleblocks are then requested with BRPeerSendGetdata()
+void BRPeerSetHeadersFirst(BRPeer *peer, int headersFirst)
+{
+    ((BRPeerContext *)peer)->headersFirst = headersFirst;
+}
+
 // call this when local block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight)
 {
@@ -1236,8 +1883,12 @@ void BRPeerConnect(BRPeer *peer)
 
             // No race - set before the thread starts.
             ctx->disconnectTime = tv.tv_sec + (double)tv.tv_usec/1000000 + CONNECT_TIMEOUT;
+            ctx->loop = _BRPeerLoopAssign();
 
-            if (pthread_attr_init(&attr) != 0) {
+            if (ctx->loop) {
+                _BRPeerLoopOpen(ctx, PF_INET6);
+            }
+            else if (pthread_attr_init(&attr) != 0) {
                 error = ENOMEM;
                 peer_log(peer, "error creating thread");
                 ctx->status = BRPeerStatusDisconnected;
@@ -1263,7 +1914,11 @@ void BRPeerDisconnect(BRPeer *peer)
     BRPeerContext *ctx = (BRPeerContext *)peer;
     int socket = -1;
 
-    if (_peerCheckAndGetSocket(ctx, &socket)) {
+    if (ctx->loop) {
+        _BRPeerLoopDisconnect(ctx);
+    }
+    else if (_peerCheckAndGetSocket(ctx, &socket)) {
+        pthread_mutex_lock(&ctx->sendLock); // don't close the socket out from under a write
         pthread_mutex_lock(&ctx->lock);
         ctx->socket = -1;
         ctx->status = BRPeerStatusDisconnected;
@@ -1271,6 +1926,7 @@ void BRPeerDisconnect(BRPeer *peer)
 
         if (shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "%s", strerror(errno));
         close(socket);
+        pthread_mutex_unlock(&ctx->sendLock);
     }
 }
 
@@ -1283,6 +1939,7 @@ void BRPeerScheduleDisconnect(BRPeer *peer, double seconds)
     gettimeofday(&tv, NULL);
     pthread_mutex_lock(&ctx->lock);
     ctx->disconnectTime = (seconds < 0) ? DBL_MAX : tv.tv_sec + (double)tv.tv_usec/1000000 + seconds;
+    if (ctx->loop) _BRPeerLoopSchedule(ctx, ctx->disconnectTime);
     pthread_mutex_unlock(&ctx->lock);
 }
 
@@ -1331,6 +1988,65 @@ double BRPeerPingTime(BRPeer *peer)
     return ((BRPeerContext *)peer)->pingTime;
 }
 
+// merkleblocks to request at once, twice the measured bandwidth-delay product so one request is always in flight while
+// the previous one is being received
+static size_t _BRPeerBlockWindow(BRPeerContext *ctx)
+{
+    double window;
+    
+    if (ctx->blockLatency <= 0 || ctx->blockInterval <= 0) return BLOCK_WINDOW_INIT;
+    window = 2.0*ctx->blockLatency/ctx->blockInterval;
+    return (window < BLOCK_WINDOW_MIN) ? BLOCK_WINDOW_MIN : (window > BLOCK_WINDOW_MAX) ? BLOCK_WINDOW_MAX :
+           (size_t)window;
+}
+
+// merkleblocks to request at once from peer to keep its connection busy without holding up the chain
+size_t BRPeerBlockWindow(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t window;
+    
+    pthread_mutex_lock(&ctx->lock);
+    window = _BRPeerBlockWindow(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return window;
+}
+
+// expected seconds for peer to deliver blockCount merkleblocks, based on its measured latency and throughput
+double BRPeerBlockTime(BRPeer *peer, size_t blockCount)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    double latency, time;
+    
+    pthread_mutex_lock(&ctx->lock);
+    latency = (ctx->blockLatency > 0) ? ctx->blockLatency : (ctx->pingTime < DBL_MAX) ? ctx->pingTime : 0;
+    time = latency + blockCount*ctx->blockInterval;
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return time;
+}
+
+// merkleblock download statistics for peer
+BRPeerStats BRPeerSyncStats(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerStats stats;
+    
+    pthread_mutex_lock(&ctx->lock);
+    stats.peer = *peer;
+    stats.pingTime = ctx->pingTime;
+    stats.blockLatency = ctx->blockLatency;
+    stats.blockInterval = ctx->blockInterval;
+    stats.blockWindow = _BRPeerBlockWindow(ctx);
+    stats.blocksInFlight = ctx->blocksInFlight;
+    stats.blockCount = ctx->blockCount;
+    stats.blockBytes = ctx->blockBytes;
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return stats;
+}
+
 // minimum tx fee rate peer will accept
 uint64_t BRPeerFeePerKb(BRPeer *peer)
 {
@@ -1348,7 +2064,7 @@ uint64_t BRPeerFeePerKb(BRPeer *peer)
 #define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
 #endif
 
-// sends a bitcoin protocol message to peer
+// sends a bitcoin protocol message to peer, whatever the socket can't take right away is queued, so this doesn't block
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
 {
     if (msgLen > MAX_MSG_LENGTH) {
@@ -1356,35 +2072,55 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
     }
     else {
         BRPeerContext *ctx = (BRPeerContext *)peer;
-        uint8_t buf[HEADER_LENGTH + msgLen], hash[32];
+        BRPeerSendItem item = { { 0 }, NULL, msgLen, 0 };
+        struct iovec iov[2] = { { item.header, HEADER_LENGTH }, { (void *)msg, msgLen } };
+        struct msghdr m;
+        uint8_t hash[32];
         size_t off = 0;
         ssize_t n = 0;
-        struct timeval tv;
         int socket, error = 0;
         
-        UInt32SetLE(&buf[off], ctx->magicNumber);
+        UInt32SetLE(&item.header[off], ctx->magicNumber);
         off += sizeof(uint32_t);
-        strncpy((char *)&buf[off], type, 12);
+        strncpy((char *)&item.header[off], type, 12);
         off += 12;
-        UInt32SetLE(&buf[off], (uint32_t)msgLen);
+        UInt32SetLE(&item.header[off], (uint32_t)msgLen);
         off += sizeof(uint32_t);
         BRSHA256_2(hash, msg, msgLen);
-        memcpy(&buf[off], hash, sizeof(uint32_t));
-        off += sizeof(uint32_t);
-        memcpy(&buf[off], msg, msgLen);
+        memcpy(&item.header[off], hash, sizeof(uint32_t));
         peer_log(peer, "sending %s", type);
-        msgLen = 0;
+        pthread_mutex_lock(&ctx->sendLock);
         socket = _peerGetSocket(ctx);
         if (socket < 0) error = ENOTCONN;
         
-        while (socket >= 0 && ! error && msgLen < sizeof(buf)) {
-            n = send(socket, &buf[msgLen], sizeof(buf) - msgLen, MSG_NOSIGNAL);
-            if (n >= 0) msgLen += n;
-            if (n < 0 && errno != EWOULDBLOCK) error = errno;
-            gettimeofday(&tv, NULL);
-            if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= _peerGetDisconnectTime(ctx)) error = ETIMEDOUT;
-            socket = _peerGetSocket(ctx);
+        if (! error && array_count(ctx->sendQueue) == 0) { // send straight from the caller's buffer
+            memset(&m, 0, sizeof(m));
+            m.msg_iov = iov;
+            m.msg_iovlen = (msgLen > 0) ? 2 : 1;
+            n = sendmsg(socket, &m, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EWOULDBLOCK && errno != EINTR) error = errno;
+            if (n < 0) n = 0;
+        }
+
+        if (! error && (size_t)n < HEADER_LENGTH + msgLen) { // queue the rest
+            if (array_count(ctx->sendQueue) > 0 && ctx->sendQueued + HEADER_LENGTH + msgLen > SEND_QUEUE_LIMIT) {
+                peer_log(peer, "send queue full, %zu bytes waiting", ctx->sendQueued);
+                error = ENOBUFS;
+            }
+            else {
+                if (msgLen > 0) item.payload = malloc(msgLen);
+                assert(msgLen == 0 || item.payload != NULL);
+                if (msgLen > 0) memcpy(item.payload, msg, msgLen);
+                item.off = n;
+                array_add(ctx->sendQueue, item);
+                ctx->sendQueued += HEADER_LENGTH + msgLen - n;
+                if (ctx->loop) _BRPeerLoopWatch(ctx);
+                // wake the peer thread so it starts polling for POLLOUT
+                if (array_count(ctx->sendQueue) == 1 && ctx->wakeFd[1] >= 0) write(ctx->wakeFd[1], "", 1);
+            }
         }
+
+        pthread_mutex_unlock(&ctx->sendLock);
         
         if (error) {
             peer_log(peer, "%s", strerror(error));
@@ -1461,13 +2197,14 @@ void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t known
     ctx->sentMempool = 1;
     
     if (! sentMempool && ! ctx->mempoolCallback) {
-        _BRPeerAddKnownTxHashes(peer, knownTxHashes, knownTxCount);
+        _BRPeerAddKnownTxHashes(peer, knownTxHashes, knownTxCount, NULL);
         
         if (completionCallback) {
             gettimeofday(&tv, NULL);
 
             pthread_mutex_lock(&ctx->lock);
             ctx->mempoolTime = tv.tv_sec + (double)tv.tv_usec/1000000 + 10.0;
+            if (ctx->loop) _BRPeerLoopSchedule(ctx, ctx->mempoolTime);
             pthread_mutex_unlock(&ctx->lock);
 
             ctx->mempoolInfo = info;
@@ -1534,11 +2271,9 @@ void BRPeerSendGetblocks(BRPeer *peer, const UInt256 locators[], size_t locators
 
 void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
-    BRPeerContext *ctx = (BRPeerContext *)peer;
-    size_t knownCount = array_count(ctx->knownTxHashes);
+    UInt256 newHashes[txCount];
 
-    _BRPeerAddKnownTxHashes(peer, txHashes, txCount);
-    txCount = array_count(ctx->knownTxHashes) - knownCount;
+    txCount = _BRPeerAddKnownTxHashes(peer, txHashes, txCount, newHashes);
 
     if (txCount > 0) {
         size_t i, off = 0, msgLen = BRVarIntSize(txCount) + (sizeof(uint32_t) + sizeof(*txHashes))*txCount;
@@ -1549,7 +2284,7 @@ void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
         for (i = 0; i < txCount; i++) {
             UInt32SetLE(&msg[off], inv_tx);
             off += sizeof(uint32_t);
-            UInt256Set(&msg[off], ctx->knownTxHashes[knownCount + i]);
+            UInt256Set(&msg[off], newHashes[i]);
             off += sizeof(UInt256);
         }
 
@@ -1566,8 +2301,10 @@ void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, c
         peer_log(peer, "couldn't send getdata, %zu is too many items, max is %d", count, MAX_GETDATA_HASHES);
     }
     else if (count > 0) {
+        BRPeerContext *ctx = (BRPeerContext *)peer;
         size_t msgLen = BRVarIntSize(count) + (sizeof(uint32_t) + sizeof(UInt256))*(count);
         uint8_t msg[msgLen];
+        struct timeval tv;
 
         off += BRVarIntSet(&msg[off], (off <= msgLen ? msgLen - off : 0), count);
         
@@ -1585,7 +2322,19 @@ void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, c
             off += sizeof(UInt256);
         }
         
-        ((BRPeerContext *)peer)->sentGetdata = 1;
+        if (blockCount > 0) {
+            gettimeofday(&tv, NULL);
+            pthread_mutex_lock(&ctx->lock);
+            
+            if (ctx->blocksInFlight == 0) { // the peer was idle, so the first block will measure latency
+                ctx->blockRequestTime = tv.tv_sec + (double)tv.tv_usec/1000000;
+            }
+            
+            ctx->blocksInFlight += blockCount;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        
+        ctx->sentGetdata = 1;
         BRPeerSendMessage(peer, msg, off, MSG_GETDATA);
     }
 }
@@ -1633,10 +2382,17 @@ void BRPeerFree(BRPeer *peer)
     if (ctx->useragent) array_free(ctx->useragent);
     if (ctx->currentBlockTxHashes) array_free(ctx->currentBlockTxHashes);
     if (ctx->knownBlockHashes) array_free(ctx->knownBlockHashes);
-    if (ctx->knownTxHashes) array_free(ctx->knownTxHashes);
-    if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
+    if (ctx->knownTxFilter) BRRollingBloomFilterFree(ctx->knownTxFilter);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
+    if (ctx->recvBuf) free(ctx->recvBuf);
+
+    if (ctx->sendQueue) {
+        _BRPeerClearSendQueue(ctx);
+        array_free(ctx->sendQueue);
+    }
+
+    pthread_mutex_destroy(&ctx->sendLock);
     free(ctx);
 }
 
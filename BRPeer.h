@@ -106,8 +106,25 @@ typedef struct {
 
 #define BR_PEER_NONE ((const BRPeer) { UINT128_ZERO, 0, 0, 0, 0 })
 
+typedef struct {
+    BRPeer peer;
+    double pingTime; // average ping time in seconds
+    double blockLatency; // average seconds from getdata to the first merkleblock, or 0 if not yet measured
+    double blockInterval; // average seconds between merkleblocks with requests in flight, or 0 if not yet measured
+    size_t blockWindow; // merkleblocks to request at once, see BRPeerBlockWindow()
+    size_t blocksInFlight; // merkleblocks requested and not yet received
+    uint64_t blockCount; // merkleblocks received
+    uint64_t blockBytes; // size of merkleblock messages received
+} BRPeerStats;
+
 // NOTE: BRPeer functions are not thread-safe
 
+// multiplexes the connections of peers connected after this call on threadCount shared epoll event loop threads
+// instead of a thread per peer, callbacks are then called from the event loop threads and threadCleanup is called when
+// the connection has ended, threadCount 0 goes back to a thread per peer (event loop threads are never stopped)
+// returns the number of event loop threads new connections will use, always 0 where epoll isn't available
+size_t BRPeerSetEventLoopThreads(size_t threadCount);
+
 // returns a newly allocated BRPeer struct that must be freed by calling BRPeerFree()
 BRPeer *BRPeerNew(uint32_t magicNumber);
 
@@ -141,6 +158,10 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime);
 
+// set this to true to request headers all the way to the tip of the chain instead of switching to getblocks at
+// earliestKeyTime, merkleblocks are then requested with BRPeerSendGetdata()
+void BRPeerSetHeadersFirst(BRPeer *peer, int headersFirst);
+
 // call this when local best block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight);
 
@@ -177,6 +198,15 @@ uint64_t BRPeerFeePerKb(BRPeer *peer);
 // average ping time for connected peer
 double BRPeerPingTime(BRPeer *peer);
 
+// merkleblocks to request at once from peer to keep its connection busy without holding up the chain
+size_t BRPeerBlockWindow(BRPeer *peer);
+
+// expected seconds for peer to deliver blockCount merkleblocks, based on its measured latency and throughput
+double BRPeerBlockTime(BRPeer *peer, size_t blockCount);
+
+// merkleblock download statistics for peer
+BRPeerStats BRPeerSyncStats(BRPeer *peer);
+
 // sends a bitcoin protocol message to peer
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
 void BRPeerSendFilterload(BRPeer *peer, const uint8_t *filter, size_t filterLen);
@@ -24,13 +24,17 @@
 
 #include "BRPeerManager.h"
 #include "BRBloomFilter.h"
+#include "BRHeaderStore.h"
+#include "BRPeerStore.h"
 #include "BRSet.h"
 #include "BRArray.h"
 #include "BRInt.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <float.h>
 #include <time.h>
 #include <assert.h>
 #include <pthread.h>
@@ -43,6 +47,16 @@
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define PEER_FLAG_FETCH       0x04 // peer has the sync bloom filter loaded and can be assigned fetch windows
+#define FETCH_PEER_WINDOWS    2    // windows a peer can have outstanding at once, each sized by BRPeerBlockWindow()
+#define FETCH_MAX_WINDOWS     16   // windows that can be outstanding or waiting to be added to the chain
+#define FETCH_STALL_TIMEOUT   10.0 // min seconds a peer can hold up the chain before its windows are given to others
+#define TX_PEER_SLOTS         64 // number of bits in BRTxPeers peers
+#define TX_PEERS_EXPIRY       (24*60*60) // unconfirmed tx relay and request entries are dropped after this long
+#define HEADER_CHUNK_SIZE     4096 // header index records are allocated this many at a time, so they never move
+#define PEER_MIN_KNOWN        100 // DNS seeds are queried in the background when fewer peers than this are known
+#define PEER_DNS_REFRESH      (24*60*60) // or when they haven't been queried in this long
+#define PEER_SAVE_COUNT       1000 // number of best known peers passed to savePeers
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
@@ -65,81 +79,34 @@ typedef struct {
 } BRPublishedTx;
 
 typedef struct {
-    UInt256 txHash;
-    BRPeer *peers;
-} BRTxPeerList;
-
-// true if peer is contained in the list of peers associated with txHash
-static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
-{
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
-
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (BRPeerEq(&list[i - 1].peers[j - 1], peer)) return 1;
-        }
-        
-        break;
-    }
-    
-    return 0;
-}
-
-// number of peers associated with txHash
-static size_t _BRTxPeerListCount(const BRTxPeerList *list, UInt256 txHash)
-{
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (UInt256Eq(list[i - 1].txHash, txHash)) return array_count(list[i - 1].peers);
-    }
-    
-    return 0;
-}
-
-// adds peer to the list of peers associated with txHash and returns the new total number of peers
-static size_t _BRTxPeerListAddPeer(BRTxPeerList **list, UInt256 txHash, const BRPeer *peer)
-{
-    for (size_t i = array_count(*list); i > 0; i--) {
-        if (! UInt256Eq((*list)[i - 1].txHash, txHash)) continue;
-        
-        for (size_t j = array_count((*list)[i - 1].peers); j > 0; j--) {
-            if (BRPeerEq(&(*list)[i - 1].peers[j - 1], peer)) return array_count((*list)[i - 1].peers);
-        }
-        
-        array_add((*list)[i - 1].peers, *peer);
-        return array_count((*list)[i - 1].peers);
-    }
+    BRPeer *peer; // peer the window is assigned to, or NULL
+    size_t start, count; // range of fetchHashes requested
+    time_t time; // when the window was assigned
+    int received; // all of the window's blocks have arrived
+} BRFetchWindow;
+
+typedef struct _BRChainHeader {
+    UInt256 blockHash; // must be first, so the struct can be used with BRMerkleBlockHash() and BRMerkleBlockEq()
+    struct _BRChainHeader *prev; // parent header, or NULL if it isn't in the index
+    struct _BRChainHeader *skip; // ancestor at _BRSkipHeight(height), used to find any ancestor in O(log n) steps
+    uint32_t height, timestamp, target;
+} BRChainHeader;
 
-    array_add(*list, ((const BRTxPeerList) { txHash, NULL }));
-    array_new((*list)[array_count(*list) - 1].peers, PEER_MAX_CONNECTIONS);
-    array_add((*list)[array_count(*list) - 1].peers, *peer);
-    return 1;
-}
+typedef struct {
+    UInt256 txHash; // must be first, so the struct can be used with BRTransactionHash() and BRTransactionEq()
+    uint64_t peers; // bitset of the manager's tx peer slots
+    time_t time; // when the entry was added
+} BRTxPeers;
 
-// removes peer from the list of peers associated with txHash, returns true if peer was found
-static int _BRTxPeerListRemovePeer(BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
-{
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
-        
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (! BRPeerEq(&list[i - 1].peers[j - 1], peer)) continue;
-            array_rm(list[i - 1].peers, j - 1);
-            return 1;
-        }
-        
-        break;
-    }
-    
-    return 0;
-}
+typedef struct {
+    UInt160 pkh; // must be first, so the struct can be used with _BRPKHHash() and _BRPKHEq()
+    BRWallet **wallets;
+} BRPKHWallets;
 
-// comparator for sorting peers by timestamp, most recent first
-inline static int _peerTimestampCompare(const void *peer, const void *otherPeer)
-{
-    if (((const BRPeer *)peer)->timestamp < ((const BRPeer *)otherPeer)->timestamp) return 1;
-    if (((const BRPeer *)peer)->timestamp > ((const BRPeer *)otherPeer)->timestamp) return -1;
-    return 0;
-}
+typedef struct {
+    BRUTXO utxo; // must be first, so the struct can be used with BRUTXOHash() and BRUTXOEq()
+    BRWallet *wallet;
+} BRUTXOWallet;
 
 // returns a hash value for a block's prevBlock value suitable for use in a hashtable
 inline static size_t _BRPrevBlockHash(const void *block)
@@ -166,18 +133,44 @@ inline static int _BRBlockHeightEq(const void *block, const void *otherBlock)
     return (((const BRMerkleBlock *)block)->height == ((const BRMerkleBlock *)otherBlock)->height);
 }
 
+// returns a hash value for a pkh suitable for use in a hashtable
+inline static size_t _BRPKHHash(const void *pkh)
+{
+    return (size_t)UInt32GetLE(pkh);
+}
+
+// true if pkh and otherPkh are equal
+inline static int _BRPKHEq(const void *pkh, const void *otherPkh)
+{
+    return UInt160Eq(UInt160Get(pkh), UInt160Get(otherPkh));
+}
+
 struct BRPeerManagerStruct {
     const BRChainParams *params;
-    BRWallet *wallet;
-    int isConnected, connectFailureCount, misbehavinCount, dnsThreadCount, peerThreadCount, maxConnectCount;
-    BRPeer *peers, *downloadPeer, fixedPeer, **connectedPeers;
+    BRWallet **wallets;
+    BRSet *pkhWallets, *utxoWallets; // pkh -> wallets and outpoint -> wallet indexes used to route transactions
+    int isConnected, connectFailureCount, dnsThreadCount, peerThreadCount, maxConnectCount;
+    BRPeer *downloadPeer, fixedPeer, **connectedPeers;
+    BRPeerStore *peerStore; // known peer addresses, scored by past connections
+    time_t dnsTime; // when DNS seeds were last queried
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
     BRBloomFilter *bloomFilter;
     double fpRate, averageTxPerBlock;
     BRSet *blocks, *orphans, *checkpoints;
+    BRSet *headers; // index of every block added to blocks, including blocks since pruned from it, keyed by blockHash
+    BRChainHeader **headerChunks; // header index records, HEADER_CHUNK_SIZE per chunk
+    size_t headerCount;
+    BRHeaderStore *headerStore; // optional built-in store of main chain headers, kept in step with lastBlock
     BRMerkleBlock *lastBlock, *lastOrphan;
-    BRTxPeerList *txRelays, *txRequests;
+    UInt256 *fetchHashes; // headers-first sync: hashes of headers newer than earliestKeyTime, from fetchHeight on
+    uint32_t fetchHeight;
+    BRFetchWindow *fetchWindows; // ranges of fetchHashes requested as merkleblocks, in chain order
+    size_t fetchHead; // index of the first window not yet added to the chain
+    BRSet *fetchedBlocks; // merkleblocks received ahead of lastBlock, waiting to be added to the chain in order
+    BRSet *txRelays, *txRequests; // txHash -> BRTxPeers indexes of peers that relayed or were sent getdata for a tx
+    BRPeer txPeers[TX_PEER_SLOTS]; // connected peers assigned to each bit of BRTxPeers peers
+    uint64_t txPeerSlots; // bitset of txPeers slots in use
     BRPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
     void *info;
@@ -191,20 +184,345 @@ struct BRPeerManagerStruct {
     pthread_mutex_t lock;
 };
 
-static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
+// number of set bits in x
+inline static size_t _BRBitCount(uint64_t x)
+{
+    size_t count;
+
+    for (count = 0; x; count++) x &= x - 1;
+    return count;
+}
+
+// returns the BRTxPeers bit for peer, assigning it a free slot if add is true, or 0 if it doesn't have one
+static uint64_t _BRPeerManagerTxPeerBit(BRPeerManager *manager, const BRPeer *peer, int add)
 {
-    for (size_t i = array_count(manager->peers); i > 0; i--) {
-        if (BRPeerEq(&manager->peers[i - 1], peer)) array_rm(manager->peers, i - 1);
+    size_t i, slot = TX_PEER_SLOTS;
+
+    for (i = 0; i < TX_PEER_SLOTS; i++) {
+        if (((manager->txPeerSlots >> i) & 1) == 0) {
+            if (slot == TX_PEER_SLOTS) slot = i;
+        }
+        else if (BRPeerEq(&manager->txPeers[i], peer)) return (uint64_t)1 << i;
+    }
+
+    if (! add || slot == TX_PEER_SLOTS) return 0;
+    manager->txPeers[slot] = *peer;
+    manager->txPeerSlots |= (uint64_t)1 << slot;
+    return (uint64_t)1 << slot;
+}
+
+// true if peer is contained in the set of peers associated with txHash
+static int _BRTxPeersHasPeer(BRPeerManager *manager, const BRSet *set, UInt256 txHash, const BRPeer *peer)
+{
+    const BRTxPeers *r = BRSetGet(set, &txHash);
+
+    return (r && (r->peers & _BRPeerManagerTxPeerBit(manager, peer, 0)) != 0);
+}
+
+// number of peers associated with txHash
+static size_t _BRTxPeersCount(const BRSet *set, UInt256 txHash)
+{
+    const BRTxPeers *r = BRSetGet(set, &txHash);
+
+    return (r) ? _BRBitCount(r->peers) : 0;
+}
+
+// adds peer to the set of peers associated with txHash and returns the new total number of peers
+static size_t _BRTxPeersAddPeer(BRPeerManager *manager, BRSet *set, UInt256 txHash, const BRPeer *peer)
+{
+    BRTxPeers *r = BRSetGet(set, &txHash);
+    uint64_t bit = _BRPeerManagerTxPeerBit(manager, peer, 1);
+
+    if (! r && bit != 0) {
+        r = calloc(1, sizeof(*r));
+        assert(r != NULL);
+        r->txHash = txHash;
+        r->time = time(NULL);
+        BRSetAdd(set, r);
+    }
+
+    if (r) r->peers |= bit;
+    return (r) ? _BRBitCount(r->peers) : 0;
+}
+
+// removes peer from the set of peers associated with txHash, returns true if peer was found, the entry for txHash is
+// dropped once no peers are left
+static int _BRTxPeersRemovePeer(BRPeerManager *manager, BRSet *set, UInt256 txHash, const BRPeer *peer)
+{
+    BRTxPeers *r = BRSetGet(set, &txHash);
+    uint64_t bit = _BRPeerManagerTxPeerBit(manager, peer, 0);
+    int found = (r && (r->peers & bit) != 0);
+
+    if (found) r->peers &= ~bit;
+
+    if (r && r->peers == 0) {
+        BRSetRemove(set, r);
+        free(r);
+    }
+
+    return found;
+}
+
+// drops the entry for txHash, used once a tx is confirmed and relay tracking is no longer needed
+static void _BRTxPeersRemoveTx(BRSet *set, UInt256 txHash)
+{
+    BRTxPeers *r = BRSetRemove(set, &txHash);
+
+    if (r) free(r);
+}
+
+// drops relay and request entries added before now - TX_PEERS_EXPIRY, so a tx that connected peers announced long ago
+// but may since have dropped from their mempools stops counting as relayed, returns the number of entries dropped
+static size_t _BRPeerManagerExpireTxPeers(BRPeerManager *manager, time_t now)
+{
+    BRSet *sets[] = { manager->txRelays, manager->txRequests };
+    size_t i, j, count, n = 0;
+    BRTxPeers **all;
+
+    for (i = 0; i < sizeof(sets)/sizeof(*sets); i++) {
+        count = BRSetCount(sets[i]);
+        all = malloc((count + 1)*sizeof(*all));
+        assert(all != NULL);
+        count = BRSetAll(sets[i], (void **)all, count);
+
+        for (j = 0; j < count; j++) {
+            if (all[j]->time + TX_PEERS_EXPIRY >= now) continue;
+            BRSetRemove(sets[i], all[j]);
+            free(all[j]);
+            n++;
+        }
+
+        free(all);
     }
 
-    if (++manager->misbehavinCount >= 10) { // clear out stored peers so we get a fresh list from DNS for next connect
-        manager->misbehavinCount = 0;
-        array_clear(manager->peers);
+    return n;
+}
+
+// clears peer from the relay and request sets and frees its tx peer slot, dropping any entries left with no peers
+static void _BRPeerManagerRemoveTxPeer(BRPeerManager *manager, const BRPeer *peer)
+{
+    BRSet *sets[] = { manager->txRelays, manager->txRequests };
+    uint64_t bit = _BRPeerManagerTxPeerBit(manager, peer, 0);
+    size_t i, j, count;
+    BRTxPeers **all;
+
+    if (bit == 0) return;
+
+    for (i = 0; i < sizeof(sets)/sizeof(*sets); i++) {
+        count = BRSetCount(sets[i]);
+        all = malloc((count + 1)*sizeof(*all));
+        assert(all != NULL);
+        count = BRSetAll(sets[i], (void **)all, count);
+
+        for (j = 0; j < count; j++) {
+            all[j]->peers &= ~bit;
+            if (all[j]->peers != 0) continue;
+            BRSetRemove(sets[i], all[j]);
+            free(all[j]);
+        }
+
+        free(all);
     }
 
+    manager->txPeerSlots &= ~bit;
+}
+
+// adds wallet to the pkh -> wallets index for each of the given addresses
+static void _BRPeerManagerIndexAddrs(BRPeerManager *manager, BRWallet *wallet, const BRAddress addrs[], size_t count)
+{
+    BRPKHWallets *r;
+    UInt160 pkh;
+    size_t i, j;
+    
+    for (i = 0; i < count; i++) {
+        if (! BRAddressHash160(&pkh, addrs[i].s)) continue;
+        r = BRSetGet(manager->pkhWallets, &pkh);
+        
+        if (! r) {
+            r = calloc(1, sizeof(*r));
+            assert(r != NULL);
+            r->pkh = pkh;
+            array_new(r->wallets, 1);
+            BRSetAdd(manager->pkhWallets, r);
+        }
+        
+        for (j = array_count(r->wallets); j > 0 && r->wallets[j - 1] != wallet; j--);
+        if (j == 0) array_add(r->wallets, wallet);
+    }
+}
+
+// removes wallet from the pkh -> wallets index
+static void _BRPeerManagerUnindexWallet(BRPeerManager *manager, BRWallet *wallet)
+{
+    size_t i, j, count = BRWalletAllAddrs(wallet, NULL, 0);
+    BRAddress *addrs = malloc((count + 1)*sizeof(*addrs));
+    BRPKHWallets *r;
+    UInt160 pkh;
+    
+    assert(addrs != NULL);
+    count = BRWalletAllAddrs(wallet, addrs, count);
+    
+    for (i = 0; i < count; i++) {
+        r = (BRAddressHash160(&pkh, addrs[i].s)) ? BRSetGet(manager->pkhWallets, &pkh) : NULL;
+        if (! r) continue;
+        
+        for (j = array_count(r->wallets); j > 0; j--) {
+            if (r->wallets[j - 1] == wallet) array_rm(r->wallets, j - 1);
+        }
+        
+        if (array_count(r->wallets) > 0) continue;
+        BRSetRemove(manager->pkhWallets, r);
+        array_free(r->wallets);
+        free(r);
+    }
+    
+    free(addrs);
+}
+
+// adds wallet to the outpoint -> wallet index for each of the given UTXOs
+static void _BRPeerManagerIndexUTXOs(BRPeerManager *manager, BRWallet *wallet, const BRUTXO utxos[], size_t count)
+{
+    BRUTXOWallet *r;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (BRSetContains(manager->utxoWallets, &utxos[i])) continue;
+        r = calloc(1, sizeof(*r));
+        assert(r != NULL);
+        *r = (BRUTXOWallet) { utxos[i], wallet };
+        BRSetAdd(manager->utxoWallets, r);
+    }
+}
+
+// adds the outputs of tx that pay to wallet to the outpoint -> wallet index, so a tx spending them can be routed even
+// when the pkh it spends from can't be found from its input
+static void _BRPeerManagerIndexOutputs(BRPeerManager *manager, BRWallet *wallet, const BRTransaction *tx)
+{
+    for (uint32_t i = 0; i < tx->outCount; i++) {
+        if (! BRWalletContainsAddress(wallet, tx->outputs[i].address)) continue;
+        _BRPeerManagerIndexUTXOs(manager, wallet, &((const BRUTXO) { tx->txHash, i }), 1);
+    }
+}
+
+// removes all entries for wallet, or all entries if wallet is NULL, from the outpoint -> wallet index
+static void _BRPeerManagerUnindexUTXOs(BRPeerManager *manager, BRWallet *wallet)
+{
+    size_t i, count = BRSetCount(manager->utxoWallets);
+    BRUTXOWallet **all = malloc((count + 1)*sizeof(*all));
+    
+    assert(all != NULL);
+    count = BRSetAll(manager->utxoWallets, (void **)all, count);
+    
+    for (i = 0; i < count; i++) {
+        if (wallet && all[i]->wallet != wallet) continue;
+        BRSetRemove(manager->utxoWallets, all[i]);
+        free(all[i]);
+    }
+    
+    free(all);
+}
+
+// appends each of manager's wallets that tx is associated with to the wallets array, found using the pkhs that tx
+// sends to or spends from, and the outpoints it spends
+static void _BRPeerManagerTxWallets(BRPeerManager *manager, const BRTransaction *tx, BRWallet ***wallets)
+{
+    BRPKHWallets *r;
+    BRUTXOWallet *u;
+    const uint8_t *p;
+    UInt160 pkh;
+    size_t i, j, k;
+    
+    for (i = 0; i < tx->inCount; i++) { // a segwit input's address isn't known, but the outpoint it spends may be
+        u = BRSetGet(manager->utxoWallets, &((const BRUTXO) { tx->inputs[i].txHash, tx->inputs[i].index }));
+        for (k = array_count(*wallets); u && k > 0 && (*wallets)[k - 1] != u->wallet; k--);
+        if (u && k == 0 && BRWalletContainsTransaction(u->wallet, tx)) array_add(*wallets, u->wallet);
+    }
+    
+    for (i = 0; i < tx->outCount + tx->inCount; i++) {
+        if (i < tx->outCount) {
+            p = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+            if (! p) continue;
+            pkh = UInt160Get(p);
+        }
+        else if (! BRAddressHash160(&pkh, tx->inputs[i - tx->outCount].address)) continue;
+        
+        r = BRSetGet(manager->pkhWallets, &pkh);
+        
+        for (j = 0; r && j < array_count(r->wallets); j++) {
+            for (k = array_count(*wallets); k > 0 && (*wallets)[k - 1] != r->wallets[j]; k--);
+            if (k == 0 && BRWalletContainsTransaction(r->wallets[j], tx)) array_add(*wallets, r->wallets[j]);
+        }
+    }
+}
+
+// returns the transaction for txHash from the first of manager's wallets that has it, and sets wallet to that wallet
+static BRTransaction *_BRPeerManagerTxForHash(BRPeerManager *manager, UInt256 txHash, BRWallet **wallet)
+{
+    BRTransaction *tx = NULL;
+    
+    for (size_t i = 0; ! tx && i < array_count(manager->wallets); i++) {
+        tx = BRWalletTransactionForHash(manager->wallets[i], txHash);
+        if (tx && wallet) *wallet = manager->wallets[i];
+    }
+    
+    return tx;
+}
+
+// true if tx itself, rather than another copy of it, belongs to one of manager's wallets
+static int _BRPeerManagerTxIsOwned(BRPeerManager *manager, const BRTransaction *tx)
+{
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (BRWalletTransactionForHash(manager->wallets[i], tx->txHash) == tx) return 1;
+    }
+    
+    return 0;
+}
+
+// registers tx with each of the given wallets that doesn't have it yet, since a wallet takes ownership of the
+// transactions registered with it, the first of those wallets gets tx itself, unless it already belongs to another
+// wallet, and the rest get their own copies, returns true if tx itself was taken by a wallet
+static int _BRPeerManagerRegisterTx(BRPeerManager *manager, BRWallet *wallets[], size_t count, BRTransaction *tx)
+{
+    int isOwned = _BRPeerManagerTxIsOwned(manager, tx), r = 0;
+    
+    for (size_t i = 0; i < count; i++) {
+        _BRPeerManagerIndexOutputs(manager, wallets[i], tx);
+        if (BRWalletTransactionForHash(wallets[i], tx->txHash)) continue;
+        BRWalletRegisterTransaction(wallets[i], (isOwned) ? BRTransactionCopy(tx) : tx);
+        if (! isOwned) r = 1;
+        isOwned = 1;
+    }
+    
+    return r;
+}
+
+// sets the block height and timestamp of the given transactions in each of manager's wallets
+static void _BRPeerManagerUpdateTx(BRPeerManager *manager, const UInt256 txHashes[], size_t txCount,
+                                   uint32_t blockHeight, uint32_t timestamp)
+{
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        BRWalletUpdateTransactions(manager->wallets[i], txHashes, txCount, blockHeight, timestamp);
+    }
+
+    for (size_t i = 0; blockHeight != TX_UNCONFIRMED && i < txCount; i++) { // confirmed tx no longer need tracking
+        _BRTxPeersRemoveTx(manager->txRelays, txHashes[i]);
+        _BRTxPeersRemoveTx(manager->txRequests, txHashes[i]);
+    }
+}
+
+static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
+{
+    // ban the peer rather than just forgetting it, so DNS seeds or other peers can't hand its address straight back
+    BRPeerStoreMisbehaving(manager->peerStore, peer, PEER_BAN_SCORE, time(NULL));
     BRPeerDisconnect(peer);
 }
 
+// saves the peer store file, and writes up to peersCount of the best known peers to peers for savePeers
+static size_t _BRPeerManagerSavePeers(BRPeerManager *manager, BRPeer peers[], size_t peersCount)
+{
+    BRPeerStoreSave(manager->peerStore);
+    return BRPeerStoreBest(manager->peerStore, peers, peersCount, time(NULL));
+}
+
 static void _BRPeerManagerSyncStopped(BRPeerManager *manager)
 {
     manager->syncStartHeight = 0;
@@ -232,26 +550,142 @@ static void _BRPeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransacti
         array_add(manager->publishedTxHashes, tx->txHash);
 
         for (size_t i = 0; i < tx->inCount; i++) {
-            _BRPeerManagerAddTxToPublishList(manager, BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash),
+            _BRPeerManagerAddTxToPublishList(manager, _BRPeerManagerTxForHash(manager, tx->inputs[i].txHash, NULL),
                                              NULL, NULL);
         }
     }
 }
 
+// height of the ancestor a header's skip pointer points to, chosen the same way as bitcoin core's GetSkipHeight() so
+// any ancestor can be reached in O(log n) steps
+static uint32_t _BRSkipHeight(uint32_t height)
+{
+    uint32_t h = (height - 1) & (height - 2); // height - 1 with its lowest set bit cleared
+    
+    if (height < 2) return 0;
+    return (height & 1) ? (h & (h - 1)) + 1 : height & (height - 1);
+}
+
+// returns header's ancestor at height, or NULL if it isn't in the index
+static BRChainHeader *_BRChainHeaderAncestor(BRChainHeader *header, uint32_t height)
+{
+    uint32_t skipHeight, skipPrevHeight;
+    
+    if (header && height > header->height) return NULL;
+    
+    while (header && header->height > height) {
+        skipHeight = _BRSkipHeight(header->height);
+        skipPrevHeight = _BRSkipHeight(header->height - 1);
+        
+        // take the skip pointer unless the parent's skip pointer gets closer to height without overshooting it
+        if (! header->skip || skipHeight < height) header = header->prev;
+        else if (skipHeight > height && skipPrevHeight >= height && skipPrevHeight + 2 < skipHeight) {
+            header = header->prev;
+        }
+        else header = header->skip;
+    }
+    
+    return header;
+}
+
+// adds block to the header index if it isn't already there, and returns its header
+static BRChainHeader *_BRPeerManagerAddHeader(BRPeerManager *manager, const BRMerkleBlock *block)
+{
+    BRChainHeader *header = BRSetGet(manager->headers, block), *prev = BRSetGet(manager->headers, &block->prevBlock);
+    
+    assert(block->height != BLOCK_UNKNOWN_HEIGHT);
+    if (prev && prev->height + 1 != block->height) prev = NULL;
+    
+    if (! header) {
+        if ((manager->headerCount % HEADER_CHUNK_SIZE) == 0) {
+            header = calloc(HEADER_CHUNK_SIZE, sizeof(*header));
+            assert(header != NULL);
+            array_add(manager->headerChunks, header);
+        }
+        
+        header = manager->headerChunks[array_count(manager->headerChunks) - 1];
+        header = &header[manager->headerCount++ % HEADER_CHUNK_SIZE];
+        header->blockHash = block->blockHash;
+        header->height = block->height;
+        header->timestamp = block->timestamp;
+        header->target = block->target;
+        BRSetAdd(manager->headers, header);
+    }
+    
+    if (! header->prev && prev) { // link headers added before their parent, such as checkpoints
+        header->prev = prev;
+        header->skip = _BRChainHeaderAncestor(prev, _BRSkipHeight(header->height));
+    }
+    
+    return header;
+}
+
+// returns the main chain ancestor of lastBlock at height, or NULL if it isn't in the index
+static BRChainHeader *_BRPeerManagerChainHeader(BRPeerManager *manager, uint32_t height)
+{
+    return _BRChainHeaderAncestor(BRSetGet(manager->headers, manager->lastBlock), height);
+}
+
+// appends block to the header store, along with any ancestors not stored yet, first truncating the store back to where
+// block's chain joins it if block is on a fork of the stored chain
+static void _BRPeerManagerStoreBlock(BRPeerManager *manager, BRMerkleBlock *block)
+{
+    BRHeaderStore *store = manager->headerStore;
+    size_t i, count = (store) ? BRHeaderStoreCount(store) : 0;
+    uint32_t first = (count > 0) ? BRHeaderStoreHeight(store, 0) : 0;
+    BRMerkleBlock *b = block, **chain;
+    BRChainHeader *prev;
+    
+    if (! store) return;
+    
+    // start an empty store from the earliest of block's ancestors in blocks with a parent in the header index, so it
+    // connects when loaded as long as that parent is a checkpoint or one of the blocks manager is created with
+    for (; count == 0 && b; b = BRSetGet(manager->blocks, &b->prevBlock)) {
+        prev = BRSetGet(manager->headers, &b->prevBlock);
+        if (prev && prev->height + 1 == b->height) first = b->height;
+    }
+    
+    if (count == 0 && first == 0) return;
+    b = block;
+    
+    array_new(chain, 1);
+    
+    while (b && b->height >= first) { // walk back to where block's chain joins the stored chain
+        array_add(chain, b);
+        i = b->height - first; // store index of b, its parent is at i - 1
+        if (i > 0 && i <= count && UInt256Eq(BRHeaderStoreBlockHash(store, i - 1), b->prevBlock)) break;
+        
+        if (i == 0) { // b replaces the first stored header, so it must have the same parent
+            if (count > 0 && ! UInt256Eq(BRHeaderStoreHeader(store, 0).prevBlock, b->prevBlock)) b = NULL;
+            break;
+        }
+        
+        b = BRSetGet(manager->blocks, &b->prevBlock);
+    }
+    
+    if (b && b->height >= first) {
+        BRHeaderStoreTruncate(store, b->height - first);
+        
+        for (i = array_count(chain); i > 0; i--) {
+            if (! BRHeaderStoreAppend(store, chain[i - 1])) break;
+        }
+    }
+    
+    array_free(chain);
+}
+
 static size_t _BRPeerManagerBlockLocators(BRPeerManager *manager, UInt256 locators[], size_t locatorsCount)
 {
     // append 10 most recent block hashes, decending, then continue appending, doubling the step back each time,
     // finishing with the genesis block (top, -1, -2, -3, -4, -5, -6, -7, -8, -9, -11, -15, -23, -39, -71, -135, ..., 0)
-    BRMerkleBlock *block = manager->lastBlock;
-    int32_t step = 1, i = 0, j;
+    BRChainHeader *header = BRSetGet(manager->headers, manager->lastBlock);
+    uint32_t step = 1;
+    int32_t i = 0;
     
-    while (block && block->height > 0) {
-        if (locators && i < locatorsCount) locators[i] = block->blockHash;
+    while (header && header->height > 0) {
+        if (locators && i < locatorsCount) locators[i] = header->blockHash;
         if (++i >= 10) step *= 2;
-        
-        for (j = 0; block && j < step; j++) {
-            block = BRSetGet(manager->blocks, &block->prevBlock);
-        }
+        header = _BRChainHeaderAncestor(header, (header->height > step) ? header->height - step : 0);
     }
     
     if (locators && i < locatorsCount) locators[i] = genesis_block_hash(manager->params);
@@ -263,37 +697,35 @@ static void _setApplyFreeBlock(void *info, void *block)
     BRMerkleBlockFree(block);
 }
 
-static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
+static void _setApplyFree(void *info, void *item)
 {
-    // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
-    // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
-    // wallet transaction is encountered during the chain sync
-    BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
-    BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+    free(item);
+}
 
-    BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
-    BRSetClear(manager->orphans); // clear out orphans that may have been received on an old filter
-    manager->lastOrphan = NULL;
-    manager->filterUpdateHeight = manager->lastBlock->height;
-    manager->fpRate = BLOOM_REDUCED_FALSEPOSITIVE_RATE;
-    
-    size_t addrsCount = BRWalletAllAddrs(manager->wallet, NULL, 0);
+static void _setApplyFreePKHWallets(void *info, void *pkhWallets)
+{
+    array_free(((BRPKHWallets *)pkhWallets)->wallets);
+    free(pkhWallets);
+}
+
+// adds wallet's addresses, UTXOs, and TXOs spent since blockHeight to filter, and its addresses to the pkh index
+static void _BRPeerManagerFilterWallet(BRPeerManager *manager, BRBloomFilter *filter, BRWallet *wallet,
+                                       uint32_t blockHeight)
+{
+    size_t addrsCount = BRWalletAllAddrs(wallet, NULL, 0);
     BRAddress *addrs = malloc(addrsCount*sizeof(*addrs));
-    size_t utxosCount = BRWalletUTXOs(manager->wallet, NULL, 0);
+    size_t utxosCount = BRWalletUTXOs(wallet, NULL, 0);
     BRUTXO *utxos = malloc(utxosCount*sizeof(*utxos));
-    uint32_t blockHeight = (manager->lastBlock->height > 100) ? manager->lastBlock->height - 100 : 0;
-    size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, blockHeight);
+    size_t txCount = BRWalletTxUnconfirmedBefore(wallet, NULL, 0, blockHeight);
     BRTransaction **transactions = malloc(txCount*sizeof(*transactions));
-    BRBloomFilter *filter;
     
     assert(addrs != NULL);
     assert(utxos != NULL);
     assert(transactions != NULL);
-    addrsCount = BRWalletAllAddrs(manager->wallet, addrs, addrsCount);
-    utxosCount = BRWalletUTXOs(manager->wallet, utxos, utxosCount);
-    txCount = BRWalletTxUnconfirmedBefore(manager->wallet, transactions, txCount, blockHeight);
-    filter = BRBloomFilterNew(manager->fpRate, addrsCount + utxosCount + txCount + 100, (uint32_t)BRPeerHash(peer),
-                              BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
+    addrsCount = BRWalletAllAddrs(wallet, addrs, addrsCount);
+    utxosCount = BRWalletUTXOs(wallet, utxos, utxosCount);
+    txCount = BRWalletTxUnconfirmedBefore(wallet, transactions, txCount, blockHeight);
+    _BRPeerManagerIndexAddrs(manager, wallet, addrs, addrsCount);
     
     for (size_t i = 0; i < addrsCount; i++) { // add addresses to watch for tx receiveing money to the wallet
         UInt160 hash = UINT160_ZERO;
@@ -307,6 +739,8 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
 
     free(addrs);
         
+    _BRPeerManagerIndexUTXOs(manager, wallet, utxos, utxosCount);
+    
     for (size_t i = 0; i < utxosCount; i++) { // add UTXOs to watch for tx sending money from the wallet
         uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
         
@@ -320,11 +754,12 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     for (size_t i = 0; i < txCount; i++) { // also add TXOs spent within the last 100 blocks
         for (size_t j = 0; j < transactions[i]->inCount; j++) {
             BRTxInput *input = &transactions[i]->inputs[j];
-            BRTransaction *tx = BRWalletTransactionForHash(manager->wallet, input->txHash);
+            BRTransaction *tx = BRWalletTransactionForHash(wallet, input->txHash);
+            const uint8_t *pkh = (tx && input->index < tx->outCount) ?
+                BRScriptPKH(tx->outputs[input->index].script, tx->outputs[input->index].scriptLen) : NULL;
             uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
             
-            if (tx && input->index < tx->outCount &&
-                BRWalletContainsAddress(manager->wallet, tx->outputs[input->index].address)) {
+            if (pkh && BRWalletContainsHash160(wallet, UInt160Get(pkh))) {
                 UInt256Set(o, input->txHash);
                 UInt32SetLE(&o[sizeof(UInt256)], input->index);
                 if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o,sizeof(o));
@@ -333,14 +768,399 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     }
     
     free(transactions);
+}
+
+// sends manager's current bloom filter to peer
+static void _BRPeerManagerSendBloomFilter(BRPeerManager *manager, BRPeer *peer)
+{
+    uint8_t data[BRBloomFilterSerialize(manager->bloomFilter, NULL, 0)];
+    size_t len = BRBloomFilterSerialize(manager->bloomFilter, data, sizeof(data));
+    
+    BRPeerSendFilterload(peer, data, len);
+}
+
+static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
+{
+    uint32_t blockHeight = (manager->lastBlock->height > 100) ? manager->lastBlock->height - 100 : 0;
+    size_t i, count = 0;
+    BRWallet *wallet;
+    BRBloomFilter *filter;
+    
+    for (i = 0; i < array_count(manager->wallets); i++) {
+        wallet = manager->wallets[i];
+        
+        // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
+        // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
+        // wallet transaction is encountered during the chain sync
+        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
+        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+        count += BRWalletAllAddrs(wallet, NULL, 0) + BRWalletUTXOs(wallet, NULL, 0) +
+                 BRWalletTxUnconfirmedBefore(wallet, NULL, 0, blockHeight);
+    }
+
+    BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
+    BRSetClear(manager->orphans); // clear out orphans that may have been received on an old filter
+    manager->lastOrphan = NULL;
+    manager->filterUpdateHeight = manager->lastBlock->height;
+    manager->fpRate = BLOOM_REDUCED_FALSEPOSITIVE_RATE;
+    _BRPeerManagerUnindexUTXOs(manager, NULL); // the outpoint index is rebuilt from the wallets' current UTXOs
+    
+    // one filter matches the union of all the wallets' addresses and outpoints
+    filter = BRBloomFilterNew(manager->fpRate, count + 100, (uint32_t)BRPeerHash(peer),
+                              BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
+    
+    for (i = 0; i < array_count(manager->wallets); i++) {
+        _BRPeerManagerFilterWallet(manager, filter, manager->wallets[i], blockHeight);
+    }
+    
     if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
     manager->bloomFilter = filter;
     // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
+    _BRPeerManagerSendBloomFilter(manager, peer);
+}
+
+// number of fetch windows assigned to peer
+static size_t _BRPeerManagerFetchCount(BRPeerManager *manager, const BRPeer *peer)
+{
+    size_t i, count = 0;
+    
+    for (i = manager->fetchHead; manager->fetchWindows && i < array_count(manager->fetchWindows); i++) {
+        if (manager->fetchWindows[i].peer == peer) count++;
+    }
+    
+    return count;
+}
+
+// true if peer is downloading the chain, either as the download peer or with fetch windows assigned
+static int _BRPeerManagerIsSyncPeer(BRPeerManager *manager, const BRPeer *peer)
+{
+    return (peer == manager->downloadPeer || _BRPeerManagerFetchCount(manager, peer) > 0);
+}
 
-    uint8_t data[BRBloomFilterSerialize(filter, NULL, 0)];
-    size_t len = BRBloomFilterSerialize(filter, data, sizeof(data));
+// true if peer has the sync bloom filter loaded and has blocks up to height
+static int _BRPeerManagerCanFetch(BRPeerManager *manager, BRPeer *peer, uint32_t height)
+{
+    return (BRPeerConnectStatus(peer) == BRPeerStatusConnected && (peer->flags & PEER_FLAG_NEEDSUPDATE) == 0 &&
+            (peer == manager->downloadPeer || (peer->flags & PEER_FLAG_FETCH) != 0) && BRPeerLastBlock(peer) >= height);
+}
+
+// seconds to wait for peer to deliver its fetch windows, twice the expected transfer time, at least PROTOCOL_TIMEOUT
+static double _BRPeerManagerFetchTimeout(BRPeerManager *manager, BRPeer *peer)
+{
+    size_t count = 0;
+    double timeout;
     
-    BRPeerSendFilterload(peer, data, len);
+    for (size_t i = manager->fetchHead; manager->fetchWindows && i < array_count(manager->fetchWindows); i++) {
+        if (manager->fetchWindows[i].peer == peer) count += manager->fetchWindows[i].count;
+    }
+    
+    timeout = 2.0*BRPeerBlockTime(peer, count);
+    return (timeout > PROTOCOL_TIMEOUT) ? timeout : PROTOCOL_TIMEOUT;
+}
+
+// the least busy peer that can fetch blocks up to height, with ties going to the lowest ping, or NULL if all are busy
+static BRPeer *_BRPeerManagerFetchPeer(BRPeerManager *manager, uint32_t height)
+{
+    BRPeer *peer = NULL, *p;
+    size_t n, best = 0;
+    
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        p = manager->connectedPeers[i - 1];
+        if (! _BRPeerManagerCanFetch(manager, p, height)) continue;
+        n = _BRPeerManagerFetchCount(manager, p);
+        if (n >= FETCH_PEER_WINDOWS) continue;
+        if (peer && (n > best || (n == best && BRPeerPingTime(p) >= BRPeerPingTime(peer)))) continue;
+        peer = p;
+        best = n;
+    }
+    
+    return peer;
+}
+
+// releases peer's fetch windows so they can be assigned to other peers
+static void _BRPeerManagerReleaseFetchWindows(BRPeerManager *manager, const BRPeer *peer)
+{
+    for (size_t i = manager->fetchHead; manager->fetchWindows && i < array_count(manager->fetchWindows); i++) {
+        if (manager->fetchWindows[i].peer == peer) manager->fetchWindows[i].peer = NULL;
+    }
+}
+
+// ends a headers-first sync, dropping any blocks received ahead of the chain
+static void _BRPeerManagerEndFetch(BRPeerManager *manager)
+{
+    BRPeer *peer;
+    
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        peer = manager->connectedPeers[i - 1];
+        if (peer != manager->downloadPeer && _BRPeerManagerFetchCount(manager, peer) > 0) {
+            BRPeerScheduleDisconnect(peer, -1); // cancel fetch timeout
+        }
+        
+        peer->flags &= ~PEER_FLAG_FETCH;
+    }
+    
+    if (manager->fetchHashes) array_free(manager->fetchHashes);
+    if (manager->fetchWindows) array_free(manager->fetchWindows);
+    if (manager->fetchedBlocks) BRSetApply(manager->fetchedBlocks, NULL, _setApplyFreeBlock);
+    if (manager->fetchedBlocks) BRSetFree(manager->fetchedBlocks);
+    manager->fetchHashes = NULL;
+    manager->fetchWindows = NULL;
+    manager->fetchedBlocks = NULL;
+    manager->fetchHead = 0;
+    manager->fetchHeight = 0;
+}
+
+// starts a headers-first sync, headers newer than a week before earliestKeyTime are queued, and their merkleblocks are
+// fetched in windows from the download peer and any other connected peers loaded with the same bloom filter
+static void _BRPeerManagerStartFetch(BRPeerManager *manager)
+{
+    BRPeer *peer;
+    
+    _BRPeerManagerEndFetch(manager);
+    array_new(manager->fetchHashes, 2000);
+    array_new(manager->fetchWindows, 100);
+    manager->fetchedBlocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, 1000);
+    
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        peer = manager->connectedPeers[i - 1];
+        if (peer == manager->downloadPeer || BRPeerConnectStatus(peer) != BRPeerStatusConnected) continue;
+        _BRPeerManagerSendBloomFilter(manager, peer);
+        peer->flags |= PEER_FLAG_FETCH;
+    }
+}
+
+// queues a header received during headers-first sync so its merkleblock can be fetched
+static void _BRPeerManagerAddFetchHeader(BRPeerManager *manager, BRPeer *peer, const BRMerkleBlock *header)
+{
+    size_t count = array_count(manager->fetchHashes);
+    uint32_t height;
+    UInt256 prevBlock = (count > 0) ? manager->fetchHashes[count - 1] : manager->lastBlock->blockHash;
+    
+    if (! UInt256Eq(header->prevBlock, prevBlock)) {
+        peer_log(peer, "ignoring header that doesn't connect to the chain: %s", u256hex(header->blockHash));
+    }
+    else {
+        if (count == 0) manager->fetchHeight = manager->lastBlock->height + 1;
+        array_add(manager->fetchHashes, header->blockHash);
+        height = manager->fetchHeight + (uint32_t)count;
+        if (height > manager->estimatedHeight) manager->estimatedHeight = height;
+        BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+    }
+}
+
+// true if block is in one of the current fetch windows and is higher than the block after lastBlock
+static int _BRPeerManagerIsFetchBlock(BRPeerManager *manager, const BRMerkleBlock *block)
+{
+    BRFetchWindow *w;
+    
+    for (size_t i = manager->fetchHead; manager->fetchWindows && i < array_count(manager->fetchWindows) &&
+         i < manager->fetchHead + FETCH_MAX_WINDOWS; i++) {
+        w = &manager->fetchWindows[i];
+        
+        for (size_t j = w->start; j < w->start + w->count; j++) {
+            if (UInt256Eq(manager->fetchHashes[j], block->blockHash)) {
+                return (manager->fetchHeight + j > manager->lastBlock->height + 1);
+            }
+        }
+    }
+    
+    return 0;
+}
+
+// removes and returns the block after lastBlock from fetchedBlocks, or NULL if it hasn't arrived yet
+static BRMerkleBlock *_BRPeerManagerNextFetchedBlock(BRPeerManager *manager)
+{
+    uint32_t height = manager->lastBlock->height + 1;
+    
+    if (! manager->fetchedBlocks || height < manager->fetchHeight ||
+        height - manager->fetchHeight >= array_count(manager->fetchHashes)) return NULL;
+    return BRSetRemove(manager->fetchedBlocks, &manager->fetchHashes[height - manager->fetchHeight]);
+}
+
+// true if each of window's blocks has been added to the chain or is waiting in fetchedBlocks
+static int _BRPeerManagerFetchWindowReceived(BRPeerManager *manager, const BRFetchWindow *window)
+{
+    for (size_t i = window->start; i < window->start + window->count; i++) {
+        if (manager->fetchHeight + i <= manager->lastBlock->height) continue;
+        if (! BRSetContains(manager->fetchedBlocks, &manager->fetchHashes[i])) return 0;
+    }
+    
+    return 1;
+}
+
+static void _fetchWindowDone(void *info, int success);
+
+// headers-first sync: skips windows that have been added to the chain, evicts a peer that's holding up the chain, and
+// assigns the next windows to the least busy peers
+static void _BRPeerManagerFetchBlocks(BRPeerManager *manager)
+{
+    size_t i, j, n, count = (manager->fetchHashes) ? array_count(manager->fetchHashes) : 0;
+    uint32_t height;
+    time_t now = time(NULL);
+    double stall;
+    int headersDone;
+    BRFetchWindow *w;
+    BRPeer *peer, *p;
+    BRPeerCallbackInfo *info;
+    
+    if (! manager->fetchHashes || ! manager->downloadPeer || ! manager->bloomFilter) return;
+    headersDone = (count > 0 && manager->fetchHeight + count > BRPeerLastBlock(manager->downloadPeer));
+    
+    while (manager->fetchHead < array_count(manager->fetchWindows)) {
+        w = &manager->fetchWindows[manager->fetchHead];
+        if (manager->fetchHeight + w->start + w->count - 1 > manager->lastBlock->height) break;
+        manager->fetchHead++;
+    }
+    
+    if (headersDone && manager->fetchHeight + count - 1 <= manager->lastBlock->height) { // all blocks are in the chain
+        _BRPeerManagerEndFetch(manager);
+        return;
+    }
+    
+    n = array_count(manager->fetchWindows);
+    n = (n > 0) ? manager->fetchWindows[n - 1].start + manager->fetchWindows[n - 1].count : 0;
+    w = (manager->fetchHead < array_count(manager->fetchWindows)) ? &manager->fetchWindows[manager->fetchHead] : NULL;
+    stall = (w && w->peer) ? 2.0*BRPeerBlockTime(w->peer, w->count) : 0;
+    if (stall < FETCH_STALL_TIMEOUT) stall = FETCH_STALL_TIMEOUT;
+    
+    if (w && w->peer && w->time + stall < now) { // the chain is waiting on the head window
+        height = manager->fetchHeight + (uint32_t)(w->start + w->count) - 1;
+        peer = w->peer;
+        
+        for (i = array_count(manager->connectedPeers); i > 0; i--) { // evict if another peer can take over
+            p = manager->connectedPeers[i - 1];
+            if (p != peer && _BRPeerManagerCanFetch(manager, p, height)) break;
+        }
+        
+        if (i > 0) {
+            peer_log(peer, "fetching blocks too slowly, disconnecting");
+            _BRPeerManagerReleaseFetchWindows(manager, peer);
+            BRPeerDisconnect(peer);
+        }
+    }
+    
+    for (i = manager->fetchHead; i < manager->fetchHead + FETCH_MAX_WINDOWS; i++) {
+        if (i < array_count(manager->fetchWindows)) { // retry a released window
+            w = &manager->fetchWindows[i];
+            if (w->peer || w->received) continue;
+            height = manager->fetchHeight + (uint32_t)(w->start + w->count) - 1;
+        }
+        else if (n < count) height = manager->fetchHeight + (uint32_t)n; // start a new window
+        else break;
+        
+        peer = _BRPeerManagerFetchPeer(manager, height);
+        if (! peer) break;
+        
+        if (i == array_count(manager->fetchWindows)) { // size the new window for the peer it's assigned to
+            j = BRPeerBlockWindow(peer);
+            if (count - n < j && ! headersDone) break; // wait for more headers to fill the window
+            if (count - n < j) j = count - n;
+            if (BRPeerLastBlock(peer) < height + j - 1) j = BRPeerLastBlock(peer) - height + 1;
+            array_add(manager->fetchWindows, ((BRFetchWindow) { NULL, n, j, 0, 0 }));
+            n += j;
+        }
+        
+        w = &manager->fetchWindows[i];
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->peer = peer;
+        info->manager = manager;
+        info->hash = manager->fetchHashes[w->start];
+        w->peer = peer;
+        w->time = now;
+        BRPeerSendGetdata(peer, NULL, 0, &manager->fetchHashes[w->start], w->count);
+        BRPeerSendPing(peer, info, _fetchWindowDone); // pong arrives once all of the window's blocks have been sent
+        BRPeerScheduleDisconnect(peer, _BRPeerManagerFetchTimeout(manager, peer)); // schedule fetch timeout
+    }
+}
+
+static void _fetchWindowDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    UInt256 hash = ((BRPeerCallbackInfo *)info)->hash;
+    BRFetchWindow *w = NULL;
+    
+    free(info);
+    if (! success) return; // the peer disconnected, its windows are released by _peerDisconnected()
+    pthread_mutex_lock(&manager->lock);
+    
+    for (size_t i = manager->fetchHead; manager->fetchWindows && i < array_count(manager->fetchWindows); i++) {
+        if (manager->fetchWindows[i].peer != peer) continue;
+        if (! UInt256Eq(manager->fetchHashes[manager->fetchWindows[i].start], hash)) continue;
+        w = &manager->fetchWindows[i];
+        break;
+    }
+    
+    if (w) {
+        w->peer = NULL;
+        
+        // blocks that arrived during a filter update were dropped, so the window is requested again
+        if (manager->bloomFilter && (peer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
+            w->received = _BRPeerManagerFetchWindowReceived(manager, w);
+            
+            if (! w->received) {
+                peer_log(peer, "missing blocks requested from height %"PRIu32", disconnecting",
+                         manager->fetchHeight + (uint32_t)w->start);
+                _BRPeerManagerReleaseFetchWindows(manager, peer);
+                BRPeerDisconnect(peer);
+            }
+        }
+        
+        if (peer != manager->downloadPeer && _BRPeerManagerFetchCount(manager, peer) == 0) {
+            BRPeerScheduleDisconnect(peer, -1); // cancel fetch timeout
+        }
+        
+        _BRPeerManagerFetchBlocks(manager);
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
+static void _fetchFilterLoadDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    free(info);
+    
+    if (success) {
+        pthread_mutex_lock(&manager->lock);
+        peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
+        _BRPeerManagerFetchBlocks(manager);
+        if (_BRPeerManagerFetchCount(manager, peer) == 0) BRPeerScheduleDisconnect(peer, -1); // cancel fetch timeout
+        pthread_mutex_unlock(&manager->lock);
+    }
+}
+
+// after a bloom filter update, reloads the other fetch peers with the new filter and requests all windows not yet added
+// to the chain again, since blocks received with the old filter may be missing matching transactions
+static void _BRPeerManagerRestartFetch(BRPeerManager *manager)
+{
+    BRPeerCallbackInfo *info;
+    BRPeer *peer;
+    
+    BRSetApply(manager->fetchedBlocks, NULL, _setApplyFreeBlock);
+    BRSetClear(manager->fetchedBlocks);
+    
+    for (size_t i = manager->fetchHead; i < array_count(manager->fetchWindows); i++) {
+        manager->fetchWindows[i].peer = NULL;
+        manager->fetchWindows[i].received = 0;
+    }
+    
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        peer = manager->connectedPeers[i - 1];
+        if (peer == manager->downloadPeer || BRPeerConnectStatus(peer) != BRPeerStatusConnected) continue;
+        peer->flags |= PEER_FLAG_FETCH | PEER_FLAG_NEEDSUPDATE;
+        _BRPeerManagerSendBloomFilter(manager, peer);
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->peer = peer;
+        info->manager = manager;
+        BRPeerSendPing(peer, info, _fetchFilterLoadDone); // blocks sent with the old filter arrive before the pong
+    }
+    
+    _BRPeerManagerFetchBlocks(manager);
 }
 
 static void _updateFilterRerequestDone(void *info, int success)
@@ -377,7 +1197,10 @@ static void _updateFilterLoadDone(void *info, int success)
         BRPeerSetNeedsFilterUpdate(peer, 0);
         peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
         
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
+        if (manager->lastBlock->height < manager->estimatedHeight && manager->fetchHashes) {
+            _BRPeerManagerRestartFetch(manager); // if fetching, drop blocks received with the old filter and refetch
+        }
+        else if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
             peerInfo = calloc(1, sizeof(*peerInfo));
             assert(peerInfo != NULL);
             peerInfo->peer = peer;
@@ -446,12 +1269,44 @@ static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
     }
 }
 
+// removes wallet's unconfirmed transactions that aren't in the mempools of any connected peers, and marks those relayed
+// by fewer than maxConnectCount peers as unverified
+static void _BRPeerManagerRemoveUnrelayedTx(BRPeerManager *manager, BRWallet *wallet, BRPeer *peer)
+{
+    UInt256 hash;
+    int isPublishing;
+    size_t txCount = BRWalletTxUnconfirmedBefore(wallet, NULL, 0, TX_UNCONFIRMED);
+    BRTransaction *tx[(txCount*sizeof(BRTransaction *) <= 0x1000) ? txCount : 0x1000/sizeof(BRTransaction *)];
+    
+    txCount = BRWalletTxUnconfirmedBefore(wallet, tx, sizeof(tx)/sizeof(*tx), TX_UNCONFIRMED);
+
+    for (size_t i = txCount; i > 0; i--) {
+        hash = tx[i - 1]->txHash;
+        isPublishing = 0;
+        
+        for (size_t j = array_count(manager->publishedTx); ! isPublishing && j > 0; j--) {
+            if (BRTransactionEq(manager->publishedTx[j - 1].tx, tx[i - 1]) &&
+                manager->publishedTx[j - 1].callback != NULL) isPublishing = 1;
+        }
+        
+        if (! isPublishing && _BRTxPeersCount(manager->txRelays, hash) == 0 &&
+            _BRTxPeersCount(manager->txRequests, hash) == 0) {
+            peer_log(peer, "removing tx unconfirmed at: %d, txHash: %s", manager->lastBlock->height, u256hex(hash));
+            assert(tx[i - 1]->blockHeight == TX_UNCONFIRMED);
+            BRWalletRemoveTransaction(wallet, hash);
+        }
+        else if (! isPublishing && _BRTxPeersCount(manager->txRelays, hash) < manager->maxConnectCount) {
+            // set timestamp 0 to mark as unverified
+            BRWalletUpdateTransactions(wallet, &hash, 1, TX_UNCONFIRMED, 0);
+        }
+    }
+}
+
 // unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
 static void _requestUnrelayedTxGetdataDone(void *info, int success)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    int isPublishing;
     size_t count = 0;
 
     free(info);
@@ -469,31 +1324,8 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
     // don't remove transactions until we're connected to maxConnectCount peers, and all peers have finished
     // relaying their mempools
     if (count >= manager->maxConnectCount) {
-        UInt256 hash;
-        size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, TX_UNCONFIRMED);
-        BRTransaction *tx[(txCount*sizeof(BRTransaction *) <= 0x1000) ? txCount : 0x1000/sizeof(BRTransaction *)];
-        
-        txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, sizeof(tx)/sizeof(*tx), TX_UNCONFIRMED);
-
-        for (size_t i = txCount; i > 0; i--) {
-            hash = tx[i - 1]->txHash;
-            isPublishing = 0;
-            
-            for (size_t j = array_count(manager->publishedTx); ! isPublishing && j > 0; j--) {
-                if (BRTransactionEq(manager->publishedTx[j - 1].tx, tx[i - 1]) &&
-                    manager->publishedTx[j - 1].callback != NULL) isPublishing = 1;
-            }
-            
-            if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) == 0 &&
-                _BRTxPeerListCount(manager->txRequests, hash) == 0) {
-                peer_log(peer, "removing tx unconfirmed at: %d, txHash: %s", manager->lastBlock->height, u256hex(hash));
-                assert(tx[i - 1]->blockHeight == TX_UNCONFIRMED);
-                BRWalletRemoveTransaction(manager->wallet, hash);
-            }
-            else if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) < manager->maxConnectCount) {
-                // set timestamp 0 to mark as unverified
-                BRWalletUpdateTransactions(manager->wallet, &hash, 1, TX_UNCONFIRMED, 0);
-            }
+        for (size_t i = 0; i < array_count(manager->wallets); i++) {
+            _BRPeerManagerRemoveUnrelayedTx(manager, manager->wallets[i], peer);
         }
     }
 
@@ -503,22 +1335,27 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
 static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *peer)
 {
     BRPeerCallbackInfo *info;
-    size_t hashCount = 0, txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, TX_UNCONFIRMED);
-    BRTransaction *tx[txCount];
-    UInt256 txHashes[txCount];
+    UInt256 *txHashes;
     
-    txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, txCount, TX_UNCONFIRMED);
+    array_new(txHashes, 10);
     
-    for (size_t i = 0; i < txCount; i++) {
-        if (! _BRTxPeerListHasPeer(manager->txRelays, tx[i]->txHash, peer) &&
-            ! _BRTxPeerListHasPeer(manager->txRequests, tx[i]->txHash, peer)) {
-            txHashes[hashCount++] = tx[i]->txHash;
-            _BRTxPeerListAddPeer(&manager->txRequests, tx[i]->txHash, peer);
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallets[i], NULL, 0, TX_UNCONFIRMED);
+        BRTransaction *tx[txCount];
+        
+        txCount = BRWalletTxUnconfirmedBefore(manager->wallets[i], tx, txCount, TX_UNCONFIRMED);
+        
+        for (size_t j = 0; j < txCount; j++) { // a tx shared by several wallets is only requested once
+            if (! _BRTxPeersHasPeer(manager, manager->txRelays, tx[j]->txHash, peer) &&
+                ! _BRTxPeersHasPeer(manager, manager->txRequests, tx[j]->txHash, peer)) {
+                array_add(txHashes, tx[j]->txHash);
+                _BRTxPeersAddPeer(manager, manager->txRequests, tx[j]->txHash, peer);
+            }
         }
     }
 
-    if (hashCount > 0) {
-        BRPeerSendGetdata(peer, txHashes, hashCount, NULL, 0);
+    if (array_count(txHashes) > 0) {
+        BRPeerSendGetdata(peer, txHashes, array_count(txHashes), NULL, 0);
     
         if ((peer->flags & PEER_FLAG_SYNCED) == 0) {
             info = calloc(1, sizeof(*info));
@@ -529,6 +1366,8 @@ static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *pee
         }
     }
     else peer->flags |= PEER_FLAG_SYNCED;
+    
+    array_free(txHashes);
 }
 
 static void _BRPeerManagerPublishPendingTx(BRPeerManager *manager, BRPeer *peer)
@@ -659,7 +1498,8 @@ static void *_findPeersThreadRoutine(void *arg)
     
     for (addr = addrList; addr && ! UInt128IsZero(*addr); addr++) {
         age = 24*60*60 + BRRand(2*24*60*60); // add between 1 and 3 days
-        array_add(manager->peers, ((const BRPeer) { *addr, manager->params->standardPort, services, now - age, 0 }));
+        BRPeerStoreAdd(manager->peerStore, &((const BRPeer) { *addr, manager->params->standardPort, services, now - age,
+                                                               0 }), 1, now);
     }
 
     manager->dnsThreadCount--;
@@ -669,8 +1509,10 @@ static void *_findPeersThreadRoutine(void *arg)
     return NULL;
 }
 
-// DNS peer discovery
-static void _BRPeerManagerFindPeers(BRPeerManager *manager)
+// DNS peer discovery, if wait is false the seeds are all queried in the background and found peers are added to the
+// peer store as lookups complete, otherwise the first seed is queried directly, and this waits until a peer that isn't
+// banned is known to connect to
+static void _BRPeerManagerFindPeers(BRPeerManager *manager, int wait)
 {
     uint64_t services = SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | manager->params->services;
     time_t now = time(NULL);
@@ -679,39 +1521,38 @@ static void _BRPeerManagerFindPeers(BRPeerManager *manager)
     pthread_attr_t attr;
     UInt128 *addr, *addrList;
     BRFindPeersInfo *info;
+    int isQuerying = (manager->dnsThreadCount > 0);
     
-    if (! UInt128IsZero(manager->fixedPeer.address)) {
-        array_set_count(manager->peers, 1);
-        manager->peers[0] = manager->fixedPeer;
-        manager->peers[0].services = services;
-        manager->peers[0].timestamp = now;
+    if (! wait && isQuerying) return; // already querying
+    manager->dnsTime = now;
+    
+    // when waiting with background queries already running, those are waited on instead of querying the seeds again
+    for (size_t i = (wait) ? 1 : 0; ! isQuerying && manager->params->dnsSeeds[i]; i++) {
+        info = calloc(1, sizeof(BRFindPeersInfo));
+        assert(info != NULL);
+        info->manager = manager;
+        info->hostname = manager->params->dnsSeeds[i];
+        info->services = services;
+        if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+            pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
     }
-    else {
-        for (size_t i = 1; manager->params->dnsSeeds[i]; i++) {
-            info = calloc(1, sizeof(BRFindPeersInfo));
-            assert(info != NULL);
-            info->manager = manager;
-            info->hostname = manager->params->dnsSeeds[i];
-            info->services = services;
-            if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
-                pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
-        }
-
+    
+    if (wait) {
         for (addr = addrList = _addressLookup(manager->params->dnsSeeds[0]); addr && ! UInt128IsZero(*addr); addr++) {
-            array_add(manager->peers, ((const BRPeer) { *addr, manager->params->standardPort, services, now, 0 }));
+            BRPeerStoreAdd(manager->peerStore, &((const BRPeer) { *addr, manager->params->standardPort, services, now,
+                                                                   0 }), 1, now);
         }
 
         if (addrList) free(addrList);
         ts.tv_sec = 0;
         ts.tv_nsec = 1;
 
-        do {
+        // the store count includes banned peers, so wait until there's a peer that can actually be connected to
+        while (manager->dnsThreadCount > 0 && BRPeerStoreBest(manager->peerStore, NULL, 0, now) == 0) {
             pthread_mutex_unlock(&manager->lock);
             nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
             pthread_mutex_lock(&manager->lock);
-        } while (manager->dnsThreadCount > 0 && array_count(manager->peers) < PEER_MAX_CONNECTIONS);
-    
-        qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
+        }
     }
 }
 
@@ -728,10 +1569,12 @@ static void _peerConnected(void *info)
     // TODO: XXX does this work with 0.11 pruned nodes?
     if ((peer->services & manager->params->services) != manager->params->services) {
         peer_log(peer, "unsupported node type");
+        BRPeerStoreRemove(manager->peerStore, peer);
         BRPeerDisconnect(peer);
     }
     else if ((peer->services & SERVICES_NODE_NETWORK) != SERVICES_NODE_NETWORK) {
         peer_log(peer, "node doesn't carry full blocks");
+        BRPeerStoreRemove(manager->peerStore, peer);
         BRPeerDisconnect(peer);
     }
     else if (BRPeerLastBlock(peer) + 10 < manager->lastBlock->height) {
@@ -740,61 +1583,71 @@ static void _peerConnected(void *info)
     }
     else if (BRPeerVersion(peer) >= 70011 && (peer->services & SERVICES_NODE_BLOOM) != SERVICES_NODE_BLOOM) {
         peer_log(peer, "node doesn't support SPV mode");
+        BRPeerStoreRemove(manager->peerStore, peer);
         BRPeerDisconnect(peer);
     }
-    else if (manager->downloadPeer && // check if we should stick with the existing download peer
-             (BRPeerLastBlock(manager->downloadPeer) >= BRPeerLastBlock(peer) ||
-              manager->lastBlock->height >= BRPeerLastBlock(peer))) {
-        if (manager->lastBlock->height >= BRPeerLastBlock(peer)) { // only load bloom filter if we're done syncing
-            manager->connectFailureCount = 0; // also reset connect failure count if we're already synced
-            _BRPeerManagerLoadBloomFilter(manager, peer);
-            _BRPeerManagerPublishPendingTx(manager, peer);
-            peerInfo = calloc(1, sizeof(*peerInfo));
-            assert(peerInfo != NULL);
-            peerInfo->peer = peer;
-            peerInfo->manager = manager;
-            BRPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
+    else { // only count the connection as good once the peer has passed the checks above
+        BRPeerStoreGood(manager->peerStore, peer, now);
+
+        if (manager->downloadPeer && // check if we should stick with the existing download peer
+            (BRPeerLastBlock(manager->downloadPeer) >= BRPeerLastBlock(peer) ||
+             manager->lastBlock->height >= BRPeerLastBlock(peer))) {
+            if (manager->lastBlock->height >= BRPeerLastBlock(peer)) { // only load bloom filter if we're done syncing
+                manager->connectFailureCount = 0; // also reset connect failure count if we're already synced
+                _BRPeerManagerLoadBloomFilter(manager, peer);
+                _BRPeerManagerPublishPendingTx(manager, peer);
+                peerInfo = calloc(1, sizeof(*peerInfo));
+                assert(peerInfo != NULL);
+                peerInfo->peer = peer;
+                peerInfo->manager = manager;
+                BRPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
+            }
+            else if (manager->fetchHashes && manager->bloomFilter) { // help fetch blocks during headers-first sync
+                _BRPeerManagerSendBloomFilter(manager, peer);
+                peer->flags |= PEER_FLAG_FETCH;
+                _BRPeerManagerFetchBlocks(manager);
+            }
         }
-    }
-    else { // select the peer with the lowest ping time to download the chain from if we're behind
-        // BUG: XXX a malicious peer can report a higher lastblock to make us select them as the download peer, if
-        // two peers agree on lastblock, use one of those two instead
-        for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
-            BRPeer *p = manager->connectedPeers[i - 1];
+        else { // select the peer with the lowest ping time to download the chain from if we're behind
+            // BUG: XXX a malicious peer can report a higher lastblock to make us select them as the download peer, if
+            // two peers agree on lastblock, use one of those two instead
+            for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+                BRPeer *p = manager->connectedPeers[i - 1];
             
-            if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
-            if ((BRPeerPingTime(p) < BRPeerPingTime(peer) && BRPeerLastBlock(p) >= BRPeerLastBlock(peer)) ||
-                BRPeerLastBlock(p) > BRPeerLastBlock(peer)) peer = p;
-        }
+                if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
+                if ((BRPeerPingTime(p) < BRPeerPingTime(peer) && BRPeerLastBlock(p) >= BRPeerLastBlock(peer)) ||
+                    BRPeerLastBlock(p) > BRPeerLastBlock(peer)) peer = p;
+            }
         
-        if (manager->downloadPeer) {
-            peer_log(peer, "selecting new download peer with higher reported lastblock");
-            BRPeerDisconnect(manager->downloadPeer);
-        }
+            if (manager->downloadPeer) {
+                peer_log(peer, "selecting new download peer with higher reported lastblock");
+                BRPeerDisconnect(manager->downloadPeer);
+            }
         
-        manager->downloadPeer = peer;
-        manager->isConnected = 1;
-        manager->estimatedHeight = BRPeerLastBlock(peer);
-        _BRPeerManagerLoadBloomFilter(manager, peer);
-        BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
-        _BRPeerManagerPublishPendingTx(manager, peer);
+            manager->downloadPeer = peer;
+            manager->isConnected = 1;
+            manager->estimatedHeight = BRPeerLastBlock(peer);
+            _BRPeerManagerLoadBloomFilter(manager, peer);
+            BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
+            _BRPeerManagerPublishPendingTx(manager, peer);
             
-        if (manager->lastBlock->height < BRPeerLastBlock(peer)) { // start blockchain sync
-            UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
-            size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
+            if (manager->lastBlock->height < BRPeerLastBlock(peer)) { // start blockchain sync
+                UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
+                size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
             
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule sync timeout
-
-            // request just block headers up to a week before earliestKeyTime, and then merkleblocks after that
-            // we do not reset connect failure count yet incase this request times out
-            if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
-                BRPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
+                BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule sync timeout
+
+                // request block headers to the tip of the chain, keeping just the headers up to a week before
+                // earliestKeyTime, and fetch merkleblocks for the rest from all connected peers in parallel
+                // we do not reset connect failure count yet incase this request times out
+                _BRPeerManagerStartFetch(manager);
+                BRPeerSetHeadersFirst(peer, 1);
+                BRPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
+            }
+            else { // we're already synced
+                manager->connectFailureCount = 0; // reset connect failure count
+                _BRPeerManagerLoadMempools(manager);
             }
-            else BRPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
-        }
-        else { // we're already synced
-            manager->connectFailureCount = 0; // reset connect failure count
-            _BRPeerManagerLoadMempools(manager);
         }
     }
 
@@ -805,23 +1658,26 @@ static void _peerDisconnected(void *info, int error)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    BRTxPeerList *peerList;
     int willSave = 0, willReconnect = 0, txError = 0;
-    size_t txCount = 0;
+    size_t txCount = 0, saveCount = 0;
+    BRPeerStats stats;
     
     //free(info);
     pthread_mutex_lock(&manager->lock);
 
     BRPublishedTx pubTx[array_count(manager->publishedTx)];
+    BRPeer save[PEER_SAVE_COUNT];
+    
+    stats = BRPeerSyncStats(peer); // score the peer on how it did, for choosing peers to connect to next time
+    BRPeerStoreSetStats(manager->peerStore, peer, (stats.pingTime < DBL_MAX) ? stats.pingTime : 0,
+                        (stats.blockCount > 0 && stats.blockInterval > 0) ?
+                        stats.blockBytes/(stats.blockCount*stats.blockInterval) : 0);
     
     if (error == EPROTO) { // if it's protocol error, the peer isn't following standard policy
         _BRPeerManagerPeerMisbehavin(manager, peer);
     }
     else if (error) { // timeout or some non-protocol related network error
-        for (size_t i = array_count(manager->peers); i > 0; i--) {
-            if (BRPeerEq(&manager->peers[i - 1], peer)) array_rm(manager->peers, i - 1);
-        }
-        
+        BRPeerStoreFailed(manager->peerStore, peer);
         manager->connectFailureCount++;
         
         // if it's a timeout and there's pending tx publish callbacks, the tx publish timed out
@@ -830,13 +1686,9 @@ static void _peerDisconnected(void *info, int error)
                                    array_count(manager->connectedPeers) == 1)) txError = ETIMEDOUT;
     }
     
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        peerList = &manager->txRelays[i - 1];
-
-        for (size_t j = array_count(peerList->peers); j > 0; j--) {
-            if (BRPeerEq(&peerList->peers[j - 1], peer)) array_rm(peerList->peers, j - 1);
-        }
-    }
+    _BRPeerManagerRemoveTxPeer(manager, peer);
+    if (peer == manager->downloadPeer) _BRPeerManagerEndFetch(manager); // sync restarts with the next download peer
+    else _BRPeerManagerReleaseFetchWindows(manager, peer);
 
     if (peer == manager->downloadPeer) { // download peer disconnected
         manager->isConnected = 0;
@@ -846,10 +1698,9 @@ static void _peerDisconnected(void *info, int error)
 
     if (! manager->isConnected && manager->connectFailureCount == MAX_CONNECT_FAILURES) {
         _BRPeerManagerSyncStopped(manager);
-        
-        // clear out stored peers so we get a fresh list from DNS on next connect attempt
-        array_clear(manager->peers);
+        manager->dnsTime = 0; // refresh peers from DNS on the next connect attempt
         txError = ENOTCONN; // trigger any pending tx publish callbacks
+        saveCount = _BRPeerManagerSavePeers(manager, save, PEER_SAVE_COUNT);
         willSave = 1;
         peer_log(peer, "sync failed");
     }
@@ -871,6 +1722,7 @@ static void _peerDisconnected(void *info, int error)
         break;
     }
 
+    _BRPeerManagerFetchBlocks(manager); // reassign any fetch windows the peer had
     BRPeerFree(peer);
     pthread_mutex_unlock(&manager->lock);
     
@@ -878,7 +1730,7 @@ static void _peerDisconnected(void *info, int error)
         pubTx[i].callback(pubTx[i].info, txError);
     }
     
-    if (willSave && manager->savePeers) manager->savePeers(manager->info, 1, NULL, 0);
+    if (willSave && manager->savePeers) manager->savePeers(manager->info, 1, save, saveCount);
     if (willSave && manager->syncStopped) manager->syncStopped(manager->info, error);
     if (willReconnect) BRPeerManagerConnect(manager); // try connecting to another peer
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
@@ -888,30 +1740,17 @@ static void _peerRelayedPeers(void *info, const BRPeer peers[], size_t peersCoun
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    time_t now = time(NULL);
+    BRPeer save[PEER_SAVE_COUNT];
+    size_t saveCount = 0;
 
     pthread_mutex_lock(&manager->lock);
     peer_log(peer, "relayed %zu peer(s)", peersCount);
+    BRPeerStoreAdd(manager->peerStore, peers, peersCount, time(NULL)); // the store limits how many it keeps
 
-    array_add_array(manager->peers, peers, peersCount);
-    qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
-
-    // limit total to 2500 peers
-    if (array_count(manager->peers) > 2500) array_set_count(manager->peers, 2500);
-    peersCount = array_count(manager->peers);
-    
-    // remove peers more than 3 hours old, or until there are only 1000 left
-    while (peersCount > 1000 && manager->peers[peersCount - 1].timestamp + 3*60*60 < now) peersCount--;
-    array_set_count(manager->peers, peersCount);
-    
-    BRPeer save[peersCount];
-
-    for (size_t i = 0; i < peersCount; i++) save[i] = manager->peers[i];
-    pthread_mutex_unlock(&manager->lock);
-    
     // peer relaying is complete when we receive <1000
-    if (peersCount > 1 && peersCount < 1000 &&
-        manager->savePeers) manager->savePeers(manager->info, 1, save, peersCount);
+    if (peersCount > 1 && peersCount < 1000) saveCount = _BRPeerManagerSavePeers(manager, save, PEER_SAVE_COUNT);
+    pthread_mutex_unlock(&manager->lock);
+    if (saveCount > 0 && manager->savePeers) manager->savePeers(manager->info, 1, save, saveCount);
 }
 
 static void _peerRelayedTx(void *info, BRTransaction *tx)
@@ -922,6 +1761,9 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
     void (*txCallback)(void *, int) = NULL;
     int isWalletTx = 0, hasPendingCallbacks = 0;
     size_t relayCount = 0;
+    UInt256 txHash = tx->txHash;
+    BRTransaction *t;
+    BRWallet **wallets;
     
     pthread_mutex_lock(&manager->lock);
     peer_log(peer, "relayed tx: %s", u256hex(tx->txHash));
@@ -932,19 +1774,29 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
             txCallback = manager->publishedTx[i - 1].callback;
             manager->publishedTx[i - 1].info = NULL;
             manager->publishedTx[i - 1].callback = NULL;
-            relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+            relayCount = _BRTxPeersAddPeer(manager, manager->txRelays, tx->txHash, peer);
         }
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
 
-    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or peer isn't syncing
+    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || ! _BRPeerManagerIsSyncPeer(manager, peer))) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    if (manager->syncStartHeight == 0 || BRWalletContainsTransaction(manager->wallet, tx)) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+    array_new(wallets, 1);
+    _BRPeerManagerTxWallets(manager, tx, &wallets);
+
+    if (array_count(wallets) > 0) { // each wallet tx belongs to gets its own copy
+        isWalletTx = 1;
+        if (! _BRPeerManagerRegisterTx(manager, wallets, array_count(wallets), tx)) BRTransactionFree(tx);
+        tx = BRWalletTransactionForHash(wallets[0], txHash);
+    }
+    else if (manager->syncStartHeight == 0 && array_count(manager->wallets) > 0) {
+        // the first wallet keeps track of unconfirmed non-wallet tx, as well as any wallet tx the pkh index missed
+        isWalletTx = BRWalletRegisterTransaction(manager->wallets[0], tx);
+        if (isWalletTx) array_add(wallets, manager->wallets[0]);
+        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallets[0], txHash);
     }
     else {
         BRTransactionFree(tx);
@@ -957,27 +1809,34 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
         }
         
-        if (BRWalletAmountSentByTx(manager->wallet, tx) > 0 && BRWalletTransactionIsValid(manager->wallet, tx)) {
-            _BRPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
+        for (size_t i = 0; i < array_count(wallets); i++) {
+            t = BRWalletTransactionForHash(wallets[i], txHash);
+            if (! t || BRWalletAmountSentByTx(wallets[i], t) == 0) continue;
+            if (! BRWalletTransactionIsValid(wallets[i], t)) continue;
+            _BRPeerManagerAddTxToPublishList(manager, t, NULL, NULL); // add valid send tx to mempool
+            break;
         }
 
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+        if (manager->syncStartHeight == 0) relayCount = _BRTxPeersAddPeer(manager, manager->txRelays, tx->txHash, peer);
         
-        _BRTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
+        _BRTxPeersRemovePeer(manager, manager->txRequests, tx->txHash, peer);
         
-        if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
+        // check if bloom filter is already being updated
+        for (size_t i = 0; manager->bloomFilter != NULL && i < array_count(wallets); i++) {
             BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
+            size_t addrsCount = sizeof(addrs)/sizeof(*addrs);
             UInt160 hash;
 
             // the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit>
             // unused addresses are still matched by the bloom filter
-            BRWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-            BRWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+            BRWalletUnusedAddrs(wallets[i], addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+            BRWalletUnusedAddrs(wallets[i], addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+            _BRPeerManagerIndexAddrs(manager, wallets[i], addrs, addrsCount);
 
-            for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
-                if (! BRAddressHash160(&hash, addrs[i].s) ||
+            for (size_t j = 0; j < addrsCount; j++) {
+                if (! BRAddressHash160(&hash, addrs[j].s) ||
                     BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
                 if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
                 manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
@@ -989,9 +1848,10 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
     
     // set timestamp when tx is verified
     if (tx && relayCount >= manager->maxConnectCount && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
-        BRWalletUpdateTransactions(manager->wallet, &tx->txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
+        _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
     }
     
+    array_free(wallets);
     pthread_mutex_unlock(&manager->lock);
     if (txCallback) txCallback(txInfo, 0);
 }
@@ -1004,9 +1864,10 @@ static void _peerHasTx(void *info, UInt256 txHash)
     BRPublishedTx pubTx = { NULL, NULL, NULL };
     int isWalletTx = 0, hasPendingCallbacks = 0;
     size_t relayCount = 0;
+    BRWallet **wallets;
     
     pthread_mutex_lock(&manager->lock);
-    tx = BRWalletTransactionForHash(manager->wallet, txHash);
+    tx = _BRPeerManagerTxForHash(manager, txHash, NULL);
     peer_log(peer, "has tx: %s", u256hex(txHash));
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
@@ -1015,19 +1876,26 @@ static void _peerHasTx(void *info, UInt256 txHash)
             if (! tx) tx = pubTx.tx;
             manager->publishedTx[i - 1].callback = NULL;
             manager->publishedTx[i - 1].info = NULL;
-            relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+            relayCount = _BRTxPeersAddPeer(manager, manager->txRelays, txHash, peer);
         }
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
     
-    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or peer isn't syncing
+    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || ! _BRPeerManagerIsSyncPeer(manager, peer))) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
     if (tx) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+        array_new(wallets, 1);
+        _BRPeerManagerTxWallets(manager, tx, &wallets);
+        isWalletTx = (array_count(wallets) > 0);
+        if (isWalletTx) _BRPeerManagerRegisterTx(manager, wallets, array_count(wallets), tx);
+        else if (_BRPeerManagerTxIsOwned(manager, tx)) isWalletTx = 1;
+        else if (array_count(manager->wallets) > 0) isWalletTx = BRWalletRegisterTransaction(manager->wallets[0], tx);
+        
+        if (isWalletTx) tx = _BRPeerManagerTxForHash(manager, txHash, NULL);
+        array_free(wallets);
 
         // reschedule sync timeout
         if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && isWalletTx) {
@@ -1036,14 +1904,14 @@ static void _peerHasTx(void *info, UInt256 txHash)
         
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+        if (manager->syncStartHeight == 0) relayCount = _BRTxPeersAddPeer(manager, manager->txRelays, txHash, peer);
 
         // set timestamp when tx is verified
         if (relayCount >= manager->maxConnectCount && tx && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
-            BRWalletUpdateTransactions(manager->wallet, &txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
+            _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
         }
 
-        _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+        _BRTxPeersRemovePeer(manager, manager->txRequests, txHash, peer);
     }
     
     pthread_mutex_unlock(&manager->lock);
@@ -1055,22 +1923,23 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     BRTransaction *tx, *t;
+    BRWallet *wallet = NULL;
 
     pthread_mutex_lock(&manager->lock);
     peer_log(peer, "rejected tx: %s", u256hex(txHash));
-    tx = BRWalletTransactionForHash(manager->wallet, txHash);
-    _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+    tx = _BRPeerManagerTxForHash(manager, txHash, &wallet);
+    _BRTxPeersRemovePeer(manager, manager->txRequests, txHash, peer);
 
     if (tx) {
-        if (_BRTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
+        if (_BRTxPeersRemovePeer(manager, manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
             // set timestamp 0 to mark tx as unverified
-            BRWalletUpdateTransactions(manager->wallet, &txHash, 1, TX_UNCONFIRMED, 0);
+            _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, 0);
         }
 
         // if we get rejected for any reason other than double-spend, the peer is likely misconfigured
-        if (code != REJECT_SPENT && BRWalletAmountSentByTx(manager->wallet, tx) > 0) {
+        if (code != REJECT_SPENT && BRWalletAmountSentByTx(wallet, tx) > 0) {
             for (size_t i = 0; i < tx->inCount; i++) { // check that all inputs are confirmed before dropping peer
-                t = BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash);
+                t = _BRPeerManagerTxForHash(manager, tx->inputs[i].txHash, NULL);
                 if (! t || t->blockHeight != TX_UNCONFIRMED) continue;
                 tx = NULL;
                 break;
@@ -1092,13 +1961,11 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
 
     // check if we hit a difficulty transition, and find previous transition time
     if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
-        BRMerkleBlock *b = block;
+        BRChainHeader *header = _BRChainHeaderAncestor(BRSetGet(manager->headers, prev),
+                                                       block->height - BLOCK_DIFFICULTY_INTERVAL);
+        BRMerkleBlock *b = (header) ? BRSetGet(manager->blocks, header) : NULL;
         UInt256 prevBlock;
 
-        for (uint32_t i = 0; b && i < BLOCK_DIFFICULTY_INTERVAL; i++) {
-            b = BRSetGet(manager->blocks, &b->prevBlock);
-        }
-
         if (! b) {
             peer_log(peer, "missing previous difficulty tansition, can't verify block: %s", u256hex(block->blockHash));
             r = 0;
@@ -1137,7 +2004,8 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
     return r;
 }
 
-static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+// adds a block relayed by peer, and returns the next block if it was already received as an orphan or fetched ahead
+static BRMerkleBlock *_BRPeerManagerRelayedBlock(void *info, BRMerkleBlock *block)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
@@ -1145,7 +2013,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     UInt256 _txHashes[(sizeof(UInt256)*txCount <= 0x1000) ? txCount : 0],
             *txHashes = (sizeof(UInt256)*txCount <= 0x1000) ? _txHashes : malloc(txCount*sizeof(*txHashes));
     size_t i, j, fpCount = 0, saveCount = 0;
-    BRMerkleBlock orphan, *b, *b2, *prev, *next = NULL;
+    BRMerkleBlock orphan, *b, *prev, *next = NULL;
+    BRChainHeader *header, *header2;
     uint32_t txTime = 0;
     
     assert(txHashes != NULL);
@@ -1161,7 +2030,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     // track the observed bloom filter false positive rate using a low pass filter to smooth out variance
     if (peer == manager->downloadPeer && block->totalTx > 0) {
         for (i = 0; i < txCount; i++) { // wallet tx are not false-positives
-            if (! BRWalletTransactionForHash(manager->wallet, txHashes[i])) fpCount++;
+            if (! _BRPeerManagerTxForHash(manager, txHashes[i], NULL)) fpCount++;
         }
         
         // moving average number of tx-per-block
@@ -1184,13 +2053,15 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         }
     }
 
-    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx)
+    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx),
+    // during headers-first sync their merkleblocks are fetched instead
     if (block->totalTx == 0 && block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) {
+        if (manager->fetchHashes && peer == manager->downloadPeer) _BRPeerManagerAddFetchHeader(manager, peer, block);
         BRMerkleBlockFree(block);
         block = NULL;
     }
-    else if (manager->bloomFilter == NULL) { // ingore potentially incomplete blocks when a filter update is pending
-        BRMerkleBlockFree(block);
+    else if (manager->bloomFilter == NULL || (peer != manager->downloadPeer && (peer->flags & PEER_FLAG_NEEDSUPDATE))) {
+        BRMerkleBlockFree(block); // ingore potentially incomplete blocks when a filter update is pending
         block = NULL;
 
         if (peer == manager->downloadPeer && manager->lastBlock->height < manager->estimatedHeight) {
@@ -1198,6 +2069,12 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
     }
+    else if (manager->fetchHashes && ! UInt256Eq(block->prevBlock, manager->lastBlock->blockHash) &&
+             _BRPeerManagerIsFetchBlock(manager, block)) { // fetched ahead of the chain, add it once prevBlock is added
+        b = BRSetAdd(manager->fetchedBlocks, block);
+        if (b && b != block) BRMerkleBlockFree(b);
+        block = NULL;
+    }
     else if (! prev) { // block is an orphan
         peer_log(peer, "relayed orphan block %s, previous %s, last block is %s, height %"PRIu32,
                  u256hex(block->blockHash), u256hex(block->prevBlock), u256hex(manager->lastBlock->blockHash),
@@ -1235,12 +2112,24 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         }
         
         BRSetAdd(manager->blocks, block);
+        _BRPeerManagerAddHeader(manager, block);
         manager->lastBlock = block;
-        if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
+        _BRPeerManagerStoreBlock(manager, block);
+        if (txCount > 0) _BRPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
         if (manager->downloadPeer) BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
+
+        // ask connected peers again for any unconfirmed tx whose relay entries expired, to recount those still relaying
+        if (_BRPeerManagerExpireTxPeers(manager, time(NULL)) > 0 && manager->syncStartHeight == 0) {
+            for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+                if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusConnected) continue;
+                _BRPeerManagerRequestUnrelayedTx(manager, manager->connectedPeers[i - 1]);
+            }
+        }
             
-        if (block->height < manager->estimatedHeight && peer == manager->downloadPeer) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        if (block->height < manager->estimatedHeight && manager->downloadPeer &&
+            (peer == manager->downloadPeer || manager->fetchHashes)) {
+            // reschedule sync timeout
+            BRPeerScheduleDisconnect(manager->downloadPeer, _BRPeerManagerFetchTimeout(manager, manager->downloadPeer));
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
         
@@ -1258,11 +2147,11 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
             peer_log(peer, "relayed existing block #%"PRIu32, block->height);
         }
         
-        b = manager->lastBlock;
-        while (b && b->height > block->height) b = BRSetGet(manager->blocks, &b->prevBlock); // is block in main chain?
+        _BRPeerManagerAddHeader(manager, block);
+        header = _BRPeerManagerChainHeader(manager, block->height); // is block in main chain?
         
-        if (BRMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
-            if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
+        if (header && UInt256Eq(header->blockHash, block->blockHash)) { // if it's not on a fork, set tx block heights
+            if (txCount > 0) _BRPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
             if (block->height == manager->lastBlock->height) manager->lastBlock = block;
         }
         
@@ -1289,24 +2178,29 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     else { // new block is on a fork
         peer_log(peer, "chain fork reached height %"PRIu32, block->height);
         BRSetAdd(manager->blocks, block);
+        header = _BRPeerManagerAddHeader(manager, block);
 
         // TODO: calculate chain work and use that instead of block height to determine longest chain
         if (block->height > manager->lastBlock->height) { // check if fork is now longer than main chain
-            b = block;
-            b2 = manager->lastBlock;
+            header2 = BRSetGet(manager->headers, manager->lastBlock);
+            header = _BRChainHeaderAncestor(header, header2->height);
             
-            while (b && b2 && ! BRMerkleBlockEq(b, b2)) { // walk back to where the fork joins the main chain
-                b = BRSetGet(manager->blocks, &b->prevBlock);
-                if (b && b->height < b2->height) b2 = BRSetGet(manager->blocks, &b2->prevBlock);
+            while (header && header2 && header != header2) { // walk back to where the fork joins the main chain
+                header = header->prev;
+                header2 = header2->prev;
             }
             
-            peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
+            assert(header != NULL); // forks older than the most recent checkpoint are ignored, so they always join
+            peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, header->height,
+                     block->height);
         
-            BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+            for (i = 0; i < array_count(manager->wallets); i++) { // mark tx after the join point as unconfirmed
+                BRWalletSetTxUnconfirmedAfter(manager->wallets[i], header->height);
+            }
 
             b = block;
         
-            while (b && b2 && b->height > b2->height) { // set transaction heights for new main chain
+            while (b && b->height > header->height) { // set transaction heights for new main chain
                 size_t count = BRMerkleBlockTxHashes(b, NULL, 0);
                 uint32_t height = b->height, timestamp = b->timestamp;
                 
@@ -1320,10 +2214,11 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
                 count = BRMerkleBlockTxHashes(b, txHashes, count);
                 b = BRSetGet(manager->blocks, &b->prevBlock);
                 if (b) timestamp = timestamp/2 + b->timestamp/2;
-                if (count > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
+                if (count > 0) _BRPeerManagerUpdateTx(manager, txHashes, count, height, timestamp);
             }
         
             manager->lastBlock = block;
+            _BRPeerManagerStoreBlock(manager, block);
             
             if (block->height == manager->estimatedHeight) { // chain download is complete
                 saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
@@ -1340,8 +2235,16 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         // check if the next block was received as an orphan
         orphan.prevBlock = block->blockHash;
         next = BRSetRemove(manager->orphans, &orphan);
+        
+        // or if it was fetched ahead of the chain
+        if (! next && block == manager->lastBlock) next = _BRPeerManagerNextFetchedBlock(manager);
+    }
+    
+    if (peer != manager->downloadPeer && _BRPeerManagerFetchCount(manager, peer) > 0) {
+        BRPeerScheduleDisconnect(peer, _BRPeerManagerFetchTimeout(manager, peer)); // reschedule fetch timeout
     }
     
+    _BRPeerManagerFetchBlocks(manager);
     BRMerkleBlock *saveBlocks[saveCount];
     
     for (i = 0, b = block; b && i < saveCount; i++) {
@@ -1355,6 +2258,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
     assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
     if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
+    if (i > 0 && manager->headerStore) BRHeaderStoreSync(manager->headerStore);
     pthread_mutex_unlock(&manager->lock);
     
     if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer) &&
@@ -1362,7 +2266,12 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
     }
     
-    if (next) _peerRelayedBlock(info, next);
+    return next;
+}
+
+static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+{
+    while (block) block = _BRPeerManagerRelayedBlock(info, block); // loop rather than recurse over queued blocks
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
@@ -1374,8 +2283,8 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
     pthread_mutex_lock(&manager->lock);
 
     for (size_t i = 0; i < txCount; i++) {
-        _BRTxPeerListRemovePeer(manager->txRelays, txHashes[i], peer);
-        _BRTxPeerListRemovePeer(manager->txRequests, txHashes[i], peer);
+        _BRTxPeersRemovePeer(manager, manager->txRelays, txHashes[i], peer);
+        _BRTxPeersRemovePeer(manager, manager->txRequests, txHashes[i], peer);
     }
 
     pthread_mutex_unlock(&manager->lock);
@@ -1386,6 +2295,7 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
     BRPeer *p, *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     uint64_t maxFeePerKb = 0, secondFeePerKb = 0;
+    int increased = 0;
     
     pthread_mutex_lock(&manager->lock);
     
@@ -1395,10 +2305,16 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
         if (BRPeerFeePerKb(p) > maxFeePerKb) secondFeePerKb = maxFeePerKb, maxFeePerKb = BRPeerFeePerKb(p);
     }
     
-    if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
-        secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallet)) {
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
+            secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallets[i])) {
+            BRWalletSetFeePerKb(manager->wallets[i], secondFeePerKb*3/2);
+            increased = 1;
+        }
+    }
+    
+    if (increased) {
         peer_log(peer, "increasing feePerKb to %"PRIu64" based on feefilter messages from peers", secondFeePerKb*3/2);
-        BRWalletSetFeePerKb(manager->wallet, secondFeePerKb*3/2);
     }
 
     pthread_mutex_unlock(&manager->lock);
@@ -1410,6 +2326,7 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     BRPublishedTx pubTx = { NULL, NULL, NULL };
     int hasPendingCallbacks = 0, error = 0;
+    BRWallet **wallets;
 
     pthread_mutex_lock(&manager->lock);
 
@@ -1422,14 +2339,33 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
 
-    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or peer isn't syncing
+    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || ! _BRPeerManagerIsSyncPeer(manager, peer))) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
-    if (pubTx.tx) BRWalletRegisterTransaction(manager->wallet, pubTx.tx);
-    if (pubTx.tx && ! BRWalletTransactionIsValid(manager->wallet, pubTx.tx)) error = EINVAL;
+    _BRTxPeersAddPeer(manager, manager->txRelays, txHash, peer);
+    
+    if (pubTx.tx) {
+        array_new(wallets, 1);
+        _BRPeerManagerTxWallets(manager, pubTx.tx, &wallets);
+        
+        if (array_count(wallets) == 0 && array_count(manager->wallets) > 0) {
+            if (! _BRPeerManagerTxIsOwned(manager, pubTx.tx)) {
+                BRWalletRegisterTransaction(manager->wallets[0], pubTx.tx);
+            }
+            
+            array_add(wallets, manager->wallets[0]);
+        }
+        else _BRPeerManagerRegisterTx(manager, wallets, array_count(wallets), pubTx.tx);
+        
+        for (size_t i = 0; i < array_count(wallets); i++) {
+            if (! BRWalletTransactionIsValid(wallets[i], pubTx.tx)) error = EINVAL;
+        }
+        
+        array_free(wallets);
+    }
+    
     pthread_mutex_unlock(&manager->lock);
     if (pubTx.callback) pubTx.callback(pubTx.info, error);
     return pubTx.tx;
@@ -1458,6 +2394,7 @@ static void _dummyThreadCleanup(void *info)
 }
 
 // returns a newly allocated BRPeerManager struct that must be freed by calling BRPeerManagerFree()
+// wallet may be NULL, in which case wallets are added with BRPeerManagerAddWallet()
 BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, uint32_t earliestKeyTime,
                                 BRMerkleBlock *blocks[], size_t blocksCount, const BRPeer peers[], size_t peersCount)
 {
@@ -1467,21 +2404,23 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     assert(manager != NULL);
     assert(params != NULL);
     assert(params->standardPort != 0);
-    assert(wallet != NULL);
     assert(blocks != NULL || blocksCount == 0);
     assert(peers != NULL || peersCount == 0);
     manager->params = params;
-    manager->wallet = wallet;
+    array_new(manager->wallets, 1);
+    manager->pkhWallets = BRSetNew(_BRPKHHash, _BRPKHEq, 100);
+    manager->utxoWallets = BRSetNew(BRUTXOHash, BRUTXOEq, 100);
     manager->earliestKeyTime = earliestKeyTime;
     manager->averageTxPerBlock = 1400;
     manager->maxConnectCount = PEER_MAX_CONNECTIONS;
-    array_new(manager->peers, peersCount);
-    if (peers) array_add_array(manager->peers, peers, peersCount);
-    qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
+    manager->peerStore = BRPeerStoreNew(NULL);
+    BRPeerStoreAdd(manager->peerStore, peers, peersCount, time(NULL));
     array_new(manager->connectedPeers, PEER_MAX_CONNECTIONS);
     manager->blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, blocksCount);
     manager->orphans = BRSetNew(_BRPrevBlockHash, _BRPrevBlockEq, blocksCount); // orphans are indexed by prevBlock
     manager->checkpoints = BRSetNew(_BRBlockHeightHash, _BRBlockHeightEq, 100); // checkpoints are indexed by height
+    manager->headers = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, blocksCount + 100);
+    array_new(manager->headerChunks, 10);
 
     for (size_t i = 0; i < manager->params->checkpointsCount; i++) {
         block = BRMerkleBlockNew();
@@ -1491,6 +2430,7 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
         block->target = manager->params->checkpoints[i].target;
         BRSetAdd(manager->checkpoints, block);
         BRSetAdd(manager->blocks, block);
+        _BRPeerManagerAddHeader(manager, block);
         if (i == 0 || block->timestamp + 7*24*60*60 < manager->earliestKeyTime) manager->lastBlock = block;
     }
 
@@ -1506,6 +2446,7 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     
     while (block) {
         BRSetAdd(manager->blocks, block);
+        _BRPeerManagerAddHeader(manager, block);
         manager->lastBlock = block;
         orphan.prevBlock = block->prevBlock;
         BRSetRemove(manager->orphans, &orphan);
@@ -1513,15 +2454,125 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
         block = BRSetGet(manager->orphans, &orphan);
     }
     
-    array_new(manager->txRelays, 10);
-    array_new(manager->txRequests, 10);
+    manager->txRelays = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    manager->txRequests = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
     pthread_mutex_init(&manager->lock, NULL);
     manager->threadCleanup = _dummyThreadCleanup;
+    if (wallet) BRPeerManagerAddWallet(manager, wallet, earliestKeyTime);
     return manager;
 }
 
+// adds wallet to the wallets synced by manager, which share its connections, block chain and bloom filter
+// if connected, the bloom filter is updated to include the wallet's addresses without reconnecting
+// earliestKeyTime is the wallet's creation time, if it's before blocks manager already synced, call one of the rescan
+// functions afterward to find the wallet's earlier transactions
+void BRPeerManagerAddWallet(BRPeerManager *manager, BRWallet *wallet, uint32_t earliestKeyTime)
+{
+    size_t i, count;
+    BRAddress *addrs;
+    BRUTXO *utxos;
+    
+    assert(manager != NULL);
+    assert(wallet != NULL);
+    pthread_mutex_lock(&manager->lock);
+    for (i = array_count(manager->wallets); i > 0 && manager->wallets[i - 1] != wallet; i--);
+    
+    if (i == 0) {
+        array_add(manager->wallets, wallet);
+        count = BRWalletAllAddrs(wallet, NULL, 0);
+        addrs = malloc((count + 1)*sizeof(*addrs));
+        assert(addrs != NULL);
+        count = BRWalletAllAddrs(wallet, addrs, count);
+        _BRPeerManagerIndexAddrs(manager, wallet, addrs, count);
+        free(addrs);
+        count = BRWalletUTXOs(wallet, NULL, 0);
+        utxos = malloc((count + 1)*sizeof(*utxos));
+        assert(utxos != NULL);
+        count = BRWalletUTXOs(wallet, utxos, count);
+        _BRPeerManagerIndexUTXOs(manager, wallet, utxos, count);
+        free(utxos);
+        
+        if (earliestKeyTime < manager->earliestKeyTime) {
+            manager->earliestKeyTime = earliestKeyTime;
+            
+            for (i = array_count(manager->connectedPeers); i > 0; i--) {
+                BRPeerSetEarliestKeyTime(manager->connectedPeers[i - 1], earliestKeyTime);
+            }
+        }
+        
+        if (manager->bloomFilter) { // reset bloom filter so it's recreated with the wallet's addresses
+            BRBloomFilterFree(manager->bloomFilter);
+            manager->bloomFilter = NULL;
+            _BRPeerManagerUpdateFilter(manager);
+        }
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// removes wallet from the wallets synced by manager, after which the wallet may be freed
+// published transactions that only wallet had are no longer published, and their callbacks are called with ECANCELED
+void BRPeerManagerRemoveWallet(BRPeerManager *manager, BRWallet *wallet)
+{
+    BRTransaction *tx;
+    size_t i, txCount = 0;
+    
+    assert(manager != NULL);
+    assert(wallet != NULL);
+    pthread_mutex_lock(&manager->lock);
+    
+    BRPublishedTx pubTx[array_count(manager->publishedTx) + 1];
+    
+    for (i = array_count(manager->wallets); i > 0 && manager->wallets[i - 1] != wallet; i--);
+    
+    if (i > 0) {
+        array_rm(manager->wallets, i - 1);
+        _BRPeerManagerUnindexWallet(manager, wallet);
+        _BRPeerManagerUnindexUTXOs(manager, wallet);
+        
+        for (i = array_count(manager->publishedTx); i > 0; i--) {
+            tx = BRWalletTransactionForHash(wallet, manager->publishedTxHashes[i - 1]);
+            if (! tx || tx != manager->publishedTx[i - 1].tx) continue; // wallet doesn't own the published tx
+            tx = _BRPeerManagerTxForHash(manager, manager->publishedTxHashes[i - 1], NULL);
+            
+            if (tx) { // another wallet has its own copy
+                manager->publishedTx[i - 1].tx = tx;
+                continue;
+            }
+            
+            if (manager->publishedTx[i - 1].callback) pubTx[txCount++] = manager->publishedTx[i - 1];
+            array_rm(manager->publishedTx, i - 1);
+            array_rm(manager->publishedTxHashes, i - 1);
+        }
+        
+        if (manager->bloomFilter) { // reset bloom filter so it no longer matches the wallet's addresses
+            BRBloomFilterFree(manager->bloomFilter);
+            manager->bloomFilter = NULL;
+            _BRPeerManagerUpdateFilter(manager);
+        }
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    
+    for (i = 0; i < txCount; i++) {
+        pubTx[i].callback(pubTx[i].info, ECANCELED);
+    }
+}
+
+// writes up to count of the wallets synced by manager to wallets, and returns the number written, or the total number
+// of wallets if wallets is NULL
+size_t BRPeerManagerWallets(BRPeerManager *manager, BRWallet *wallets[], size_t count)
+{
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    if (! wallets || count > array_count(manager->wallets)) count = array_count(manager->wallets);
+    if (wallets) memcpy(wallets, manager->wallets, count*sizeof(*wallets));
+    pthread_mutex_unlock(&manager->lock);
+    return count;
+}
+
 // not thread-safe, set callbacks once before calling BRPeerManagerConnect()
 // info is a void pointer that will be passed along with each callback call
 // void syncStarted(void *) - called when blockchain syncing starts
@@ -1562,10 +2613,87 @@ void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t
     pthread_mutex_lock(&manager->lock);
     manager->maxConnectCount = UInt128IsZero(address) ? PEER_MAX_CONNECTIONS : 1;
     manager->fixedPeer = ((const BRPeer) { address, port, 0, 0, 0 });
-    array_clear(manager->peers);
     pthread_mutex_unlock(&manager->lock);
 }
 
+// loads the chain headers saved in the header store file at path, creating the file if needed, and from then on keeps
+// it in step with the main chain - the stored chain is loaded from the first header that connects to one of the
+// checkpoints or blocks manager was created with, and is discarded if none do, an empty store is started with the chain
+// manager was created with, call before BRPeerManagerConnect()
+// returns true on success, or false and sets errno if the file can't be opened
+int BRPeerManagerSetHeaderStore(BRPeerManager *manager, const char *path)
+{
+    BRHeaderStore *store;
+    BRMerkleBlock header, *block;
+    BRChainHeader *prev;
+    size_t i, start, count, keep;
+    
+    assert(manager != NULL);
+    assert(path != NULL);
+    store = BRHeaderStoreOpen(path);
+    if (! store) return 0;
+    pthread_mutex_lock(&manager->lock);
+    count = BRHeaderStoreCount(store);
+    
+    // headers stored before the first one that connects can't be verified, so they're left out of the header index
+    for (start = 0; start < count; start++) {
+        header = BRHeaderStoreHeader(store, start);
+        prev = BRSetGet(manager->headers, &header.prevBlock);
+        if (prev && prev->height + 1 == header.height) break;
+    }
+    
+    if (start == count) BRHeaderStoreTruncate(store, 0), count = 0;
+    
+    // only the blocks needed to verify the next difficulty transition are kept, the rest just go in the header index
+    keep = (count > 0) ? BRHeaderStoreHeight(store, count - 1) % BLOCK_DIFFICULTY_INTERVAL : 0;
+    keep += BLOCK_DIFFICULTY_INTERVAL + 1;
+    
+    for (i = start; i < count; i++) {
+        header = BRHeaderStoreHeader(store, i);
+        _BRPeerManagerAddHeader(manager, &header);
+        if (i + keep < count) continue;
+        block = BRSetGet(manager->blocks, &header);
+        if (! block) block = BRMerkleBlockCopy(&header), BRSetAdd(manager->blocks, block);
+        if (block->height > manager->lastBlock->height) manager->lastBlock = block;
+    }
+    
+    if (manager->headerStore) BRHeaderStoreClose(manager->headerStore);
+    manager->headerStore = store;
+    
+    if (count == 0) { // existing installs start the store from the chain they were created with
+        _BRPeerManagerStoreBlock(manager, manager->lastBlock);
+        BRHeaderStoreSync(store);
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    return 1;
+}
+
+// loads the peer addresses and scores saved in the peer store file at path, and from then on saves them back to it,
+// known peers are then connected to right away, with DNS seeds only queried in the background, call before
+// BRPeerManagerConnect()
+void BRPeerManagerSetPeerStore(BRPeerManager *manager, const char *path)
+{
+    BRPeerStore *store;
+    BRPeer *peers;
+    size_t count;
+    time_t now = time(NULL);
+    
+    assert(manager != NULL);
+    assert(path != NULL);
+    store = BRPeerStoreNew(path);
+    pthread_mutex_lock(&manager->lock);
+    count = BRPeerStoreBest(manager->peerStore, NULL, 0, now);
+    peers = calloc(count + 1, sizeof(*peers));
+    assert(peers != NULL);
+    count = BRPeerStoreBest(manager->peerStore, peers, count, now);
+    BRPeerStoreAdd(store, peers, count, now); // keep any peers manager was created with
+    BRPeerStoreFree(manager->peerStore);
+    manager->peerStore = store;
+    pthread_mutex_unlock(&manager->lock);
+    free(peers);
+}
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager)
 {
@@ -1608,21 +2736,32 @@ void BRPeerManagerConnect(BRPeerManager *manager)
     if (array_count(manager->connectedPeers) < manager->maxConnectCount) {
         time_t now = time(NULL);
         BRPeer *peers;
+        size_t count;
 
-        if (array_count(manager->peers) < manager->maxConnectCount ||
-            manager->peers[manager->maxConnectCount - 1].timestamp + 3*24*60*60 < now) {
-            _BRPeerManagerFindPeers(manager);
-        }
-        
         array_new(peers, 100);
-        array_add_array(peers, manager->peers,
-                        (array_count(manager->peers) < 100) ? array_count(manager->peers) : 100);
+        
+        if (! UInt128IsZero(manager->fixedPeer.address)) {
+            array_add(peers, manager->fixedPeer);
+            peers[0].services = SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | manager->params->services;
+            peers[0].timestamp = now;
+        }
+        else { // connect to the best known peers right away, only waiting on DNS seeds if there aren't enough
+            count = BRPeerStoreBest(manager->peerStore, NULL, 0, now);
+            
+            if (count < manager->maxConnectCount) _BRPeerManagerFindPeers(manager, 1);
+            else if (count < PEER_MIN_KNOWN || manager->dnsTime + PEER_DNS_REFRESH < now) {
+                _BRPeerManagerFindPeers(manager, 0);
+            }
+            
+            array_set_count(peers, 100);
+            array_set_count(peers, BRPeerStoreBest(manager->peerStore, peers, 100, now));
+        }
 
         while (array_count(peers) > 0 && array_count(manager->connectedPeers) < manager->maxConnectCount) {
             size_t i = BRRand((uint32_t)array_count(peers)); // index of random peer
             BRPeerCallbackInfo *info;
             
-            i = i*i/array_count(peers); // bias random peer selection toward peers with more recent timestamp
+            i = i*i/array_count(peers); // bias random peer selection toward peers with higher scores
         
             for (size_t j = array_count(manager->connectedPeers); i != SIZE_MAX && j > 0; j--) {
                 if (! BRPeerEq(&peers[i], manager->connectedPeers[j - 1])) continue;
@@ -1636,6 +2775,7 @@ void BRPeerManagerConnect(BRPeerManager *manager)
                 info->manager = manager;
                 info->peer = BRPeerNew(manager->params->magicNumber);
                 *info->peer = peers[i];
+                BRPeerStoreAttempt(manager->peerStore, &peers[i], now);
                 array_rm(peers, i);
                 array_add(manager->connectedPeers, info->peer);
                 manager->peerThreadCount++;
@@ -1707,13 +2847,11 @@ void BRPeerManagerDisconnect(BRPeerManager *manager)
 static int _BRPeerManagerRescan(BRPeerManager *manager, BRMerkleBlock *newLastBlock) {
     if (NULL == newLastBlock) return 0;
 
+    _BRPeerManagerEndFetch(manager);
     manager->lastBlock = newLastBlock;
 
     if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
-        for (size_t i = array_count(manager->peers); i > 0; i--) {
-            if (BRPeerEq(&manager->peers[i - 1], manager->downloadPeer)) array_rm(manager->peers, i - 1);
-        }
-
+        BRPeerStoreAttempt(manager->peerStore, manager->downloadPeer, time(NULL)); // pass it over when reconnecting
         BRPeerDisconnect(manager->downloadPeer);
     }
 
@@ -1768,13 +2906,10 @@ void BRPeerManagerRescanFromLastHardcodedCheckpoint(BRPeerManager *manager)
 
 static BRMerkleBlock *_BRPeerManagerLookupBlockFromBlockNumber(BRPeerManager *manager, uint32_t blockNumber)
 {
-    BRMerkleBlock *block = manager->lastBlock;
+    BRChainHeader *header = _BRPeerManagerChainHeader(manager, blockNumber);
+    BRMerkleBlock *block = (header) ? BRSetGet(manager->blocks, header) : NULL;
 
-    // walk the chain, looking for blockNumber
-    while (block) {
-        if (block->height == blockNumber) return block;
-        block = BRSetGet (manager->blocks, &block->prevBlock);
-    }
+    if (block) return block;
 
     // blockNumber not in the (abbreviated) chain - look through checkpoints
     for (int i = 0; i < manager->params->checkpointsCount; i++)
@@ -1907,6 +3042,25 @@ const char *BRPeerManagerDownloadPeerName(BRPeerManager *manager)
     return manager->downloadPeerName;
 }
 
+// writes merkleblock download statistics for up to count of the connected peers to stats, and returns the number
+// written, or the total number of connected peers if stats is NULL
+size_t BRPeerManagerSyncStats(BRPeerManager *manager, BRPeerStats stats[], size_t count)
+{
+    size_t i, n = 0;
+    
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    
+    for (i = 0; i < array_count(manager->connectedPeers) && (! stats || n < count); i++) {
+        if (BRPeerConnectStatus(manager->connectedPeers[i]) != BRPeerStatusConnected) continue;
+        if (stats) stats[n] = BRPeerSyncStats(manager->connectedPeers[i]);
+        n++;
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    return n;
+}
+
 static void _publishTxInvDone(void *info, int success)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
@@ -1976,21 +3130,20 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
     }
 }
 
-// number of connected peers that have relayed the given unconfirmed transaction
+// number of connected peers that have relayed the given unconfirmed transaction, a confirmed transaction is no longer
+// tracked and counts as relayed by PEER_MAX_CONNECTIONS peers
 size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash)
 {
+    BRTransaction *tx;
     size_t count = 0;
 
     assert(manager != NULL);
     assert(! UInt256IsZero(txHash));
     pthread_mutex_lock(&manager->lock);
+    tx = _BRPeerManagerTxForHash(manager, txHash, NULL);
     
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        if (! UInt256Eq(manager->txRelays[i - 1].txHash, txHash)) continue;
-        count = array_count(manager->txRelays[i - 1].peers);
-        break;
-    }
-    
+    if (tx && tx->blockHeight != TX_UNCONFIRMED) count = PEER_MAX_CONNECTIONS;
+    else count = _BRTxPeersCount(manager->txRelays, txHash);
     pthread_mutex_unlock(&manager->lock);
     return count;
 }
@@ -2006,7 +3159,9 @@ void BRPeerManagerFree(BRPeerManager *manager)
     
     assert(manager != NULL);
     pthread_mutex_lock(&manager->lock);
-    array_free(manager->peers);
+    _BRPeerManagerEndFetch(manager);
+    BRPeerStoreSave(manager->peerStore);
+    BRPeerStoreFree(manager->peerStore);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) BRPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
     BRSetApply(manager->blocks, NULL, _setApplyFreeBlock);
@@ -2014,17 +3169,26 @@ void BRPeerManagerFree(BRPeerManager *manager)
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     BRSetFree(manager->orphans);
     BRSetFree(manager->checkpoints);
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) array_free(manager->txRelays[i - 1].peers);
-    array_free(manager->txRelays);
-    for (size_t i = array_count(manager->txRequests); i > 0; i--) array_free(manager->txRequests[i - 1].peers);
-    array_free(manager->txRequests);
+    BRSetFree(manager->headers);
+    if (manager->headerStore) BRHeaderStoreClose(manager->headerStore);
+    for (size_t i = array_count(manager->headerChunks); i > 0; i--) free(manager->headerChunks[i - 1]);
+    array_free(manager->headerChunks);
+    BRSetApply(manager->txRelays, NULL, _setApplyFree);
+    BRSetFree(manager->txRelays);
+    BRSetApply(manager->txRequests, NULL, _setApplyFree);
+    BRSetFree(manager->txRequests);
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
         tx = manager->publishedTx[i - 1].tx;
-        if (tx && tx != BRWalletTransactionForHash(manager->wallet, tx->txHash)) BRTransactionFree(tx);
+        if (tx && ! _BRPeerManagerTxIsOwned(manager, tx)) BRTransactionFree(tx);
     }
 
     if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+    BRSetApply(manager->pkhWallets, NULL, _setApplyFreePKHWallets);
+    BRSetFree(manager->pkhWallets);
+    _BRPeerManagerUnindexUTXOs(manager, NULL);
+    BRSetFree(manager->utxoWallets);
+    array_free(manager->wallets);
 
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
@@ -2032,3 +3196,64 @@ void BRPeerManagerFree(BRPeerManager *manager)
     pthread_mutex_destroy(&manager->lock);
     free(manager);
 }
+
+void BRPeerManagerRelayedTxTest(BRPeerManager *manager, BRPeer *peer, BRTransaction *tx)
+{
+    BRPeerCallbackInfo info = { peer, manager, UINT256_ZERO };
+
+    _peerRelayedTx(&info, tx);
+}
+
+const BRBloomFilter *BRPeerManagerBloomFilterTest(BRPeerManager *manager, BRPeer *peer)
+{
+    pthread_mutex_lock(&manager->lock);
+    if (! manager->bloomFilter) _BRPeerManagerLoadBloomFilter(manager, peer);
+    pthread_mutex_unlock(&manager->lock);
+    return manager->bloomFilter;
+}
+
+size_t BRPeerManagerExpireTxPeersTest(BRPeerManager *manager, time_t now)
+{
+    size_t count;
+
+    pthread_mutex_lock(&manager->lock);
+    count = _BRPeerManagerExpireTxPeers(manager, now);
+    pthread_mutex_unlock(&manager->lock);
+    return count;
+}
+
+void BRPeerManagerSetChainTest(BRPeerManager *manager, BRMerkleBlock *blocks[], size_t blocksCount)
+{
+    for (size_t i = 0; i < blocksCount; i++) _BRPeerManagerAddHeader(manager, blocks[i]);
+    if (blocksCount > 0) manager->lastBlock = blocks[blocksCount - 1];
+}
+
+UInt256 BRPeerManagerAncestorTest(BRPeerManager *manager, UInt256 blockHash, uint32_t height)
+{
+    BRChainHeader *header = _BRChainHeaderAncestor(BRSetGet(manager->headers, &blockHash), height);
+
+    return (header) ? header->blockHash : UINT256_ZERO;
+}
+
+UInt256 BRPeerManagerSkipTest(BRPeerManager *manager, UInt256 blockHash, uint32_t *skipHeight)
+{
+    BRChainHeader *header = BRSetGet(manager->headers, &blockHash);
+
+    *skipHeight = (header) ? _BRSkipHeight(header->height) : 0;
+    return (header && header->skip) ? header->skip->blockHash : UINT256_ZERO;
+}
+
+size_t BRPeerManagerBlockLocatorsTest(BRPeerManager *manager, UInt256 locators[], size_t locatorsCount)
+{
+    return _BRPeerManagerBlockLocators(manager, locators, locatorsCount);
+}
+
+void BRPeerManagerAddBlockTest(BRPeerManager *manager, BRMerkleBlock *block)
+{
+    pthread_mutex_lock(&manager->lock);
+    BRSetAdd(manager->blocks, block);
+    _BRPeerManagerAddHeader(manager, block);
+    manager->lastBlock = block;
+    _BRPeerManagerStoreBlock(manager, block);
+    pthread_mutex_unlock(&manager->lock);
+}
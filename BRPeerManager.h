@@ -42,9 +42,24 @@ extern "C" {
 typedef struct BRPeerManagerStruct BRPeerManager;
 
 // returns a newly allocated BRPeerManager struct that must be freed by calling BRPeerManagerFree()
+// wallet may be NULL, in which case wallets are added with BRPeerManagerAddWallet()
 BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, uint32_t earliestKeyTime,
                                 BRMerkleBlock *blocks[], size_t blocksCount, const BRPeer peers[], size_t peersCount);
 
+// adds wallet to the wallets synced by manager, which share its connections, block chain and bloom filter
+// if connected, the bloom filter is updated to include the wallet's addresses without reconnecting
+// earliestKeyTime is the wallet's creation time, if it's before blocks manager already synced, call one of the rescan
+// functions afterward to find the wallet's earlier transactions
+void BRPeerManagerAddWallet(BRPeerManager *manager, BRWallet *wallet, uint32_t earliestKeyTime);
+
+// removes wallet from the wallets synced by manager, after which the wallet may be freed
+// published transactions that only wallet had are no longer published, and their callbacks are called with ECANCELED
+void BRPeerManagerRemoveWallet(BRPeerManager *manager, BRWallet *wallet);
+
+// writes up to count of the wallets synced by manager to wallets, and returns the number written, or the total number
+// of wallets if wallets is NULL
+size_t BRPeerManagerWallets(BRPeerManager *manager, BRWallet *wallets[], size_t count);
+
 // not thread-safe, set callbacks once before calling BRPeerManagerConnect()
 // info is a void pointer that will be passed along with each callback call
 // void syncStarted(void *) - called when blockchain syncing starts
@@ -69,6 +84,18 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
 
+// loads the chain headers saved in the header store file at path, creating the file if needed, and from then on keeps
+// it in step with the main chain - the stored chain is loaded from the first header that connects to one of the
+// checkpoints or blocks manager was created with, and is discarded if none do, an empty store is started with the chain
+// manager was created with, call before BRPeerManagerConnect()
+// returns true on success, or false and sets errno if the file can't be opened
+int BRPeerManagerSetHeaderStore(BRPeerManager *manager, const char *path);
+
+// loads the peer addresses and scores saved in the peer store file at path, and from then on saves them back to it,
+// known peers are then connected to right away, with DNS seeds only queried in the background, call before
+// BRPeerManagerConnect()
+void BRPeerManagerSetPeerStore(BRPeerManager *manager, const char *path);
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager);
 
@@ -108,11 +135,16 @@ size_t BRPeerManagerPeerCount(BRPeerManager *manager);
 // description of the peer most recently used to sync blockchain data
 const char *BRPeerManagerDownloadPeerName(BRPeerManager *manager);
 
+// writes merkleblock download statistics for up to count of the connected peers to stats, and returns the number
+// written, or the total number of connected peers if stats is NULL
+size_t BRPeerManagerSyncStats(BRPeerManager *manager, BRPeerStats stats[], size_t count);
+
 // publishes tx to bitcoin network (do not call BRTransactionFree() on tx afterward)
 void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *info,
                             void (*callback)(void *info, int error));
 
-// number of connected peers that have relayed the given unconfirmed transaction
+// number of connected peers that have relayed the given unconfirmed transaction, a confirmed transaction is no longer
+// tracked and counts as relayed by PEER_MAX_CONNECTIONS peers
 size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash);
 
 // return the BRChainParams used to create this peer manager
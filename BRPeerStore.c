@@ -0,0 +1,444 @@
+//
+//  BRPeerStore.c
+//
+//  Copyright (c) 2019 breadwallet LLC.
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRPeerStore.h"
+#include "BRCrypto.h"
+#include "BRKey.h"
+#include "BRSet.h"
+#include "BRInt.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+
+#define PEER_NEW_BUCKETS    64
+#define PEER_TRIED_BUCKETS  16
+#define PEER_BUCKET_SIZE    32
+#define PEER_GROUP_NEW      8 // new buckets the addresses of a single network group are spread over
+#define PEER_GROUP_TRIED    4 // tried buckets the addresses of a single network group are spread over
+#define PEER_SLOTS          ((PEER_NEW_BUCKETS + PEER_TRIED_BUCKETS)*PEER_BUCKET_SIZE)
+#define PEER_HORIZON        (30*24*60*60) // addresses not heard about in this long can be replaced
+#define PEER_RETRY_TIME     (10*60) // a failed peer is passed over for this long before it's retried
+#define PEER_STORE_MAGIC    0x53505242 // "BRPS"
+#define PEER_STORE_VERSION  1
+#define FILE_HEADER_SIZE    16 // magic, version, secret, record count
+#define RECORD_SIZE         55
+
+typedef struct {
+    BRPeer peer; // must be first, so the struct can be used with BRPeerHash() and BRPeerEq()
+    uint32_t lastTry, lastSuccess, banTime; // banTime is when a ban ends
+    uint32_t pingTime; // milliseconds, 0 if not measured
+    uint32_t throughput; // merkleblock bytes per second, 0 if not measured
+    uint16_t attempts, banScore; // attempts is failed connection attempts since the last success
+    uint8_t tried;
+} BRPeerEntry;
+
+struct BRPeerStoreStruct {
+    char *path;
+    uint32_t secret; // keeps which buckets an address lands in from being predicted by peers
+    BRPeerEntry slots[PEER_SLOTS]; // new table buckets followed by tried table buckets, empty slots have port 0
+    BRSet *index; // address and port -> entry in slots
+};
+
+// network group of address, the /16 of an IPv4 address or the /32 of an IPv6 address
+static uint32_t _BRPeerGroup(UInt128 address)
+{
+    if (address.u64[0] == 0 && address.u16[4] == 0 && address.u16[5] == 0xffff) { // IPv4 mapped IPv6 address
+        return 0x10000 | UInt16GetBE(&address.u8[12]);
+    }
+    
+    return UInt32GetBE(address.u8);
+}
+
+// index of the slot peer belongs in, in the tried table if tried is true, or else the new table
+static size_t _BRPeerStoreSlot(BRPeerStore *store, const BRPeer *peer, int tried)
+{
+    uint8_t key[sizeof(UInt128) + sizeof(uint16_t)], group[sizeof(uint32_t)*2];
+    uint32_t h, bucket;
+    
+    UInt128Set(key, peer->address);
+    UInt16SetLE(&key[sizeof(UInt128)], peer->port);
+    h = BRMurmur3_32(key, sizeof(key), store->secret);
+    UInt32SetLE(group, _BRPeerGroup(peer->address));
+    UInt32SetLE(&group[sizeof(uint32_t)], h % ((tried) ? PEER_GROUP_TRIED : PEER_GROUP_NEW));
+    bucket = BRMurmur3_32(group, sizeof(group), store->secret ^ (uint32_t)tried);
+    bucket = (tried) ? PEER_NEW_BUCKETS + bucket % PEER_TRIED_BUCKETS : bucket % PEER_NEW_BUCKETS;
+    return bucket*PEER_BUCKET_SIZE + BRMurmur3_32(key, sizeof(key), store->secret + bucket) % PEER_BUCKET_SIZE;
+}
+
+// true if entry is bad enough to give its slot to another address
+static int _BRPeerEntryIsTerrible(const BRPeerEntry *entry, uint64_t now)
+{
+    if (entry->peer.port == 0) return 1; // empty slot
+    if (entry->banTime > now) return 0; // keep bans until they end
+    if (entry->lastTry + 60 > now) return 0; // don't replace a peer that's being connected to
+    if (entry->peer.timestamp + PEER_HORIZON < now) return 1; // not heard about in a month
+    if (entry->lastSuccess == 0 && entry->attempts >= 3) return 1; // never connected after three tries
+    if (entry->lastSuccess + 7*24*60*60 < now && entry->attempts >= 10) return 1; // failing for over a week
+    return 0;
+}
+
+// higher scores are better, peers that have been connected to recently, respond quickly, and send merkleblocks fast
+// score highest
+static double _BRPeerEntryScore(const BRPeerEntry *entry, uint64_t now)
+{
+    uint64_t seen = (entry->lastSuccess > entry->peer.timestamp) ? entry->lastSuccess : entry->peer.timestamp;
+    double score = (entry->tried) ? 4.0 : 1.0;
+    
+    if (seen < now) score /= 1.0 + (double)(now - seen)/(24*60*60);
+    if (entry->lastTry > entry->lastSuccess && entry->lastTry + PEER_RETRY_TIME > now) score *= 0.01;
+    score *= pow(0.66, (entry->attempts < 8) ? entry->attempts : 8);
+    if (entry->pingTime > 0) score /= 1.0 + entry->pingTime/250.0;
+    if (entry->throughput > 0) score *= 1.0 + log2(1.0 + entry->throughput/50000.0);
+    return score;
+}
+
+// empties slot
+static void _BRPeerStoreClear(BRPeerStore *store, BRPeerEntry *slot)
+{
+    BRSetRemove(store->index, slot);
+    memset(slot, 0, sizeof(*slot));
+}
+
+// puts a copy of entry in its slot in the tried or new table, moving out the slot's current entry if force is true,
+// or otherwise only if it's terrible, returns the slot or NULL if entry wasn't stored
+static BRPeerEntry *_BRPeerStorePut(BRPeerStore *store, BRPeerEntry entry, uint64_t now, int force)
+{
+    BRPeerEntry *slot = &store->slots[_BRPeerStoreSlot(store, &entry.peer, entry.tried)], evicted = *slot;
+    
+    if (slot->peer.port != 0 && ! force && ! _BRPeerEntryIsTerrible(slot, now)) return NULL;
+    if (slot->peer.port != 0) _BRPeerStoreClear(store, slot);
+    *slot = entry;
+    BRSetAdd(store->index, slot);
+    
+    if (evicted.peer.port != 0 && evicted.tried && force) { // a tried peer pushed out goes back to the new table
+        evicted.tried = 0;
+        _BRPeerStorePut(store, evicted, now, 0);
+    }
+    
+    return slot;
+}
+
+// returns the entry for peer, adding it to the new table if needed, or NULL if there's no room for it
+static BRPeerEntry *_BRPeerStoreEntry(BRPeerStore *store, const BRPeer *peer, uint64_t now)
+{
+    BRPeerEntry *entry = BRSetGet(store->index, peer);
+    
+    if (! entry) {
+        BRPeerStoreAdd(store, peer, 1, now);
+        entry = BRSetGet(store->index, peer);
+    }
+    
+    return entry;
+}
+
+// loads the records in the file at path into store, ignoring the file if it's missing or isn't a valid peer store
+static void _BRPeerStoreLoad(BRPeerStore *store, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t hdr[FILE_HEADER_SIZE], rec[RECORD_SIZE];
+    BRPeerEntry entry;
+    size_t i, count = 0;
+    uint64_t now = (uint64_t)time(NULL);
+    
+    if (f && fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr) && UInt32GetLE(&hdr[0]) == PEER_STORE_MAGIC &&
+        UInt32GetLE(&hdr[4]) == PEER_STORE_VERSION) {
+        store->secret = UInt32GetLE(&hdr[8]);
+        count = UInt32GetLE(&hdr[12]);
+    }
+    
+    for (i = 0; i < count && fread(rec, 1, sizeof(rec), f) == sizeof(rec); i++) {
+        memset(&entry, 0, sizeof(entry));
+        entry.peer.address = UInt128Get(&rec[0]);
+        entry.peer.port = UInt16GetLE(&rec[16]);
+        entry.peer.services = UInt64GetLE(&rec[18]);
+        entry.peer.timestamp = UInt32GetLE(&rec[26]);
+        entry.lastTry = UInt32GetLE(&rec[30]);
+        entry.lastSuccess = UInt32GetLE(&rec[34]);
+        entry.banTime = UInt32GetLE(&rec[38]);
+        entry.pingTime = UInt32GetLE(&rec[42]);
+        entry.throughput = UInt32GetLE(&rec[46]);
+        entry.attempts = UInt16GetLE(&rec[50]);
+        entry.banScore = UInt16GetLE(&rec[52]);
+        entry.tried = (rec[54] != 0);
+        if (entry.peer.port != 0 && ! BRSetContains(store->index, &entry)) _BRPeerStorePut(store, entry, now, 0);
+    }
+    
+    if (f) fclose(f);
+}
+
+// returns a new peer store, loaded from the file at path if it exists, that must be freed by calling BRPeerStoreFree()
+// path may be NULL for a store that's only kept in memory
+// NOTE: BRPeerStore functions are not thread-safe
+BRPeerStore *BRPeerStoreNew(const char *path)
+{
+    BRPeerStore *store = calloc(1, sizeof(*store));
+    
+    assert(store != NULL);
+    store->index = BRSetNew(BRPeerHash, BRPeerEq, PEER_SLOTS);
+    store->secret = BRRand(0);
+    
+    if (path) {
+        store->path = strdup(path);
+        assert(store->path != NULL);
+        _BRPeerStoreLoad(store, path);
+    }
+    
+    return store;
+}
+
+// number of known peer addresses, including banned ones
+size_t BRPeerStoreCount(BRPeerStore *store)
+{
+    assert(store != NULL);
+    return BRSetCount(store->index);
+}
+
+// adds peer addresses to the new table, or refreshes the timestamps and services of ones already known
+void BRPeerStoreAdd(BRPeerStore *store, const BRPeer peers[], size_t peersCount, uint64_t now)
+{
+    BRPeerEntry entry, *e;
+    
+    assert(store != NULL);
+    assert(peers != NULL || peersCount == 0);
+    
+    for (size_t i = 0; i < peersCount; i++) {
+        if (UInt128IsZero(peers[i].address) || peers[i].port == 0) continue;
+        e = BRSetGet(store->index, &peers[i]);
+        
+        if (e) {
+            if (peers[i].timestamp > e->peer.timestamp) e->peer.timestamp = peers[i].timestamp;
+            if (e->peer.timestamp > now) e->peer.timestamp = now;
+            e->peer.services |= peers[i].services;
+        }
+        else {
+            memset(&entry, 0, sizeof(entry));
+            entry.peer = peers[i];
+            entry.peer.flags = 0;
+            if (entry.peer.timestamp > now) entry.peer.timestamp = now;
+            _BRPeerStorePut(store, entry, now, 0);
+        }
+    }
+}
+
+// records a connection attempt to peer
+void BRPeerStoreAttempt(BRPeerStore *store, const BRPeer *peer, uint64_t now)
+{
+    BRPeerEntry *entry;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    entry = BRSetGet(store->index, peer);
+    if (entry) entry->lastTry = (uint32_t)now;
+}
+
+// records a successful connection to peer, moving it to the tried table
+void BRPeerStoreGood(BRPeerStore *store, const BRPeer *peer, uint64_t now)
+{
+    BRPeerEntry entry, *e;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    e = BRSetGet(store->index, peer);
+    memset(&entry, 0, sizeof(entry));
+    entry.peer = *peer;
+    entry.peer.flags = 0;
+    
+    if (e) {
+        entry = *e;
+        entry.peer.services = peer->services;
+        _BRPeerStoreClear(store, e);
+    }
+    
+    entry.peer.timestamp = now;
+    entry.lastTry = entry.lastSuccess = (uint32_t)now;
+    entry.attempts = 0;
+    entry.tried = 1;
+    _BRPeerStorePut(store, entry, now, 1);
+}
+
+// records a failed connection or a connection that ended in an error
+void BRPeerStoreFailed(BRPeerStore *store, const BRPeer *peer)
+{
+    BRPeerEntry *entry;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    entry = BRSetGet(store->index, peer);
+    if (entry && entry->attempts < UINT16_MAX) entry->attempts++;
+}
+
+// records peer's measured ping time in seconds, and merkleblock throughput in bytes per second, 0 if not measured
+void BRPeerStoreSetStats(BRPeerStore *store, const BRPeer *peer, double pingTime, double throughput)
+{
+    BRPeerEntry *entry;
+    uint32_t ms = (pingTime > 0 && pingTime < 60) ? (uint32_t)(pingTime*1000) + 1 : 0,
+             bps = (throughput > 0 && throughput < UINT32_MAX) ? (uint32_t)throughput : 0;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    entry = BRSetGet(store->index, peer);
+    if (! entry) return;
+    
+    // average with earlier measurements, so one slow or fast session doesn't decide a peer's score
+    if (ms > 0) entry->pingTime = (entry->pingTime > 0) ? entry->pingTime/2 + ms/2 : ms;
+    if (bps > 0) entry->throughput = (entry->throughput > 0) ? entry->throughput/2 + bps/2 : bps;
+}
+
+// adds score to peer's misbehavior score, banning the peer for PEER_BAN_TIME once it reaches PEER_BAN_SCORE
+// returns true if peer is banned
+int BRPeerStoreMisbehaving(BRPeerStore *store, const BRPeer *peer, int score, uint64_t now)
+{
+    BRPeerEntry *entry;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    entry = _BRPeerStoreEntry(store, peer, now);
+    if (! entry) return 0;
+    if (entry->banTime > now) return 1; // already banned
+    entry->banScore = (entry->banScore + score < PEER_BAN_SCORE) ? entry->banScore + score : PEER_BAN_SCORE;
+    
+    if (entry->banScore >= PEER_BAN_SCORE) {
+        entry->banTime = (uint32_t)(now + PEER_BAN_TIME);
+        entry->banScore = 0;
+    }
+    
+    return (entry->banTime > now);
+}
+
+// true if peer is currently banned
+int BRPeerStoreIsBanned(BRPeerStore *store, const BRPeer *peer, uint64_t now)
+{
+    BRPeerEntry *entry;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    entry = BRSetGet(store->index, peer);
+    return (entry && entry->banTime > now);
+}
+
+// removes peer from the store
+void BRPeerStoreRemove(BRPeerStore *store, const BRPeer *peer)
+{
+    BRPeerEntry *entry;
+    
+    assert(store != NULL);
+    assert(peer != NULL);
+    entry = BRSetGet(store->index, peer);
+    if (entry) _BRPeerStoreClear(store, entry);
+}
+
+typedef struct {
+    const BRPeerEntry *entry;
+    double score;
+} BRPeerScore;
+
+// comparator for sorting peer scores, highest first
+static int _BRPeerScoreCompare(const void *a, const void *b)
+{
+    if (((const BRPeerScore *)a)->score < ((const BRPeerScore *)b)->score) return 1;
+    if (((const BRPeerScore *)a)->score > ((const BRPeerScore *)b)->score) return -1;
+    return 0;
+}
+
+// writes up to peersCount of the best scoring peers that aren't banned to peers, best first, and returns the number
+// written, or the total number of peers that aren't banned if peers is NULL
+size_t BRPeerStoreBest(BRPeerStore *store, BRPeer peers[], size_t peersCount, uint64_t now)
+{
+    BRPeerScore *scores;
+    size_t i, count = 0;
+    
+    assert(store != NULL);
+    scores = malloc(BRSetCount(store->index)*sizeof(*scores) + 1);
+    assert(scores != NULL);
+    
+    for (i = 0; i < PEER_SLOTS; i++) {
+        if (store->slots[i].peer.port == 0 || store->slots[i].banTime > now) continue;
+        scores[count].entry = &store->slots[i];
+        scores[count++].score = _BRPeerEntryScore(&store->slots[i], now);
+    }
+    
+    if (peers) {
+        qsort(scores, count, sizeof(*scores), _BRPeerScoreCompare);
+        if (count > peersCount) count = peersCount;
+        for (i = 0; i < count; i++) peers[i] = scores[i].entry->peer;
+    }
+    
+    free(scores);
+    return count;
+}
+
+// writes the store to its file, replacing the previous one in a single rename, returns true on success
+int BRPeerStoreSave(BRPeerStore *store)
+{
+    char tmp[(store->path) ? strlen(store->path) + 5 : 1];
+    uint8_t hdr[FILE_HEADER_SIZE], rec[RECORD_SIZE];
+    const BRPeerEntry *e;
+    FILE *f;
+    int r = 1;
+    
+    assert(store != NULL);
+    if (! store->path) return 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", store->path);
+    f = fopen(tmp, "wb");
+    if (! f) return 0;
+    UInt32SetLE(&hdr[0], PEER_STORE_MAGIC);
+    UInt32SetLE(&hdr[4], PEER_STORE_VERSION);
+    UInt32SetLE(&hdr[8], store->secret);
+    UInt32SetLE(&hdr[12], (uint32_t)BRSetCount(store->index));
+    if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) r = 0;
+    
+    for (size_t i = 0; r && i < PEER_SLOTS; i++) {
+        e = &store->slots[i];
+        if (e->peer.port == 0) continue;
+        UInt128Set(&rec[0], e->peer.address);
+        UInt16SetLE(&rec[16], e->peer.port);
+        UInt64SetLE(&rec[18], e->peer.services);
+        UInt32SetLE(&rec[26], (uint32_t)e->peer.timestamp);
+        UInt32SetLE(&rec[30], e->lastTry);
+        UInt32SetLE(&rec[34], e->lastSuccess);
+        UInt32SetLE(&rec[38], e->banTime);
+        UInt32SetLE(&rec[42], e->pingTime);
+        UInt32SetLE(&rec[46], e->throughput);
+        UInt16SetLE(&rec[50], e->attempts);
+        UInt16SetLE(&rec[52], e->banScore);
+        rec[54] = e->tried;
+        if (fwrite(rec, 1, sizeof(rec), f) != sizeof(rec)) r = 0;
+    }
+    
+    if (fclose(f) != 0) r = 0;
+    if (r && rename(tmp, store->path) != 0) r = 0;
+    if (! r) remove(tmp);
+    return r;
+}
+
+// frees memory allocated for store
+void BRPeerStoreFree(BRPeerStore *store)
+{
+    assert(store != NULL);
+    BRSetFree(store->index);
+    if (store->path) free(store->path);
+    free(store);
+}
@@ -0,0 +1,94 @@
+//
+//  BRPeerStore.h
+//
+//  Copyright (c) 2019 breadwallet LLC.
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRPeerStore_h
+#define BRPeerStore_h
+
+#include "BRPeer.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// known peer addresses, scored by how recently and how well they've served us, with misbehaving peers banned for a time
+//
+// addresses heard about from DNS seeds or relayed by other peers go in the "new" table, and are moved to the "tried"
+// table once a connection to them succeeds. each table is a fixed number of buckets, and the buckets an address can
+// land in are picked by a secret hash of its network group, so peers flooding us with addresses from a few networks
+// can only fill a few buckets and can't push out addresses we've connected to before
+
+#define PEER_BAN_SCORE 100 // misbehavior score at which a peer is banned
+#define PEER_BAN_TIME  (24*60*60) // seconds a peer stays banned
+
+typedef struct BRPeerStoreStruct BRPeerStore;
+
+// returns a new peer store, loaded from the file at path if it exists, that must be freed by calling BRPeerStoreFree()
+// path may be NULL for a store that's only kept in memory
+// NOTE: BRPeerStore functions are not thread-safe
+BRPeerStore *BRPeerStoreNew(const char *path);
+
+// number of known peer addresses, including banned ones
+size_t BRPeerStoreCount(BRPeerStore *store);
+
+// adds peer addresses to the new table, or refreshes the timestamps and services of ones already known
+void BRPeerStoreAdd(BRPeerStore *store, const BRPeer peers[], size_t peersCount, uint64_t now);
+
+// records a connection attempt to peer
+void BRPeerStoreAttempt(BRPeerStore *store, const BRPeer *peer, uint64_t now);
+
+// records a successful connection to peer, moving it to the tried table
+void BRPeerStoreGood(BRPeerStore *store, const BRPeer *peer, uint64_t now);
+
+// records a failed connection or a connection that ended in an error
+void BRPeerStoreFailed(BRPeerStore *store, const BRPeer *peer);
+
+// records peer's measured ping time in seconds, and merkleblock throughput in bytes per second, 0 if not measured
+void BRPeerStoreSetStats(BRPeerStore *store, const BRPeer *peer, double pingTime, double throughput);
+
+// adds score to peer's misbehavior score, banning the peer for PEER_BAN_TIME once it reaches PEER_BAN_SCORE
+// returns true if peer is banned
+int BRPeerStoreMisbehaving(BRPeerStore *store, const BRPeer *peer, int score, uint64_t now);
+
+// true if peer is currently banned
+int BRPeerStoreIsBanned(BRPeerStore *store, const BRPeer *peer, uint64_t now);
+
+// removes peer from the store
+void BRPeerStoreRemove(BRPeerStore *store, const BRPeer *peer);
+
+// writes up to peersCount of the best scoring peers that aren't banned to peers, best first, and returns the number
+// written, or the total number of peers that aren't banned if peers is NULL
+size_t BRPeerStoreBest(BRPeerStore *store, BRPeer peers[], size_t peersCount, uint64_t now);
+
+// writes the store to its file, replacing the previous one in a single rename, returns true on success
+int BRPeerStoreSave(BRPeerStore *store);
+
+// frees memory allocated for store
+void BRPeerStoreFree(BRPeerStore *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRPeerStore_h
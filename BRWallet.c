@@ -26,11 +26,14 @@
 #include "BRSet.h"
 #include "BRAddress.h"
 #include "BRArray.h"
+#include "BRCrypto.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <float.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <assert.h>
 
 inline static size_t _pkhHash(const void *pkh)
@@ -51,268 +54,2439 @@ inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
     return (fee > standardFee) ? fee : standardFee;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const UInt160 *chain)
+#define UTXO_TYPE_P2PKH  0
+#define UTXO_TYPE_P2WPKH 1
+#define BNB_MAX_TRIES    100000
+
+inline static uint8_t _utxoScriptType(const uint8_t *script, size_t scriptLen)
+{
+    return (script && scriptLen > 0 && script[0] == OP_0) ? UTXO_TYPE_P2WPKH : UTXO_TYPE_P2PKH;
+}
+
+// estimated virtual size of an input spending an output of the given type, rounded up from BRTransactionVSize()
+inline static size_t _utxoInputVSize(uint8_t type)
+{
+    return (type == UTXO_TYPE_P2WPKH) ? (TX_INPUT_SIZE + 1 + 3)/4 : TX_INPUT_SIZE + 1;
+}
+
+// fee for the given virtual size, without rounding, never below the standard fee rate
+inline static uint64_t _vsizeFee(uint64_t feePerKb, size_t vsize)
+{
+    if (feePerKb < TX_FEE_PER_KB) feePerKb = TX_FEE_PER_KB;
+    return (vsize*feePerKb + 999)/1000;
+}
+
+typedef struct {
+    BRUTXO o;
+    uint64_t amount;
+    uint32_t height;
+    uint32_t path;
+    uint8_t type;
+} BRUTXOIndexEntry;
+
+// struct-of-arrays index of spendable outputs, ordered by amount, so coin selection doesn't need any tx lookups
+typedef struct {
+    BRUTXO *outpoints;
+    uint64_t *amounts;
+    uint32_t *heights;
+    uint32_t *paths; // BIP32 chain in the high bit, address index in the remaining bits, UINT32_MAX if unknown
+    uint8_t *types;
+    uint64_t total;
+    size_t changed; // lowest position changed since outpoints were last copied to a wallet view
+} BRUTXOIndex;
+
+static void _BRUTXOIndexInit(BRUTXOIndex *idx, size_t capacity)
+{
+    array_new(idx->outpoints, capacity);
+    array_new(idx->amounts, capacity);
+    array_new(idx->heights, capacity);
+    array_new(idx->paths, capacity);
+    array_new(idx->types, capacity);
+    idx->total = 0;
+    idx->changed = 0;
+}
+
+static void _BRUTXOIndexFree(BRUTXOIndex *idx)
+{
+    array_free(idx->outpoints);
+    array_free(idx->amounts);
+    array_free(idx->heights);
+    array_free(idx->paths);
+    array_free(idx->types);
+}
+
+inline static size_t _BRUTXOIndexCount(const BRUTXOIndex *idx)
+{
+    return array_count(idx->amounts);
+}
+
+// position of the first entry with an amount not less than the given amount (binary search)
+static size_t _BRUTXOIndexLowerBound(const BRUTXOIndex *idx, uint64_t amount)
+{
+    size_t lo = 0, hi = array_count(idx->amounts), mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (idx->amounts[mid] < amount) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    return lo;
+}
+
+static void _BRUTXOIndexAdd(BRUTXOIndex *idx, BRUTXOIndexEntry e)
+{
+    size_t i = _BRUTXOIndexLowerBound(idx, e.amount + 1); // insert after any entries with equal amounts
+    
+    array_insert(idx->outpoints, i, e.o);
+    array_insert(idx->amounts, i, e.amount);
+    array_insert(idx->heights, i, e.height);
+    array_insert(idx->paths, i, e.path);
+    array_insert(idx->types, i, e.type);
+    idx->total += e.amount;
+    if (i < idx->changed) idx->changed = i;
+}
+
+// removes the entry for the given outpoint and amount and writes it to removed, returns true if it was found
+static int _BRUTXOIndexRemove(BRUTXOIndex *idx, BRUTXO o, uint64_t amount, BRUTXOIndexEntry *removed)
+{
+    size_t i = _BRUTXOIndexLowerBound(idx, amount), count = array_count(idx->amounts);
+    
+    while (i < count && idx->amounts[i] == amount && ! BRUTXOEq(&idx->outpoints[i], &o)) i++;
+    if (i >= count || idx->amounts[i] != amount) return 0;
+    *removed = (BRUTXOIndexEntry) { idx->outpoints[i], idx->amounts[i], idx->heights[i], idx->paths[i], idx->types[i] };
+    array_rm(idx->outpoints, i);
+    array_rm(idx->amounts, i);
+    array_rm(idx->heights, i);
+    array_rm(idx->paths, i);
+    array_rm(idx->types, i);
+    idx->total -= amount;
+    if (i < idx->changed) idx->changed = i;
+    return 1;
+}
+
+// effective value of an index entry: its amount less the fee to spend it, which may be zero or negative
+inline static int64_t _BRUTXOIndexEffectiveValue(const BRUTXOIndex *idx, size_t i, uint64_t feePerKb)
+{
+    return (int64_t)idx->amounts[i] - (int64_t)_vsizeFee(feePerKb, _utxoInputVSize(idx->types[i]));
+}
+
+// writes all index positions to sorted, ordered by descending effective value
+// amounts are sorted within each script type, so this is a merge of two sorted sequences
+static void _BRUTXOIndexSortEffective(const BRUTXOIndex *idx, uint64_t feePerKb, size_t sorted[], int64_t values[])
+{
+    size_t a = _BRUTXOIndexCount(idx), b = a, n = 0, count = a;
+    int64_t va = 0, vb = 0;
+    
+    while (n < count) {
+        while (a > 0 && idx->types[a - 1] != UTXO_TYPE_P2PKH) a--;
+        while (b > 0 && idx->types[b - 1] != UTXO_TYPE_P2WPKH) b--;
+        if (a > 0) va = _BRUTXOIndexEffectiveValue(idx, a - 1, feePerKb);
+        if (b > 0) vb = _BRUTXOIndexEffectiveValue(idx, b - 1, feePerKb);
+        
+        if (a > 0 && (b == 0 || va >= vb)) values[n] = va, sorted[n++] = --a;
+        else values[n] = vb, sorted[n++] = --b;
+    }
+}
+
+// branch-and-bound search for a subset of values (sorted descending, all positive) summing to [target, target + window]
+// writes the chosen positions in values to sel and returns the number written, or 0 if no solution was found
+static size_t _BRBranchAndBound(const int64_t values[], size_t count, uint64_t target, uint64_t window, size_t sel[])
+{
+    uint8_t *inc = calloc(count + 1, sizeof(*inc)), *best = calloc(count + 1, sizeof(*best));
+    size_t depth = 0, bestDepth = 0, n = 0, i;
+    uint64_t value = 0, available = 0, bestExcess = UINT64_MAX;
+    int backtrack;
+    
+    assert(inc != NULL && best != NULL);
+    for (i = 0; i < count; i++) available += (uint64_t)values[i];
+    
+    for (size_t tries = 0; tries < BNB_MAX_TRIES; tries++) {
+        backtrack = 0;
+        
+        if (value + available < target || value > target + window) backtrack = 1;
+        else if (value >= target) { // solution found, save it if it's the closest one yet
+            if (value - target < bestExcess) {
+                bestExcess = value - target;
+                bestDepth = depth;
+                memcpy(best, inc, depth);
+            }
+            
+            if (bestExcess == 0) break;
+            backtrack = 1;
+        }
+        
+        if (backtrack) { // walk back to the last included value, and try the branch where it's excluded
+            while (depth > 0 && ! inc[depth - 1]) available += (uint64_t)values[--depth];
+            if (depth == 0) break;
+            inc[depth - 1] = 0;
+            value -= (uint64_t)values[depth - 1];
+        }
+        else { // move forward, including the next value unless an equal previous value was already excluded
+            available -= (uint64_t)values[depth];
+            
+            if (depth > 0 && ! inc[depth - 1] && values[depth] == values[depth - 1]) inc[depth++] = 0;
+            else inc[depth] = 1, value += (uint64_t)values[depth++];
+        }
+    }
+    
+    for (i = 0; bestExcess != UINT64_MAX && i < bestDepth; i++) {
+        if (best[i]) sel[n++] = i;
+    }
+    
+    free(inc);
+    free(best);
+    return n;
+}
+
+#define UNDO_APPLIED 0
+#define UNDO_INVALID 1
+#define UNDO_PENDING 2
+
+#define TX_FLAG_INVALID    0x01
+#define TX_FLAG_PENDING    0x02 // pending regardless of the current time and block height
+#define TX_FLAG_UNVERIFIED 0x04 // tx or an unconfirmed input has a zero timestamp
+
+// status of an unconfirmed tx, folded together with the status of its unconfirmed inputs
+typedef struct {
+    uint32_t lockHeight; // pending while wallet->blockHeight + 1 < lockHeight
+    uint32_t lockTime; // pending while the current time < lockTime
+    uint8_t flags;
+} BRTxStatus;
+
+// memoized values for a tx in wallet->transactions, recomputed whenever the tx is re-applied to the balance, which
+// happens for every tx that follows a change in wallet->transactions, so it includes every tx that depends on a
+// changed one
+typedef struct {
+    UInt256 txHash; // must be first, so BRTransactionHash() and BRTransactionEq() can be used on it
+    BRTxStatus status; // all zero for confirmed transactions
+    uint64_t received, sent, fee, balanceAfter; // see BRWalletAmountReceivedFromTx() etc.
+} BRTxInfo;
+
+// summary of an archived transaction, which is otherwise only kept serialized in wallet->archive
+typedef struct {
+    BRTxInfo info; // must be first, so BRTransactionHash() and BRTransactionEq() can be used on it
+    uint32_t blockHeight, timestamp;
+    size_t offset; // position of the serialized tx in wallet->archive
+    uint32_t length;
+} BRArchivedTx;
+
+// copies of the spent outputs and used pkhs of archived transactions, which stay in spentOutputs and usedPKH or
+// foreignPKH
+typedef struct {
+    BRUTXO *spent;
+    UInt160 *used;
+    size_t spentCount, usedCount;
+} BRArchiveBase;
+
+// effects of applying a transaction to the wallet balance, so they can be rolled back when earlier history changes
+// the spent inputs, used pkhs, and added/removed utxos are kept on stacks shared by all transactions, in apply order
+typedef struct {
+    BRTransaction *tx;
+    uint64_t totalSent, totalReceived, settledBalance; // values before the transaction was applied
+    uint32_t spentCount, usedCount, addedCount, removedCount;
+    uint8_t status;
+} BRTxUndo;
+
+#define PKH_PATH_BLOCK_SIZE 1024
+
+// BIP32 path of a wallet address, kept in fixed size blocks so set members stay put as the chains grow
+typedef struct {
+    UInt160 pkh; // must be first, so the struct can be used with _pkhHash() and _pkhEq()
+    uint32_t path; // chain << 31 | index
+} BRPKHPath;
+
+// wallet transactions sending to or spending from a pkh, ordered by block height and then tx hash
+typedef struct {
+    UInt160 pkh; // must be first, so the struct can be used with _pkhHash() and _pkhEq()
+    BRTransaction **txs;
+} BRPKHTxs;
+
+#define WALLET_EVENT_TX_ADDED   0
+#define WALLET_EVENT_TX_UPDATED 1
+#define WALLET_EVENT_TX_DELETED 2
+
+#define NOTIFIER_STACK_SIZE (512 * 1024)
+
+// a callback queued for the notifier thread
+typedef struct {
+    uint8_t type;
+    BRTransaction *tx; // WALLET_EVENT_TX_ADDED
+    UInt256 txHash; // WALLET_EVENT_TX_UPDATED, WALLET_EVENT_TX_DELETED
+    uint32_t blockHeight, timestamp; // WALLET_EVENT_TX_UPDATED
+    int notifyUser, recommendRescan; // WALLET_EVENT_TX_DELETED
+} BRWalletEvent;
+
+#define VIEW_CHUNK_SIZE 256
+
+// block of VIEW_CHUNK_SIZE view array items, shared by every published view it's in until the writer changes it
+typedef struct {
+    size_t refs; // only changed while holding the wallet lock
+    uint8_t items[];
+} BRViewChunk;
+
+// copy-on-write array of fixed size items, so publishing a view only copies the chunks that changed
+typedef struct {
+    BRViewChunk **chunks;
+    size_t count, itemSize;
+} BRViewArray;
+
+static void _BRViewArrayInit(BRViewArray *a, size_t itemSize)
+{
+    array_new(a->chunks, 10);
+    a->count = 0;
+    a->itemSize = itemSize;
+}
+
+static void _BRViewArrayFree(BRViewArray *a)
+{
+    for (size_t i = 0; i < array_count(a->chunks); i++) {
+        if (--a->chunks[i]->refs == 0) free(a->chunks[i]);
+    }
+    
+    array_free(a->chunks);
+}
+
+// returns a copy of a that shares all its chunks
+static BRViewArray _BRViewArrayCopy(const BRViewArray *a)
+{
+    BRViewArray copy = *a;
+    
+    array_new(copy.chunks, array_count(a->chunks));
+    array_add_array(copy.chunks, a->chunks, array_count(a->chunks));
+    for (size_t i = 0; i < array_count(copy.chunks); i++) copy.chunks[i]->refs++;
+    return copy;
+}
+
+// updates a to match the first count items, any of which at or after start may have changed, copying only the chunks
+// whose contents actually differ
+static void _BRViewArraySync(BRViewArray *a, const void *items, size_t start, size_t count)
+{
+    size_t i, n, old, chunkCount = (count + VIEW_CHUNK_SIZE - 1)/VIEW_CHUNK_SIZE;
+    const uint8_t *p = items;
+    BRViewChunk *chunk;
+    
+    if (start > a->count) start = a->count;
+    
+    while (array_count(a->chunks) > chunkCount) {
+        chunk = a->chunks[array_count(a->chunks) - 1];
+        if (--chunk->refs == 0) free(chunk);
+        array_rm_last(a->chunks);
+    }
+    
+    for (i = start/VIEW_CHUNK_SIZE; i < chunkCount; i++) {
+        n = (count - i*VIEW_CHUNK_SIZE < VIEW_CHUNK_SIZE) ? count - i*VIEW_CHUNK_SIZE : VIEW_CHUNK_SIZE;
+        old = (a->count - i*VIEW_CHUNK_SIZE < VIEW_CHUNK_SIZE) ? a->count - i*VIEW_CHUNK_SIZE : VIEW_CHUNK_SIZE;
+        if (a->count < i*VIEW_CHUNK_SIZE) old = 0;
+        chunk = (i < array_count(a->chunks)) ? a->chunks[i] : NULL;
+        if (chunk && n == old && memcmp(chunk->items, &p[i*VIEW_CHUNK_SIZE*a->itemSize], n*a->itemSize) == 0) continue;
+        
+        if (! chunk || chunk->refs > 1) { // copy on write
+            if (chunk) chunk->refs--;
+            chunk = malloc(sizeof(*chunk) + VIEW_CHUNK_SIZE*a->itemSize);
+            assert(chunk != NULL);
+            chunk->refs = 1;
+            if (i < array_count(a->chunks)) a->chunks[i] = chunk;
+            else array_add(a->chunks, chunk);
+        }
+        
+        memcpy(chunk->items, &p[i*VIEW_CHUNK_SIZE*a->itemSize], n*a->itemSize);
+    }
+    
+    a->count = count;
+}
+
+inline static const void *_BRViewArrayItem(const BRViewArray *a, size_t i)
+{
+    return &a->chunks[i/VIEW_CHUNK_SIZE]->items[(i % VIEW_CHUNK_SIZE)*a->itemSize];
+}
+
+// writes up to count items from a to items, returns the number written, or a->count if items is NULL
+static size_t _BRViewArrayGet(const BRViewArray *a, void *items, size_t count)
+{
+    uint8_t *p = items;
+    size_t n;
+    
+    if (! items || a->count < count) count = a->count;
+    
+    for (size_t i = 0; items && i*VIEW_CHUNK_SIZE < count; i++) {
+        n = (count - i*VIEW_CHUNK_SIZE < VIEW_CHUNK_SIZE) ? count - i*VIEW_CHUNK_SIZE : VIEW_CHUNK_SIZE;
+        memcpy(&p[i*VIEW_CHUNK_SIZE*a->itemSize], a->chunks[i]->items, n*a->itemSize);
+    }
+    
+    return count;
+}
+
+// immutable snapshot of the wallet published after each write, so queries don't wait for the wallet lock
+typedef struct {
+    size_t refs; // readers using the view, guarded by wallet->viewLock
+    uint64_t balance, totalSent, totalReceived;
+    BRViewArray transactions, utxos, internalChain, externalChain;
+} BRWalletView;
+
+struct BRWalletStruct {
+    uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
+    uint64_t settledBalance; // balance after the last transaction that wasn't invalid or pending
+    uint64_t archivedBalance; // balance after the last archived transaction
+    uint32_t blockHeight;
+    BRUTXOIndex utxoIndex;
+    BRTxUndo *undo;
+    const BRTxInput **spentStack;
+    const uint8_t **usedStack;
+    BRUTXOIndexEntry *addedStack, *removedStack;
+    BRTransaction **transactions;
+    BRMasterPubKey masterPubKey;
+    int forkId;
+    UInt160 *internalChain, *externalChain;
+    uint64_t *internalBalances, *externalBalances; // unspent balance of each chain address, by address index
+    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs;
+    BRSet *usedPKH; // wallet pkhs that transactions send to
+    BRSet *foreignPKH; // other pkhs that transactions send to, moved to usedPKH if they turn up in the address chains
+    BRSet *allPKH; // BRPKHPath of every address in the chains, stored in pkhPathBlocks
+    BRSet *txInfo; // memoized BRTxInfo of each tx in wallet->transactions
+    BRSet *pkhTxs; // BRPKHTxs of every pkh that a tx in wallet->transactions sends to or spends from
+    BRPKHPath **pkhPathBlocks;
+    size_t pkhPathCount;
+    BRSet *archivedTx; // BRArchivedTx of every archived transaction
+    BRSet *rehydratedTx; // parsed copies of archived transactions, returned by BRWalletTransactionForHash()
+    uint8_t *archive; // serialized archived transactions
+    BRArchiveBase *archiveBases;
+    BRTransaction **archiveGarbage; // archived transactions to free once no published view can reference them
+    BRWalletView *view, nextView, **retiredViews; // published view, its successor, and replaced views still in use
+    size_t viewTxChanged; // lowest position in wallet->transactions changed since the last published view
+    void *callbackInfo;
+    void (*balanceChanged)(void *info, uint64_t balance);
+    void (*txAdded)(void *info, BRTransaction *tx);
+    void (*txsAdded)(void *info, BRTransaction *txs[], size_t txCount);
+    void (*txUpdated)(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight, uint32_t timestamp);
+    void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan);
+    void (*threadCleanup)(void *info);
+    uint32_t flushLatency; // milliseconds callbacks can be queued for the notifier thread, or 0 to call them directly
+    BRWalletEvent *events; // callbacks queued for the notifier thread, in the order they happened
+    uint64_t eventBalance; // latest balance to deliver with balanceChanged, if eventBalanceChanged is set
+    int eventBalanceChanged, notifierRunning, notifierDelivering; // notifierDelivering is set while it calls back
+    struct timespec eventDeadline; // when the oldest queued callback is due
+    pthread_t notifier;
+    pthread_mutex_t lock, viewLock, eventLock;
+    pthread_cond_t eventCond;
+};
+
+inline static void _BRWalletAddressFromHash160(BRWallet *wallet, char *addr, size_t addrLen, UInt160 h)
+{
+    if (wallet->forkId != 0) {
+        const uint8_t script[] = { OP_DUP, OP_HASH160, 20, h.u8[0], h.u8[1], h.u8[2], h.u8[3], h.u8[4], h.u8[5],
+                                   h.u8[6], h.u8[7], h.u8[8], h.u8[9], h.u8[10], h.u8[11], h.u8[12], h.u8[13], h.u8[14],
+                                   h.u8[15], h.u8[16], h.u8[17], h.u8[18], h.u8[19], OP_EQUALVERIFY, OP_CHECKSIG };
+        
+        BRAddressFromScriptPubKey(addr, addrLen, script, sizeof(script));
+    }
+    else BRAddressFromHash160(addr, addrLen, &h);
+}
+
+// BIP32 path of a wallet pkh, packed as chain << 31 | index, or UINT32_MAX if pkh isn't a wallet address
+inline static uint32_t _BRWalletPKHPath(BRWallet *wallet, const uint8_t *pkh)
+{
+    const BRPKHPath *p = (pkh) ? BRSetGet(wallet->allPKH, pkh) : NULL;
+    
+    return (p) ? p->path : UINT32_MAX;
+}
+
+// adds a newly generated wallet address to allPKH, along with its BIP32 path
+inline static void _BRWalletAddPKHPath(BRWallet *wallet, UInt160 pkh, uint32_t chain, uint32_t index)
+{
+    size_t i = wallet->pkhPathCount % PKH_PATH_BLOCK_SIZE;
+    BRPKHPath *block;
+    
+    if (i == 0) {
+        block = malloc(PKH_PATH_BLOCK_SIZE*sizeof(*block));
+        assert(block != NULL);
+        array_add(wallet->pkhPathBlocks, block);
+    }
+    
+    block = wallet->pkhPathBlocks[array_count(wallet->pkhPathBlocks) - 1];
+    block[i].pkh = pkh;
+    block[i].path = (chain << 31) | index;
+    BRSetAdd(wallet->allPKH, &block[i]);
+    wallet->pkhPathCount++;
+}
+
+// true if a transaction sends to pkh
+inline static int _BRWalletPKHIsMarked(BRWallet *wallet, const uint8_t *pkh)
+{
+    return BRSetContains(wallet->usedPKH, pkh) || BRSetContains(wallet->foreignPKH, pkh);
+}
+
+// adds pkh to usedPKH if it's a wallet address, otherwise to foreignPKH
+inline static void _BRWalletMarkPKH(BRWallet *wallet, const uint8_t *pkh)
+{
+    BRSetAdd((BRSetContains(wallet->allPKH, pkh)) ? wallet->usedPKH : wallet->foreignPKH, (void *)pkh);
+}
+
+inline static void _BRWalletUnmarkPKH(BRWallet *wallet, const uint8_t *pkh)
+{
+    if (! BRSetRemove(wallet->usedPKH, pkh)) BRSetRemove(wallet->foreignPKH, pkh);
+}
+
+// adds amount, which may be negative, to the unspent balance of the address with the given BIP32 path
+inline static void _BRWalletAddAddressBalance(BRWallet *wallet, uint32_t path, int64_t amount)
+{
+    uint64_t *balances = (path >> 31 == SEQUENCE_INTERNAL_CHAIN) ? wallet->internalBalances : wallet->externalBalances;
+    size_t index = path & 0x7fffffff;
+    
+    if (path == UINT32_MAX) return;
+    while (array_count(balances) <= index) array_add(balances, 0);
+    balances[index] += (uint64_t)amount;
+    if (path >> 31 == SEQUENCE_INTERNAL_CHAIN) wallet->internalBalances = balances;
+    else wallet->externalBalances = balances;
+}
+
+// selects utxo index positions to use as inputs for a transaction sending amount, and writes them to order
+// baseSize is the virtual size of the transaction without any inputs or change output
+// the first *bnbCount positions are a changeless branch-and-bound solution (with a fee-aware window of minAmount) if
+// one was found, followed by a fallback order: the smallest single output that can cover the amount and leave change,
+// then the rest by largest effective value first, so the fewest inputs are used
+// returns the number of positions written to order, which is all positions in the index
+static size_t _BRWalletSelectUTXOs(BRWallet *wallet, uint64_t amount, size_t baseSize, uint64_t minAmount,
+                                   size_t order[], size_t *bnbCount)
+{
+    BRUTXOIndex *idx = &wallet->utxoIndex;
+    size_t i, n = 0, positive = 0, larger = SIZE_MAX, count = _BRUTXOIndexCount(idx);
+    size_t *sorted = malloc((count + 1)*sizeof(*sorted)), *sel = malloc((count + 1)*sizeof(*sel));
+    int64_t *values = malloc((count + 1)*sizeof(*values));
+    uint8_t *used = calloc(count + 1, sizeof(*used));
+    // vsize rounding slack, witness flag, input count varint, and fee round-off in BRWalletCreateTxForOutputs()
+    uint64_t target = amount + _vsizeFee(wallet->feePerKb, baseSize + 4) + 200;
+    
+    assert(sorted != NULL && sel != NULL && values != NULL && used != NULL);
+    _BRUTXOIndexSortEffective(idx, wallet->feePerKb, sorted, values);
+    while (positive < count && values[positive] > 0) positive++;
+    *bnbCount = _BRBranchAndBound(values, positive, target, minAmount, sel);
+    
+    for (i = 0; i < *bnbCount; i++) {
+        order[n++] = sorted[sel[i]];
+        used[sel[i]] = 1;
+    }
+    
+    for (i = 0; i < positive && values[i] >= (int64_t)(target + minAmount); i++) {
+        if (! used[i]) larger = i; // smallest single output that leaves a change output
+    }
+    
+    if (larger != SIZE_MAX) order[n++] = sorted[larger], used[larger] = 1;
+    
+    for (i = 0; i < count; i++) {
+        if (! used[i]) order[n++] = sorted[i];
+    }
+    
+    free(used);
+    free(values);
+    free(sel);
+    free(sorted);
+    return n;
+}
+
+// ordering key for txs in the same block: the highest wallet chain path among tx outputs, so the internal chain comes
+// after the external chain and later addresses after earlier ones, or UINT32_MAX if no output is to a wallet address
+inline static uint32_t _BRWalletTxChainKey(BRWallet *wallet, const BRTransaction *tx)
+{
+    uint32_t path, key = 0;
+    int found = 0;
+    
+    for (size_t i = 0; i < tx->outCount; i++) {
+        path = _BRWalletPKHPath(wallet, BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen));
+        if (path == UINT32_MAX) continue;
+        if (! found || path > key) key = path;
+        found = 1;
+    }
+    
+    return (found) ? key : UINT32_MAX;
+}
+
+// wallet->transactions is bucketed by block height, lowest first, so a height's bucket is found by binary search
+// sets *start and *end to the range of positions holding txs with the given blockHeight
+inline static void _BRWalletTxBucket(BRWallet *wallet, uint32_t blockHeight, size_t *start, size_t *end)
+{
+    size_t lo = 0, hi = array_count(wallet->transactions), mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (wallet->transactions[mid]->blockHeight < blockHeight) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    *start = lo;
+    hi = array_count(wallet->transactions);
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (wallet->transactions[mid]->blockHeight <= blockHeight) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    *end = lo;
+}
+
+// position of tx in wallet->transactions, searching the bucket for blockHeight, or SIZE_MAX if it isn't there
+inline static size_t _BRWalletTxPosition(BRWallet *wallet, const BRTransaction *tx, uint32_t blockHeight)
+{
+    size_t start, end;
+    
+    _BRWalletTxBucket(wallet, blockHeight, &start, &end);
+    
+    for (size_t i = start; i < end; i++) {
+        if (wallet->transactions[i] == tx) return i;
+    }
+    
+    return SIZE_MAX;
+}
+
+typedef struct {
+    const BRTransaction *tx;
+    size_t i;
+} BRTxBucketRef;
+
+inline static int _BRTxBucketRefCompare(const void *a, const void *b)
+{
+    const BRTransaction *t1 = ((const BRTxBucketRef *)a)->tx, *t2 = ((const BRTxBucketRef *)b)->tx;
+    
+    return (t1 < t2) ? -1 : (t1 > t2) ? 1 : 0;
+}
+
+// min-heap of bucket-local indexes ordered by chain key, then by the existing position in the bucket
+inline static int _txHeapLess(const uint32_t keys[], size_t a, size_t b)
+{
+    return (keys[a] < keys[b] || (keys[a] == keys[b] && a < b));
+}
+
+inline static void _txHeapPush(size_t heap[], size_t *count, const uint32_t keys[], size_t i)
+{
+    size_t j = (*count)++, p;
+    
+    while (j > 0 && _txHeapLess(keys, i, heap[(p = (j - 1)/2)])) heap[j] = heap[p], j = p;
+    heap[j] = i;
+}
+
+inline static size_t _txHeapPop(size_t heap[], size_t *count, const uint32_t keys[])
+{
+    size_t top = heap[0], last = heap[--(*count)], j = 0, c;
+    
+    while ((c = 2*j + 1) < *count) {
+        if (c + 1 < *count && _txHeapLess(keys, heap[c + 1], heap[c])) c++;
+        if (! _txHeapLess(keys, heap[c], last)) break;
+        heap[j] = heap[c], j = c;
+    }
+    
+    if (*count > 0) heap[j] = last;
+    return top;
+}
+
+// orders the same height txs in wallet->transactions[start..end) so each tx comes after any tx in the bucket that it
+// spends from, using the dependency graph within the bucket, and otherwise by chain key, then by existing order
+// returns the first position that changed, or end if none did
+static size_t _BRWalletSortTxBucket(BRWallet *wallet, size_t start, size_t end)
+{
+    size_t i, j, k, n = end - start, heapCount = 0, first = end;
+    
+    if (n < 2) return end;
+    
+    BRTransaction **bucket = wallet->transactions + start, **sorted = malloc(n*sizeof(*sorted));
+    BRTxBucketRef *refs = malloc(n*sizeof(*refs)), ref, *r;
+    uint32_t *keys = malloc(n*sizeof(*keys));
+    size_t *inDegree = calloc(n, sizeof(*inDegree)), *offset = calloc(n + 2, sizeof(*offset)),
+           *heap = malloc(n*sizeof(*heap)), *parents, *children, *adj;
+    
+    assert(sorted != NULL && refs != NULL && keys != NULL && inDegree != NULL && offset != NULL && heap != NULL);
+    array_new(parents, n);
+    array_new(children, n);
+    
+    for (i = 0; i < n; i++) {
+        refs[i].tx = bucket[i], refs[i].i = i;
+        keys[i] = _BRWalletTxChainKey(wallet, bucket[i]);
+    }
+    
+    qsort(refs, n, sizeof(*refs), _BRTxBucketRefCompare);
+    
+    for (i = 0; i < n; i++) { // edges from each tx to the txs in the bucket that spend from it
+        for (j = 0; j < bucket[i]->inCount; j++) {
+            ref.tx = BRSetGet(wallet->allTx, &bucket[i]->inputs[j].txHash);
+            if (! ref.tx || ref.tx == bucket[i] || ref.tx->blockHeight != bucket[i]->blockHeight) continue;
+            r = bsearch(&ref, refs, n, sizeof(*refs), _BRTxBucketRefCompare);
+            if (! r) continue;
+            array_add(parents, r->i);
+            array_add(children, i);
+            offset[r->i + 2]++;
+            inDegree[i]++;
+        }
+    }
+    
+    // children of bucket tx k are adj[offset[k]..offset[k + 1]) once the edges are placed
+    adj = malloc((array_count(parents) + 1)*sizeof(*adj));
+    assert(adj != NULL);
+    for (i = 2; i < n + 2; i++) offset[i] += offset[i - 1];
+    for (i = 0; i < array_count(parents); i++) adj[offset[parents[i] + 1]++] = children[i];
+    
+    for (i = 0; i < n; i++) {
+        if (inDegree[i] == 0) _txHeapPush(heap, &heapCount, keys, i);
+    }
+    
+    for (i = 0; heapCount > 0; i++) {
+        k = _txHeapPop(heap, &heapCount, keys);
+        sorted[i] = bucket[k];
+        
+        for (j = offset[k]; j < offset[k + 1]; j++) {
+            if (--inDegree[adj[j]] == 0) _txHeapPush(heap, &heapCount, keys, adj[j]);
+        }
+    }
+    
+    assert(i == n); // tx hashes commit to their inputs, so the dependency graph can't have a cycle
+    
+    for (j = 0; i == n && j < n; j++) {
+        if (bucket[j] == sorted[j]) continue;
+        if (first == end) first = start + j;
+        bucket[j] = sorted[j];
+    }
+    
+    free(adj);
+    array_free(children);
+    array_free(parents);
+    free(heap);
+    free(offset);
+    free(inDegree);
+    free(keys);
+    free(refs);
+    free(sorted);
+    return first;
+}
+
+// true if tx spends an output of parent
+inline static int _BRWalletTxSpendsFrom(const BRTransaction *tx, const BRTransaction *parent)
+{
+    for (size_t i = 0; i < tx->inCount; i++) {
+        if (UInt256Eq(tx->inputs[i].txHash, parent->txHash)) return 1;
+    }
+    
+    return 0;
+}
+
+// true if a tx in the wallet spends from tx, as far as can be told without searching wallet->transactions, which
+// covers every tx applied to the balance and every invalid tx
+static int _BRWalletTxMayHaveSpender(BRWallet *wallet, const BRTransaction *tx)
+{
+    const BRTransaction *t;
+    
+    for (size_t i = 0; i < tx->outCount; i++) {
+        if (BRSetContains(wallet->spentOutputs, &((const BRUTXO) { tx->txHash, (uint32_t)i }))) return 1;
+    }
+    
+    for (t = BRSetIterate(wallet->invalidTx, NULL); t; t = BRSetIterate(wallet->invalidTx, t)) {
+        if (_BRWalletTxSpendsFrom(t, tx)) return 1;
+    }
+    
+    return 0;
+}
+
+// inserts tx into wallet->transactions, keeping wallet->transactions sorted by block height, oldest first, and in
+// dependency order within each block, same height txs that spend from tx must already be applied or invalid
+// tx is placed by chain key with a binary search, and then after any tx in its bucket that it spends from, the bucket
+// is only fully re-sorted when a tx that spends from tx may already be in it
+// returns the first position that changed
+static size_t _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+{
+    uint32_t key = _BRWalletTxChainKey(wallet, tx);
+    const BRTransaction *t;
+    size_t start, end, lo, hi, mid, i;
+    int hasParent = 0;
+    
+    _BRWalletTxBucket(wallet, tx->blockHeight, &start, &end);
+    
+    if (end > start && _BRWalletTxMayHaveSpender(wallet, tx)) {
+        array_insert(wallet->transactions, end, tx);
+        lo = _BRWalletSortTxBucket(wallet, start, end + 1);
+        return (lo < end) ? lo : end;
+    }
+    
+    for (i = 0; ! hasParent && i < tx->inCount; i++) {
+        t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        if (t && t != tx && t->blockHeight == tx->blockHeight) hasParent = 1;
+    }
+    
+    for (lo = start, hi = end; lo < hi;) { // after txs with the same key, as if appended and then sorted
+        mid = lo + (hi - lo)/2;
+        if (_BRWalletTxChainKey(wallet, wallet->transactions[mid]) <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    for (i = end; hasParent && i > lo; i--) { // move past the last tx in the bucket that tx spends from
+        if (_BRWalletTxSpendsFrom(tx, wallet->transactions[i - 1])) break;
+    }
+    
+    if (hasParent) lo = i;
+    array_insert(wallet->transactions, lo, tx);
+    return lo;
+}
+
+inline static int _BRWalletTxHeightCompare(const void *a, const void *b)
+{
+    const BRTransaction *tx1 = *(const BRTransaction * const *)a, *tx2 = *(const BRTransaction * const *)b;
+    
+    if (tx1->blockHeight != tx2->blockHeight) return (tx1->blockHeight < tx2->blockHeight) ? -1 : 1;
+    return memcmp(&tx1->txHash, &tx2->txHash, sizeof(tx1->txHash));
+}
+
+// sorts all of wallet->transactions at once, by block height and then dependency order within each block
+static void _BRWalletSortTxs(BRWallet *wallet)
+{
+    size_t start = 0, end, count = array_count(wallet->transactions);
+    
+    qsort(wallet->transactions, count, sizeof(*wallet->transactions), _BRWalletTxHeightCompare);
+    
+    while (start < count) {
+        for (end = start + 1; end < count && wallet->transactions[end]->blockHeight ==
+             wallet->transactions[start]->blockHeight; end++);
+        _BRWalletSortTxBucket(wallet, start, end);
+        start = end;
+    }
+}
+
+// compares tx to the query position (blockHeight, txHash), in the same order as _BRWalletTxHeightCompare()
+inline static int _BRWalletTxKeyCompare(const BRTransaction *tx, uint32_t blockHeight, UInt256 txHash)
+{
+    if (tx->blockHeight != blockHeight) return (tx->blockHeight < blockHeight) ? -1 : 1;
+    return memcmp(&tx->txHash, &txHash, sizeof(txHash));
+}
+
+// position of the first tx in txs that doesn't come before (blockHeight, txHash) (binary search)
+static size_t _BRWalletTxKeyLowerBound(BRTransaction *const txs[], size_t count, uint32_t blockHeight, UInt256 txHash)
+{
+    size_t lo = 0, hi = count, mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (_BRWalletTxKeyCompare(txs[mid], blockHeight, txHash) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    return lo;
+}
+
+// writes the distinct pkhs that tx sends to or spends from to pkhs, which must have room for inCount + outCount pkhs
+// spent pkhs come from the input addresses, so they're known even before the tx being spent from is registered
+static size_t _BRWalletTxPKHs(const BRTransaction *tx, UInt160 pkhs[])
+{
+    size_t i, j, n = 0;
+    const uint8_t *p;
+    UInt160 pkh;
+    
+    for (i = 0; i < tx->outCount + tx->inCount; i++) {
+        if (i < tx->outCount) {
+            p = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+            if (! p) continue;
+            pkh = UInt160Get(p);
+        }
+        else if (! BRAddressHash160(&pkh, tx->inputs[i - tx->outCount].address)) continue;
+        
+        for (j = 0; j < n && ! UInt160Eq(pkhs[j], pkh); j++);
+        if (j == n) pkhs[n++] = pkh;
+    }
+    
+    return n;
+}
+
+// adds tx to the pkhTxs list of each pkh it sends to or spends from
+static void _BRWalletIndexTx(BRWallet *wallet, BRTransaction *tx)
+{
+    UInt160 pkhs[tx->inCount + tx->outCount + 1];
+    size_t i, pos, count = _BRWalletTxPKHs(tx, pkhs);
+    BRPKHTxs *r;
+    
+    for (i = 0; i < count; i++) {
+        r = BRSetGet(wallet->pkhTxs, &pkhs[i]);
+        
+        if (! r) {
+            r = calloc(1, sizeof(*r));
+            assert(r != NULL);
+            r->pkh = pkhs[i];
+            array_new(r->txs, 1);
+            BRSetAdd(wallet->pkhTxs, r);
+        }
+        
+        pos = _BRWalletTxKeyLowerBound(r->txs, array_count(r->txs), tx->blockHeight, tx->txHash);
+        if (pos < array_count(r->txs) && r->txs[pos] == tx) continue;
+        array_insert(r->txs, pos, tx);
+    }
+}
+
+// removes tx from the pkhTxs lists, where it's positioned by the given blockHeight, which may differ from its current
+// one if tx is being moved
+static void _BRWalletUnindexTx(BRWallet *wallet, const BRTransaction *tx, uint32_t blockHeight)
+{
+    UInt160 pkhs[tx->inCount + tx->outCount + 1];
+    size_t i, pos, count = _BRWalletTxPKHs(tx, pkhs);
+    BRPKHTxs *r;
+    
+    for (i = 0; i < count; i++) {
+        r = BRSetGet(wallet->pkhTxs, &pkhs[i]);
+        if (! r) continue;
+        pos = _BRWalletTxKeyLowerBound(r->txs, array_count(r->txs), blockHeight, tx->txHash);
+        
+        if (pos >= array_count(r->txs) || r->txs[pos] != tx) { // blockHeight was changed without updating the wallet
+            for (pos = 0; pos < array_count(r->txs) && r->txs[pos] != tx; pos++);
+        }
+        
+        if (pos < array_count(r->txs)) array_rm(r->txs, pos);
+        if (array_count(r->txs) > 0) continue;
+        BRSetRemove(wallet->pkhTxs, r);
+        array_free(r->txs);
+        free(r);
+    }
+}
+
+// removes the given txs, which must already be in the archivedTx set, from the pkhTxs lists, compacting each affected
+// list once rather than removing from the front of it once per tx
+static void _BRWalletUnindexArchivedTxs(BRWallet *wallet, BRTransaction *txs[], size_t txCount)
+{
+    BRSet *lists = BRSetNew(_pkhHash, _pkhEq, txCount + 1);
+    BRPKHTxs *r, **all;
+    size_t i, j, n, count;
+    
+    for (i = 0; i < txCount; i++) {
+        UInt160 pkhs[txs[i]->inCount + txs[i]->outCount + 1];
+        
+        for (j = 0, count = _BRWalletTxPKHs(txs[i], pkhs); j < count; j++) {
+            r = BRSetGet(wallet->pkhTxs, &pkhs[j]);
+            if (r) BRSetAdd(lists, r);
+        }
+    }
+    
+    all = malloc((BRSetCount(lists) + 1)*sizeof(*all));
+    assert(all != NULL);
+    count = BRSetAll(lists, (void **)all, BRSetCount(lists));
+    
+    for (i = 0; i < count; i++) {
+        r = all[i];
+        
+        for (j = 0, n = 0; j < array_count(r->txs); j++) {
+            if (! BRSetContains(wallet->archivedTx, r->txs[j])) r->txs[n++] = r->txs[j];
+        }
+        
+        array_count(r->txs) = n;
+        if (n > 0) continue;
+        BRSetRemove(wallet->pkhTxs, r);
+        array_free(r->txs);
+        free(r);
+    }
+    
+    free(all);
+    BRSetFree(lists);
+}
+
+// non-threadsafe version of BRWalletContainsTransaction()
+static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
+{
+    int r = 0;
+    const uint8_t *pkh;
+    
+    for (size_t i = 0; ! r && i < tx->outCount; i++) {
+        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+        if (pkh && BRSetContains(wallet->allPKH, pkh)) r = 1;
+    }
+    
+    for (size_t i = 0; ! r && i < tx->inCount; i++) {
+        BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        uint32_t n = tx->inputs[i].index;
+        
+        pkh = (t && n < t->outCount) ? BRScriptPKH(t->outputs[n].script, t->outputs[n].scriptLen) : NULL;
+        if (pkh && BRSetContains(wallet->allPKH, pkh)) r = 1;
+    }
+    
+    return r;
+}
+
+// true if an unconfirmed tx can't be immediately spent (see BRWalletTransactionIsPending()), ignoring pending inputs
+static int _BRWalletTxIsPostdated(BRWallet *wallet, const BRTransaction *tx, time_t now)
+{
+    int r = (BRTransactionVSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
+    
+    for (size_t j = 0; ! r && j < tx->outCount; j++) {
+        if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) r = 1; // check that no outputs are dust
+    }
+    
+    for (size_t j = 0; ! r && j < tx->inCount; j++) {
+        if (tx->inputs[j].sequence < UINT32_MAX - 1) r = 1; // check for replace-by-fee
+        if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+            tx->lockTime > wallet->blockHeight + 1) r = 1; // future lockTime
+        if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) r = 1; // future lockTime
+        // TODO: XXX handle BIP68 check lock time verify rules
+    }
+    
+    return r;
+}
+
+static BRTxStatus _BRWalletTxStatus(BRWallet *wallet, const BRTransaction *tx);
+
+// computes the status of an unconfirmed tx from its own fields and the memoized status of its inputs
+static BRTxStatus _BRWalletComputeTxStatus(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxStatus s = { 0, 0, 0 }, p;
+    const BRTransaction *t;
+    size_t i;
+    
+    if (! BRSetContains(wallet->allTx, tx)) { // an unregistered tx is invalid if it spends already spent outputs
+        for (i = 0; ! (s.flags & TX_FLAG_INVALID) && i < tx->inCount; i++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[i])) s.flags |= TX_FLAG_INVALID;
+        }
+    }
+    else if (BRSetContains(wallet->invalidTx, tx)) s.flags |= TX_FLAG_INVALID;
+    
+    if (tx->timestamp == 0) s.flags |= TX_FLAG_UNVERIFIED;
+    if (BRTransactionVSize(tx) > TX_MAX_SIZE) s.flags |= TX_FLAG_PENDING; // check tx size is under TX_MAX_SIZE
+    
+    for (i = 0; i < tx->outCount; i++) {
+        if (tx->outputs[i].amount < TX_MIN_OUTPUT_AMOUNT) s.flags |= TX_FLAG_PENDING; // check for dust outputs
+    }
+    
+    for (i = 0; i < tx->inCount; i++) {
+        if (tx->inputs[i].sequence < UINT32_MAX - 1) s.flags |= TX_FLAG_PENDING; // check for replace-by-fee
+        if (tx->inputs[i].sequence == UINT32_MAX) continue;
+        s.lockTime = tx->lockTime; // future lockTime
+        if (tx->lockTime < TX_MAX_LOCK_HEIGHT) s.lockHeight = tx->lockTime;
+    }
+    
+    for (i = 0; i < tx->inCount; i++) { // fold in the status of unconfirmed inputs
+        t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        if (! t || t == tx) continue;
+        p = _BRWalletTxStatus(wallet, t);
+        s.flags |= p.flags;
+        if (p.lockHeight > s.lockHeight) s.lockHeight = p.lockHeight;
+        if (p.lockTime > s.lockTime) s.lockTime = p.lockTime;
+    }
+    
+    return s;
+}
+
+// status of tx, memoized for wallet transactions, confirmed transactions have no status flags
+static BRTxStatus _BRWalletTxStatus(BRWallet *wallet, const BRTransaction *tx)
+{
+    const BRTxInfo *info;
+    
+    if (tx->blockHeight != TX_UNCONFIRMED) return (BRTxStatus) { 0, 0, 0 };
+    info = BRSetGet(wallet->txInfo, tx);
+    return (info) ? info->status : _BRWalletComputeTxStatus(wallet, tx);
+}
+
+// total tx outputs to wallet addresses
+static uint64_t _BRWalletTxReceived(BRWallet *wallet, const BRTransaction *tx)
+{
+    uint64_t amount = 0;
+    const uint8_t *pkh;
+    
+    // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
+    for (size_t i = 0; i < tx->outCount; i++) {
+        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+        if (pkh && BRSetContains(wallet->allPKH, pkh)) amount += tx->outputs[i].amount;
+    }
+    
+    return amount;
+}
+
+// total wallet outputs spent by tx
+static uint64_t _BRWalletTxSent(BRWallet *wallet, const BRTransaction *tx)
+{
+    uint64_t amount = 0;
+    const BRTransaction *t;
+    const uint8_t *pkh;
+    uint32_t n;
+    
+    for (size_t i = 0; i < tx->inCount; i++) {
+        t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        n = tx->inputs[i].index;
+        if (! t || n >= t->outCount) continue;
+        pkh = BRScriptPKH(t->outputs[n].script, t->outputs[n].scriptLen);
+        if (pkh && BRSetContains(wallet->allPKH, pkh)) amount += t->outputs[n].amount;
+    }
+    
+    return amount;
+}
+
+// tx fee if all its inputs are from known transactions, UINT64_MAX otherwise
+static uint64_t _BRWalletTxFee(BRWallet *wallet, const BRTransaction *tx)
+{
+    uint64_t amount = 0;
+    const BRTransaction *t;
+    uint32_t n;
+    
+    for (size_t i = 0; i < tx->inCount && amount != UINT64_MAX; i++) {
+        t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        n = tx->inputs[i].index;
+        amount = (t && n < t->outCount) ? amount + t->outputs[n].amount : UINT64_MAX;
+    }
+    
+    for (size_t i = 0; i < tx->outCount && amount != UINT64_MAX; i++) {
+        amount -= tx->outputs[i].amount;
+    }
+    
+    return amount;
+}
+
+// recomputes the memoized values of a wallet tx after it's been applied to the balance
+static void _BRWalletUpdateTxInfo(BRWallet *wallet, const BRTransaction *tx, uint64_t balanceAfter)
+{
+    BRTxInfo *info = BRSetGet(wallet->txInfo, tx);
+    
+    if (! info) {
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->txHash = tx->txHash;
+        BRSetAdd(wallet->txInfo, info);
+    }
+    
+    info->status = (BRTxStatus) { 0, 0, 0 };
+    if (tx->blockHeight == TX_UNCONFIRMED) info->status = _BRWalletComputeTxStatus(wallet, tx);
+    info->received = _BRWalletTxReceived(wallet, tx);
+    info->sent = _BRWalletTxSent(wallet, tx);
+    info->fee = _BRWalletTxFee(wallet, tx);
+    info->balanceAfter = balanceAfter;
+}
+
+// memoized values of a wallet tx, or the summary of an archived one, or NULL if tx isn't registered
+inline static const BRTxInfo *_BRWalletTxInfo(BRWallet *wallet, const BRTransaction *tx)
+{
+    const BRTxInfo *info = BRSetGet(wallet->txInfo, tx);
+    
+    return (info) ? info : BRSetGet(wallet->archivedTx, tx);
+}
+
+// forgets the memoized values of a tx being removed from the wallet
+static void _BRWalletRemoveTxInfo(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxInfo *info = BRSetGet(wallet->txInfo, tx);
+    
+    if (info) {
+        BRSetRemove(wallet->txInfo, info);
+        free(info);
+    }
+}
+
+// recomputes the memoized values of the unconfirmed wallet transactions, after a non-wallet tx that they might spend
+// from was added or confirmed
+static void _BRWalletUpdateUnconfirmedInfo(BRWallet *wallet)
+{
+    size_t start, end;
+    
+    _BRWalletTxBucket(wallet, TX_UNCONFIRMED, &start, &end);
+    
+    for (size_t i = start; i < end; i++) {
+        _BRWalletUpdateTxInfo(wallet, wallet->transactions[i], wallet->balanceHist[i]);
+    }
+}
+
+// TX_STATUS_VALID, TX_STATUS_PENDING and TX_STATUS_VERIFIED flags for a tx with the given status at time now
+inline static uint8_t _BRWalletTxStatusFlags(BRWallet *wallet, BRTxStatus s, time_t now)
+{
+    int pending = ((s.flags & TX_FLAG_PENDING) || s.lockHeight > wallet->blockHeight + 1 || s.lockTime > now);
+    uint8_t r = 0;
+    
+    if (! (s.flags & TX_FLAG_INVALID)) r |= TX_STATUS_VALID;
+    if (pending) r |= TX_STATUS_PENDING;
+    if (! pending && ! (s.flags & (TX_FLAG_INVALID | TX_FLAG_UNVERIFIED))) r |= TX_STATUS_VERIFIED;
+    return r;
+}
+
+// applies the next transaction in wallet->transactions order to the balance, utxos, and spent outputs, and pushes its
+// effects onto the undo stacks
+static void _BRWalletApplyTx(BRWallet *wallet, BRTransaction *tx, time_t now)
+{
+    BRTxUndo u = { tx, wallet->totalSent, wallet->totalReceived, wallet->settledBalance, 0, 0, 0, 0,
+                   UNDO_APPLIED };
+    BRUTXOIndexEntry e;
+    BRTransaction *t;
+    const uint8_t *pkh;
+    size_t j;
+    
+    // check if any inputs are invalid or already spent
+    for (j = 0; tx->blockHeight == TX_UNCONFIRMED && u.status == UNDO_APPLIED && j < tx->inCount; j++) {
+        if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+            BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) u.status = UNDO_INVALID;
+    }
+    
+    if (u.status == UNDO_INVALID) {
+        BRSetAdd(wallet->invalidTx, tx);
+        array_add(wallet->balanceHist, wallet->balance);
+        array_add(wallet->undo, u);
+        return;
+    }
+    
+    // add inputs to spent output set, and remove any utxos they spend
+    for (j = 0; j < tx->inCount; j++) {
+        if (BRSetContains(wallet->spentOutputs, &tx->inputs[j])) continue;
+        BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        array_add(wallet->spentStack, &tx->inputs[j]);
+        u.spentCount++;
+        t = BRSetGet(wallet->allTx, &tx->inputs[j].txHash);
+        if (! t || tx->inputs[j].index >= t->outCount) continue;
+        
+        if (_BRUTXOIndexRemove(&wallet->utxoIndex, ((const BRUTXO) { t->txHash, tx->inputs[j].index }),
+                               t->outputs[tx->inputs[j].index].amount, &e)) {
+            array_add(wallet->removedStack, e);
+            u.removedCount++;
+            wallet->balance -= e.amount;
+            _BRWalletAddAddressBalance(wallet, e.path, -(int64_t)e.amount);
+        }
+    }
+    
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        if (_BRWalletTxIsPostdated(wallet, tx, now)) u.status = UNDO_PENDING;
+        
+        for (j = 0; u.status == UNDO_APPLIED && j < tx->inCount; j++) {
+            if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) u.status = UNDO_PENDING;
+        }
+        
+        if (u.status == UNDO_PENDING) {
+            BRSetAdd(wallet->pendingTx, tx);
+            array_add(wallet->balanceHist, wallet->balance);
+            array_add(wallet->undo, u);
+            return;
+        }
+    }
+    
+    // add outputs to UTXO set, unless an earlier tx already spent them (transaction ordering is not guaranteed)
+    // output pkhs that aren't in the wallet yet go in foreignPKH, so BRWalletUnusedAddrs() can tell when a new
+    // address has already received funds
+    // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
+    // TODO: don't add coin generation outputs < 100 blocks deep
+    // NOTE: balance/UTXOs will then need to be recalculated when last block changes
+    for (j = 0; j < tx->outCount; j++) {
+        if (tx->outputs[j].address[0] == '\0') continue;
+        pkh = BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen);
+        if (! pkh) continue;
+        
+        if (! _BRWalletPKHIsMarked(wallet, pkh)) {
+            _BRWalletMarkPKH(wallet, pkh);
+            array_add(wallet->usedStack, pkh);
+            u.usedCount++;
+        }
+        
+        if (! BRSetContains(wallet->allPKH, pkh) ||
+            BRSetContains(wallet->spentOutputs, &((const BRUTXO) { tx->txHash, (uint32_t)j }))) continue;
+        e = (BRUTXOIndexEntry) { { tx->txHash, (uint32_t)j }, tx->outputs[j].amount, tx->blockHeight,
+                                 _BRWalletPKHPath(wallet, pkh),
+                                 _utxoScriptType(tx->outputs[j].script, tx->outputs[j].scriptLen) };
+        _BRUTXOIndexAdd(&wallet->utxoIndex, e);
+        array_add(wallet->addedStack, e);
+        u.addedCount++;
+        wallet->balance += e.amount;
+        _BRWalletAddAddressBalance(wallet, e.path, (int64_t)e.amount);
+    }
+    
+    if (wallet->settledBalance < wallet->balance) wallet->totalReceived += wallet->balance - wallet->settledBalance;
+    if (wallet->balance < wallet->settledBalance) wallet->totalSent += wallet->settledBalance - wallet->balance;
+    wallet->settledBalance = wallet->balance;
+    array_add(wallet->balanceHist, wallet->balance);
+    array_add(wallet->undo, u);
+}
+
+// rolls back the effects of the last applied transaction
+static void _BRWalletUnapplyTx(BRWallet *wallet)
+{
+    size_t n = array_count(wallet->undo);
+    BRTxUndo u = wallet->undo[n - 1];
+    BRUTXOIndexEntry e;
+    
+    array_rm_last(wallet->undo);
+    array_rm_last(wallet->balanceHist);
+    
+    if (u.status == UNDO_INVALID) BRSetRemove(wallet->invalidTx, u.tx);
+    if (u.status == UNDO_PENDING) BRSetRemove(wallet->pendingTx, u.tx);
+    
+    while (u.addedCount-- > 0) {
+        e = wallet->addedStack[array_count(wallet->addedStack) - 1];
+        _BRUTXOIndexRemove(&wallet->utxoIndex, e.o, e.amount, &e);
+        _BRWalletAddAddressBalance(wallet, e.path, -(int64_t)e.amount);
+        array_rm_last(wallet->addedStack);
+    }
+    
+    while (u.usedCount-- > 0) {
+        _BRWalletUnmarkPKH(wallet, wallet->usedStack[array_count(wallet->usedStack) - 1]);
+        array_rm_last(wallet->usedStack);
+    }
+    
+    while (u.removedCount-- > 0) {
+        e = wallet->removedStack[array_count(wallet->removedStack) - 1];
+        _BRUTXOIndexAdd(&wallet->utxoIndex, e);
+        _BRWalletAddAddressBalance(wallet, e.path, (int64_t)e.amount);
+        array_rm_last(wallet->removedStack);
+    }
+    
+    while (u.spentCount-- > 0) {
+        BRSetRemove(wallet->spentOutputs, wallet->spentStack[array_count(wallet->spentStack) - 1]);
+        array_rm_last(wallet->spentStack);
+    }
+    
+    wallet->balance = (n > 1) ? wallet->balanceHist[n - 2] : wallet->archivedBalance;
+    wallet->totalSent = u.totalSent;
+    wallet->totalReceived = u.totalReceived;
+    wallet->settledBalance = u.settledBalance;
+}
+
+#if BITCOIN_DEBUG
+// recomputes the balance by replaying every transaction from scratch, and checks that it matches the incremental result
+static void _BRWalletCheckBalance(BRWallet *wallet, time_t now)
+{
+    size_t i, j, count = array_count(wallet->transactions), utxoCount = 0;
+    uint64_t balance = 0, prevBalance = 0, totalSent = 0, totalReceived = 0, *balanceHist;
+    BRSet *spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, count + 100),
+          *invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10),
+          *pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10),
+          *usedPKH = BRSetNew(_pkhHash, _pkhEq, count + 100),
+          *utxos = BRSetNew(BRUTXOHash, BRUTXOEq, count + 100), *indexed;
+    BRUTXO *utxoList;
+    BRTransaction *tx, *t;
+    const uint8_t *pkh;
+    int isInvalid, isPending;
+    
+    array_new(balanceHist, count);
+    array_new(utxoList, 100);
+    
+    for (i = 0; i < array_count(wallet->archiveBases); i++) { // archived txs left nothing unspent
+        const BRArchiveBase *base = &wallet->archiveBases[i];
+        
+        for (j = 0; j < base->spentCount; j++) BRSetAdd(spentOutputs, &base->spent[j]);
+        for (j = 0; j < base->usedCount; j++) BRSetAdd(usedPKH, &base->used[j]);
+    }
+    
+    for (tx = BRSetIterate(wallet->allTx, NULL); tx; tx = BRSetIterate(wallet->allTx, tx)) {
+        if (! BRSetContains(wallet->archivedTx, tx)) continue; // archived txs still spent from can have utxos
+        
+        for (j = 0; j < tx->outCount; j++) {
+            pkh = (tx->outputs[j].address[0] != '\0') ?
+                  BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen) : NULL;
+            if (! pkh || ! BRSetContains(wallet->allPKH, pkh) ||
+                BRSetContains(spentOutputs, &((const BRUTXO) { tx->txHash, (uint32_t)j }))) continue;
+            array_add(utxoList, ((const BRUTXO) { tx->txHash, (uint32_t)j }));
+            balance += tx->outputs[j].amount;
+        }
+    }
+    
+    assert(balance == wallet->archivedBalance);
+    prevBalance = balance;
+    totalSent = (count > 0) ? wallet->undo[0].totalSent : wallet->totalSent;
+    totalReceived = (count > 0) ? wallet->undo[0].totalReceived : wallet->totalReceived;
+    
+    for (i = 0; i < count; i++) {
+        tx = wallet->transactions[i];
+        assert(i == 0 || wallet->transactions[i - 1]->blockHeight <= tx->blockHeight);
+        
+        for (j = 0; j < tx->inCount; j++) { // same height txs that tx spends from must come before it
+            t = BRSetGet(wallet->allTx, &tx->inputs[j].txHash);
+            assert(! t || t->blockHeight != tx->blockHeight || _BRWalletTxPosition(wallet, t, t->blockHeight) < i ||
+                   _BRWalletTxPosition(wallet, t, t->blockHeight) == SIZE_MAX);
+        }
+        
+        for (j = 0, isInvalid = 0; tx->blockHeight == TX_UNCONFIRMED && ! isInvalid && j < tx->inCount; j++) {
+            if (BRSetContains(spentOutputs, &tx->inputs[j]) || BRSetContains(invalidTx, &tx->inputs[j].txHash)) {
+                isInvalid = 1;
+            }
+        }
+        
+        if (isInvalid) {
+            BRSetAdd(invalidTx, tx);
+            array_add(balanceHist, balance);
+            continue;
+        }
+        
+        for (j = 0; j < tx->inCount; j++) BRSetAdd(spentOutputs, &tx->inputs[j]);
+        isPending = (tx->blockHeight == TX_UNCONFIRMED && _BRWalletTxIsPostdated(wallet, tx, now));
+        
+        for (j = 0; tx->blockHeight == TX_UNCONFIRMED && ! isPending && j < tx->inCount; j++) {
+            if (BRSetContains(pendingTx, &tx->inputs[j].txHash)) isPending = 1;
+        }
+        
+        for (j = 0; ! isPending && j < tx->outCount; j++) {
+            pkh = (tx->outputs[j].address[0] != '\0') ?
+                  BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen) : NULL;
+            if (pkh) BRSetAdd(usedPKH, (void *)pkh);
+            if (! pkh || ! BRSetContains(wallet->allPKH, pkh)) continue;
+            array_add(utxoList, ((const BRUTXO) { tx->txHash, (uint32_t)j }));
+            balance += tx->outputs[j].amount;
+        }
+        
+        for (j = array_count(utxoList); j > 0; j--) { // check the entire UTXO set against the spent output set
+            if (! BRSetContains(spentOutputs, &utxoList[j - 1])) continue;
+            t = BRSetGet(wallet->allTx, &utxoList[j - 1].hash);
+            balance -= t->outputs[utxoList[j - 1].n].amount;
+            array_rm(utxoList, j - 1);
+        }
+        
+        if (isPending) BRSetAdd(pendingTx, tx);
+        array_add(balanceHist, balance);
+        if (isPending) continue;
+        if (prevBalance < balance) totalReceived += balance - prevBalance;
+        if (balance < prevBalance) totalSent += prevBalance - balance;
+        prevBalance = balance;
+    }
+    
+    indexed = BRSetNew(BRUTXOHash, BRUTXOEq, _BRUTXOIndexCount(&wallet->utxoIndex));
+    for (i = 0; i < _BRUTXOIndexCount(&wallet->utxoIndex); i++) BRSetAdd(indexed, &wallet->utxoIndex.outpoints[i]);
+    for (i = 0; i < array_count(utxoList); i++) BRSetAdd(utxos, &utxoList[i]);
+    utxoCount = array_count(utxoList);
+    
+    assert(balance == wallet->balance);
+    assert(totalSent == wallet->totalSent && totalReceived == wallet->totalReceived);
+    assert(array_count(balanceHist) == array_count(wallet->balanceHist));
+    for (i = 0; i < count; i++) assert(balanceHist[i] == wallet->balanceHist[i]);
+    assert(BRSetCount(utxos) == utxoCount && BRSetCount(indexed) == _BRUTXOIndexCount(&wallet->utxoIndex));
+    assert(utxoCount == BRSetCount(indexed) && BRSetCount(utxos) == BRSetCount(indexed));
+    for (i = 0; i < utxoCount; i++) assert(BRSetContains(indexed, &utxoList[i]));
+    assert(BRSetCount(spentOutputs) == BRSetCount(wallet->spentOutputs));
+    assert(BRSetCount(invalidTx) == BRSetCount(wallet->invalidTx));
+    assert(BRSetCount(pendingTx) == BRSetCount(wallet->pendingTx));
+    assert(BRSetCount(usedPKH) == BRSetCount(wallet->usedPKH) + BRSetCount(wallet->foreignPKH));
+    for (i = 0; i < array_count(wallet->usedStack); i++) assert(BRSetContains(wallet->allPKH, wallet->usedStack[i]) ==
+                                                                BRSetContains(wallet->usedPKH, wallet->usedStack[i]));
+    for (i = 0; i < count; i++) assert(BRSetContains(invalidTx, wallet->transactions[i]) ==
+                                       BRSetContains(wallet->invalidTx, wallet->transactions[i]));
+    for (i = 0; i < count; i++) assert(BRSetContains(pendingTx, wallet->transactions[i]) ==
+                                       BRSetContains(wallet->pendingTx, wallet->transactions[i]));
+    
+    for (i = 0; i < count; i++) { // memoized values match a fresh computation
+        const BRTxInfo *info = BRSetGet(wallet->txInfo, wallet->transactions[i]);
+        BRTxStatus s = _BRWalletTxStatus(wallet, wallet->transactions[i]);
+        
+        if (wallet->transactions[i]->blockHeight == TX_UNCONFIRMED) {
+            s = _BRWalletComputeTxStatus(wallet, wallet->transactions[i]);
+        }
+        
+        assert(info != NULL && info->balanceAfter == wallet->balanceHist[i]);
+        assert(info->status.flags == s.flags && info->status.lockHeight == s.lockHeight &&
+               info->status.lockTime == s.lockTime);
+        assert(info->received == _BRWalletTxReceived(wallet, wallet->transactions[i]));
+        assert(info->sent == _BRWalletTxSent(wallet, wallet->transactions[i]));
+        assert(info->fee == _BRWalletTxFee(wallet, wallet->transactions[i]));
+    }
+    
+    assert(BRSetCount(wallet->txInfo) == count);
+    
+    for (i = 0, j = 0; i < count; i++) { // every tx is in the pkhTxs list of each of its pkhs, and nowhere else
+        BRTransaction *tx = wallet->transactions[i];
+        UInt160 pkhs[tx->inCount + tx->outCount + 1];
+        size_t n = _BRWalletTxPKHs(tx, pkhs);
+        
+        for (size_t k = 0; k < n; k++, j++) {
+            const BRPKHTxs *r = BRSetGet(wallet->pkhTxs, &pkhs[k]);
+            size_t pos = (r) ? _BRWalletTxKeyLowerBound(r->txs, array_count(r->txs), tx->blockHeight, tx->txHash) : 0;
+            
+            assert(r != NULL && pos < array_count(r->txs) && r->txs[pos] == tx);
+        }
+    }
+    
+    BRPKHTxs *pkhTxs[BRSetCount(wallet->pkhTxs) + 1];
+    size_t pkhTxsCount = BRSetAll(wallet->pkhTxs, (void **)pkhTxs, BRSetCount(wallet->pkhTxs)), entries = 0;
+    
+    for (i = 0; i < pkhTxsCount; i++) entries += array_count(pkhTxs[i]->txs);
+    assert(entries == j);
+    
+    assert(BRSetCount(wallet->allPKH) == array_count(wallet->internalChain) + array_count(wallet->externalChain));
+    
+    for (i = 0; i < array_count(wallet->externalChain); i++) {
+        assert(_BRWalletPKHPath(wallet, wallet->externalChain[i].u8) == (SEQUENCE_EXTERNAL_CHAIN << 31 | i));
+    }
+    
+    uint64_t addrTotal = 0;
+    
+    for (i = 0; i < array_count(wallet->internalBalances); i++) addrTotal += wallet->internalBalances[i];
+    for (i = 0; i < array_count(wallet->externalBalances); i++) addrTotal += wallet->externalBalances[i];
+    assert(addrTotal == wallet->utxoIndex.total);
+    
+    for (i = 0; i < _BRUTXOIndexCount(&wallet->utxoIndex); i++) { // each utxo's address has at least its amount
+        uint32_t path = wallet->utxoIndex.paths[i];
+        const uint64_t *balances = (path >> 31) ? wallet->internalBalances : wallet->externalBalances;
+        
+        assert(path != UINT32_MAX && (path & 0x7fffffff) < array_count(balances));
+        assert(balances[path & 0x7fffffff] >= wallet->utxoIndex.amounts[i]);
+    }
+    BRSetFree(indexed);
+    BRSetFree(utxos);
+    BRSetFree(usedPKH);
+    BRSetFree(pendingTx);
+    BRSetFree(invalidTx);
+    BRSetFree(spentOutputs);
+    array_free(utxoList);
+    array_free(balanceHist);
+}
+#endif
+
+static void _BRWalletViewFree(BRWalletView *view)
 {
-    const uint8_t *pkh;
+    _BRViewArrayFree(&view->transactions);
+    _BRViewArrayFree(&view->utxos);
+    _BRViewArrayFree(&view->internalChain);
+    _BRViewArrayFree(&view->externalChain);
+    free(view);
+}
+
+// publishes the current wallet state as a new view, must be called while holding the wallet lock
+// readers of the previous view keep it until they release it, and it's freed by a later publish once unused
+static void _BRWalletPublishView(BRWallet *wallet)
+{
+    BRWalletView *next = &wallet->nextView, *view = calloc(1, sizeof(*view)), *old, **unused = NULL;
+    size_t i, count;
+    
+    assert(view != NULL);
+    next->balance = wallet->balance;
+    next->totalSent = wallet->totalSent;
+    next->totalReceived = wallet->totalReceived;
+    _BRViewArraySync(&next->transactions, wallet->transactions, wallet->viewTxChanged,
+                     array_count(wallet->transactions));
+    _BRViewArraySync(&next->utxos, wallet->utxoIndex.outpoints, wallet->utxoIndex.changed,
+                     _BRUTXOIndexCount(&wallet->utxoIndex));
+    _BRViewArraySync(&next->internalChain, wallet->internalChain, next->internalChain.count,
+                     array_count(wallet->internalChain)); // chains only ever grow
+    _BRViewArraySync(&next->externalChain, wallet->externalChain, next->externalChain.count,
+                     array_count(wallet->externalChain));
+    wallet->viewTxChanged = array_count(wallet->transactions);
+    wallet->utxoIndex.changed = _BRUTXOIndexCount(&wallet->utxoIndex);
+    *view = *next;
+    view->refs = 0;
+    view->transactions = _BRViewArrayCopy(&next->transactions);
+    view->utxos = _BRViewArrayCopy(&next->utxos);
+    view->internalChain = _BRViewArrayCopy(&next->internalChain);
+    view->externalChain = _BRViewArrayCopy(&next->externalChain);
+    
+#if BITCOIN_DEBUG
+    for (i = 0; i < array_count(wallet->transactions); i++) {
+        assert(*(BRTransaction **)_BRViewArrayItem(&view->transactions, i) == wallet->transactions[i]);
+    }
+    
+    for (i = 0; i < _BRUTXOIndexCount(&wallet->utxoIndex); i++) {
+        assert(BRUTXOEq(_BRViewArrayItem(&view->utxos, i), &wallet->utxoIndex.outpoints[i]));
+    }
+    
+    assert(view->transactions.count == array_count(wallet->transactions));
+    assert(view->utxos.count == _BRUTXOIndexCount(&wallet->utxoIndex));
+#endif
+    
+    pthread_mutex_lock(&wallet->viewLock);
+    old = wallet->view;
+    wallet->view = view;
+    if (old) array_add(wallet->retiredViews, old);
+    
+    for (i = array_count(wallet->retiredViews); i > 0; i--) { // collect replaced views no reader is using anymore
+        if (wallet->retiredViews[i - 1]->refs > 0) continue;
+        if (! unused) array_new(unused, array_count(wallet->retiredViews));
+        array_add(unused, wallet->retiredViews[i - 1]);
+        array_rm(wallet->retiredViews, i - 1);
+    }
+    
+    count = array_count(wallet->retiredViews);
+    pthread_mutex_unlock(&wallet->viewLock);
+    pthread_mutex_lock(&wallet->eventLock);
+    if (array_count(wallet->events) > 0 || wallet->notifierDelivering) count++; // txAdded may not have been called yet
+    pthread_mutex_unlock(&wallet->eventLock);
+    
+    if (count == 0) { // no reader or callback can still see archived transactions
+        for (i = 0; i < array_count(wallet->archiveGarbage); i++) BRTransactionFree(wallet->archiveGarbage[i]);
+        array_clear(wallet->archiveGarbage);
+    }
+    
+    count = (unused) ? array_count(unused) : 0;
+    for (i = 0; i < count; i++) _BRWalletViewFree(unused[i]); // chunk refs are only changed under the wallet lock
+    if (unused) array_free(unused);
+}
+
+// returns the latest published view, which must be released by calling _BRWalletReleaseView()
+// holds only the view lock, and only long enough to take a reference, so readers never wait for a wallet update
+static const BRWalletView *_BRWalletRetainView(BRWallet *wallet)
+{
+    BRWalletView *view;
+    
+    pthread_mutex_lock(&wallet->viewLock);
+    view = wallet->view;
+    view->refs++;
+    pthread_mutex_unlock(&wallet->viewLock);
+    return view;
+}
+
+static void _BRWalletReleaseView(BRWallet *wallet, const BRWalletView *view)
+{
+    pthread_mutex_lock(&wallet->viewLock);
+    ((BRWalletView *)view)->refs--;
+    pthread_mutex_unlock(&wallet->viewLock);
+}
+
+// updates the balance, utxos, and spent outputs after wallet->transactions changed at or after position pos
+// transactions before pos keep their previously applied effects, and later ones are rolled back and re-applied
+// unconfirmed transactions are always re-applied, since whether they're pending depends on time and block height
+static void _BRWalletUpdateBalance(BRWallet *wallet, size_t pos)
+{
+    BRTransaction *tx;
+    time_t now = time(NULL);
+    size_t count = array_count(wallet->transactions);
+    
+    if (pos < wallet->viewTxChanged) wallet->viewTxChanged = pos;
+    if (pos > array_count(wallet->undo)) pos = array_count(wallet->undo);
+    while (pos > 0 && wallet->transactions[pos - 1]->blockHeight == TX_UNCONFIRMED) pos--;
+    while (array_count(wallet->undo) > pos) _BRWalletUnapplyTx(wallet);
+    
+    while (array_count(wallet->undo) < count) {
+        tx = wallet->transactions[array_count(wallet->undo)];
+        _BRWalletApplyTx(wallet, tx, now);
+        _BRWalletUpdateTxInfo(wallet, tx, wallet->balance);
+    }
+    
+    assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
+#if BITCOIN_DEBUG
+    _BRWalletCheckBalance(wallet, now);
+#endif
+    _BRWalletPublishView(wallet);
+}
+
+// allocates an empty wallet with room for txCount transactions
+static BRWallet *_BRWalletAlloc(size_t txCount, BRMasterPubKey mpk, int forkId)
+{
+    BRWallet *wallet = calloc(1, sizeof(*wallet));
     
-    for (size_t i = array_count(chain); i > 0; i--) {
+    assert(wallet != NULL);
+    _BRUTXOIndexInit(&wallet->utxoIndex, 100);
+    array_new(wallet->undo, txCount + 100);
+    array_new(wallet->spentStack, txCount + 100);
+    array_new(wallet->usedStack, txCount + 100);
+    array_new(wallet->addedStack, 100);
+    array_new(wallet->removedStack, 100);
+    array_new(wallet->transactions, txCount + 100);
+    wallet->feePerKb = DEFAULT_FEE_PER_KB;
+    wallet->masterPubKey = mpk;
+    wallet->forkId = forkId;
+    array_new(wallet->internalChain, 100);
+    array_new(wallet->externalChain, 100);
+    array_new(wallet->internalBalances, 100);
+    array_new(wallet->externalBalances, 100);
+    array_new(wallet->balanceHist, txCount + 100);
+    wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
+    wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
+    wallet->usedPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
+    wallet->foreignPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
+    wallet->allPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
+    wallet->txInfo = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
+    wallet->pkhTxs = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
+    wallet->archivedTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    wallet->rehydratedTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    array_new(wallet->archive, 0);
+    array_new(wallet->archiveBases, 0);
+    array_new(wallet->archiveGarbage, 0);
+    array_new(wallet->pkhPathBlocks, 10);
+    _BRViewArrayInit(&wallet->nextView.transactions, sizeof(BRTransaction *));
+    _BRViewArrayInit(&wallet->nextView.utxos, sizeof(BRUTXO));
+    _BRViewArrayInit(&wallet->nextView.internalChain, sizeof(UInt160));
+    _BRViewArrayInit(&wallet->nextView.externalChain, sizeof(UInt160));
+    array_new(wallet->retiredViews, 10);
+    pthread_mutex_init(&wallet->lock, NULL);
+    pthread_mutex_init(&wallet->viewLock, NULL);
+    pthread_mutex_init(&wallet->eventLock, NULL);
+    pthread_cond_init(&wallet->eventCond, NULL);
+    array_new(wallet->events, 0);
+    _BRWalletPublishView(wallet);
+    return wallet;
+}
+
+// allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
+// forkId is 0 for bitcoin, 0x40 for b-cash
+BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk, int forkId)
+{
+    BRWallet *wallet = NULL;
+    BRTransaction *tx;
+    const uint8_t *pkh;
+
+    assert(transactions != NULL || txCount == 0);
+    wallet = _BRWalletAlloc(txCount, mpk, forkId);
+
+    for (size_t i = 0; transactions && i < txCount; i++) {
+        tx = transactions[i];
+        if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
+        BRSetAdd(wallet->allTx, tx);
+        array_add(wallet->transactions, tx);
+
         for (size_t j = 0; j < tx->outCount; j++) {
             pkh = BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen);
-            if (pkh && _pkhEq(pkh, &chain[i - 1])) return i - 1;
+            if (pkh) _BRWalletMarkPKH(wallet, pkh);
+        }
+    }
+    
+    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_EXTERNAL_CHAIN);
+    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, SEQUENCE_INTERNAL_CHAIN);
+    _BRWalletSortTxs(wallet);
+    for (size_t i = 0; i < array_count(wallet->transactions); i++) _BRWalletIndexTx(wallet, wallet->transactions[i]);
+    BRSetClear(wallet->usedPKH); // used pkhs are tracked along with balance
+    BRSetClear(wallet->foreignPKH);
+    _BRWalletUpdateBalance(wallet, 0);
+
+    if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
+        BRWalletFree(wallet);
+        wallet = NULL;
+    }
+    
+    return wallet;
+}
+
+// orders archived tx summaries by their position in the archive, which is the order they were archived in
+inline static int _BRArchivedTxOffsetCompare(const void *a, const void *b)
+{
+    const BRArchivedTx *x = *(const BRArchivedTx *const *)a, *y = *(const BRArchivedTx *const *)b;
+    
+    return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+#define WALLET_SNAPSHOT_MAGIC   0x53575242 // "BRWS"
+#define WALLET_SNAPSHOT_VERSION 2 // version 1 snapshots, without the archive, can still be loaded
+#define WALLET_SNAPSHOT_HEADER  (sizeof(uint32_t)*2 + sizeof(UInt256)) // magic, version, and checksum
+
+// a wallet snapshot is a little-endian header followed by a payload with only fixed width fields, so it can be read
+// in place from a memory mapped file:
+// magic, version, SHA256_2(payload)
+// forkId, master pubkey, blockHeight, balance, totalSent, totalReceived, settledBalance
+// external and internal chain pkhs, each preceded by a count
+// tx count, then each tx with its blockHeight, timestamp and serialized length
+// the same for unconfirmed non-wallet transactions kept for invalid tx checks
+// for each tx, its undo record followed by the input and output indexes it pushed onto the spent and used stacks, and
+// the utxo entries it added and removed
+// for each tx, the balance after it and its memoized status and amounts
+// utxo index, as its count followed by each of its sorted arrays
+// archived tx count, then each archived tx's hash, blockHeight, timestamp, serialized length and amounts, oldest first,
+// followed by the archive itself, the balance after it, and the spent outputs and used pkhs of archived txs, each
+// preceded by a count
+
+inline static void _snapshotSetU8(uint8_t *buf, size_t *off, uint8_t u)
+{
+    if (buf) buf[*off] = u;
+    *off += sizeof(uint8_t);
+}
+
+inline static void _snapshotSetU32(uint8_t *buf, size_t *off, uint32_t u)
+{
+    if (buf) UInt32SetLE(&buf[*off], u);
+    *off += sizeof(uint32_t);
+}
+
+inline static void _snapshotSetU64(uint8_t *buf, size_t *off, uint64_t u)
+{
+    if (buf) UInt64SetLE(&buf[*off], u);
+    *off += sizeof(uint64_t);
+}
+
+inline static void _snapshotSetBytes(uint8_t *buf, size_t *off, const void *bytes, size_t len)
+{
+    if (buf && len > 0) memcpy(&buf[*off], bytes, len);
+    *off += len;
+}
+
+inline static void _snapshotSetTx(uint8_t *buf, size_t *off, const BRTransaction *tx)
+{
+    size_t len = BRTransactionSerialize(tx, NULL, 0);
+    
+    _snapshotSetU32(buf, off, tx->blockHeight);
+    _snapshotSetU32(buf, off, tx->timestamp);
+    _snapshotSetU32(buf, off, (uint32_t)len);
+    if (buf) BRTransactionSerialize(tx, &buf[*off], len);
+    *off += len;
+}
+
+inline static void _snapshotSetEntry(uint8_t *buf, size_t *off, BRUTXOIndexEntry e)
+{
+    _snapshotSetBytes(buf, off, &e.o.hash, sizeof(UInt256));
+    _snapshotSetU32(buf, off, e.o.n);
+    _snapshotSetU64(buf, off, e.amount);
+    _snapshotSetU32(buf, off, e.height);
+    _snapshotSetU32(buf, off, e.path);
+    _snapshotSetU8(buf, off, e.type);
+}
+
+// writes the snapshot payload to buf, or only measures it if buf is NULL, returns the payload length
+static size_t _BRWalletSnapshotPayload(BRWallet *wallet, uint8_t *buf)
+{
+    size_t i, j, k, off = 0, spent = 0, used = 0, added = 0, removed = 0, count = array_count(wallet->transactions);
+    size_t allCount = BRSetCount(wallet->allTx);
+    BRTransaction *tx, **allTx = malloc(allCount*sizeof(*allTx));
+    const BRTxInfo *info;
+    const BRTxUndo *u;
+    
+    assert(allTx != NULL || allCount == 0);
+    
+    _snapshotSetU32(buf, &off, (uint32_t)wallet->forkId);
+    _snapshotSetU32(buf, &off, wallet->masterPubKey.fingerPrint);
+    _snapshotSetBytes(buf, &off, &wallet->masterPubKey.chainCode, sizeof(UInt256));
+    _snapshotSetBytes(buf, &off, wallet->masterPubKey.pubKey, sizeof(wallet->masterPubKey.pubKey));
+    _snapshotSetU32(buf, &off, wallet->blockHeight);
+    _snapshotSetU64(buf, &off, wallet->balance);
+    _snapshotSetU64(buf, &off, wallet->totalSent);
+    _snapshotSetU64(buf, &off, wallet->totalReceived);
+    _snapshotSetU64(buf, &off, wallet->settledBalance);
+    _snapshotSetU32(buf, &off, (uint32_t)array_count(wallet->externalChain));
+    _snapshotSetBytes(buf, &off, wallet->externalChain, array_count(wallet->externalChain)*sizeof(UInt160));
+    _snapshotSetU32(buf, &off, (uint32_t)array_count(wallet->internalChain));
+    _snapshotSetBytes(buf, &off, wallet->internalChain, array_count(wallet->internalChain)*sizeof(UInt160));
+    _snapshotSetU32(buf, &off, (uint32_t)count);
+    
+    for (i = 0; i < count; i++) _snapshotSetTx(buf, &off, wallet->transactions[i]);
+    allCount = BRSetAll(wallet->allTx, (void **)allTx, allCount);
+    qsort(allTx, allCount, sizeof(*allTx), _BRWalletTxHeightCompare); // so equal wallets give identical snapshots
+    for (i = 0, j = 0; i < allCount; i++) if (BRSetContains(wallet->archivedTx, allTx[i])) j++;
+    _snapshotSetU32(buf, &off, (uint32_t)(allCount - count - j));
+    
+    for (i = 0; i < allCount; i++) { // non-wallet transactions are the ones without a txInfo record or archive entry
+        if (! BRSetContains(wallet->txInfo, allTx[i]) && ! BRSetContains(wallet->archivedTx, allTx[i])) {
+            _snapshotSetTx(buf, &off, allTx[i]);
+        }
+    }
+    
+    free(allTx);
+    
+    for (i = 0; i < count; i++) {
+        u = &wallet->undo[i];
+        tx = u->tx;
+        _snapshotSetU64(buf, &off, u->totalSent);
+        _snapshotSetU64(buf, &off, u->totalReceived);
+        _snapshotSetU64(buf, &off, u->settledBalance);
+        _snapshotSetU32(buf, &off, u->spentCount);
+        _snapshotSetU32(buf, &off, u->usedCount);
+        _snapshotSetU32(buf, &off, u->addedCount);
+        _snapshotSetU32(buf, &off, u->removedCount);
+        _snapshotSetU8(buf, &off, u->status);
+        
+        for (j = 0; j < u->spentCount; j++, spent++) { // spent stack entries point into tx->inputs
+            _snapshotSetU32(buf, &off, (uint32_t)(wallet->spentStack[spent] - tx->inputs));
+        }
+        
+        for (j = 0; j < u->usedCount; j++, used++) { // used stack entries point into tx output scripts
+            for (k = 0; k < tx->outCount; k++) {
+                if (BRScriptPKH(tx->outputs[k].script, tx->outputs[k].scriptLen) == wallet->usedStack[used]) break;
+            }
+            
+            _snapshotSetU32(buf, &off, (uint32_t)k);
+        }
+        
+        for (j = 0; j < u->addedCount; j++) _snapshotSetEntry(buf, &off, wallet->addedStack[added++]);
+        for (j = 0; j < u->removedCount; j++) _snapshotSetEntry(buf, &off, wallet->removedStack[removed++]);
+    }
+    
+    for (i = 0; i < count; i++) {
+        info = BRSetGet(wallet->txInfo, wallet->transactions[i]);
+        _snapshotSetU64(buf, &off, wallet->balanceHist[i]);
+        _snapshotSetU32(buf, &off, info->status.lockHeight);
+        _snapshotSetU32(buf, &off, info->status.lockTime);
+        _snapshotSetU8(buf, &off, info->status.flags);
+        _snapshotSetU64(buf, &off, info->received);
+        _snapshotSetU64(buf, &off, info->sent);
+        _snapshotSetU64(buf, &off, info->fee);
+    }
+    
+    count = _BRUTXOIndexCount(&wallet->utxoIndex);
+    _snapshotSetU32(buf, &off, (uint32_t)count);
+    
+    for (i = 0; i < count; i++) {
+        _snapshotSetBytes(buf, &off, &wallet->utxoIndex.outpoints[i].hash, sizeof(UInt256));
+        _snapshotSetU32(buf, &off, wallet->utxoIndex.outpoints[i].n);
+    }
+    
+    for (i = 0; i < count; i++) _snapshotSetU64(buf, &off, wallet->utxoIndex.amounts[i]);
+    for (i = 0; i < count; i++) _snapshotSetU32(buf, &off, wallet->utxoIndex.heights[i]);
+    for (i = 0; i < count; i++) _snapshotSetU32(buf, &off, wallet->utxoIndex.paths[i]);
+    _snapshotSetBytes(buf, &off, wallet->utxoIndex.types, count);
+    
+    count = BRSetCount(wallet->archivedTx);
+    BRArchivedTx **archived = malloc((count + 1)*sizeof(*archived));
+    
+    assert(archived != NULL);
+    count = BRSetAll(wallet->archivedTx, (void **)archived, count);
+    qsort(archived, count, sizeof(*archived), _BRArchivedTxOffsetCompare);
+    _snapshotSetU32(buf, &off, (uint32_t)count);
+    
+    for (i = 0; i < count; i++) {
+        _snapshotSetBytes(buf, &off, &archived[i]->info.txHash, sizeof(UInt256));
+        _snapshotSetU32(buf, &off, archived[i]->blockHeight);
+        _snapshotSetU32(buf, &off, archived[i]->timestamp);
+        _snapshotSetU32(buf, &off, archived[i]->length);
+        _snapshotSetU64(buf, &off, archived[i]->info.received);
+        _snapshotSetU64(buf, &off, archived[i]->info.sent);
+        _snapshotSetU64(buf, &off, archived[i]->info.fee);
+        _snapshotSetU64(buf, &off, archived[i]->info.balanceAfter);
+    }
+    
+    free(archived);
+    _snapshotSetBytes(buf, &off, wallet->archive, array_count(wallet->archive)); // the sum of the lengths above
+    _snapshotSetU64(buf, &off, wallet->archivedBalance);
+    
+    for (i = 0, spent = 0, used = 0; i < array_count(wallet->archiveBases); i++) {
+        spent += wallet->archiveBases[i].spentCount;
+        used += wallet->archiveBases[i].usedCount;
+    }
+    
+    _snapshotSetU32(buf, &off, (uint32_t)spent);
+    
+    for (i = 0; i < array_count(wallet->archiveBases); i++) {
+        for (j = 0; j < wallet->archiveBases[i].spentCount; j++) {
+            _snapshotSetBytes(buf, &off, &wallet->archiveBases[i].spent[j].hash, sizeof(UInt256));
+            _snapshotSetU32(buf, &off, wallet->archiveBases[i].spent[j].n);
+        }
+    }
+    
+    _snapshotSetU32(buf, &off, (uint32_t)used);
+    
+    for (i = 0; i < array_count(wallet->archiveBases); i++) {
+        _snapshotSetBytes(buf, &off, wallet->archiveBases[i].used, wallet->archiveBases[i].usedCount*sizeof(UInt160));
+    }
+    
+    return off;
+}
+
+// writes a versioned, checksummed snapshot of the wallet to buf, for loading with BRWalletLoadSnapshot()
+// returns number of bytes written, or total bufLen needed if buf is NULL
+size_t BRWalletSerialize(BRWallet *wallet, uint8_t *buf, size_t bufLen)
+{
+    size_t len, off = 0;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    len = WALLET_SNAPSHOT_HEADER + _BRWalletSnapshotPayload(wallet, NULL);
+    
+    if (buf && len <= bufLen) {
+        _snapshotSetU32(buf, &off, WALLET_SNAPSHOT_MAGIC);
+        _snapshotSetU32(buf, &off, WALLET_SNAPSHOT_VERSION);
+        _BRWalletSnapshotPayload(wallet, &buf[WALLET_SNAPSHOT_HEADER]);
+        BRSHA256_2(&buf[off], &buf[WALLET_SNAPSHOT_HEADER], len - WALLET_SNAPSHOT_HEADER);
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return (! buf || len <= bufLen) ? len : 0;
+}
+
+// reads len bytes at *off, or returns NULL if that would run past the end of buf
+inline static const uint8_t *_snapshotGet(const uint8_t *buf, size_t bufLen, size_t *off, size_t len)
+{
+    const uint8_t *p = (*off <= bufLen && len <= bufLen - *off) ? &buf[*off] : NULL;
+    
+    if (p) *off += len;
+    return p;
+}
+
+inline static uint32_t _snapshotGetU32(const uint8_t *buf, size_t bufLen, size_t *off, int *ok)
+{
+    const uint8_t *p = _snapshotGet(buf, bufLen, off, sizeof(uint32_t));
+    
+    if (! p) *ok = 0;
+    return (p) ? UInt32GetLE(p) : 0;
+}
+
+inline static uint64_t _snapshotGetU64(const uint8_t *buf, size_t bufLen, size_t *off, int *ok)
+{
+    const uint8_t *p = _snapshotGet(buf, bufLen, off, sizeof(uint64_t));
+    
+    if (! p) *ok = 0;
+    return (p) ? UInt64GetLE(p) : 0;
+}
+
+inline static uint8_t _snapshotGetU8(const uint8_t *buf, size_t bufLen, size_t *off, int *ok)
+{
+    const uint8_t *p = _snapshotGet(buf, bufLen, off, sizeof(uint8_t));
+    
+    if (! p) *ok = 0;
+    return (p) ? *p : 0;
+}
+
+inline static BRUTXOIndexEntry _snapshotGetEntry(const uint8_t *buf, size_t bufLen, size_t *off, int *ok)
+{
+    const uint8_t *p = _snapshotGet(buf, bufLen, off, sizeof(UInt256));
+    BRUTXOIndexEntry e;
+    
+    if (! p) *ok = 0;
+    e.o.hash = (p) ? UInt256Get(p) : UINT256_ZERO;
+    e.o.n = _snapshotGetU32(buf, bufLen, off, ok);
+    e.amount = _snapshotGetU64(buf, bufLen, off, ok);
+    e.height = _snapshotGetU32(buf, bufLen, off, ok);
+    e.path = _snapshotGetU32(buf, bufLen, off, ok);
+    e.type = _snapshotGetU8(buf, bufLen, off, ok);
+    return e;
+}
+
+// parses a transaction written by _snapshotSetTx(), returns NULL if it's malformed
+static BRTransaction *_snapshotGetTx(const uint8_t *buf, size_t bufLen, size_t *off)
+{
+    int ok = 1;
+    uint32_t blockHeight = _snapshotGetU32(buf, bufLen, off, &ok), timestamp = _snapshotGetU32(buf, bufLen, off, &ok);
+    size_t len = _snapshotGetU32(buf, bufLen, off, &ok);
+    const uint8_t *p = (ok) ? _snapshotGet(buf, bufLen, off, len) : NULL;
+    BRTransaction *tx = (p) ? BRTransactionParse(p, len) : NULL;
+    
+    if (tx && ! BRTransactionIsSigned(tx)) BRTransactionFree(tx), tx = NULL;
+    if (tx) tx->blockHeight = blockHeight, tx->timestamp = timestamp;
+    return tx;
+}
+
+// reads the chain pkhs, with no EC derivation, returns false if buf is too short
+static int _BRWalletLoadSnapshotChain(BRWallet *wallet, const uint8_t *buf, size_t bufLen, size_t *off,
+                                      uint32_t internal)
+{
+    int ok = 1;
+    size_t count = _snapshotGetU32(buf, bufLen, off, &ok);
+    const uint8_t *p = (ok && count <= bufLen/sizeof(UInt160)) ?
+                       _snapshotGet(buf, bufLen, off, count*sizeof(UInt160)) : NULL;
+    UInt160 *chain = (internal == SEQUENCE_INTERNAL_CHAIN) ? wallet->internalChain : wallet->externalChain;
+    
+    if (! p) return 0;
+    array_set_capacity(chain, count + 100);
+    array_set_count(chain, count);
+    memcpy(chain, p, count*sizeof(UInt160));
+    for (size_t i = 0; i < count; i++) _BRWalletAddPKHPath(wallet, chain[i], internal, (uint32_t)i);
+    
+    if (internal == SEQUENCE_INTERNAL_CHAIN) wallet->internalChain = chain;
+    else wallet->externalChain = chain;
+    return 1;
+}
+
+// parses the archived tx with the given hash into allTx, if it's archived and not already there, returns false if the
+// archive is malformed
+static int _BRWalletLoadArchivedTx(BRWallet *wallet, UInt256 txHash)
+{
+    const BRArchivedTx *a = BRSetGet(wallet->archivedTx, &txHash);
+    BRTransaction *tx;
+    
+    if (! a || BRSetContains(wallet->allTx, a)) return 1;
+    tx = BRTransactionParse(&wallet->archive[a->offset], a->length);
+    if (tx && ! UInt256Eq(tx->txHash, txHash)) BRTransactionFree(tx), tx = NULL;
+    if (! tx) return 0;
+    tx->blockHeight = a->blockHeight;
+    tx->timestamp = a->timestamp;
+    BRSetAdd(wallet->allTx, tx);
+    return 1;
+}
+
+// reads the archived tx summaries, the archive, and the spent outputs and used pkhs of archived txs, returns false if
+// they're malformed
+static int _BRWalletLoadSnapshotArchive(BRWallet *wallet, const uint8_t *buf, size_t bufLen, size_t *off)
+{
+    BRArchiveBase base = { NULL, NULL, 0, 0 };
+    BRArchivedTx *a;
+    const uint8_t *p;
+    size_t i, count, len = 0;
+    int ok = 1;
+    
+    count = _snapshotGetU32(buf, bufLen, off, &ok);
+    if (ok && count > bufLen/(sizeof(UInt256) + sizeof(uint32_t)*3 + sizeof(uint64_t)*4)) ok = 0;
+    
+    for (i = 0; ok && i < count; i++) {
+        a = calloc(1, sizeof(*a));
+        assert(a != NULL);
+        p = _snapshotGet(buf, bufLen, off, sizeof(UInt256));
+        a->info.txHash = (p) ? UInt256Get(p) : UINT256_ZERO;
+        a->blockHeight = _snapshotGetU32(buf, bufLen, off, &ok);
+        a->timestamp = _snapshotGetU32(buf, bufLen, off, &ok);
+        a->length = _snapshotGetU32(buf, bufLen, off, &ok);
+        a->offset = len;
+        a->info.received = _snapshotGetU64(buf, bufLen, off, &ok);
+        a->info.sent = _snapshotGetU64(buf, bufLen, off, &ok);
+        a->info.fee = _snapshotGetU64(buf, bufLen, off, &ok);
+        a->info.balanceAfter = _snapshotGetU64(buf, bufLen, off, &ok);
+        len += a->length;
+        if (! p || len > bufLen || BRSetContains(wallet->archivedTx, a)) ok = 0;
+        if (! ok) free(a);
+        else BRSetAdd(wallet->archivedTx, a);
+    }
+    
+    p = (ok) ? _snapshotGet(buf, bufLen, off, len) : NULL;
+    if (! p) return 0;
+    array_set_capacity(wallet->archive, len);
+    array_add_array(wallet->archive, p, len);
+    wallet->archivedBalance = _snapshotGetU64(buf, bufLen, off, &ok);
+    base.spentCount = _snapshotGetU32(buf, bufLen, off, &ok);
+    if (ok && base.spentCount > bufLen/(sizeof(UInt256) + sizeof(uint32_t))) ok = 0;
+    base.spent = (ok) ? malloc((base.spentCount + 1)*sizeof(*base.spent)) : NULL;
+    
+    for (i = 0; ok && i < base.spentCount; i++) {
+        p = _snapshotGet(buf, bufLen, off, sizeof(UInt256));
+        base.spent[i].hash = (p) ? UInt256Get(p) : UINT256_ZERO;
+        base.spent[i].n = _snapshotGetU32(buf, bufLen, off, &ok);
+        if (! p) ok = 0;
+    }
+    
+    base.usedCount = (ok) ? _snapshotGetU32(buf, bufLen, off, &ok) : 0;
+    p = (ok && base.usedCount <= bufLen/sizeof(UInt160)) ?
+        _snapshotGet(buf, bufLen, off, base.usedCount*sizeof(UInt160)) : NULL;
+    base.used = (p) ? malloc((base.usedCount + 1)*sizeof(*base.used)) : NULL;
+    if (base.used) memcpy(base.used, p, base.usedCount*sizeof(UInt160));
+    
+    if (! base.used) { // malformed
+        free(base.spent);
+        return 0;
+    }
+    
+    for (i = 0; i < base.spentCount; i++) BRSetAdd(wallet->spentOutputs, &base.spent[i]);
+    for (i = 0; i < base.usedCount; i++) _BRWalletMarkPKH(wallet, base.used[i].u8);
+    array_add(wallet->archiveBases, base);
+    
+    // archived txs that wallet txs spend from, or that still have utxos, are kept in allTx
+    for (i = 0; ok && i < array_count(wallet->transactions); i++) {
+        BRTransaction *tx = wallet->transactions[i];
+        
+        for (size_t j = 0; ok && j < tx->inCount; j++) ok = _BRWalletLoadArchivedTx(wallet, tx->inputs[j].txHash);
+    }
+    
+    for (i = 0; ok && i < _BRUTXOIndexCount(&wallet->utxoIndex); i++) {
+        ok = _BRWalletLoadArchivedTx(wallet, wallet->utxoIndex.outpoints[i].hash);
+    }
+    
+    return ok;
+}
+
+// allocates and populates a BRWallet struct from a snapshot written by BRWalletSerialize(), which must be freed by
+// calling BRWalletFree(), buf may be a memory mapped file and isn't referenced after this returns
+// returns NULL if the snapshot is corrupt, from an unknown version, or was made for a different mpk or forkId
+BRWallet *BRWalletLoadSnapshot(const uint8_t *buf, size_t bufLen, BRMasterPubKey mpk, int forkId)
+{
+    BRWallet *wallet = NULL;
+    BRTransaction *tx;
+    BRTxInfo *info;
+    BRTxUndo u;
+    UInt256 md;
+    const uint8_t *p;
+    size_t i, j, count, off = 0;
+    uint32_t version;
+    int ok = 1;
+    
+    assert(buf != NULL || bufLen == 0);
+    if (! buf || bufLen < WALLET_SNAPSHOT_HEADER) return NULL;
+    version = UInt32GetLE(&buf[sizeof(uint32_t)]);
+    if (UInt32GetLE(buf) != WALLET_SNAPSHOT_MAGIC || version < 1 || version > WALLET_SNAPSHOT_VERSION) return NULL;
+    
+    BRSHA256_2(&md, &buf[WALLET_SNAPSHOT_HEADER], bufLen - WALLET_SNAPSHOT_HEADER);
+    if (! UInt256Eq(md, UInt256Get(&buf[sizeof(uint32_t)*2]))) return NULL;
+    buf += WALLET_SNAPSHOT_HEADER;
+    bufLen -= WALLET_SNAPSHOT_HEADER;
+    
+    if (_snapshotGetU32(buf, bufLen, &off, &ok) != (uint32_t)forkId ||
+        _snapshotGetU32(buf, bufLen, &off, &ok) != mpk.fingerPrint ||
+        ! (p = _snapshotGet(buf, bufLen, &off, sizeof(UInt256))) || ! UInt256Eq(UInt256Get(p), mpk.chainCode) ||
+        ! (p = _snapshotGet(buf, bufLen, &off, sizeof(mpk.pubKey))) || memcmp(p, mpk.pubKey, sizeof(mpk.pubKey))) {
+        return NULL;
+    }
+    
+    wallet = _BRWalletAlloc(0, mpk, forkId);
+    wallet->blockHeight = _snapshotGetU32(buf, bufLen, &off, &ok);
+    wallet->balance = _snapshotGetU64(buf, bufLen, &off, &ok);
+    wallet->totalSent = _snapshotGetU64(buf, bufLen, &off, &ok);
+    wallet->totalReceived = _snapshotGetU64(buf, bufLen, &off, &ok);
+    wallet->settledBalance = _snapshotGetU64(buf, bufLen, &off, &ok);
+    if (ok) ok = _BRWalletLoadSnapshotChain(wallet, buf, bufLen, &off, SEQUENCE_EXTERNAL_CHAIN);
+    if (ok) ok = _BRWalletLoadSnapshotChain(wallet, buf, bufLen, &off, SEQUENCE_INTERNAL_CHAIN);
+    count = _snapshotGetU32(buf, bufLen, &off, &ok);
+    
+    for (i = 0; ok && i < count; i++) {
+        tx = _snapshotGetTx(buf, bufLen, &off);
+        if (tx && BRSetContains(wallet->allTx, tx)) BRTransactionFree(tx), tx = NULL;
+        if (! tx) ok = 0;
+        if (! ok) break;
+        BRSetAdd(wallet->allTx, tx);
+        array_add(wallet->transactions, tx);
+        _BRWalletIndexTx(wallet, tx);
+    }
+    
+    j = _snapshotGetU32(buf, bufLen, &off, &ok);
+    
+    while (ok && j-- > 0) { // non-wallet transactions are owned by the wallet once added to allTx
+        tx = _snapshotGetTx(buf, bufLen, &off);
+        if (tx && BRSetContains(wallet->allTx, tx)) BRTransactionFree(tx), tx = NULL;
+        if (! tx) ok = 0;
+        if (! ok) break;
+        BRSetAdd(wallet->allTx, tx);
+    }
+    
+    for (i = 0; ok && i < count; i++) {
+        tx = wallet->transactions[i];
+        u.tx = tx;
+        u.totalSent = _snapshotGetU64(buf, bufLen, &off, &ok);
+        u.totalReceived = _snapshotGetU64(buf, bufLen, &off, &ok);
+        u.settledBalance = _snapshotGetU64(buf, bufLen, &off, &ok);
+        u.spentCount = _snapshotGetU32(buf, bufLen, &off, &ok);
+        u.usedCount = _snapshotGetU32(buf, bufLen, &off, &ok);
+        u.addedCount = _snapshotGetU32(buf, bufLen, &off, &ok);
+        u.removedCount = _snapshotGetU32(buf, bufLen, &off, &ok);
+        u.status = _snapshotGetU8(buf, bufLen, &off, &ok);
+        if (u.spentCount > tx->inCount || u.usedCount > tx->outCount) ok = 0;
+        if (u.status == UNDO_INVALID) BRSetAdd(wallet->invalidTx, tx);
+        if (u.status == UNDO_PENDING) BRSetAdd(wallet->pendingTx, tx);
+        
+        for (j = 0; ok && j < u.spentCount; j++) {
+            uint32_t n = _snapshotGetU32(buf, bufLen, &off, &ok);
+            
+            if (n >= tx->inCount) ok = 0;
+            if (! ok) break;
+            array_add(wallet->spentStack, &tx->inputs[n]);
+            BRSetAdd(wallet->spentOutputs, &tx->inputs[n]);
+        }
+        
+        for (j = 0; ok && j < u.usedCount; j++) {
+            uint32_t n = _snapshotGetU32(buf, bufLen, &off, &ok);
+            const uint8_t *pkh = (ok && n < tx->outCount) ?
+                                 BRScriptPKH(tx->outputs[n].script, tx->outputs[n].scriptLen) : NULL;
+            
+            if (! pkh) ok = 0;
+            if (! ok) break;
+            array_add(wallet->usedStack, pkh);
+            _BRWalletMarkPKH(wallet, pkh);
+        }
+        
+        for (j = 0; ok && j < u.addedCount; j++) {
+            array_add(wallet->addedStack, _snapshotGetEntry(buf, bufLen, &off, &ok));
+        }
+        
+        for (j = 0; ok && j < u.removedCount; j++) {
+            array_add(wallet->removedStack, _snapshotGetEntry(buf, bufLen, &off, &ok));
+        }
+        
+        array_add(wallet->undo, u);
+    }
+    
+    for (i = 0; ok && i < count; i++) {
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->txHash = wallet->transactions[i]->txHash;
+        info->balanceAfter = _snapshotGetU64(buf, bufLen, &off, &ok);
+        info->status.lockHeight = _snapshotGetU32(buf, bufLen, &off, &ok);
+        info->status.lockTime = _snapshotGetU32(buf, bufLen, &off, &ok);
+        info->status.flags = _snapshotGetU8(buf, bufLen, &off, &ok);
+        info->received = _snapshotGetU64(buf, bufLen, &off, &ok);
+        info->sent = _snapshotGetU64(buf, bufLen, &off, &ok);
+        info->fee = _snapshotGetU64(buf, bufLen, &off, &ok);
+        array_add(wallet->balanceHist, info->balanceAfter);
+        BRSetAdd(wallet->txInfo, info);
+    }
+    
+    count = _snapshotGetU32(buf, bufLen, &off, &ok);
+    if (ok && count > bufLen/(sizeof(UInt256) + sizeof(uint32_t)*3 + sizeof(uint64_t) + 1)) ok = 0;
+    
+    if (ok) {
+        BRUTXOIndex *idx = &wallet->utxoIndex;
+        
+        array_set_count(idx->outpoints, count);
+        array_set_count(idx->amounts, count);
+        array_set_count(idx->heights, count);
+        array_set_count(idx->paths, count);
+        array_set_count(idx->types, count);
+        
+        for (i = 0; ok && i < count; i++) {
+            p = _snapshotGet(buf, bufLen, &off, sizeof(UInt256));
+            idx->outpoints[i].hash = (p) ? UInt256Get(p) : UINT256_ZERO;
+            idx->outpoints[i].n = _snapshotGetU32(buf, bufLen, &off, &ok);
+            if (! p) ok = 0;
         }
+        
+        for (i = 0; ok && i < count; i++) idx->amounts[i] = _snapshotGetU64(buf, bufLen, &off, &ok);
+        for (i = 0; ok && i < count; i++) idx->heights[i] = _snapshotGetU32(buf, bufLen, &off, &ok);
+        for (i = 0; ok && i < count; i++) idx->paths[i] = _snapshotGetU32(buf, bufLen, &off, &ok);
+        for (i = 0; ok && i < count; i++) idx->types[i] = _snapshotGetU8(buf, bufLen, &off, &ok);
+        for (i = 0; ok && i < count; i++) idx->total += idx->amounts[i];
+        for (i = 0; ok && i < count; i++) _BRWalletAddAddressBalance(wallet, idx->paths[i], (int64_t)idx->amounts[i]);
+        for (i = 1; ok && i < count; i++) if (idx->amounts[i - 1] > idx->amounts[i]) ok = 0;
+    }
+    
+    if (ok && version >= 2) ok = _BRWalletLoadSnapshotArchive(wallet, buf, bufLen, &off);
+    
+    if (! ok || off != bufLen || array_count(wallet->addedStack) < _BRUTXOIndexCount(&wallet->utxoIndex)) {
+        BRWalletFree(wallet);
+        return NULL;
     }
     
-    return -1;
+    // re-apply unconfirmed transactions, since their status depends on the current time
+    _BRWalletUpdateBalance(wallet, array_count(wallet->transactions));
+    return wallet;
 }
 
-struct BRWalletStruct {
-    uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
-    uint32_t blockHeight;
-    BRUTXO *utxos;
-    BRTransaction **transactions;
-    BRMasterPubKey masterPubKey;
-    int forkId;
-    UInt160 *internalChain, *externalChain;
-    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedPKH, *allPKH;
-    void *callbackInfo;
-    void (*balanceChanged)(void *info, uint64_t balance);
-    void (*txAdded)(void *info, BRTransaction *tx);
-    void (*txUpdated)(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight, uint32_t timestamp);
-    void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan);
-    pthread_mutex_t lock;
-};
-
-inline static void _BRWalletAddressFromHash160(BRWallet *wallet, char *addr, size_t addrLen, UInt160 h)
+// queues a callback for the notifier thread, call with eventLock held
+static void _BRWalletQueueEvent(BRWallet *wallet, const BRWalletEvent *event)
 {
-    if (wallet->forkId != 0) {
-        const uint8_t script[] = { OP_DUP, OP_HASH160, 20, h.u8[0], h.u8[1], h.u8[2], h.u8[3], h.u8[4], h.u8[5],
-                                   h.u8[6], h.u8[7], h.u8[8], h.u8[9], h.u8[10], h.u8[11], h.u8[12], h.u8[13], h.u8[14],
-                                   h.u8[15], h.u8[16], h.u8[17], h.u8[18], h.u8[19], OP_EQUALVERIFY, OP_CHECKSIG };
-        
-        BRAddressFromScriptPubKey(addr, addrLen, script, sizeof(script));
+    struct timeval tv;
+    
+    if (array_count(wallet->events) == 0 && ! wallet->eventBalanceChanged) { // first queued callback sets the deadline
+        gettimeofday(&tv, NULL);
+        tv.tv_sec += wallet->flushLatency/1000;
+        tv.tv_usec += (wallet->flushLatency % 1000)*1000;
+        if (tv.tv_usec >= 1000000) tv.tv_sec++, tv.tv_usec -= 1000000;
+        wallet->eventDeadline.tv_sec = tv.tv_sec;
+        wallet->eventDeadline.tv_nsec = tv.tv_usec*1000;
+        pthread_cond_signal(&wallet->eventCond);
     }
-    else BRAddressFromHash160(addr, addrLen, &h);
+    
+    if (event) array_add(wallet->events, *event);
 }
 
-inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+// calls balanceChanged, or queues it for the notifier thread if events are batched
+static void _BRWalletBalanceChanged(BRWallet *wallet, uint64_t balance)
 {
-    if (! tx1 || ! tx2) return 0;
-    if (tx1->blockHeight > tx2->blockHeight) return 1;
-    if (tx1->blockHeight < tx2->blockHeight) return 0;
-    
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (UInt256Eq(tx1->inputs[i].txHash, tx2->txHash)) return 1;
-    }
+    pthread_mutex_lock(&wallet->eventLock);
     
-    for (size_t i = 0; i < tx2->inCount; i++) {
-        if (UInt256Eq(tx2->inputs[i].txHash, tx1->txHash)) return 0;
+    if (wallet->notifierRunning) {
+        _BRWalletQueueEvent(wallet, NULL);
+        wallet->eventBalance = balance;
+        wallet->eventBalanceChanged = 1;
+        pthread_mutex_unlock(&wallet->eventLock);
     }
-
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (_BRWalletTxIsAscending(wallet, BRSetGet(wallet->allTx, &(tx1->inputs[i].txHash)), tx2)) return 1;
+    else {
+        pthread_mutex_unlock(&wallet->eventLock);
+        if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, balance);
     }
-
-    return 0;
 }
 
-inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+// calls txsAdded if set, otherwise txAdded for each tx, or queues them for the notifier thread
+static void _BRWalletTxsAdded(BRWallet *wallet, BRTransaction *txs[], size_t txCount)
 {
-    size_t i = -1, j = -1;
-
-    if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
-    if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    if ((i = _txChainIndex(tx1, wallet->internalChain)) != -1) j = _txChainIndex(tx2, wallet->internalChain);
-    if (j == -1 && (i = _txChainIndex(tx1, wallet->externalChain)) != -1) j = _txChainIndex(tx2, wallet->externalChain);
-    if (i != -1 && j != -1 && i != j) return (i > j) ? 1 : -1;
-    return 0;
+    pthread_mutex_lock(&wallet->eventLock);
+    
+    if (wallet->notifierRunning) {
+        for (size_t i = 0; i < txCount; i++) {
+            _BRWalletQueueEvent(wallet, &(const BRWalletEvent) { WALLET_EVENT_TX_ADDED, txs[i], UINT256_ZERO, 0, 0,
+                                                                 0, 0 });
+        }
+        
+        pthread_mutex_unlock(&wallet->eventLock);
+    }
+    else {
+        pthread_mutex_unlock(&wallet->eventLock);
+        
+        if (wallet->txsAdded) wallet->txsAdded(wallet->callbackInfo, txs, txCount);
+        else if (wallet->txAdded) {
+            for (size_t i = 0; i < txCount; i++) wallet->txAdded(wallet->callbackInfo, txs[i]);
+        }
+    }
 }
 
-// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+// calls txUpdated, or queues it for the notifier thread
+static void _BRWalletTxUpdated(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                               uint32_t timestamp)
 {
-    size_t i = array_count(wallet->transactions);
-    
-    array_set_count(wallet->transactions, i + 1);
+    pthread_mutex_lock(&wallet->eventLock);
     
-    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
-        wallet->transactions[i] = wallet->transactions[i - 1];
-        i--;
+    if (wallet->notifierRunning) {
+        for (size_t i = 0; i < txCount; i++) {
+            _BRWalletQueueEvent(wallet, &(const BRWalletEvent) { WALLET_EVENT_TX_UPDATED, NULL, txHashes[i],
+                                                                 blockHeight, timestamp, 0, 0 });
+        }
+        
+        pthread_mutex_unlock(&wallet->eventLock);
+    }
+    else {
+        pthread_mutex_unlock(&wallet->eventLock);
+        if (wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, txHashes, txCount, blockHeight, timestamp);
     }
-    
-    wallet->transactions[i] = tx;
 }
 
-// non-threadsafe version of BRWalletContainsTransaction()
-static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
+// calls txDeleted, or queues it for the notifier thread
+static void _BRWalletTxDeleted(BRWallet *wallet, UInt256 txHash, int notifyUser, int recommendRescan)
 {
-    int r = 0;
-    const uint8_t *pkh;
+    pthread_mutex_lock(&wallet->eventLock);
     
-    for (size_t i = 0; ! r && i < tx->outCount; i++) {
-        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
-        if (pkh && BRSetContains(wallet->allPKH, pkh)) r = 1;
+    if (wallet->notifierRunning) {
+        _BRWalletQueueEvent(wallet, &(const BRWalletEvent) { WALLET_EVENT_TX_DELETED, NULL, txHash, 0, 0,
+                                                             notifyUser, recommendRescan });
+        pthread_mutex_unlock(&wallet->eventLock);
     }
-    
-    for (size_t i = 0; ! r && i < tx->inCount; i++) {
-        BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
-        uint32_t n = tx->inputs[i].index;
-        
-        pkh = (t && n < t->outCount) ? BRScriptPKH(t->outputs[n].script, t->outputs[n].scriptLen) : NULL;
-        if (pkh && BRSetContains(wallet->allPKH, pkh)) r = 1;
+    else {
+        pthread_mutex_unlock(&wallet->eventLock);
+        if (wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, txHash, notifyUser, recommendRescan);
     }
-    
-    return r;
 }
 
-static void _BRWalletUpdateBalance(BRWallet *wallet)
+// delivers queued callbacks in order, combining each run of added txs into one txsAdded call (if set), and each run
+// of updated txs with the same blockHeight and timestamp into one txUpdated call
+static void _BRWalletDeliverEvents(BRWallet *wallet, const BRWalletEvent *events, size_t count)
 {
-    int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
-    time_t now = time(NULL);
+    BRTransaction **txs = NULL;
+    UInt256 *hashes = NULL;
     size_t i, j;
-    BRTransaction *tx, *t;
-    const uint8_t *pkh;
     
-    array_clear(wallet->utxos);
-    array_clear(wallet->balanceHist);
-    BRSetClear(wallet->spentOutputs);
-    BRSetClear(wallet->invalidTx);
-    BRSetClear(wallet->pendingTx);
-    BRSetClear(wallet->usedPKH);
-    wallet->totalSent = 0;
-    wallet->totalReceived = 0;
-
-    for (i = 0; i < array_count(wallet->transactions); i++) {
-        tx = wallet->transactions[i];
-
-        // check if any inputs are invalid or already spent
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
-                    BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
-            }
-        
-            if (isInvalid) {
-                BRSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
-        }
-
-        // add inputs to spent output set
-        for (j = 0; j < tx->inCount; j++) {
-            BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count && events[j].type == events[i].type; j++) {
+            if (events[i].type == WALLET_EVENT_TX_DELETED) break;
+            if (events[i].type == WALLET_EVENT_TX_UPDATED && (events[j].blockHeight != events[i].blockHeight ||
+                                                              events[j].timestamp != events[i].timestamp)) break;
         }
-
-        // check if tx is pending
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            isPending = (BRTransactionVSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
-            
-            for (j = 0; ! isPending && j < tx->outCount; j++) {
-                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
-            }
-
-            for (j = 0; ! isPending && j < tx->inCount; j++) {
-                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                    tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
-                if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
-                // TODO: XXX handle BIP68 check lock time verify rules
-            }
-            
-            if (isPending) {
-                BRSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
-        }
-
-        // add outputs to UTXO set
-        // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
-        // TODO: don't add coin generation outputs < 100 blocks deep
-        // NOTE: balance/UTXOs will then need to be recalculated when last block changes
-        for (j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') {
-                pkh = BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen);
-
-                if (pkh && BRSetContains(wallet->allPKH, pkh)) {
-                    BRSetAdd(wallet->usedPKH, (void *)pkh);
-                    array_add(wallet->utxos, ((const BRUTXO) { tx->txHash, (uint32_t)j }));
-                    balance += tx->outputs[j].amount;
+        
+        switch (events[i].type) {
+            case WALLET_EVENT_TX_ADDED:
+                if (! txs) array_new(txs, j - i);
+                array_clear(txs);
+                for (size_t k = i; k < j; k++) array_add(txs, events[k].tx);
+                
+                if (wallet->txsAdded) wallet->txsAdded(wallet->callbackInfo, txs, array_count(txs));
+                else if (wallet->txAdded) {
+                    for (size_t k = 0; k < array_count(txs); k++) wallet->txAdded(wallet->callbackInfo, txs[k]);
                 }
-            }
-        }
-
-        // transaction ordering is not guaranteed, so check the entire UTXO set against the entire spent output set
-        for (j = array_count(wallet->utxos); j > 0; j--) {
-            if (! BRSetContains(wallet->spentOutputs, &wallet->utxos[j - 1])) continue;
-            t = BRSetGet(wallet->allTx, &wallet->utxos[j - 1].hash);
-            balance -= t->outputs[wallet->utxos[j - 1].n].amount;
-            array_rm(wallet->utxos, j - 1);
+                
+                break;
+                
+            case WALLET_EVENT_TX_UPDATED:
+                if (! hashes) array_new(hashes, j - i);
+                array_clear(hashes);
+                for (size_t k = i; k < j; k++) array_add(hashes, events[k].txHash);
+                
+                if (wallet->txUpdated) {
+                    wallet->txUpdated(wallet->callbackInfo, hashes, array_count(hashes), events[i].blockHeight,
+                                      events[i].timestamp);
+                }
+                
+                break;
+                
+            case WALLET_EVENT_TX_DELETED:
+                if (wallet->txDeleted) {
+                    wallet->txDeleted(wallet->callbackInfo, events[i].txHash, events[i].notifyUser,
+                                      events[i].recommendRescan);
+                }
+                
+                break;
         }
-        
-        if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
-        if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
-        array_add(wallet->balanceHist, balance);
-        prevBalance = balance;
     }
-
-    assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
-    wallet->balance = balance;
+    
+    if (txs) array_free(txs);
+    if (hashes) array_free(hashes);
 }
 
-// allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
-// forkId is 0 for bitcoin, 0x40 for b-cash
-BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk, int forkId)
+static void *_BRWalletNotifierRoutine(void *arg)
 {
-    BRWallet *wallet = NULL;
-    BRTransaction *tx;
-    const uint8_t *pkh;
-
-    assert(transactions != NULL || txCount == 0);
-    wallet = calloc(1, sizeof(*wallet));
-    assert(wallet != NULL);
-    array_new(wallet->utxos, 100);
-    array_new(wallet->transactions, txCount + 100);
-    wallet->feePerKb = DEFAULT_FEE_PER_KB;
-    wallet->masterPubKey = mpk;
-    wallet->forkId = forkId;
-    array_new(wallet->internalChain, 100);
-    array_new(wallet->externalChain, 100);
-    array_new(wallet->balanceHist, txCount + 100);
-    wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
-    wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
-    wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
-    wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
-    wallet->usedPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
-    wallet->allPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
-    pthread_mutex_init(&wallet->lock, NULL);
-
-    for (size_t i = 0; transactions && i < txCount; i++) {
-        tx = transactions[i];
-        if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
-        BRSetAdd(wallet->allTx, tx);
-        _BRWalletInsertTx(wallet, tx);
-
-        for (size_t j = 0; j < tx->outCount; j++) {
-            pkh = BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen);
-            if (pkh) BRSetAdd(wallet->usedPKH, (void *)pkh);
-        }
-    }
+    BRWallet *wallet = arg;
+    BRWalletEvent *events = NULL, *t;
+    uint64_t balance;
+    int balanceChanged;
     
-    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_EXTERNAL_CHAIN);
-    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, SEQUENCE_INTERNAL_CHAIN);
-
-    _BRWalletUpdateBalance(wallet);
-
-    if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
-        BRWalletFree(wallet);
-        wallet = NULL;
+    array_new(events, 100);
+    pthread_mutex_lock(&wallet->eventLock);
+    
+    while (wallet->notifierRunning || array_count(wallet->events) > 0 || wallet->eventBalanceChanged) {
+        if (array_count(wallet->events) == 0 && ! wallet->eventBalanceChanged) {
+            pthread_cond_wait(&wallet->eventCond, &wallet->eventLock);
+            continue;
+        }
+        
+        // wait until the oldest queued callback is due, unless the notifier is stopping
+        if (wallet->notifierRunning &&
+            pthread_cond_timedwait(&wallet->eventCond, &wallet->eventLock, &wallet->eventDeadline) != ETIMEDOUT) {
+            continue;
+        }
+        
+        t = wallet->events, wallet->events = events, events = t; // take the queue, so more can be added meanwhile
+        balance = wallet->eventBalance;
+        balanceChanged = wallet->eventBalanceChanged;
+        wallet->eventBalanceChanged = 0;
+        wallet->notifierDelivering = 1;
+        pthread_mutex_unlock(&wallet->eventLock);
+        _BRWalletDeliverEvents(wallet, events, array_count(events));
+        if (balanceChanged && wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, balance);
+        array_clear(events);
+        pthread_mutex_lock(&wallet->eventLock);
+        wallet->notifierDelivering = 0;
     }
     
-    return wallet;
+    pthread_mutex_unlock(&wallet->eventLock);
+    array_free(events);
+    if (wallet->threadCleanup) wallet->threadCleanup(wallet->callbackInfo);
+    return NULL;
 }
 
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
@@ -338,25 +2512,67 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
     wallet->txDeleted = txDeleted;
 }
 
-// wallets are composed of chains of addresses
-// each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
-// this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
-// the internal chain is used for change addresses and the external chain for receive addresses
-// addrs may be NULL to only generate addresses for BRWalletContainsAddress()
-// returns the number addresses written to addrs
-size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, uint32_t internal)
+// not thread-safe, set once after BRWalletSetCallbacks(), before calling other BRWallet functions
+// void txsAdded(void *, BRTransaction *[], size_t) - if set, called instead of txAdded, once with all the transactions
+//   added by a BRWalletRegisterTransactions() call (or a run of added transactions when events are batched)
+void BRWalletSetTxsAddedCallback(BRWallet *wallet, void (*txsAdded)(void *info, BRTransaction *txs[], size_t txCount))
 {
-    UInt160 *chain = NULL, *origChain;
-    size_t i, j = 0, count, startCount;
+    assert(wallet != NULL);
+    wallet->txsAdded = txsAdded;
+}
 
+// not thread-safe, call after setting callbacks, before calling other BRWallet functions
+// if flushLatency is non-zero, callbacks are queued and delivered in batches on a dedicated notifier thread, at most
+// flushLatency milliseconds after the first queued one, instead of being called from whichever thread changed the
+// wallet: runs of added txs are combined into one txsAdded call (if set), runs of updated txs with the same
+// blockHeight and timestamp into one txUpdated call, and balanceChanged is called once with the latest balance
+// a flushLatency of 0 delivers any queued callbacks, stops the notifier thread, and goes back to direct callbacks
+// threadCleanup is called on the notifier thread just before it exits, e.g. to detach it from a JVM
+void BRWalletSetEventBatching(BRWallet *wallet, uint32_t flushLatency, void (*threadCleanup)(void *info))
+{
+    pthread_attr_t attr;
+    int running;
+    
     assert(wallet != NULL);
-    assert(gapLimit > 0);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_mutex_lock(&wallet->eventLock);
+    running = wallet->notifierRunning;
+    wallet->flushLatency = flushLatency;
+    wallet->threadCleanup = threadCleanup;
+    
+    if (flushLatency > 0 && ! running) {
+        wallet->notifierRunning = 1;
+        
+        if (pthread_attr_init(&attr) != 0) wallet->notifierRunning = 0;
+        else {
+            if (pthread_attr_setstacksize(&attr, NOTIFIER_STACK_SIZE) != 0 ||
+                pthread_create(&wallet->notifier, &attr, _BRWalletNotifierRoutine, wallet) != 0) {
+                wallet->notifierRunning = 0; // callbacks stay direct
+            }
+            
+            pthread_attr_destroy(&attr);
+        }
+    }
+    else if (flushLatency == 0 && running) {
+        wallet->notifierRunning = 0;
+        pthread_cond_signal(&wallet->eventCond);
+    }
+    
+    pthread_mutex_unlock(&wallet->eventLock);
+    if (flushLatency == 0 && running) pthread_join(wallet->notifier, NULL);
+}
+
+// generates addresses until the chain ends with gapLimit addresses that aren't in usedPKH, and returns the index of
+// the first of them, sets *used if transactions already sent to any of the new addresses
+static size_t _BRWalletExtendChain(BRWallet *wallet, uint32_t gapLimit, uint32_t internal, int *used)
+{
+    UInt160 *chain = NULL;
+    const uint8_t *pkh;
+    size_t i, count;
+
     if (internal == SEQUENCE_EXTERNAL_CHAIN) chain = wallet->externalChain;
     if (internal == SEQUENCE_INTERNAL_CHAIN) chain = wallet->internalChain;
     assert(chain != NULL);
-    origChain = chain;
-    i = count = startCount = array_count(chain);
+    i = count = array_count(chain);
     
     // keep only the trailing contiguous block of addresses with no transactions
     while (i > 0 && ! BRSetContains(wallet->usedPKH, &chain[i - 1])) i--;
@@ -368,65 +2584,82 @@ size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimi
         
         if (! BRKeySetPubKey(&key, pubKey, len)) break;
         array_add(chain, BRKeyHash160(&key));
+        _BRWalletAddPKHPath(wallet, chain[count], internal, (uint32_t)count);
+        pkh = BRSetRemove(wallet->foreignPKH, &chain[count]);
         count++;
-        if (BRSetContains(wallet->usedPKH, &chain[array_count(chain) - 1])) i = count;
+        if (! pkh) continue;
+        BRSetAdd(wallet->usedPKH, (void *)pkh);
+        i = count;
+        *used = 1; // an already registered transaction sent funds to the new address
     }
 
-    if (addrs && i + gapLimit <= count) {
+    // allPKH members live in pkhPathBlocks, so it doesn't matter if the chain was moved to a new memory location
+    if (internal == SEQUENCE_EXTERNAL_CHAIN) wallet->externalChain = chain;
+    if (internal == SEQUENCE_INTERNAL_CHAIN) wallet->internalChain = chain;
+    return i;
+}
+
+// non-threadsafe version of BRWalletUnusedAddrs()
+static size_t _BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, uint32_t internal)
+{
+    size_t i, j = 0, startCount = BRSetCount(wallet->allPKH);
+    int needsUpdate = 0;
+    const UInt160 *chain;
+
+    i = _BRWalletExtendChain(wallet, gapLimit, internal, &needsUpdate);
+    chain = (internal == SEQUENCE_INTERNAL_CHAIN) ? wallet->internalChain : wallet->externalChain;
+
+    if (addrs && i + gapLimit <= array_count(chain)) {
         for (j = 0; j < gapLimit; j++) {
             _BRWalletAddressFromHash160(wallet, addrs[j].s, sizeof(*addrs), chain[i + j]);
         }
     }
     
-    // was chain moved to a new memory location?
-    if (chain == origChain) {
-        for (i = startCount; i < count; i++) {
-            BRSetAdd(wallet->allPKH, &chain[i]);
-        }
-    }
-    else {
-        if (internal == SEQUENCE_EXTERNAL_CHAIN) wallet->externalChain = chain;
-        if (internal == SEQUENCE_INTERNAL_CHAIN) wallet->internalChain = chain;
-
-        BRSetClear(wallet->allPKH); // clear and rebuild allAddrs
-
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            BRSetAdd(wallet->allPKH, &wallet->internalChain[i - 1]);
-        }
-        
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            BRSetAdd(wallet->allPKH, &wallet->externalChain[i - 1]);
-        }
-    }
+    if (needsUpdate && array_count(wallet->undo) > 0) _BRWalletUpdateBalance(wallet, 0);
+    else if (BRSetCount(wallet->allPKH) > startCount) _BRWalletPublishView(wallet);
+    return j;
+}
 
+// wallets are composed of chains of addresses
+// each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
+// this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
+// the internal chain is used for change addresses and the external chain for receive addresses
+// addrs may be NULL to only generate addresses for BRWalletContainsAddress()
+// returns the number addresses written to addrs
+size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, uint32_t internal)
+{
+    size_t r;
+    
+    assert(wallet != NULL);
+    assert(gapLimit > 0);
+    pthread_mutex_lock(&wallet->lock);
+    r = _BRWalletUnusedAddrs(wallet, addrs, gapLimit, internal);
     pthread_mutex_unlock(&wallet->lock);
-    return j;
+    return r;
 }
 
 // current wallet balance, not including transactions known to be invalid
 uint64_t BRWalletBalance(BRWallet *wallet)
 {
+    const BRWalletView *view;
     uint64_t balance;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    balance = wallet->balance;
-    pthread_mutex_unlock(&wallet->lock);
+    view = _BRWalletRetainView(wallet);
+    balance = view->balance;
+    _BRWalletReleaseView(wallet, view);
     return balance;
 }
 
 // writes unspent outputs to utxos and returns the number of outputs written, or total number available if utxos is NULL
 size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO *utxos, size_t utxosCount)
 {
-    assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    if (! utxos || array_count(wallet->utxos) < utxosCount) utxosCount = array_count(wallet->utxos);
-
-    for (size_t i = 0; utxos && i < utxosCount; i++) {
-        utxos[i] = wallet->utxos[i];
-    }
+    const BRWalletView *view;
 
-    pthread_mutex_unlock(&wallet->lock);
+    assert(wallet != NULL);
+    view = _BRWalletRetainView(wallet);
+    utxosCount = _BRViewArrayGet(&view->utxos, utxos, utxosCount);
+    _BRWalletReleaseView(wallet, view);
     return utxosCount;
 }
 
@@ -434,15 +2667,12 @@ size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO *utxos, size_t utxosCount)
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount)
 {
-    assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    if (! transactions || array_count(wallet->transactions) < txCount) txCount = array_count(wallet->transactions);
+    const BRWalletView *view;
 
-    for (size_t i = 0; transactions && i < txCount; i++) {
-        transactions[i] = wallet->transactions[i];
-    }
-    
-    pthread_mutex_unlock(&wallet->lock);
+    assert(wallet != NULL);
+    view = _BRWalletRetainView(wallet);
+    txCount = _BRViewArrayGet(&view->transactions, transactions, txCount);
+    _BRWalletReleaseView(wallet, view);
     return txCount;
 }
 
@@ -462,32 +2692,119 @@ size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions
     for (size_t i = 0; transactions && i < txCount; i++) {
         transactions[i] = wallet->transactions[(total - n) + i];
     }
-
+
+    pthread_mutex_unlock(&wallet->lock);
+    return txCount;
+}
+
+// position of the first tx in the height ordered txs with a blockHeight not less than the given one (binary search)
+static size_t _BRWalletTxHeightLowerBound(BRTransaction *const txs[], size_t count, uint32_t blockHeight)
+{
+    size_t lo = 0, hi = count, mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (txs[mid]->blockHeight < blockHeight) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    return lo;
+}
+
+// writes up to txCount transactions matching query that come after cursor, ordered by block height and then tx hash,
+// or in reverse if query->newestFirst is set, and updates cursor to the last transaction written
+// returns the number of transactions written, which is less than txCount only if there are no more matches
+size_t BRWalletQueryTransactions(BRWallet *wallet, const BRTxQuery *query, BRTxCursor *cursor,
+                                 BRTransaction *transactions[], size_t txCount)
+{
+    BRTransaction **txs = NULL, **bucket = NULL, *tx;
+    const BRPKHTxs *r = NULL;
+    size_t i, j, k, count = 0, n = 0;
+    uint32_t height;
+    int started, cmp;
+    UInt160 pkh;
+    
+    assert(wallet != NULL);
+    assert(query != NULL);
+    assert(cursor != NULL);
+    assert(transactions != NULL || txCount == 0);
+    pthread_mutex_lock(&wallet->lock);
+    started = ! UInt256IsZero(cursor->txHash);
+    
+    if (query->address) { // transactions for an address come from its pkhTxs list, which has the same order
+        r = (BRAddressHash160(&pkh, query->address)) ? BRSetGet(wallet->pkhTxs, &pkh) : NULL;
+        if (r) txs = r->txs, count = array_count(r->txs);
+    }
+    else txs = wallet->transactions, count = array_count(wallet->transactions);
+    
+    // both lists are sorted by height, so start at the first bucket that may have matches, and then sort each bucket
+    // by tx hash, since within a block, wallet->transactions is in dependency order
+    if (! query->newestFirst) {
+        height = (started && cursor->blockHeight > query->fromHeight) ? cursor->blockHeight : query->fromHeight;
+        i = _BRWalletTxHeightLowerBound(txs, count, height);
+    }
+    else {
+        height = (started && cursor->blockHeight < query->toHeight) ? cursor->blockHeight : query->toHeight;
+        i = (height < UINT32_MAX) ? _BRWalletTxHeightLowerBound(txs, count, height + 1) : count;
+    }
+    
+    if (count > 0) array_new(bucket, 10);
+    
+    while (n < txCount && ((query->newestFirst) ? i > 0 : i < count)) {
+        height = txs[(query->newestFirst) ? i - 1 : i]->blockHeight;
+        if (height < query->fromHeight || height > query->toHeight) break;
+        array_clear(bucket);
+        
+        if (! query->newestFirst) {
+            for (j = i; j < count && txs[j]->blockHeight == height; j++) array_add(bucket, txs[j]);
+            i = j;
+        }
+        else {
+            for (j = i; j > 0 && txs[j - 1]->blockHeight == height; j--) array_add(bucket, txs[j - 1]);
+            i = j;
+        }
+        
+        qsort(bucket, array_count(bucket), sizeof(*bucket), _BRWalletTxHeightCompare);
+        
+        for (k = 0; n < txCount && k < array_count(bucket); k++) {
+            tx = bucket[(query->newestFirst) ? array_count(bucket) - k - 1 : k];
+            cmp = (started) ? _BRWalletTxKeyCompare(tx, cursor->blockHeight, cursor->txHash) : 0;
+            if (started && ((query->newestFirst) ? cmp >= 0 : cmp <= 0)) continue;
+            if (tx->timestamp < query->fromTime || tx->timestamp > query->toTime) continue;
+            transactions[n++] = tx;
+            cursor->blockHeight = tx->blockHeight;
+            cursor->txHash = tx->txHash;
+        }
+    }
+    
+    if (bucket) array_free(bucket);
     pthread_mutex_unlock(&wallet->lock);
-    return txCount;
+    return n;
 }
 
 // total amount spent from the wallet (exluding change)
 uint64_t BRWalletTotalSent(BRWallet *wallet)
 {
+    const BRWalletView *view;
     uint64_t totalSent;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    totalSent = wallet->totalSent;
-    pthread_mutex_unlock(&wallet->lock);
+    view = _BRWalletRetainView(wallet);
+    totalSent = view->totalSent;
+    _BRWalletReleaseView(wallet, view);
     return totalSent;
 }
 
 // total amount received by the wallet (exluding change)
 uint64_t BRWalletTotalReceived(BRWallet *wallet)
 {
+    const BRWalletView *view;
     uint64_t totalReceived;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    totalReceived = wallet->totalReceived;
-    pthread_mutex_unlock(&wallet->lock);
+    view = _BRWalletRetainView(wallet);
+    totalReceived = view->totalReceived;
+    _BRWalletReleaseView(wallet, view);
     return totalReceived;
 }
 
@@ -536,39 +2853,52 @@ BRAddress BRWalletLegacyAddress(BRWallet *wallet)
 // returns the number addresses written, or total number available if addrs is NULL
 size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
 {
+    const BRWalletView *view;
+    const BRViewArray *internalChain, *externalChain;
     size_t i, internalCount = 0, externalCount = 0;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    internalCount = (! addrs || array_count(wallet->internalChain) < addrsCount) ?
-                    array_count(wallet->internalChain) : addrsCount;
+    view = _BRWalletRetainView(wallet);
+    internalChain = &view->internalChain;
+    externalChain = &view->externalChain;
+    internalCount = (! addrs || internalChain->count < addrsCount) ? internalChain->count : addrsCount;
 
     for (i = 0; addrs && i < internalCount; i++) {
-        _BRWalletAddressFromHash160(wallet, addrs[i].s, sizeof(*addrs), wallet->internalChain[i]);
+        _BRWalletAddressFromHash160(wallet, addrs[i].s, sizeof(*addrs),
+                                    UInt160Get(_BRViewArrayItem(internalChain, i)));
     }
 
-    externalCount = (! addrs || array_count(wallet->externalChain) < addrsCount - internalCount) ?
-                    array_count(wallet->externalChain) : addrsCount - internalCount;
+    externalCount = (! addrs || externalChain->count < addrsCount - internalCount) ?
+                    externalChain->count : addrsCount - internalCount;
 
     for (i = 0; addrs && i < externalCount; i++) {
-        _BRWalletAddressFromHash160(wallet, addrs[internalCount + i].s, sizeof(*addrs), wallet->externalChain[i]);
+        _BRWalletAddressFromHash160(wallet, addrs[internalCount + i].s, sizeof(*addrs),
+                                    UInt160Get(_BRViewArrayItem(externalChain, i)));
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _BRWalletReleaseView(wallet, view);
     return internalCount + externalCount;
 }
 
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 {
-    int r = 0;
     UInt160 pkh = UINT160_ZERO;
     
     assert(wallet != NULL);
     assert(addr != NULL);
+    if (addr) BRAddressHash160(&pkh, addr); // decode the address before taking the wallet lock
+    return BRWalletContainsHash160(wallet, pkh);
+}
+
+// true if hash160 is the pubkey hash of an address previously generated by BRWalletUnusedAddrs()
+int BRWalletContainsHash160(BRWallet *wallet, UInt160 hash160)
+{
+    int r = 0;
+    
+    assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (addr) BRAddressHash160(&pkh, addr);
-    r = BRSetContains(wallet->allPKH, &pkh);
+    r = BRSetContains(wallet->allPKH, &hash160);
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
@@ -581,13 +2911,60 @@ int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr)
     
     assert(wallet != NULL);
     assert(addr != NULL);
+    if (addr) BRAddressHash160(&pkh, addr); // decode the address before taking the wallet lock
     pthread_mutex_lock(&wallet->lock);
-    if (addr) BRAddressHash160(&pkh, addr);
     r = BRSetContains(wallet->usedPKH, &pkh);
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
 
+// writes transactions that send to or spend from addr, ordered by block height and then tx hash, to the given
+// transactions array, returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTransactionsForAddress(BRWallet *wallet, const char *addr, BRTransaction *transactions[],
+                                      size_t txCount)
+{
+    const BRPKHTxs *r;
+    UInt160 pkh = UINT160_ZERO;
+    
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    if (addr) BRAddressHash160(&pkh, addr); // decode the address before taking the wallet lock
+    pthread_mutex_lock(&wallet->lock);
+    r = BRSetGet(wallet->pkhTxs, &pkh);
+    if (! r) txCount = 0;
+    else if (! transactions || array_count(r->txs) < txCount) txCount = array_count(r->txs);
+    
+    for (size_t i = 0; transactions && i < txCount; i++) {
+        transactions[i] = r->txs[i];
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return txCount;
+}
+
+// unspent balance of a wallet address, the part of the wallet balance that's been sent to it and not yet spent
+uint64_t BRWalletAddressBalance(BRWallet *wallet, const char *addr)
+{
+    uint64_t balance = 0;
+    const uint64_t *balances;
+    UInt160 pkh = UINT160_ZERO;
+    uint32_t path;
+    
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    if (addr) BRAddressHash160(&pkh, addr);
+    pthread_mutex_lock(&wallet->lock);
+    path = _BRWalletPKHPath(wallet, pkh.u8);
+    
+    if (path != UINT32_MAX) {
+        balances = (path >> 31 == SEQUENCE_INTERNAL_CHAIN) ? wallet->internalBalances : wallet->externalBalances;
+        if ((path & 0x7fffffff) < array_count(balances)) balance = balances[path & 0x7fffffff];
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return balance;
+}
+
 // returns an unsigned transaction that sends the specified amount from the wallet to the given address
 // result must be freed by calling BRTransactionFree()
 BRTransaction *BRWalletCreateTransaction(BRWallet *wallet, uint64_t amount, const char *addr)
@@ -607,8 +2984,8 @@ BRTransaction *BRWalletCreateTransaction(BRWallet *wallet, uint64_t amount, cons
 BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount)
 {
     BRTransaction *tx, *transaction = BRTransactionNew();
-    uint64_t feeAmount, amount = 0, balance = 0, minAmount;
-    size_t i, j, cpfpSize = 0;
+    uint64_t feeAmount, fee, amount = 0, balance = 0, minAmount;
+    size_t i, j, count, bnbCount = 0, cpfpSize = 0, *order;
     BRUTXO *o;
     BRAddress addr = BR_ADDRESS_NONE;
     
@@ -624,13 +3001,16 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
     minAmount = BRWalletMinOutputAmount(wallet);
     pthread_mutex_lock(&wallet->lock);
     feeAmount = _txFee(wallet->feePerKb, BRTransactionVSize(transaction) + TX_OUTPUT_SIZE);
+    order = malloc((_BRUTXOIndexCount(&wallet->utxoIndex) + 1)*sizeof(*order));
+    assert(order != NULL);
+    count = _BRWalletSelectUTXOs(wallet, amount, BRTransactionVSize(transaction), minAmount, order, &bnbCount);
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
     // TODO: avoid combining addresses in a single transaction when possible to reduce information leakage
     // TODO: use up UTXOs received from any of the output scripts that this transaction sends funds to, to mitigate an
     //       attacker double spending and requesting a refund
-    for (i = 0; i < array_count(wallet->utxos); i++) {
-        o = &wallet->utxos[i];
+    for (i = 0; i < count; i++) {
+        o = &wallet->utxoIndex.outpoints[order[i]];
         tx = BRSetGet(wallet->allTx, o);
         if (! tx || o->n >= tx->outCount) continue;
         BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
@@ -641,7 +3021,7 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
             transaction = NULL;
         
             // check for sufficient total funds before building a smaller transaction
-            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
+            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + count*TX_INPUT_SIZE +
                                                   (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
             pthread_mutex_unlock(&wallet->lock);
 
@@ -675,9 +3055,22 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
         // increase fee to round off remaining wallet balance to nearest 100 satoshi
         if (wallet->balance > amount + feeAmount) feeAmount += (wallet->balance - (amount + feeAmount)) % 100;
         
+        if (i + 1 < bnbCount) continue; // add the rest of the changeless solution
+        
+        if (i + 1 == bnbCount) { // a changeless solution doesn't need to pay for a change output
+            fee = _txFee(wallet->feePerKb, BRTransactionVSize(transaction) + cpfpSize);
+            if (wallet->balance > amount + fee) fee += (wallet->balance - (amount + fee)) % 100;
+            
+            if (balance >= amount + fee && balance - (amount + fee) <= minAmount) {
+                feeAmount = fee;
+                break;
+            }
+        }
+        
         if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
     }
     
+    free(order);
     pthread_mutex_unlock(&wallet->lock);
     
     if (transaction && (outCount < 1 || balance < amount + feeAmount)) { // no outputs/insufficient funds
@@ -701,7 +3094,7 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, const void *seed, size_t seedLen)
 {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
+    uint32_t path, internalIdx[tx->inCount], externalIdx[tx->inCount];
     size_t i, internalCount = 0, externalCount = 0;
     int forkId, r = 0;
     
@@ -711,15 +3104,10 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, const void *see
     forkId = wallet->forkId;
     
     for (i = 0; tx && i < tx->inCount; i++) {
-        const uint8_t *pkh = BRScriptPKH(tx->inputs[i].script, tx->inputs[i].scriptLen);
-        
-        for (j = (uint32_t)array_count(wallet->internalChain); pkh && j > 0; j--) {
-            if (UInt160Eq(UInt160Get(pkh), wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t)array_count(wallet->externalChain); pkh && j > 0; j--) {
-            if (UInt160Eq(UInt160Get(pkh), wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
+        path = _BRWalletPKHPath(wallet, BRScriptPKH(tx->inputs[i].script, tx->inputs[i].scriptLen));
+        if (path == UINT32_MAX) continue;
+        if ((path >> 31) == SEQUENCE_INTERNAL_CHAIN) internalIdx[internalCount++] = path & 0x7fffffff;
+        else externalIdx[externalCount++] = path & 0x7fffffff;
     }
 
     pthread_mutex_unlock(&wallet->lock);
@@ -763,19 +3151,23 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
     if (tx && BRTransactionIsSigned(tx)) {
         pthread_mutex_lock(&wallet->lock);
 
-        if (! BRSetContains(wallet->allTx, tx)) {
+        if (! BRSetContains(wallet->allTx, tx) && ! BRSetContains(wallet->archivedTx, tx)) {
             if (_BRWalletContainsTx(wallet, tx)) {
                 // TODO: verify signatures when possible
                 // TODO: handle tx replacement with input sequence numbers
                 //       (for now, replacements appear invalid until confirmation)
                 BRSetAdd(wallet->allTx, tx);
-                _BRWalletInsertTx(wallet, tx);
-                _BRWalletUpdateBalance(wallet);
+                _BRWalletIndexTx(wallet, tx);
+                _BRWalletUpdateBalance(wallet, _BRWalletInsertTx(wallet, tx));
                 wasAdded = 1;
             }
             else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
                    // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
-                if (tx->blockHeight == TX_UNCONFIRMED) BRSetAdd(wallet->allTx, tx);
+                if (tx->blockHeight == TX_UNCONFIRMED) {
+                    BRSetAdd(wallet->allTx, tx);
+                    _BRWalletUpdateUnconfirmedInfo(wallet); // in case a wallet tx spends from it
+                }
+                
                 r = 0;
                 // BUG: XXX memory leak if tx is not added to wallet->allTx, and we can't just free it
             }
@@ -789,13 +3181,112 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
         // when a wallet address is used in a transaction, generate a new address to replace it
         BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
         BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-        if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
-        if (wallet->txAdded) wallet->txAdded(wallet->callbackInfo, tx);
+        _BRWalletBalanceChanged(wallet, wallet->balance);
+        _BRWalletTxsAdded(wallet, &tx, 1);
     }
 
     return r;
 }
 
+// adds the transactions associated with the wallet, in any order, and returns the number added
+// the wallet balance is updated and new addresses are generated once for the whole batch, rather than once per tx
+size_t BRWalletRegisterTransactions(BRWallet *wallet, BRTransaction *txs[], size_t txCount)
+{
+    BRTransaction *tx, *t, **pending = NULL, **added = NULL;
+    const uint8_t **marked = NULL, *pkh;
+    uint32_t *sorted = NULL; // heights of the buckets sorted after inserting the batch
+    size_t i, j, n, start, end, pos = SIZE_MAX, count;
+    int needsUpdate = 0, unconfirmed = 0;
+    
+    assert(wallet != NULL);
+    assert(txs != NULL || txCount == 0);
+    array_new(pending, txCount);
+    array_new(added, txCount);
+    array_new(marked, 0);
+    array_new(sorted, 0);
+    
+    for (i = 0; txs && i < txCount; i++) {
+        if (txs[i] && BRTransactionIsSigned(txs[i])) array_add(pending, txs[i]);
+    }
+    
+    // in block order, each tx's outputs extend the address chains enough to find the txs that come after it
+    qsort(pending, array_count(pending), sizeof(*pending), _BRWalletTxHeightCompare);
+    pthread_mutex_lock(&wallet->lock);
+    
+    do { // repeat until no more are added, in case a tx spends from one that sorts after it
+        count = array_count(added);
+        
+        for (i = 0, j = 0; i < array_count(pending); i++) {
+            tx = pending[i];
+            if (BRSetContains(wallet->allTx, tx) || BRSetContains(wallet->archivedTx, tx)) continue; // registered
+            if (! _BRWalletContainsTx(wallet, tx)) { pending[j++] = tx; continue; }
+            BRSetAdd(wallet->allTx, tx);
+            _BRWalletIndexTx(wallet, tx);
+            n = _BRWalletInsertTx(wallet, tx);
+            if (n < pos) pos = n;
+            array_add(added, tx);
+            
+            // mark output pkhs as used until the balance is updated, so the address chains can be extended now
+            for (n = 0; n < tx->outCount; n++) {
+                pkh = BRScriptPKH(tx->outputs[n].script, tx->outputs[n].scriptLen);
+                if (! pkh || _BRWalletPKHIsMarked(wallet, pkh)) continue;
+                _BRWalletMarkPKH(wallet, pkh);
+                array_add(marked, pkh);
+            }
+            
+            _BRWalletExtendChain(wallet, SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_EXTERNAL_CHAIN, &needsUpdate);
+            _BRWalletExtendChain(wallet, SEQUENCE_GAP_LIMIT_INTERNAL, SEQUENCE_INTERNAL_CHAIN, &needsUpdate);
+        }
+        
+        array_set_count(pending, j);
+    } while (array_count(added) > count);
+    
+    // txs in the batch aren't applied until the balance is updated, so _BRWalletInsertTx() can't see a batch tx that
+    // spends from a later one, each height bucket with a batch tx that spends from its own bucket is sorted once here
+    for (i = 0; i < array_count(added); i++) {
+        tx = added[i];
+        
+        for (n = 0; n < tx->inCount; n++) {
+            t = BRSetGet(wallet->allTx, &tx->inputs[n].txHash);
+            if (t && t != tx && t->blockHeight == tx->blockHeight) break;
+        }
+        
+        if (n == tx->inCount) continue;
+        for (n = 0; n < array_count(sorted) && sorted[n] != tx->blockHeight; n++);
+        if (n < array_count(sorted)) continue;
+        array_add(sorted, tx->blockHeight);
+        _BRWalletTxBucket(wallet, tx->blockHeight, &start, &end);
+        n = _BRWalletSortTxBucket(wallet, start, end);
+        if (n < end && n < pos) pos = n;
+    }
+    
+    for (i = array_count(marked); i > 0; i--) _BRWalletUnmarkPKH(wallet, marked[i - 1]);
+    if (needsUpdate) pos = 0; // a new address had already been used by a registered tx
+    if (pos != SIZE_MAX) _BRWalletUpdateBalance(wallet, pos);
+    
+    for (i = 0; i < array_count(pending); i++) { // keep track of unconfirmed non-wallet txs, see RegisterTransaction
+        if (pending[i]->blockHeight != TX_UNCONFIRMED || BRSetContains(wallet->allTx, pending[i]) ||
+            BRSetContains(wallet->archivedTx, pending[i])) continue;
+        BRSetAdd(wallet->allTx, pending[i]);
+        unconfirmed = 1;
+    }
+    
+    if (unconfirmed) _BRWalletUpdateUnconfirmedInfo(wallet); // in case a wallet tx spends from them
+    pthread_mutex_unlock(&wallet->lock);
+    count = array_count(added);
+    
+    if (count > 0) {
+        _BRWalletBalanceChanged(wallet, wallet->balance);
+        _BRWalletTxsAdded(wallet, added, count);
+    }
+    
+    array_free(sorted);
+    array_free(marked);
+    array_free(added);
+    array_free(pending);
+    return count;
+}
+
 // removes a tx from the wallet, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 {
@@ -807,6 +3298,7 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
     assert(! UInt256IsZero(txHash));
     pthread_mutex_lock(&wallet->lock);
     tx = BRSetGet(wallet->allTx, &txHash);
+    if (tx && BRSetContains(wallet->archivedTx, tx)) tx = NULL; // archived txs are deeper than any re-org
 
     if (tx) {
         array_new(hashes, 0);
@@ -833,13 +3325,15 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
             BRWalletRemoveTransaction(wallet, txHash);
         }
         else {
-            for (size_t i = array_count(wallet->transactions); i > 0; i--) {
-                if (! BRTransactionEq(wallet->transactions[i - 1], tx)) continue;
-                array_rm(wallet->transactions, i - 1);
-                break;
-            }
+            size_t i = _BRWalletTxPosition(wallet, tx, tx->blockHeight);
             
-            _BRWalletUpdateBalance(wallet);
+            _BRWalletRemoveTxInfo(wallet, tx);
+            
+            if (i != SIZE_MAX) {
+                _BRWalletUnindexTx(wallet, tx, tx->blockHeight);
+                array_rm(wallet->transactions, i);
+                _BRWalletUpdateBalance(wallet, i);
+            }
             pthread_mutex_unlock(&wallet->lock);
             
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
@@ -854,8 +3348,8 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
                 }
             }
 
-            if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
-            if (wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, txHash, notifyUser, recommendRescan);
+            _BRWalletBalanceChanged(wallet, wallet->balance);
+            _BRWalletTxDeleted(wallet, txHash, notifyUser, recommendRescan);
         }
         
         array_free(hashes);
@@ -864,14 +3358,26 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 }
 
 // returns the transaction with the given hash if it's been registered in the wallet
+// an archived transaction is parsed from the archive the first time it's asked for, and kept until BRWalletFree()
 BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash)
 {
     BRTransaction *tx;
+    const BRArchivedTx *a;
     
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
     pthread_mutex_lock(&wallet->lock);
     tx = BRSetGet(wallet->allTx, &txHash);
+    if (! tx) tx = BRSetGet(wallet->rehydratedTx, &txHash);
+    a = (tx) ? NULL : BRSetGet(wallet->archivedTx, &txHash);
+    if (a) tx = BRTransactionParse(&wallet->archive[a->offset], a->length);
+    
+    if (a && tx) {
+        tx->blockHeight = a->blockHeight;
+        tx->timestamp = a->timestamp;
+        BRSetAdd(wallet->rehydratedTx, tx);
+    }
+    
     pthread_mutex_unlock(&wallet->lock);
     return tx;
 }
@@ -879,8 +3385,7 @@ BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash)
 // true if no previous wallet transaction spends any of the given transaction's inputs, and no inputs are invalid
 int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    int r = 1;
+    uint8_t status = TX_STATUS_VALID;
 
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
@@ -888,84 +3393,64 @@ int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
     // TODO: XXX attempted double spends should cause conflicted tx to remain unverified until they're confirmed
     // TODO: XXX conflicted tx with the same wallet outputs should be presented as the same tx to the user
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be invalid
+    if (tx) {
         pthread_mutex_lock(&wallet->lock);
-
-        if (! BRSetContains(wallet->allTx, tx)) {
-            for (size_t i = 0; r && i < tx->inCount; i++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[i])) r = 0;
-            }
-        }
-        else if (BRSetContains(wallet->invalidTx, tx)) r = 0;
-
+        status = _BRWalletTxStatusFlags(wallet, _BRWalletTxStatus(wallet, tx), time(NULL));
         pthread_mutex_unlock(&wallet->lock);
-
-        for (size_t i = 0; r && i < tx->inCount; i++) {
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && ! BRWalletTransactionIsValid(wallet, t)) r = 0;
-        }
     }
     
-    return r;
+    return (status & TX_STATUS_VALID) ? 1 : 0;
 }
 
 // true if tx cannot be immediately spent (i.e. if it or an input tx can be replaced-by-fee)
 int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    time_t now = time(NULL);
-    uint32_t blockHeight;
-    int r = 0;
+    uint8_t status = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
-    blockHeight = wallet->blockHeight;
-    pthread_mutex_unlock(&wallet->lock);
-
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be postdated
-        if (BRTransactionVSize(tx) > TX_MAX_SIZE) r = 1; // check transaction size is under TX_MAX_SIZE
-        
-        for (size_t i = 0; ! r && i < tx->inCount; i++) {
-            if (tx->inputs[i].sequence < UINT32_MAX - 1) r = 1; // check for replace-by-fee
-            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                tx->lockTime > blockHeight + 1) r = 1; // future lockTime
-            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime > now) r = 1; // future lockTime
-        }
-        
-        for (size_t i = 0; ! r && i < tx->outCount; i++) { // check that no outputs are dust
-            if (tx->outputs[i].amount < TX_MIN_OUTPUT_AMOUNT) r = 1;
-        }
-        
-        for (size_t i = 0; ! r && i < tx->inCount; i++) { // check if any inputs are known to be pending
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && BRWalletTransactionIsPending(wallet, t)) r = 1;
-        }
+    
+    if (tx) {
+        pthread_mutex_lock(&wallet->lock);
+        status = _BRWalletTxStatusFlags(wallet, _BRWalletTxStatus(wallet, tx), time(NULL));
+        pthread_mutex_unlock(&wallet->lock);
     }
     
-    return r;
+    return (status & TX_STATUS_PENDING) ? 1 : 0;
 }
 
 // true if tx is considered 0-conf safe (valid and not pending, timestamp is greater than 0, and no unverified inputs)
 int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    int r = 1;
+    uint8_t status = TX_STATUS_VERIFIED;
 
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be unverified
-        if (tx->timestamp == 0 || ! BRWalletTransactionIsValid(wallet, tx) ||
-            BRWalletTransactionIsPending(wallet, tx)) r = 0;
-            
-        for (size_t i = 0; r && i < tx->inCount; i++) { // check if any inputs are known to be unverified
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && ! BRWalletTransactionIsVerified(wallet, t)) r = 0;
-        }
+    if (tx) {
+        pthread_mutex_lock(&wallet->lock);
+        status = _BRWalletTxStatusFlags(wallet, _BRWalletTxStatus(wallet, tx), time(NULL));
+        pthread_mutex_unlock(&wallet->lock);
     }
     
-    return r;
+    return (status & TX_STATUS_VERIFIED) ? 1 : 0;
+}
+
+// writes the TX_STATUS_VALID, TX_STATUS_PENDING and TX_STATUS_VERIFIED flags of each given transaction to statuses
+void BRWalletTransactionStatuses(BRWallet *wallet, BRTransaction *transactions[], size_t txCount, uint8_t statuses[])
+{
+    time_t now = time(NULL);
+    
+    assert(wallet != NULL);
+    assert(transactions != NULL || txCount == 0);
+    assert(statuses != NULL || txCount == 0);
+    pthread_mutex_lock(&wallet->lock);
+    
+    for (size_t i = 0; transactions && statuses && i < txCount; i++) {
+        statuses[i] = _BRWalletTxStatusFlags(wallet, _BRWalletTxStatus(wallet, transactions[i]), now);
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
 }
 
 // set the block heights and timestamps for the given transactions
@@ -975,8 +3460,8 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
 {
     BRTransaction *tx;
     UInt256 hashes[txCount];
+    size_t i, j, k, pos = SIZE_MAX;
     int needsUpdate = 0;
-    size_t i, j, k;
     
     assert(wallet != NULL);
     assert(txHashes != NULL || txCount == 0);
@@ -986,71 +3471,231 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
     for (i = 0, j = 0; txHashes && i < txCount; i++) {
         tx = BRSetGet(wallet->allTx, &txHashes[i]);
         if (! tx || (tx->blockHeight == blockHeight && tx->timestamp == timestamp)) continue;
+        if (BRSetContains(wallet->archivedTx, tx)) continue; // archived txs are deeper than any re-org
+        k = _BRWalletTxPosition(wallet, tx, tx->blockHeight); // find tx in its old height bucket before moving it
+        if (k != SIZE_MAX) _BRWalletUnindexTx(wallet, tx, tx->blockHeight);
         tx->timestamp = timestamp;
         tx->blockHeight = blockHeight;
         
         if (_BRWalletContainsTx(wallet, tx)) {
-            for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
-                if (! BRTransactionEq(wallet->transactions[k - 1], tx)) continue;
-                array_rm(wallet->transactions, k - 1);
-                _BRWalletInsertTx(wallet, tx);
-                break;
+            if (k != SIZE_MAX) { // remove and re-insert tx to keep wallet sorted
+                array_rm(wallet->transactions, k);
+                if (k < pos) pos = k;
+                k = _BRWalletInsertTx(wallet, tx);
+                if (k < pos) pos = k;
+                _BRWalletIndexTx(wallet, tx);
             }
             
             hashes[j++] = txHashes[i];
-            if (BRSetContains(wallet->pendingTx, tx) || BRSetContains(wallet->invalidTx, tx)) needsUpdate = 1;
         }
         else if (blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
             BRSetRemove(wallet->allTx, tx);
             BRTransactionFree(tx);
+            needsUpdate = 1; // in case an unconfirmed wallet tx spends from it
         }
     }
     
-    if (needsUpdate) _BRWalletUpdateBalance(wallet);
+    if (pos != SIZE_MAX) _BRWalletUpdateBalance(wallet, pos);
+    else if (needsUpdate) _BRWalletUpdateUnconfirmedInfo(wallet);
     pthread_mutex_unlock(&wallet->lock);
-    if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
+    if (j > 0) _BRWalletTxUpdated(wallet, hashes, j, blockHeight, timestamp);
 }
 
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight)
 {
-    size_t i, j, count;
+    size_t i, j, start, count;
     
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
     wallet->blockHeight = blockHeight;
-    count = i = array_count(wallet->transactions);
-    while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
-    count -= i;
+    _BRWalletTxBucket(wallet, blockHeight, &start, &i);
+    count = array_count(wallet->transactions) - i;
 
     UInt256 hashes[count];
 
     for (j = 0; j < count; j++) {
+        _BRWalletUnindexTx(wallet, wallet->transactions[i + j], wallet->transactions[i + j]->blockHeight);
         wallet->transactions[i + j]->blockHeight = TX_UNCONFIRMED;
+        _BRWalletIndexTx(wallet, wallet->transactions[i + j]);
         hashes[j] = wallet->transactions[i + j]->txHash;
     }
     
-    if (count > 0) _BRWalletUpdateBalance(wallet);
+    // the txs no longer confirmed join the unconfirmed bucket, which may then need its dependency order fixed
+    _BRWalletSortTxBucket(wallet, i, array_count(wallet->transactions));
+    if (count > 0) _BRWalletUpdateBalance(wallet, i);
     pthread_mutex_unlock(&wallet->lock);
-    if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
+    if (count > 0) _BRWalletTxUpdated(wallet, hashes, count, TX_UNCONFIRMED, 0);
 }
 
-// returns the amount received by the wallet from the transaction (total outputs to change and/or receive addresses)
-uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
+// true if every output of tx to a wallet address has been spent
+static int _BRWalletTxIsSpent(BRWallet *wallet, const BRTransaction *tx)
 {
-    uint64_t amount = 0;
     const uint8_t *pkh;
     
+    for (size_t i = 0; i < tx->outCount; i++) {
+        pkh = (tx->outputs[i].address[0] != '\0') ? BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen) : NULL;
+        if (pkh && BRSetContains(wallet->allPKH, pkh) &&
+            ! BRSetContains(wallet->spentOutputs, &((const BRUTXO) { tx->txHash, (uint32_t)i }))) return 0;
+    }
+    
+    return 1;
+}
+
+// moves the oldest wallet transactions that are confirmed at least depth blocks below the wallet blockHeight, and
+// whose outputs to the wallet are all spent, into a compact serialized archive, and returns the number archived
+// archived transactions are freed, no longer returned by BRWalletTransactions() or queries, and keep only a summary
+// with their amounts, see BRWalletArchivedTransactions(), BRWalletTransactionForHash() returns a copy parsed from the
+// archive, except for those that later wallet transactions spend from, which stay in memory
+// NOTE: chain re-orgs deeper than depth aren't handled for archived transactions
+size_t BRWalletArchiveTransactions(BRWallet *wallet, uint32_t depth)
+{
+    BRTransaction *tx, **resident;
+    BRArchivedTx *a;
+    BRArchiveBase base = { NULL, NULL, 0, 0 };
+    BRSet *spentFrom = BRSetNew(BRTransactionHash, BRTransactionEq, 100);
+    size_t i, j, k, count, len, spent = 0, used = 0, added = 0, removed = 0;
+    
     assert(wallet != NULL);
-    assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
+    count = array_count(wallet->transactions);
+    
+    for (k = 0; wallet->blockHeight >= depth && k < count; k++) { // archive the longest run of old, spent txs
+        tx = wallet->transactions[k];
+        if (tx->blockHeight > wallet->blockHeight - depth || wallet->undo[k].status != UNDO_APPLIED) break;
+        if (! _BRWalletTxIsSpent(wallet, tx)) break;
+        spent += wallet->undo[k].spentCount;
+        used += wallet->undo[k].usedCount;
+        added += wallet->undo[k].addedCount;
+        removed += wallet->undo[k].removedCount;
+    }
     
-    // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
-    for (size_t i = 0; tx && i < tx->outCount; i++) {
-        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
-        if (pkh && BRSetContains(wallet->allPKH, pkh)) amount += tx->outputs[i].amount;
+    if (k > 0) {
+        base.spent = malloc((spent + 1)*sizeof(*base.spent));
+        base.used = malloc((used + 1)*sizeof(*base.used));
+        assert(base.spent != NULL && base.used != NULL);
+    }
+    
+    // copy the spent outputs and used pkhs that point into archived txs, and point the set entries at the copies
+    for (i = 0; i < spent; i++) {
+        base.spent[i] = (BRUTXO) { wallet->spentStack[i]->txHash, wallet->spentStack[i]->index };
+        BRSetAdd(wallet->spentOutputs, &base.spent[i]);
+    }
+    
+    for (i = 0; i < used; i++) {
+        UInt160Set(&base.used[i], UInt160Get(wallet->usedStack[i]));
+        _BRWalletMarkPKH(wallet, base.used[i].u8);
+    }
+    
+    base.spentCount = spent;
+    base.usedCount = used;
+    if (k > 0) array_add(wallet->archiveBases, base);
+    
+    for (i = k; i < count; i++) { // txs that remaining txs spend from are still needed for their amounts and fees
+        tx = wallet->transactions[i];
+        for (j = 0; j < tx->inCount; j++) BRSetAdd(spentFrom, &tx->inputs[j].txHash);
+    }
+    
+    for (i = 0; i < k; i++) {
+        tx = wallet->transactions[i];
+        a = calloc(1, sizeof(*a));
+        assert(a != NULL);
+        a->info = *(const BRTxInfo *)BRSetGet(wallet->txInfo, tx);
+        a->blockHeight = tx->blockHeight;
+        a->timestamp = tx->timestamp;
+        a->offset = array_count(wallet->archive);
+        len = BRTransactionSerialize(tx, NULL, 0);
+        a->length = (uint32_t)len;
+        
+        if (a->offset + len > array_capacity(wallet->archive)) {
+            array_set_capacity(wallet->archive, (a->offset + len)*3/2);
+        }
+        
+        BRTransactionSerialize(tx, &wallet->archive[a->offset], len);
+        array_count(wallet->archive) += len;
+        BRSetAdd(wallet->archivedTx, a);
+        _BRWalletRemoveTxInfo(wallet, tx);
+    }
+    
+    _BRWalletUnindexArchivedTxs(wallet, wallet->transactions, k);
+    resident = malloc((BRSetCount(wallet->allTx) + 1)*sizeof(*resident));
+    assert(resident != NULL);
+    count = BRSetAll(wallet->allTx, (void **)resident, BRSetCount(wallet->allTx));
+    
+    for (i = 0; i < count; i++) { // free archived txs, including earlier ones, that nothing spends from or could spend
+        tx = resident[i];
+        if (! BRSetContains(wallet->archivedTx, tx) || BRSetContains(spentFrom, tx)) continue;
+        if (! _BRWalletTxIsSpent(wallet, tx)) continue; // its spending tx was removed
+        BRSetRemove(wallet->allTx, tx);
+        array_add(wallet->archiveGarbage, tx); // a reader may still see tx in an older view
+    }
+    
+    free(resident);
+    BRSetFree(spentFrom);
+    if (spent > 0) array_rm_range(wallet->spentStack, 0, spent);
+    if (used > 0) array_rm_range(wallet->usedStack, 0, used);
+    if (added > 0) array_rm_range(wallet->addedStack, 0, added);
+    if (removed > 0) array_rm_range(wallet->removedStack, 0, removed);
+    
+    if (k > 0) {
+        wallet->archivedBalance = wallet->balanceHist[k - 1];
+        array_rm_range(wallet->transactions, 0, k);
+        array_rm_range(wallet->balanceHist, 0, k);
+        array_rm_range(wallet->undo, 0, k);
+        wallet->viewTxChanged = 0;
+#if BITCOIN_DEBUG
+        _BRWalletCheckBalance(wallet, time(NULL));
+#endif
+        _BRWalletPublishView(wallet);
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return k;
+}
+
+// writes the txHash, blockHeight, timestamp, and amounts of up to count archived transactions to summaries, oldest
+// first, and returns the number written, or the total number of archived transactions if summaries is NULL
+size_t BRWalletArchivedTransactions(BRWallet *wallet, BRTxSummary summaries[], size_t count)
+{
+    BRArchivedTx **all;
+    size_t i, n;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    n = BRSetCount(wallet->archivedTx);
+    
+    if (summaries && n > 0) {
+        all = malloc(n*sizeof(*all));
+        assert(all != NULL);
+        n = BRSetAll(wallet->archivedTx, (void **)all, n);
+        qsort(all, n, sizeof(*all), _BRArchivedTxOffsetCompare);
+        if (n > count) n = count;
+        
+        for (i = 0; i < n; i++) {
+            summaries[i] = (BRTxSummary) { all[i]->info.txHash, all[i]->blockHeight, all[i]->timestamp,
+                                           { all[i]->info.received, all[i]->info.sent, all[i]->info.fee,
+                                             all[i]->info.balanceAfter } };
+        }
+        
+        free(all);
     }
     
+    pthread_mutex_unlock(&wallet->lock);
+    return n;
+}
+
+// returns the amount received by the wallet from the transaction (total outputs to change and/or receive addresses)
+uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
+{
+    const BRTxInfo *info;
+    uint64_t amount = 0;
+    
+    assert(wallet != NULL);
+    assert(tx != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    info = (tx) ? _BRWalletTxInfo(wallet, tx) : NULL;
+    if (info) amount = info->received;
+    else if (tx) amount = _BRWalletTxReceived(wallet, tx);
     pthread_mutex_unlock(&wallet->lock);
     return amount;
 }
@@ -1058,23 +3703,15 @@ uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
 // returns the amount sent from the wallet by the trasaction (total wallet outputs consumed, change and fee included)
 uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
 {
+    const BRTxInfo *info;
     uint64_t amount = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
-    
-    for (size_t i = 0; tx && i < tx->inCount; i++) {
-        BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
-        uint32_t n = tx->inputs[i].index;
-        const uint8_t *pkh;
-
-        if (t && n < t->outCount) {
-            pkh = BRScriptPKH(t->outputs[n].script, t->outputs[n].scriptLen);
-            if (pkh && BRSetContains(wallet->allPKH, pkh)) amount += t->outputs[n].amount;
-        }
-    }
-    
+    info = (tx) ? _BRWalletTxInfo(wallet, tx) : NULL;
+    if (info) amount = info->sent;
+    else if (tx) amount = _BRWalletTxSent(wallet, tx);
     pthread_mutex_unlock(&wallet->lock);
     return amount;
 }
@@ -1082,49 +3719,58 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
 // returns the fee for the given transaction if all its inputs are from wallet transactions, UINT64_MAX otherwise
 uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
 {
+    const BRTxInfo *info;
     uint64_t amount = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
-    
-    for (size_t i = 0; tx && i < tx->inCount && amount != UINT64_MAX; i++) {
-        BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
-        uint32_t n = tx->inputs[i].index;
-        
-        if (t && n < t->outCount) {
-            amount += t->outputs[n].amount;
-        }
-        else amount = UINT64_MAX;
-    }
-    
+    info = (tx) ? _BRWalletTxInfo(wallet, tx) : NULL;
+    if (info) amount = info->fee;
+    else if (tx) amount = _BRWalletTxFee(wallet, tx);
     pthread_mutex_unlock(&wallet->lock);
-    
-    for (size_t i = 0; tx && i < tx->outCount && amount != UINT64_MAX; i++) {
-        amount -= tx->outputs[i].amount;
-    }
-    
     return amount;
 }
 
 // historical wallet balance after the given transaction, or current balance if transaction is not registered in wallet
 uint64_t BRWalletBalanceAfterTx(BRWallet *wallet, const BRTransaction *tx)
 {
+    const BRTxInfo *info;
     uint64_t balance;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
     pthread_mutex_lock(&wallet->lock);
-    balance = wallet->balance;
+    info = (tx) ? _BRWalletTxInfo(wallet, tx) : NULL;
+    balance = (info) ? info->balanceAfter : wallet->balance;
+    pthread_mutex_unlock(&wallet->lock);
+    return balance;
+}
+
+// writes the amount received, amount sent, fee, and balance after each given transaction to amounts
+void BRWalletTransactionAmounts(BRWallet *wallet, BRTransaction *transactions[], size_t txCount, BRTxAmounts amounts[])
+{
+    const BRTxInfo *info;
+    
+    assert(wallet != NULL);
+    assert(transactions != NULL || txCount == 0);
+    assert(amounts != NULL || txCount == 0);
+    pthread_mutex_lock(&wallet->lock);
     
-    for (size_t i = array_count(wallet->transactions); tx && i > 0; i--) {
-        if (! BRTransactionEq(tx, wallet->transactions[i - 1])) continue;
-        balance = wallet->balanceHist[i - 1];
-        break;
+    for (size_t i = 0; transactions && amounts && i < txCount; i++) {
+        info = _BRWalletTxInfo(wallet, transactions[i]);
+        
+        if (info) {
+            amounts[i] = (BRTxAmounts) { info->received, info->sent, info->fee, info->balanceAfter };
+        }
+        else {
+            amounts[i] = (BRTxAmounts) { _BRWalletTxReceived(wallet, transactions[i]),
+                                         _BRWalletTxSent(wallet, transactions[i]),
+                                         _BRWalletTxFee(wallet, transactions[i]), wallet->balance };
+        }
     }
-
+    
     pthread_mutex_unlock(&wallet->lock);
-    return balance;
 }
 
 // fee that will be added for a transaction of the given size in bytes
@@ -1178,26 +3824,19 @@ uint64_t BRWalletMinOutputAmount(BRWallet *wallet)
 // maximum amount that can be sent from the wallet to a single address after fees
 uint64_t BRWalletMaxOutputAmount(BRWallet *wallet)
 {
-    BRTransaction *tx;
-    BRUTXO *o;
     uint64_t fee, amount = 0;
-    size_t i, txSize, cpfpSize = 0, inCount = 0;
+    size_t txSize, cpfpSize = 0, inCount = 0;
 
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
 
-    for (i = array_count(wallet->utxos); i > 0; i--) {
-        o = &wallet->utxos[i - 1];
-        tx = BRSetGet(wallet->allTx, &o->hash);
-        if (! tx || o->n >= tx->outCount) continue;
-        inCount++;
-        amount += tx->outputs[o->n].amount;
-        
-//        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
-//        // don't include parent tx with more than 10 inputs or 10 outputs
-//        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
-//            ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionVSize(tx);
-    }
+    inCount = _BRUTXOIndexCount(&wallet->utxoIndex);
+    amount = wallet->utxoIndex.total;
+
+//    // size of unconfirmed, non-change inputs for child-pays-for-parent fee
+//    // don't include parent tx with more than 10 inputs or 10 outputs
+//    if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
+//        ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionVSize(tx);
 
     txSize = 8 + BRVarIntSize(inCount) + TX_INPUT_SIZE*inCount + BRVarIntSize(2) + TX_OUTPUT_SIZE*2;
     fee = _txFee(wallet->feePerKb, txSize + cpfpSize);
@@ -1211,13 +3850,46 @@ static void _setApplyFreeTx(void *info, void *tx)
     BRTransactionFree(tx);
 }
 
+static void _setApplyFree(void *info, void *item)
+{
+    free(item);
+}
+
+static void _setApplyFreePKHTxs(void *info, void *item)
+{
+    array_free(((BRPKHTxs *)item)->txs);
+    free(item);
+}
+
 // frees memory allocated for wallet, and calls BRTransactionFree() for all registered transactions
 void BRWalletFree(BRWallet *wallet)
 {
     assert(wallet != NULL);
+    BRWalletSetEventBatching(wallet, 0, wallet->threadCleanup); // deliver any queued callbacks first
     pthread_mutex_lock(&wallet->lock);
     BRSetFree(wallet->allPKH);
+    BRSetApply(wallet->txInfo, NULL, _setApplyFree);
+    BRSetFree(wallet->txInfo);
+    BRSetApply(wallet->pkhTxs, NULL, _setApplyFreePKHTxs);
+    BRSetFree(wallet->pkhTxs);
+    BRSetApply(wallet->archivedTx, NULL, _setApplyFree);
+    BRSetFree(wallet->archivedTx);
+    BRSetApply(wallet->rehydratedTx, NULL, _setApplyFreeTx);
+    BRSetFree(wallet->rehydratedTx);
+    array_free(wallet->archive);
+    
+    for (size_t i = 0; i < array_count(wallet->archiveBases); i++) {
+        free(wallet->archiveBases[i].spent);
+        free(wallet->archiveBases[i].used);
+    }
+    
+    array_free(wallet->archiveBases);
+    for (size_t i = 0; i < array_count(wallet->archiveGarbage); i++) BRTransactionFree(wallet->archiveGarbage[i]);
+    array_free(wallet->archiveGarbage);
+    for (size_t i = 0; i < array_count(wallet->pkhPathBlocks); i++) free(wallet->pkhPathBlocks[i]);
+    array_free(wallet->pkhPathBlocks);
     BRSetFree(wallet->usedPKH);
+    BRSetFree(wallet->foreignPKH);
     BRSetFree(wallet->invalidTx);
     BRSetFree(wallet->pendingTx);
     BRSetApply(wallet->allTx, NULL, _setApplyFreeTx);
@@ -1225,10 +3897,33 @@ void BRWalletFree(BRWallet *wallet)
     BRSetFree(wallet->spentOutputs);
     array_free(wallet->internalChain);
     array_free(wallet->externalChain);
+    array_free(wallet->internalBalances);
+    array_free(wallet->externalBalances);
     array_free(wallet->balanceHist);
     array_free(wallet->transactions);
-    array_free(wallet->utxos);
+    _BRUTXOIndexFree(&wallet->utxoIndex);
+    array_free(wallet->undo);
+    array_free(wallet->spentStack);
+    array_free(wallet->usedStack);
+    array_free(wallet->addedStack);
+    array_free(wallet->removedStack);
+    
+    for (size_t i = 0; i < array_count(wallet->retiredViews); i++) {
+        assert(wallet->retiredViews[i]->refs == 0);
+        _BRWalletViewFree(wallet->retiredViews[i]);
+    }
+    
+    array_free(wallet->retiredViews);
+    _BRWalletViewFree(wallet->view);
+    _BRViewArrayFree(&wallet->nextView.transactions);
+    _BRViewArrayFree(&wallet->nextView.utxos);
+    _BRViewArrayFree(&wallet->nextView.internalChain);
+    _BRViewArrayFree(&wallet->nextView.externalChain);
+    array_free(wallet->events);
     pthread_mutex_unlock(&wallet->lock);
+    pthread_cond_destroy(&wallet->eventCond);
+    pthread_mutex_destroy(&wallet->eventLock);
+    pthread_mutex_destroy(&wallet->viewLock);
     pthread_mutex_destroy(&wallet->lock);
     free(wallet);
 }
@@ -39,6 +39,10 @@ extern "C" {
 #define MIN_FEE_PER_KB     TX_FEE_PER_KB                       // bitcoind 0.12 default min-relay fee
 #define MAX_FEE_PER_KB     ((TX_FEE_PER_KB*1000100 + 190)/191) // slightly higher than a 10,000bit fee on a 191byte tx
 
+#define TX_STATUS_VALID    0x01 // see BRWalletTransactionIsValid()
+#define TX_STATUS_PENDING  0x02 // see BRWalletTransactionIsPending()
+#define TX_STATUS_VERIFIED 0x04 // see BRWalletTransactionIsVerified()
+
 typedef struct {
     UInt256 hash;
     uint32_t n;
@@ -58,10 +62,47 @@ inline static int BRUTXOEq(const void *utxo, const void *otherUtxo)
 
 typedef struct BRWalletStruct BRWallet;
 
+typedef struct {
+    uint64_t received; // see BRWalletAmountReceivedFromTx()
+    uint64_t sent; // see BRWalletAmountSentByTx()
+    uint64_t fee; // see BRWalletFeeForTx()
+    uint64_t balanceAfter; // see BRWalletBalanceAfterTx()
+} BRTxAmounts;
+
+typedef struct {
+    UInt256 txHash;
+    uint32_t blockHeight;
+    uint32_t timestamp;
+    BRTxAmounts amounts;
+} BRTxSummary;
+
+typedef struct {
+    uint32_t fromHeight, toHeight; // inclusive block height range, use TX_UNCONFIRMED to include unconfirmed txs
+    uint32_t fromTime, toTime; // inclusive timestamp range, checked for each tx in the height range
+    int newestFirst; // true to return transactions in descending order
+    const char *address; // if not NULL, only transactions that send to or spend from address
+} BRTxQuery;
+
+// position in a transaction query, initialize to { 0, UINT256_ZERO } to start at the beginning of the results
+typedef struct {
+    uint32_t blockHeight;
+    UInt256 txHash;
+} BRTxCursor;
+
 // allocates and populates a BRWallet struct that must be freed by calling BRWalletFree()
 // forkId is 0 for bitcoin, 0x40 for b-cash
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk, int forkId);
 
+// writes a versioned, checksummed snapshot of the wallet to buf, for loading with BRWalletLoadSnapshot()
+// returns number of bytes written, or total bufLen needed if buf is NULL
+size_t BRWalletSerialize(BRWallet *wallet, uint8_t *buf, size_t bufLen);
+
+// allocates and populates a BRWallet struct from a snapshot written by BRWalletSerialize(), which must be freed by
+// calling BRWalletFree(), without deriving any addresses or replaying confirmed transactions
+// buf may be a memory mapped file and isn't referenced after this returns
+// returns NULL if the snapshot is corrupt, from an unknown version, or was made for a different mpk or forkId
+BRWallet *BRWalletLoadSnapshot(const uint8_t *buf, size_t bufLen, BRMasterPubKey mpk, int forkId);
+
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -76,6 +117,20 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
                                             uint32_t timestamp),
                           void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan));
 
+// not thread-safe, set once after BRWalletSetCallbacks(), before calling other BRWallet functions
+// void txsAdded(void *, BRTransaction *[], size_t) - if set, called instead of txAdded, once with all the transactions
+//   added by a BRWalletRegisterTransactions() call (or a run of added transactions when events are batched)
+void BRWalletSetTxsAddedCallback(BRWallet *wallet, void (*txsAdded)(void *info, BRTransaction *txs[], size_t txCount));
+
+// not thread-safe, call after setting callbacks, before calling other BRWallet functions
+// if flushLatency is non-zero, callbacks are queued and delivered in batches on a dedicated notifier thread, at most
+// flushLatency milliseconds after the first queued one, instead of being called from whichever thread changed the
+// wallet: runs of added txs are combined into one txsAdded call (if set), runs of updated txs with the same
+// blockHeight and timestamp into one txUpdated call, and balanceChanged is called once with the latest balance
+// a flushLatency of 0 delivers any queued callbacks, stops the notifier thread, and goes back to direct callbacks
+// threadCleanup is called on the notifier thread just before it exits, e.g. to detach it from a JVM
+void BRWalletSetEventBatching(BRWallet *wallet, uint32_t flushLatency, void (*threadCleanup)(void *info));
+
 // wallets are composed of chains of addresses
 // each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
 // this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
@@ -97,9 +152,20 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount);
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr);
 
+// true if hash160 is the pubkey hash of an address previously generated by BRWalletUnusedAddrs()
+int BRWalletContainsHash160(BRWallet *wallet, UInt160 hash160);
+
 // true if the address was previously used as an input or output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr);
 
+// writes transactions that send to or spend from addr, ordered by block height and then tx hash, to the given
+// transactions array, returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTransactionsForAddress(BRWallet *wallet, const char *addr, BRTransaction *transactions[],
+                                      size_t txCount);
+
+// unspent balance of a wallet address, the part of the wallet balance that's been sent to it and not yet spent
+uint64_t BRWalletAddressBalance(BRWallet *wallet, const char *addr);
+
 // writes transactions registered in the wallet, sorted by date, oldest first, to the given transactions array
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount);
@@ -109,6 +175,12 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight);
 
+// writes up to txCount transactions matching query that come after cursor, ordered by block height and then tx hash,
+// or in reverse if query->newestFirst is set, and updates cursor to the last transaction written
+// returns the number of transactions written, which is less than txCount only if there are no more matches
+size_t BRWalletQueryTransactions(BRWallet *wallet, const BRTxQuery *query, BRTxCursor *cursor,
+                                 BRTransaction *transactions[], size_t txCount);
+
 // current wallet balance, not including transactions known to be invalid
 uint64_t BRWalletBalance(BRWallet *wallet);
 
@@ -144,10 +216,15 @@ int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx);
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
 int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx);
 
+// adds the transactions associated with the wallet, in any order, and returns the number added
+// the wallet balance is updated and new addresses are generated once for the whole batch, rather than once per tx
+size_t BRWalletRegisterTransactions(BRWallet *wallet, BRTransaction *txs[], size_t txCount);
+
 // removes a tx from the wallet, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash);
 
 // returns the transaction with the given hash if it's been registered in the wallet
+// an archived transaction is parsed from the archive the first time it's asked for, and kept until BRWalletFree()
 BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash);
 
 // true if no previous wallet transaction spends any of the given transaction's inputs, and no inputs are invalid
@@ -159,6 +236,9 @@ int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx);
 // true if tx is considered 0-conf safe (valid and not pending, timestamp is greater than 0, and no unverified inputs)
 int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx);
 
+// writes the TX_STATUS_VALID, TX_STATUS_PENDING and TX_STATUS_VERIFIED flags of each given transaction to statuses
+void BRWalletTransactionStatuses(BRWallet *wallet, BRTransaction *transactions[], size_t txCount, uint8_t statuses[]);
+
 // set the block heights and timestamps for the given transactions
 // use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
 void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
@@ -167,6 +247,18 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight);
 
+// moves the oldest wallet transactions that are confirmed at least depth blocks below the wallet blockHeight, and
+// whose outputs to the wallet are all spent, into a compact serialized archive, and returns the number archived
+// archived transactions are freed, no longer returned by BRWalletTransactions() or queries, and keep only a summary
+// with their amounts, see BRWalletArchivedTransactions(), BRWalletTransactionForHash() returns a copy parsed from the
+// archive, except for those that later wallet transactions spend from, which stay in memory
+// NOTE: chain re-orgs deeper than depth aren't handled for archived transactions
+size_t BRWalletArchiveTransactions(BRWallet *wallet, uint32_t depth);
+
+// writes the txHash, blockHeight, timestamp, and amounts of up to count archived transactions to summaries, oldest
+// first, and returns the number written, or the total number of archived transactions if summaries is NULL
+size_t BRWalletArchivedTransactions(BRWallet *wallet, BRTxSummary summaries[], size_t count);
+
 // returns the amount received by the wallet from the transaction (total outputs to change and/or receive addresses)
 uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx);
 
@@ -179,6 +271,9 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx);
 // historical wallet balance after the given transaction, or current balance if transaction is not registered in wallet
 uint64_t BRWalletBalanceAfterTx(BRWallet *wallet, const BRTransaction *tx);
 
+// writes the amount received, amount sent, fee, and balance after each given transaction to amounts
+void BRWalletTransactionAmounts(BRWallet *wallet, BRTransaction *transactions[], size_t txCount, BRTxAmounts amounts[]);
+
 // fee that will be added for a transaction of the given size in bytes
 uint64_t BRWalletFeeForTxSize(BRWallet *wallet, size_t size);
 
@@ -25,6 +25,8 @@
 #include "BRCrypto.h"
 #include "BRBloomFilter.h"
 #include "BRMerkleBlock.h"
+#include "BRHeaderStore.h"
+#include "BRPeerStore.h"
 #include "BRWallet.h"
 #include "BRKey.h"
 #include "BRBIP38Key.h"
@@ -49,6 +51,7 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #define SKIP_BIP38 1
@@ -2072,6 +2075,45 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
     printf("tx deleted: %s\n", u256hex(txHash));
 }
 
+static void walletTxsAdded(void *info, BRTransaction *txs[], size_t txCount)
+{
+    size_t *counts = info;
+    
+    counts[0]++; // number of calls
+    counts[1] += txCount;
+}
+
+typedef struct {
+    BRWallet *wallet;
+    volatile int done;
+    int failed;
+    size_t reads;
+} BRWalletReader;
+
+// reads the wallet while it's being funded, the tx count and balance must never go backwards
+static void *walletReaderThread(void *info)
+{
+    BRWalletReader *reader = info;
+    BRTransaction *txs[400];
+    size_t i, txCount, prevCount = 0;
+    uint64_t balance, prevBalance = 0;
+    
+    while (! reader->done || reader->reads == 0) {
+        txCount = BRWalletTransactions(reader->wallet, txs, 400);
+        balance = BRWalletBalance(reader->wallet);
+        if (txCount < prevCount || balance < prevBalance || BRWalletUTXOs(reader->wallet, NULL, 0) > 400) {
+            reader->failed = 1;
+        }
+        
+        for (i = 0; i < txCount; i++) if (! txs[i] || txs[i]->outCount != 1) reader->failed = 1;
+        prevCount = txCount;
+        prevBalance = balance;
+        reader->reads++;
+    }
+    
+    return NULL;
+}
+
 // TODO: test standard free transaction no change
 // TODO: test free transaction who's inputs are too new to hit min free priority
 // TODO: test transaction with change below min allowable output
@@ -2198,14 +2240,43 @@ int BRWalletTests()
 
     if (tx && BRWalletTransactionIsPending(w, tx))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsPending() test 2\n", __func__);
-    
+
+    BRTransaction *txList[2];
+    uint8_t statuses[2];
+
+    BRWalletTransactionStatuses(w, txList, BRWalletTransactions(w, txList, 2), statuses);
+    if (statuses[0] != (TX_STATUS_VALID | TX_STATUS_VERIFIED) || statuses[1] != (TX_STATUS_VALID | TX_STATUS_VERIFIED))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionStatuses() test 1\n", __func__);
+
+    BRWalletUpdateTransactions(w, &hash, 1, TX_UNCONFIRMED, 0); // first tx, and so the tx spending it, is unverified
+    BRWalletTransactionStatuses(w, txList, BRWalletTransactions(w, txList, 2), statuses);
+    if (statuses[0] != TX_STATUS_VALID || statuses[1] != TX_STATUS_VALID ||
+        (tx && BRWalletTransactionIsVerified(w, tx)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionStatuses() test 2\n", __func__);
+
+    BRTxAmounts txAmounts[2];
+
+    BRWalletTransactionAmounts(w, txList, BRWalletTransactions(w, txList, 2), txAmounts);
+    if (txAmounts[0].received != SATOSHIS || txAmounts[0].sent != 0 || txAmounts[0].fee != UINT64_MAX ||
+        txAmounts[0].balanceAfter != SATOSHIS || ! tx || txAmounts[1].sent != SATOSHIS ||
+        txAmounts[1].received != BRWalletAmountReceivedFromTx(w, tx) || txAmounts[1].fee != BRWalletFeeForTx(w, tx) ||
+        txAmounts[1].balanceAfter != BRWalletBalance(w))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionAmounts() test\n", __func__);
+
     BRWalletRemoveTransaction(w, hash); // removing first tx should recursively remove second, leaving none
     if (BRWalletTransactions(w, NULL, 0) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() test\n", __func__);
 
     if (! BRAddressEq(BRWalletReceiveAddress(w).s, recvAddr.s)) // verify used addresses are correctly tracked
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletReceiveAddress() test\n", __func__);
-    
+
+    UInt160 recvHash = UINT160_ZERO;
+
+    BRAddressHash160(&recvHash, recvAddr.s);
+    if (! BRWalletContainsAddress(w, recvAddr.s) || ! BRWalletContainsHash160(w, recvHash) ||
+        BRWalletContainsHash160(w, UINT160_ZERO))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletContainsHash160() test\n", __func__);
+
     if (BRWalletFeeForTxAmount(w, SATOSHIS) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeForTxAmount() test 2\n", __func__);
     
@@ -2230,6 +2301,256 @@ int BRWalletTests()
     BRTransactionFree(tx);
     BRWalletFree(w);
     
+    BRKey gapKey; // first external address past the gap limit
+    BRAddress gapAddr;
+    uint8_t gapPubKey[BRBIP32PubKey(NULL, 0, mpk, SEQUENCE_EXTERNAL_CHAIN, SEQUENCE_GAP_LIMIT_EXTERNAL)];
+    
+    BRKeySetPubKey(&gapKey, gapPubKey, BRBIP32PubKey(gapPubKey, sizeof(gapPubKey), mpk, SEQUENCE_EXTERNAL_CHAIN,
+                                                     SEQUENCE_GAP_LIMIT_EXTERNAL));
+    BRKeyAddress(&gapKey, gapAddr.s, sizeof(gapAddr));
+    
+    uint8_t gapScript[BRAddressScriptPubKey(NULL, 0, gapAddr.s)];
+    size_t gapScriptLen = BRAddressScriptPubKey(gapScript, sizeof(gapScript), gapAddr.s);
+    
+    w = BRWalletNew(NULL, 0, mpk, 0);
+    tx = BRTransactionNew(); // pays the receive address, the address past the gap limit, and a non-wallet address
+    BRTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, 1000000, outScript, outScriptLen);
+    BRTransactionAddOutput(tx, 2000000, gapScript, gapScriptLen);
+    BRTransactionAddOutput(tx, 3000000, inScript, inScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    BRWalletRegisterTransaction(w, tx);
+    
+    if (BRWalletBalance(w) != 3000000 || ! BRWalletAddressIsUsed(w, recvAddr.s) ||
+        ! BRWalletAddressIsUsed(w, gapAddr.s) || BRWalletAddressIsUsed(w, addr.s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAddressIsUsed() test\n", __func__);
+    
+    BRWalletFree(w);
+    
+    BRWalletReader reader = { BRWalletNew(NULL, 0, mpk, 0), 0, 0, 0 };
+    BRTransaction *funding[300];
+    pthread_t readerThread;
+    int readerStarted = (pthread_create(&readerThread, NULL, walletReaderThread, &reader) == 0);
+    
+    for (size_t i = 0; i < 300; i++) { // more txs and utxos than fit in one view chunk
+        funding[i] = BRTransactionNew();
+        BRTransactionAddInput(funding[i], inHash, (uint32_t)i, 1, inScript, inScriptLen, NULL, 0, NULL, 0,
+                              TXIN_SEQUENCE);
+        BRTransactionAddOutput(funding[i], 10000 + i, outScript, outScriptLen);
+        BRTransactionSign(funding[i], 0, &k, 1);
+        BRWalletRegisterTransaction(reader.wallet, funding[i]);
+    }
+    
+    reader.done = 1;
+    if (readerStarted) pthread_join(readerThread, NULL);
+    
+    if (! readerStarted || reader.failed || BRWalletTransactions(reader.wallet, NULL, 0) != 300 ||
+        BRWalletUTXOs(reader.wallet, NULL, 0) != 300 || BRWalletBalance(reader.wallet) != 300*10000 + 299*300/2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalance() concurrent read test\n", __func__);
+    
+    BRTransaction *viewTxs[300];
+    size_t viewCount;
+    
+    BRWalletRemoveTransaction(reader.wallet, funding[150]->txHash); // changes one chunk of the published view
+    viewCount = BRWalletTransactions(reader.wallet, viewTxs, 300);
+    for (size_t i = 0; i < viewCount; i++) if (viewTxs[i]->outputs[0].amount == 10000 + 150) viewCount = 0;
+    
+    if (viewCount != 299 || BRWalletUTXOs(reader.wallet, NULL, 0) != 299 ||
+        BRWalletBalance(reader.wallet) != 300*10000 + 299*300/2 - (10000 + 150))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() view update test\n", __func__);
+    
+    BRWalletFree(reader.wallet);
+    
+    BRTransaction *txs[3];
+    uint64_t amounts[3] = { 1000000, 2000000, 5000000 };
+    
+    for (size_t i = 0; i < 3; i++) {
+        txs[i] = BRTransactionNew();
+        BRTransactionAddInput(txs[i], inHash, (uint32_t)i, 1, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(txs[i], amounts[i], outScript, outScriptLen);
+        BRTransactionSign(txs[i], 0, &k, 1);
+    }
+    
+    w = BRWalletNew(txs, 3, mpk, 0);
+    tx = BRWalletCreateTransaction(w, 3000000 - 4000, addr.s); // 1m + 2m covers this without change, 5m doesn't
+    
+    if (! tx || tx->inCount != 2 || tx->outCount != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() changeless test\n", __func__);
+    
+    if (tx && BRWalletAmountSentByTx(w, tx) != 3000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() changeless test 2\n", __func__);
+
+    if (tx) BRTransactionFree(tx);
+    tx = BRWalletCreateTransaction(w, 4000000, addr.s); // smallest single output that covers amount plus change
+    
+    if (! tx || tx->inCount != 1 || tx->outCount != 2 || BRWalletAmountSentByTx(w, tx) != 5000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() single input test\n", __func__);
+
+    if (tx) BRWalletSignTransaction(w, tx, &seed, sizeof(seed));
+    if (tx && BRTransactionIsSigned(tx)) tx->timestamp = 1, BRWalletRegisterTransaction(w, tx);
+    txs[0]->blockHeight = 1; // confirming an earlier tx updates the balance starting from its new position
+    BRWalletUpdateTransactions(w, &txs[0]->txHash, 1, 1, 1);
+
+    if (! tx || BRWalletBalance(w) != 8000000 - BRWalletAmountSentByTx(w, tx) + BRWalletAmountReceivedFromTx(w, tx))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() incremental balance test\n", __func__);
+
+    if (tx) BRWalletRemoveTransaction(w, tx->txHash);
+
+    if (BRWalletBalance(w) != 8000000 || BRWalletUTXOs(w, NULL, 0) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() incremental balance test\n", __func__);
+
+    tx = BRWalletCreateTransaction(w, 4000000, BRWalletReceiveAddress(w).s);
+    if (tx) BRWalletSignTransaction(w, tx, &seed, sizeof(seed));
+    if (tx && BRTransactionIsSigned(tx)) BRWalletRegisterTransaction(w, tx);
+
+    if (tx) { // confirm the spending tx first, then the tx it spends from, both in the same block
+        UInt256 hash = tx->inputs[0].txHash;
+        BRTransaction *list[5];
+
+        BRWalletUpdateTransactions(w, &tx->txHash, 1, 2, 2);
+        BRWalletUpdateTransactions(w, &hash, 1, 2, 2);
+
+        if (BRWalletTransactions(w, list, 5) != 4 || ! UInt256Eq(list[1]->txHash, hash) || list[2] != tx)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() same block order test\n",
+                           __func__);
+    }
+    else r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() same block order test\n", __func__);
+
+    BRTxQuery query = { 0, TX_UNCONFIRMED, 0, UINT32_MAX, 1, NULL };
+    BRTxCursor cursor = { 0, UINT256_ZERO };
+    BRTransaction *page[3];
+    size_t pageCount = BRWalletQueryTransactions(w, &query, &cursor, page, 3);
+
+    if (! tx || pageCount != 3 || page[0]->blockHeight != TX_UNCONFIRMED || page[2]->blockHeight != 2 ||
+        BRWalletQueryTransactions(w, &query, &cursor, page, 3) != 1 || page[0]->blockHeight != 1 ||
+        BRWalletQueryTransactions(w, &query, &cursor, page, 3) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletQueryTransactions() test 1\n", __func__);
+
+    query = (BRTxQuery) { 1, 2, 0, UINT32_MAX, 0, addr.s }; // txs spending from addr, confirmed in blocks 1 to 2
+    cursor = (BRTxCursor) { 0, UINT256_ZERO };
+    pageCount = BRWalletQueryTransactions(w, &query, &cursor, page, 3);
+
+    if (pageCount != 2 || page[0]->blockHeight != 1 || page[1]->blockHeight != 2 || page[1] == tx)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletQueryTransactions() test 2\n", __func__);
+
+    size_t addrCount = BRWalletAllAddrs(w, NULL, 0);
+    BRAddress *addrs = calloc(addrCount, sizeof(*addrs));
+    uint64_t addrTotal = 0;
+
+    addrCount = BRWalletAllAddrs(w, addrs, addrCount);
+    for (size_t i = 0; i < addrCount; i++) addrTotal += BRWalletAddressBalance(w, addrs[i].s);
+    free(addrs);
+
+    if (addrTotal != BRWalletBalance(w) || BRWalletAddressBalance(w, addr.s) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAddressBalance() test\n", __func__);
+
+    query = (BRTxQuery) { 0, TX_UNCONFIRMED, 0, UINT32_MAX, 0, addr.s };
+    cursor = (BRTxCursor) { 0, UINT256_ZERO };
+    pageCount = BRWalletQueryTransactions(w, &query, &cursor, page, 3);
+
+    if (BRWalletTransactionsForAddress(w, addr.s, NULL, 0) != pageCount ||
+        BRWalletTransactionsForAddress(w, addr.s, page, 1) != 1 || page[0]->blockHeight != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsForAddress() test\n", __func__);
+
+    size_t snapLen = BRWalletSerialize(w, NULL, 0);
+    uint8_t *snap = malloc(snapLen);
+    BRWallet *w2 = (snapLen > 0 && BRWalletSerialize(w, snap, snapLen) == snapLen) ?
+                   BRWalletLoadSnapshot(snap, snapLen, mpk, 0) : NULL;
+    BRTransaction *list2[5];
+
+    if (! w2 || ! tx || BRWalletBalance(w2) != BRWalletBalance(w) || BRWalletTransactions(w2, list2, 5) != 4 ||
+        BRWalletUTXOs(w2, NULL, 0) != BRWalletUTXOs(w, NULL, 0) ||
+        ! UInt256Eq(list2[2]->txHash, tx->txHash) ||
+        BRWalletBalanceAfterTx(w2, list2[2]) != BRWalletBalanceAfterTx(w, tx) ||
+        ! BRAddressEq(BRWalletReceiveAddress(w2).s, BRWalletReceiveAddress(w).s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletLoadSnapshot() test 1\n", __func__);
+
+    if (w2) BRWalletFree(w2);
+    snap[snapLen/2] ^= 1;
+    w2 = BRWalletLoadSnapshot(snap, snapLen, mpk, 0);
+
+    if (w2) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletLoadSnapshot() test 2\n", __func__);
+
+    if (w2) BRWalletFree(w2);
+    free(snap);
+    w2 = BRWalletNew(NULL, 0, mpk, 0);
+    size_t addedCounts[2] = { 0, 0 };
+    
+    if (w2) {
+        BRWalletSetCallbacks(w2, addedCounts, NULL, NULL, NULL, NULL);
+        BRWalletSetTxsAddedCallback(w2, walletTxsAdded);
+        BRWalletSetEventBatching(w2, 60000, NULL); // hold callbacks until the notifier is stopped
+    }
+
+    if (w2 && BRWalletTransactions(w, list2, 5) == 4) { // register copies of the wallet txs in one batch, with
+        for (size_t i = 0; i < 4; i++) list2[i] = BRTransactionCopy(list2[i]); // spending txs before their inputs
+        for (size_t i = 0; i < 2; i++) tx = list2[i], list2[i] = list2[3 - i], list2[3 - i] = tx;
+        list2[4] = BRTransactionCopy(list2[0]); // a duplicate is skipped, and stays owned by the caller
+
+        if (BRWalletRegisterTransactions(w2, list2, 5) != 4 || BRWalletBalance(w2) != BRWalletBalance(w) ||
+            BRWalletUTXOs(w2, NULL, 0) != BRWalletUTXOs(w, NULL, 0) ||
+            ! BRAddressEq(BRWalletReceiveAddress(w2).s, BRWalletReceiveAddress(w).s))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransactions() test\n", __func__);
+
+        BRTransactionFree(list2[4]);
+    }
+    else r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransactions() test\n", __func__);
+
+    size_t queuedCount = addedCounts[0];
+
+    if (w2) BRWalletSetEventBatching(w2, 0, NULL); // deliver queued callbacks
+
+    if (queuedCount != 0 || addedCounts[0] != 1 || addedCounts[1] != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetEventBatching() test\n", __func__);
+
+    if (w2) BRWalletFree(w2);
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, inHash, 5, 1, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, 1000000, outScript, outScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    tx->blockHeight = 1;
+    w2 = BRWalletNew(&tx, 1, mpk, 0);
+    
+    UInt256 archivedHash = tx->txHash;
+    BRTxSummary summary;
+    
+    tx = BRWalletCreateTransaction(w2, 500000, addr.s); // spends all of the first tx, and keeps its change unspent
+    if (tx) BRWalletSignTransaction(w2, tx, &seed, sizeof(seed));
+    if (tx && BRTransactionIsSigned(tx)) BRWalletRegisterTransaction(w2, tx);
+    if (tx) BRWalletUpdateTransactions(w2, &tx->txHash, 1, 2, 2);
+    BRWalletSetTxUnconfirmedAfter(w2, 10);
+    uint64_t balance = BRWalletBalance(w2);
+
+    if (! tx || BRWalletArchiveTransactions(w2, 6) != 1 || BRWalletBalance(w2) != balance ||
+        BRWalletTransactions(w2, list2, 5) != 1 || list2[0] != tx ||
+        BRWalletArchivedTransactions(w2, &summary, 1) != 1 || ! UInt256Eq(summary.txHash, archivedHash) ||
+        summary.blockHeight != 1 || summary.amounts.received != 1000000 ||
+        ! BRWalletTransactionForHash(w2, archivedHash) || BRWalletArchiveTransactions(w2, 6) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletArchiveTransactions() test 1\n", __func__);
+
+    BRWalletSetTxUnconfirmedAfter(w2, 1); // re-applying the spending tx still finds the archived tx it spends from
+    list2[0] = BRTransactionCopy(BRWalletTransactionForHash(w2, archivedHash));
+
+    if (! tx || BRWalletBalance(w2) != balance || BRWalletAmountSentByTx(w2, tx) != 1000000 ||
+        BRWalletRegisterTransactions(w2, list2, 1) != 0 || BRWalletBalance(w2) != balance)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletArchiveTransactions() test 2\n", __func__);
+
+    BRTransactionFree(list2[0]);
+    snapLen = BRWalletSerialize(w2, NULL, 0);
+    snap = malloc(snapLen);
+    BRWallet *w3 = (snapLen > 0 && BRWalletSerialize(w2, snap, snapLen) == snapLen) ?
+                   BRWalletLoadSnapshot(snap, snapLen, mpk, 0) : NULL;
+
+    if (! w3 || BRWalletBalance(w3) != balance || BRWalletArchivedTransactions(w3, NULL, 0) != 1 ||
+        BRWalletTransactions(w3, list2, 5) != 1 || BRWalletAmountSentByTx(w3, list2[0]) != 1000000 ||
+        BRWalletAmountReceivedFromTx(w3, BRWalletTransactionForHash(w3, archivedHash)) != 1000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletArchiveTransactions() snapshot test\n", __func__);
+
+    if (w3) BRWalletFree(w3);
+    free(snap);
+    BRWalletFree(w2);
+    BRWalletFree(w);
+    
     amt = BRBitcoinAmount(50000, 50000);
     if (amt != SATOSHIS) r = 0, fprintf(stderr, "***FAILED*** %s: BRBitcoinAmount() test 1\n", __func__);
 
@@ -2317,6 +2638,31 @@ int BRBloomFilterTests()
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterSerialize() test 2\n", __func__);
     
     BRBloomFilterFree(f);
+
+    BRRollingBloomFilter *rf = BRRollingBloomFilterNew(0.01, 1000, 0);
+    size_t length = rf->length, fpCount = 0, oldCount = 0;
+    uint32_t n;
+
+    for (n = 0; n < 3000; n++) BRRollingBloomFilterInsertData(rf, (uint8_t *)&n, sizeof(n));
+    
+    for (n = 2000; n < 3000; n++) {
+        if (BRRollingBloomFilterContainsData(rf, (uint8_t *)&n, sizeof(n))) continue;
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRRollingBloomFilterContainsData() test 1\n", __func__);
+        break;
+    }
+
+    for (n = 0; n < 500; n++) if (BRRollingBloomFilterContainsData(rf, (uint8_t *)&n, sizeof(n))) oldCount++;
+    
+    // oldest generation should be forgotten
+    if (oldCount > 25)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRRollingBloomFilterContainsData() test 2\n", __func__);
+
+    for (n = 100000; n < 110000; n++) if (BRRollingBloomFilterContainsData(rf, (uint8_t *)&n, sizeof(n))) fpCount++;
+    
+    if (fpCount > 300 || rf->length != length)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRRollingBloomFilterContainsData() test 3\n", __func__);
+
+    BRRollingBloomFilterFree(rf);
     return r;
 }
 
@@ -2414,6 +2760,143 @@ int BRMerkleBlockTests()
     return r;
 }
 
+int BRHeaderStoreTests()
+{
+    int r = 1;
+    const char *path = "BRHeaderStoreTests.tmp";
+    char header[] = // block 10001 header
+    "\x01\x00\x00\x00\x06\xe5\x33\xfd\x1a\xda\x86\x39\x1f\x3f\x6c\x34\x32\x04\xb0\xd2\x78\xd4\xaa\xec\x1c\x0b"
+    "\x20\xaa\x27\xba\x03\x00\x00\x00\x00\x00\x6a\xbb\xb3\xeb\x3d\x73\x3a\x9f\xe1\x89\x67\xfd\x7d\x4c\x11\x7e"
+    "\x4c\xcb\xba\xc5\xbe\xc4\xd9\x10\xd9\x00\xb3\xae\x07\x93\xe7\x7f\x54\x24\x1b\x4d\x4c\x86\x04\x1b\x40\x89"
+    "\xcc\x9b";
+    BRMerkleBlock *b = BRMerkleBlockParse((uint8_t *)header, sizeof(header) - 1), *b2 = BRMerkleBlockCopy(b), h;
+    BRHeaderStore *store, *crashed;
+    
+    unlink(path);
+    b->height = 10001;
+    b2->prevBlock = b->blockHash;
+    b2->blockHash = uint256("0000000000000000000000000000000000000000000000000000000000000001"); // fails proof-of-work
+    b2->height = 10002;
+    store = BRHeaderStoreOpen(path);
+    
+    if (! store || BRHeaderStoreCount(store) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 0\n", __func__);
+    
+    if (store && ! BRHeaderStoreAppend(store, b))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 0\n", __func__);
+    
+    if (store && BRHeaderStoreAppend(store, b)) // doesn't follow the last header
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 1\n", __func__);
+    
+    if (store && ! BRHeaderStoreAppend(store, b2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 2\n", __func__);
+    
+    if (store && BRHeaderStoreCount(store) == 2) {
+        h = BRHeaderStoreHeader(store, 0);
+        
+        if (! UInt256Eq(h.blockHash, b->blockHash) || ! UInt256Eq(h.merkleRoot, b->merkleRoot) ||
+            h.nonce != b->nonce || h.height != 10001)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreHeader() test\n", __func__);
+        
+        if (UInt64GetLE(BRHeaderStoreChainWork(store, 0).u8) != 62209952899966) // 2^64/0x04864c
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreChainWork() test\n", __func__);
+        
+        if (! UInt256Eq(BRHeaderStoreBlockHash(store, 1), b2->blockHash) || BRHeaderStoreHeight(store, 1) != 10002)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreBlockHash() test\n", __func__);
+    }
+    else r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreCount() test 0\n", __func__);
+    
+    if (store) BRHeaderStoreClose(store);
+    store = BRHeaderStoreOpen(path);
+    
+    if (! store || BRHeaderStoreCount(store) != 2) // synced headers are kept without being checked
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 1\n", __func__);
+    
+    if (store && (! BRHeaderStoreTruncate(store, 0) || BRHeaderStoreCount(store) != 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreTruncate() test\n", __func__);
+    
+    if (store) BRHeaderStoreClose(store);
+    crashed = BRHeaderStoreOpen(path); // appends without syncing, and is left open as if the process had crashed
+    if (crashed) BRHeaderStoreAppend(crashed, b), BRHeaderStoreAppend(crashed, b2);
+    store = BRHeaderStoreOpen(path);
+    
+    if (! store || BRHeaderStoreCount(store) != 1 || ! UInt256Eq(BRHeaderStoreBlockHash(store, 0), b->blockHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 2\n", __func__);
+    
+    if (store) BRHeaderStoreClose(store);
+    if (crashed) BRHeaderStoreClose(crashed);
+    unlink(path);
+    BRMerkleBlockFree(b);
+    BRMerkleBlockFree(b2);
+    return r;
+}
+
+void BRPeerManagerAddBlockTest(BRPeerManager *manager, BRMerkleBlock *block);
+
+// block header at height following prev, with a block hash that matches its serialized header
+static BRMerkleBlock *peerManagerNextBlock(const BRMerkleBlock *prev, uint32_t height)
+{
+    BRMerkleBlock header = *prev, *block;
+    uint8_t buf[80];
+
+    header.prevBlock = prev->blockHash;
+    header.timestamp = prev->timestamp + 600;
+    header.totalTx = 0;
+    BRMerkleBlockSerialize(&header, buf, sizeof(buf));
+    block = BRMerkleBlockParse(buf, sizeof(buf));
+    block->height = height;
+    return block;
+}
+
+int BRPeerManagerHeaderStoreTests()
+{
+    int r = 1;
+    const char *path = "BRPeerManagerHeaderStoreTests.tmp";
+    const BRCheckPoint *checkpoint = &BR_CHAIN_PARAMS.checkpoints[BR_CHAIN_PARAMS.checkpointsCount - 1];
+    BRMerkleBlock *blocks[5], *copies[5], *next, start = { .version = 1 };
+    BRPeerManager *manager;
+    BRHeaderStore *store;
+    UInt256 hash;
+    uint32_t height;
+    size_t i;
+
+    // saved blocks from a difficulty transition past the last checkpoint, as an existing install would have
+    height = (checkpoint->height/BLOCK_DIFFICULTY_INTERVAL + 2)*BLOCK_DIFFICULTY_INTERVAL;
+    start.blockHash = UInt256Reverse(checkpoint->hash);
+    start.timestamp = checkpoint->timestamp;
+    start.target = checkpoint->target;
+
+    for (i = 0; i < 5; i++) {
+        blocks[i] = peerManagerNextBlock((i > 0) ? blocks[i - 1] : &start, height + (uint32_t)i);
+        copies[i] = BRMerkleBlockCopy(blocks[i]);
+    }
+
+    unlink(path);
+    manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, NULL, 0, blocks, 5, NULL, 0);
+    if (! BRPeerManagerSetHeaderStore(manager, path))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerSetHeaderStore() test 0\n", __func__);
+
+    next = peerManagerNextBlock(blocks[4], height + 5);
+    hash = next->blockHash;
+    BRPeerManagerAddBlockTest(manager, next);
+    BRPeerManagerFree(manager);
+    store = BRHeaderStoreOpen(path);
+
+    // the store starts with the saved chain after the transition block, the first with a parent manager can verify
+    if (! store || BRHeaderStoreCount(store) != 5 || BRHeaderStoreHeight(store, 0) != height + 1 ||
+        ! UInt256Eq(BRHeaderStoreBlockHash(store, BRHeaderStoreCount(store) - 1), hash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: empty header store seed test\n", __func__);
+
+    if (store) BRHeaderStoreClose(store);
+    manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, NULL, 0, copies, 5, NULL, 0); // cold start from the same saved blocks
+    if (! BRPeerManagerSetHeaderStore(manager, path) || BRPeerManagerLastBlockHeight(manager) != height + 5)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerSetHeaderStore() test 1\n", __func__);
+
+    BRPeerManagerFree(manager);
+    unlink(path);
+    return r;
+}
+
 int BRPaymentProtocolTests()
 {
     int r = 1;
@@ -2862,6 +3345,295 @@ int BRPeerTests()
     return r;
 }
 
+int BRPeerStoreTests()
+{
+    int r = 1;
+    const char *path = "BRPeerStoreTests.tmp";
+    uint64_t now = (uint64_t)time(NULL);
+    BRPeer peers[3], best[3];
+    BRPeerStore *store;
+    size_t i;
+    
+    unlink(path);
+    
+    for (i = 0; i < 3; i++) { // 10.0.0.1, 10.0.1.1 and 10.0.2.1, heard about an hour apart
+        peers[i] = BR_PEER_NONE;
+        peers[i].address.u16[5] = 0xffff;
+        peers[i].address.u8[12] = 10, peers[i].address.u8[14] = (uint8_t)i, peers[i].address.u8[15] = 1;
+        peers[i].port = 8333;
+        peers[i].services = SERVICES_NODE_NETWORK;
+        peers[i].timestamp = now - i*60*60;
+    }
+    
+    store = BRPeerStoreNew(path);
+    BRPeerStoreAdd(store, peers, 3, now);
+    BRPeerStoreAdd(store, peers, 3, now);
+    
+    if (BRPeerStoreCount(store) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreAdd() test\n", __func__);
+    
+    if (BRPeerStoreBest(store, best, 3, now) != 3 || ! BRPeerEq(&best[0], &peers[0]) || ! BRPeerEq(&best[2], &peers[2]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreBest() test 0\n", __func__);
+    
+    BRPeerStoreAttempt(store, &peers[2], now);
+    BRPeerStoreGood(store, &peers[2], now);
+    
+    if (BRPeerStoreBest(store, best, 1, now) != 1 || ! BRPeerEq(&best[0], &peers[2]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreGood() test\n", __func__);
+    
+    BRPeerStoreAttempt(store, &peers[0], now);
+    BRPeerStoreFailed(store, &peers[0]);
+    
+    if (BRPeerStoreBest(store, best, 3, now) != 3 || ! BRPeerEq(&best[2], &peers[0]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreFailed() test\n", __func__);
+    
+    if (BRPeerStoreMisbehaving(store, &peers[1], PEER_BAN_SCORE/2, now) || // banned on reaching PEER_BAN_SCORE
+        ! BRPeerStoreMisbehaving(store, &peers[1], PEER_BAN_SCORE/2, now) ||
+        ! BRPeerStoreIsBanned(store, &peers[1], now))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreMisbehaving() test\n", __func__);
+    
+    if (BRPeerStoreBest(store, NULL, 0, now) != 2 || BRPeerStoreIsBanned(store, &peers[1], now + PEER_BAN_TIME))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreIsBanned() test\n", __func__);
+    
+    if (! BRPeerStoreSave(store))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreSave() test\n", __func__);
+    
+    BRPeerStoreFree(store);
+    store = BRPeerStoreNew(path);
+    
+    if (BRPeerStoreCount(store) != 3 || ! BRPeerStoreIsBanned(store, &peers[1], now) ||
+        BRPeerStoreBest(store, best, 1, now) != 1 || ! BRPeerEq(&best[0], &peers[2]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreNew() test\n", __func__);
+    
+    BRPeerStoreRemove(store, &peers[1]);
+    
+    if (BRPeerStoreCount(store) != 2 || BRPeerStoreIsBanned(store, &peers[1], now))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerStoreRemove() test\n", __func__);
+    
+    BRPeerStoreFree(store);
+    unlink(path);
+    return r;
+}
+
+void BRPeerManagerRelayedTxTest(BRPeerManager *manager, BRPeer *peer, BRTransaction *tx);
+const BRBloomFilter *BRPeerManagerBloomFilterTest(BRPeerManager *manager, BRPeer *peer);
+size_t BRPeerManagerExpireTxPeersTest(BRPeerManager *manager, time_t now);
+
+static void peerManagerPublished(void *info, int error)
+{
+    *(int *)info = error;
+}
+
+// signed tx spending a non-wallet outpoint from addr and paying amount to each of to1 and to2 (if not NULL)
+static BRTransaction *peerManagerPayTx(BRKey *key, const char *addr, uint32_t n, const char *to1, const char *to2,
+                                       uint64_t amount)
+{
+    BRTransaction *tx = BRTransactionNew();
+    UInt256 inHash = UINT256_ZERO;
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr);
+
+    inHash.u32[0] = n;
+    BRTransactionAddInput(tx, inHash, 0, amount*2 + 10000, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, amount, NULL, 0);
+    BRTxOutputSetAddress(&tx->outputs[0], to1);
+
+    if (to2) {
+        BRTransactionAddOutput(tx, amount, NULL, 0);
+        BRTxOutputSetAddress(&tx->outputs[1], to2);
+    }
+
+    BRTransactionSign(tx, 0, key, 1);
+    return tx;
+}
+
+int BRPeerManagerTests()
+{
+    int r = 1, error = 0;
+    UInt512 seed1, seed2;
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001"), hash;
+    BRKey k;
+    BRAddress addr;
+    UInt160 pkh1, pkh2;
+    uint8_t buf[1024];
+    size_t len;
+
+    BRBIP39DeriveKey(&seed1, "first wallet", NULL);
+    BRBIP39DeriveKey(&seed2, "second wallet", NULL);
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, addr.s, sizeof(addr));
+
+    BRWallet *w1 = BRWalletNew(NULL, 0, BRBIP32MasterPubKey(&seed1, sizeof(seed1)), 0),
+             *w2 = BRWalletNew(NULL, 0, BRBIP32MasterPubKey(&seed2, sizeof(seed2)), 0);
+    BRPeerManager *manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, w1, 0, NULL, 0, NULL, 0);
+    BRPeer *peer = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+    BRAddress recv1 = BRWalletReceiveAddress(w1), recv2 = BRWalletReceiveAddress(w2);
+    BRTransaction *tx;
+
+    BRPeerManagerAddWallet(manager, w2, 0);
+    if (BRPeerManagerWallets(manager, NULL, 0) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test\n", __func__);
+
+    tx = peerManagerPayTx(&k, addr.s, 1, recv1.s, recv2.s, SATOSHIS);
+    hash = tx->txHash;
+    BRPeerManagerRelayedTxTest(manager, peer, tx); // tx paying both wallets
+    if (BRWalletBalance(w1) != SATOSHIS || BRWalletBalance(w2) != SATOSHIS ||
+        BRWalletTransactionForHash(w1, hash) == BRWalletTransactionForHash(w2, hash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: multi-wallet tx test\n", __func__);
+
+    // spend w2's P2WPKH output, the scriptSig is empty so the spending tx has no input pkh to route it by
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, hash, 1, SATOSHIS, NULL, 0, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTxInputSetAddress(&tx->inputs[0], recv2.s);
+    BRTransactionAddOutput(tx, SATOSHIS - 10000, NULL, 0);
+    BRTxOutputSetAddress(&tx->outputs[0], addr.s);
+    BRWalletSignTransaction(w2, tx, &seed2, sizeof(seed2));
+    len = BRTransactionSerialize(tx, buf, sizeof(buf));
+    BRTransactionFree(tx);
+    tx = BRTransactionParse(buf, len);
+    hash = tx->txHash;
+    if (tx->inputs[0].address[0] != '\0' || tx->inputs[0].sigLen != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: P2WPKH spend input test\n", __func__);
+
+    BRPeerManagerRelayedTxTest(manager, peer, tx);
+    if (BRWalletBalance(w2) != 0 || ! BRWalletTransactionForHash(w2, hash) || BRWalletTransactionForHash(w1, hash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: outpoint routing test\n", __func__);
+
+    BRAddressHash160(&pkh1, BRWalletReceiveAddress(w1).s);
+    BRAddressHash160(&pkh2, BRWalletReceiveAddress(w2).s);
+    if (! BRBloomFilterContainsData(BRPeerManagerBloomFilterTest(manager, peer), pkh1.u8, sizeof(pkh1)) ||
+        ! BRBloomFilterContainsData(BRPeerManagerBloomFilterTest(manager, peer), pkh2.u8, sizeof(pkh2)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: bloom filter test\n", __func__);
+
+    tx = peerManagerPayTx(&k, addr.s, 2, recv2.s, NULL, SATOSHIS);
+    BRWalletRegisterTransaction(w2, tx);
+    BRPeerManagerPublishTx(manager, tx, &error, peerManagerPublished);
+    if (error != 0) r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerPublishTx() test\n", __func__);
+
+    BRPeerManagerRemoveWallet(manager, w2);
+    if (error != ECANCELED)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRemoveWallet() publish callback test\n", __func__);
+
+    if (! BRBloomFilterContainsData(BRPeerManagerBloomFilterTest(manager, peer), pkh1.u8, sizeof(pkh1)) ||
+        BRBloomFilterContainsData(BRPeerManagerBloomFilterTest(manager, peer), pkh2.u8, sizeof(pkh2)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRemoveWallet() bloom filter test\n", __func__);
+
+    tx = peerManagerPayTx(&k, addr.s, 3, recv2.s, NULL, SATOSHIS);
+    BRPeerManagerRelayedTxTest(manager, peer, tx); // no longer routed to w2
+    if (BRPeerManagerWallets(manager, NULL, 0) != 1 || BRWalletBalance(w2) != SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRemoveWallet() test\n", __func__);
+
+    tx = peerManagerPayTx(&k, addr.s, 4, recv1.s, NULL, SATOSHIS);
+    hash = tx->txHash;
+    BRPeerManagerRelayedTxTest(manager, peer, tx);
+    if (BRPeerManagerRelayCount(manager, hash) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRelayCount() test 1\n", __func__);
+
+    BRPeerManagerExpireTxPeersTest(manager, time(NULL));
+    if (BRPeerManagerRelayCount(manager, hash) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRelayCount() test 2\n", __func__);
+
+    BRPeerManagerExpireTxPeersTest(manager, time(NULL) + 2*24*60*60); // relay entry expires after a day
+    if (BRPeerManagerRelayCount(manager, hash) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRelayCount() expiry test\n", __func__);
+
+    BRWalletUpdateTransactions(w1, &hash, 1, 1000, 1);
+    if (BRPeerManagerRelayCount(manager, hash) != PEER_MAX_CONNECTIONS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRelayCount() confirmed test\n", __func__);
+
+    BRPeerManagerFree(manager);
+    BRPeerFree(peer);
+    BRWalletFree(w1);
+    BRWalletFree(w2);
+    return r;
+}
+
+void BRPeerManagerSetChainTest(BRPeerManager *manager, BRMerkleBlock *blocks[], size_t blocksCount);
+UInt256 BRPeerManagerAncestorTest(BRPeerManager *manager, UInt256 blockHash, uint32_t height);
+UInt256 BRPeerManagerSkipTest(BRPeerManager *manager, UInt256 blockHash, uint32_t *skipHeight);
+size_t BRPeerManagerBlockLocatorsTest(BRPeerManager *manager, UInt256 locators[], size_t locatorsCount);
+
+// ancestor at height of the given block, found by walking back one prevBlock at a time
+static BRMerkleBlock *peerManagerLinearAncestor(BRSet *blocks, BRMerkleBlock *block, uint32_t height)
+{
+    while (block && block->height > height) block = BRSetGet(blocks, &block->prevBlock);
+    return block;
+}
+
+int BRPeerManagerChainTests()
+{
+    int r = 1;
+    const uint32_t count = 5000;
+    BRPeerManager *manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, NULL, 0, NULL, 0, NULL, 0);
+    BRMerkleBlock *chain[count], *tip, *b;
+    BRSet *blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, count);
+    UInt256 locators[64], skip;
+    uint32_t i, tipHeight, height, skipHeight, step;
+    size_t n, locatorsCount;
+
+    for (i = 0; i < count; i++) { // a chain of headers from the genesis block
+        chain[i] = BRMerkleBlockNew();
+        chain[i]->height = i;
+        chain[i]->timestamp = BR_CHAIN_PARAMS.checkpoints[0].timestamp + i*600;
+        chain[i]->target = BR_CHAIN_PARAMS.checkpoints[0].target;
+        if (i > 0) chain[i]->prevBlock = chain[i - 1]->blockHash;
+        if (i > 0) BRSHA256(&chain[i]->blockHash, &i, sizeof(i));
+        else chain[i]->blockHash = UInt256Reverse(BR_CHAIN_PARAMS.checkpoints[0].hash);
+        BRSetAdd(blocks, chain[i]);
+    }
+
+    BRPeerManagerSetChainTest(manager, chain, count);
+
+    for (i = 0; i < count; i++) {
+        b = peerManagerLinearAncestor(blocks, chain[count - 1], i);
+        if (! UInt256Eq(BRPeerManagerAncestorTest(manager, chain[count - 1]->blockHash, i), b->blockHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: ancestor of tip at height %"PRIu32" test\n", __func__, i);
+
+        skip = BRPeerManagerSkipTest(manager, chain[i]->blockHash, &skipHeight);
+        b = BRSetGet(blocks, &skip);
+        if (i >= 2 && (skipHeight >= i || ! b || b != peerManagerLinearAncestor(blocks, chain[i], skipHeight)))
+            r = 0, fprintf(stderr, "***FAILED*** %s: skip pointer at height %"PRIu32" test\n", __func__, i);
+    }
+
+    for (i = 0; i < 1000; i++) { // random heights, including 0 and the tip itself
+        tipHeight = BRRand(count);
+        height = (i % 4 == 0) ? 0 : (i % 4 == 1) ? tipHeight : BRRand(tipHeight + 1);
+        tip = chain[tipHeight];
+        b = peerManagerLinearAncestor(blocks, tip, height);
+        if (! UInt256Eq(BRPeerManagerAncestorTest(manager, tip->blockHash, height), b->blockHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: ancestor at height %"PRIu32" of %"PRIu32" test\n", __func__,
+                           height, tipHeight);
+    }
+
+    if (! UInt256IsZero(BRPeerManagerAncestorTest(manager, chain[10]->blockHash, 11)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: ancestor above header test\n", __func__);
+
+    for (i = 0; i < 100; i++) { // locators from random tips, including the genesis block and the top of the chain
+        tipHeight = (i == 0) ? 0 : (i == 1) ? count - 1 : BRRand(count);
+        BRPeerManagerSetChainTest(manager, chain, tipHeight + 1);
+        locatorsCount = BRPeerManagerBlockLocatorsTest(manager, locators, sizeof(locators)/sizeof(*locators));
+        if (locatorsCount != BRPeerManagerBlockLocatorsTest(manager, NULL, 0) || locatorsCount > 64)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerBlockLocators() count test\n", __func__);
+
+        // expect top, -1, -2, ..., -9, -11, -15, -23, -39, ..., 0
+        for (n = 0, step = 1, height = tipHeight; n < locatorsCount && height > 0; n++) {
+            b = peerManagerLinearAncestor(blocks, chain[tipHeight], height);
+            if (! UInt256Eq(locators[n], b->blockHash)) break;
+            if (n + 1 >= 10) step *= 2;
+            height = (height > step) ? height - step : 0;
+        }
+
+        if (n + 1 != locatorsCount || ! UInt256Eq(locators[n], chain[0]->blockHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerBlockLocators() at height %"PRIu32" test\n",
+                           __func__, tipHeight);
+    }
+
+    BRPeerManagerFree(manager);
+    BRSetFree(blocks);
+    for (i = 0; i < count; i++) BRMerkleBlockFree(chain[i]);
+    return r;
+}
+
 int BRRunTests()
 {
     int fail = 0;
@@ -2912,6 +3684,16 @@ int BRRunTests()
     printf("%s\n", (BRBloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRMerkleBlockTests...               ");
     printf("%s\n", (BRMerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRHeaderStoreTests...               ");
+    printf("%s\n", (BRHeaderStoreTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerStoreTests...                 ");
+    printf("%s\n", (BRPeerStoreTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerTests...               ");
+    printf("%s\n", (BRPeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerChainTests...          ");
+    printf("%s\n", (BRPeerManagerChainTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerHeaderStoreTests...    ");
+    printf("%s\n", (BRPeerManagerHeaderStoreTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolTests...           ");
     printf("%s\n", (BRPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolEncryptionTests... ");